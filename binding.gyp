@@ -3,7 +3,14 @@
     {
       "target_name": "pprof",
       "sources": [ 
+        "bindings/context-recorder.cc",
+        "bindings/cpu-time-sampler.cc",
+        "bindings/profile-aggregator.cc",
+        "bindings/profile-builder.cc",
+        "bindings/profile-encoder.cc",
         "bindings/profiler.cc",
+        "bindings/source-map-decoder.cc",
+        "bindings/v8-shim.cc",
       ],
       "include_dirs": [ "<!(node -e \"require('nan')\")" ],
       # TODO(#62): The following line suppresses compliation warnings
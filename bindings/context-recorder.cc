@@ -0,0 +1,250 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "context-recorder.h"
+
+#include <algorithm>
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#endif
+
+namespace {
+
+#if !defined(_WIN32)
+// Key of the recorder of each thread. Unlike thread_local storage, which may
+// be allocated on first use by a thread, it can be read in a signal handler.
+pthread_key_t recorderKey;
+std::once_flag recorderKeyOnce;
+
+// Guards the fields below other than the previous handler, which the signal
+// handler reads.
+std::mutex installMutex;
+int recorderCount = 0;
+struct sigaction previousAction;
+std::atomic<void (*)(int, siginfo_t*, void*)> previousSigaction{NULL};
+std::atomic<void (*)(int)> previousHandler{NULL};
+#endif
+
+// Returns the CPU time used by the calling thread, or -1. clock_gettime() is
+// async-signal-safe, so this may be called by the signal handler.
+int64_t ThreadCpuNanos() {
+#if defined(_WIN32)
+  return -1;
+#else
+  struct timespec time;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0) {
+    return -1;
+  }
+  return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+#endif
+}
+
+}  // namespace
+
+bool ContextRecorder::Supported() {
+#if defined(_WIN32)
+  return false;
+#else
+  return true;
+#endif
+}
+
+int64_t ContextRecorder::NowMicros() {
+#if defined(_WIN32)
+  return 0;
+#else
+  // The clocks of base::TimeTicks::Now() in V8.
+#if defined(__APPLE__)
+  clockid_t clock = CLOCK_UPTIME_RAW;
+#else
+  clockid_t clock = CLOCK_MONOTONIC;
+#endif
+  struct timespec time;
+  clock_gettime(clock, &time);
+  return static_cast<int64_t>(time.tv_sec) * 1000000 + time.tv_nsec / 1000;
+#endif
+}
+
+ContextRecorder::ContextRecorder(const std::atomic<uint32_t>* context)
+    : context_(context) {
+#if !defined(_WIN32)
+  std::call_once(recorderKeyOnce,
+                 [] { pthread_key_create(&recorderKey, NULL); });
+  pthread_setspecific(recorderKey, this);
+  std::lock_guard<std::mutex> lock(installMutex);
+  recorderCount++;
+  InstallLocked();
+#endif
+}
+
+ContextRecorder::~ContextRecorder() {
+#if !defined(_WIN32)
+  std::lock_guard<std::mutex> lock(installMutex);
+  if (--recorderCount == 0) {
+    // The handler of the CPU profiler is put back, unless the profiler has
+    // already put back the one it replaced, or installed its own again.
+    struct sigaction current;
+    sigaction(SIGPROF, NULL, &current);
+    if ((current.sa_flags & SA_SIGINFO) &&
+        current.sa_sigaction == HandleSignal) {
+      sigaction(SIGPROF, &previousAction, NULL);
+    }
+  }
+  pthread_setspecific(recorderKey, NULL);
+#endif
+}
+
+void ContextRecorder::Install() {
+#if !defined(_WIN32)
+  std::lock_guard<std::mutex> lock(installMutex);
+  InstallLocked();
+#endif
+}
+
+#if !defined(_WIN32)
+void ContextRecorder::InstallLocked() {
+  struct sigaction current;
+  sigaction(SIGPROF, NULL, &current);
+  if ((current.sa_flags & SA_SIGINFO) &&
+      current.sa_sigaction == HandleSignal) {
+    return;
+  }
+  previousAction = current;
+  if (current.sa_flags & SA_SIGINFO) {
+    previousHandler.store(NULL);
+    previousSigaction.store(current.sa_sigaction);
+  } else {
+    previousSigaction.store(NULL);
+    previousHandler.store(current.sa_handler);
+  }
+  struct sigaction action = current;
+  action.sa_sigaction = HandleSignal;
+  action.sa_flags = current.sa_flags | SA_SIGINFO | SA_RESTART;
+  sigaction(SIGPROF, &action, NULL);
+}
+
+void ContextRecorder::HandleSignal(int signo, siginfo_t* info,
+                                   void* ucontext) {
+  int savedErrno = errno;
+  ContextRecorder* recorder =
+      static_cast<ContextRecorder*>(pthread_getspecific(recorderKey));
+  int64_t startCpuNanos = recorder ? recorder->Record() : -1;
+  errno = savedErrno;
+  void (*sigactionHandler)(int, siginfo_t*, void*) = previousSigaction.load();
+  void (*handler)(int) = previousHandler.load();
+  if (sigactionHandler) {
+    sigactionHandler(signo, info, ucontext);
+  } else if (handler && handler != SIG_DFL && handler != SIG_IGN) {
+    handler(signo);
+  }
+  if (startCpuNanos >= 0) {
+    savedErrno = errno;
+    int64_t endCpuNanos = ThreadCpuNanos();
+    if (endCpuNanos > startCpuNanos) {
+      recorder->handlerNanos_.fetch_add(endCpuNanos - startCpuNanos,
+                                        std::memory_order_relaxed);
+    }
+    errno = savedErrno;
+  }
+}
+#endif
+
+int64_t ContextRecorder::Record() {
+  uint64_t index = writing_.load(std::memory_order_relaxed);
+  writing_.store(index + 1, std::memory_order_relaxed);
+  // Drain() reads writing_ after the slot, to detect that it was overwritten
+  // while it read it.
+  std::atomic_thread_fence(std::memory_order_release);
+  Slot& slot = slots_[index % kCapacity];
+  slot.timeMicros.store(NowMicros(), std::memory_order_relaxed);
+  slot.context.store(context_->load(std::memory_order_relaxed),
+                     std::memory_order_relaxed);
+  int64_t cpuNanos = ThreadCpuNanos();
+  slot.cpuNanos.store(cpuNanos, std::memory_order_relaxed);
+  written_.store(index + 1, std::memory_order_release);
+  return cpuNanos;
+}
+
+void ContextRecorder::Drain(std::vector<Point>* points) {
+  std::lock_guard<std::mutex> lock(drainMutex_);
+  uint64_t written = written_.load(std::memory_order_acquire);
+  uint64_t first =
+      std::max(drained_, written > kCapacity ? written - kCapacity : 0);
+  size_t start = points->size();
+  for (uint64_t i = first; i < written; i++) {
+    const Slot& slot = slots_[i % kCapacity];
+    points->push_back({slot.timeMicros.load(std::memory_order_relaxed),
+                       slot.context.load(std::memory_order_relaxed),
+                       slot.cpuNanos.load(std::memory_order_relaxed)});
+  }
+  // The points whose slots the handler started to write again while they
+  // were copied are dropped.
+  std::atomic_thread_fence(std::memory_order_acquire);
+  uint64_t writing = writing_.load(std::memory_order_relaxed);
+  uint64_t valid = writing > kCapacity ? writing - kCapacity : 0;
+  if (valid > first) {
+    size_t overwritten = std::min(valid, written) - first;
+    points->erase(points->begin() + start,
+                  points->begin() + start + overwritten);
+    first += overwritten;
+  }
+  dropped_ += first - drained_;
+  drained_ = written;
+}
+
+uint64_t ContextRecorder::droppedCount() {
+  std::lock_guard<std::mutex> lock(drainMutex_);
+  return dropped_;
+}
+
+std::vector<ptrdiff_t> SamplePoints(
+    const std::vector<ContextRecorder::Point>& points,
+    const std::vector<int64_t>& timestamps) {
+  std::vector<ptrdiff_t> indices(timestamps.size(), -1);
+  std::vector<bool> matched(points.size(), false);
+  for (size_t i = 0; i < timestamps.size(); i++) {
+    auto next = std::upper_bound(
+        points.begin(), points.end(), timestamps[i],
+        [](int64_t time, const ContextRecorder::Point& point) {
+          return time < point.timeMicros;
+        });
+    if (next == points.begin()) {
+      continue;
+    }
+    size_t point = next - points.begin() - 1;
+    if (!matched[point]) {
+      matched[point] = true;
+      indices[i] = point;
+    }
+  }
+  return indices;
+}
+
+std::vector<uint32_t> SampleContexts(
+    const std::vector<ContextRecorder::Point>& points,
+    const std::vector<int64_t>& timestamps) {
+  std::vector<ptrdiff_t> indices = SamplePoints(points, timestamps);
+  std::vector<uint32_t> contexts(timestamps.size(), 0);
+  for (size_t i = 0; i < indices.size(); i++) {
+    if (indices[i] >= 0) {
+      contexts[i] = points[indices[i]].context;
+    }
+  }
+  return contexts;
+}
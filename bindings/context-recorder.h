@@ -0,0 +1,135 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PPROF_BINDINGS_CONTEXT_RECORDER_H_
+#define PPROF_BINDINGS_CONTEXT_RECORDER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <signal.h>
+#endif
+
+// Records the context of the thread which creates it, such as the ID of the
+// request it is serving, and the CPU time it has used, each time the CPU
+// profiler of V8 samples the thread. V8 samples a thread by sending it
+// SIGPROF, whose handler is chained with one which records the time, the
+// context and the CPU clock of the thread, without locks or allocation, into
+// a ring which is drained by Drain(). Each sample of V8 can then be labeled
+// with the context the thread had when it was taken, however often the
+// context changes, and be charged the CPU time used since the previous one.
+// The CPU time the thread spends in the handler of V8, which walks its
+// stack, is added up too, as the cost of sampling it.
+// Where V8 does not sample threads with signals, i.e. on Windows, the
+// recorder is not supported. Does not depend on V8.
+class ContextRecorder {
+ public:
+  // The context of the thread when it was sampled at timeMicros, on the
+  // clock of NowMicros(), and the CPU time it had used, or -1 if its CPU
+  // clock could not be read.
+  struct Point {
+    int64_t timeMicros;
+    uint32_t context;
+    int64_t cpuNanos;
+  };
+
+  static bool Supported();
+
+  // Returns the current time in microseconds on the clock which V8
+  // timestamps its samples with.
+  static int64_t NowMicros();
+
+  // Starts recording the calling thread, which stores its context in
+  // *context. The signal handler of the CPU profiler must have been
+  // installed, i.e. a profile must be running, so that it is chained.
+  explicit ContextRecorder(const std::atomic<uint32_t>* context);
+  // Must be destroyed by the thread which created it.
+  ~ContextRecorder();
+
+  ContextRecorder(const ContextRecorder&) = delete;
+  ContextRecorder& operator=(const ContextRecorder&) = delete;
+
+  // Chains the handler again, if the CPU profiler has installed its own
+  // since, which it does each time it starts sampling after it stopped.
+  static void Install();
+
+  // Appends the points recorded since the last call to points, in
+  // increasing order of time. May be called from any thread.
+  void Drain(std::vector<Point>* points);
+
+  // Number of points which were overwritten before they were drained.
+  uint64_t droppedCount();
+
+  // CPU time in nanoseconds which the thread has spent in the signal handler
+  // of the CPU profiler, i.e. taking samples, since the recorder was created.
+  int64_t HandlerNanos() const {
+    return handlerNanos_.load(std::memory_order_relaxed);
+  }
+
+ private:
+#if !defined(_WIN32)
+  // Installs the handler in front of the current one, if it is not yet.
+  // installMutex must be held.
+  static void InstallLocked();
+  static void HandleSignal(int signo, siginfo_t* info, void* ucontext);
+#endif
+  // Returns the CPU time of the thread recorded with the point, or -1.
+  int64_t Record();
+
+  // Points are drained every few milliseconds by CpuTimeSampler, so the ring
+  // only has to hold the samples taken meanwhile.
+  static const size_t kCapacity = 4096;
+
+  struct Slot {
+    std::atomic<int64_t> timeMicros{0};
+    std::atomic<uint32_t> context{0};
+    std::atomic<int64_t> cpuNanos{0};
+  };
+
+  const std::atomic<uint32_t>* context_;
+  Slot slots_[kCapacity];
+  // Number of points which the handler started to record, and recorded.
+  std::atomic<uint64_t> writing_{0};
+  std::atomic<uint64_t> written_{0};
+  // Only added to by the handler, on the recorded thread.
+  std::atomic<int64_t> handlerNanos_{0};
+  // Guards the fields below, which are only used by Drain().
+  std::mutex drainMutex_;
+  uint64_t drained_ = 0;
+  uint64_t dropped_ = 0;
+};
+
+// Returns the index of the point recorded for each sample at the given
+// timestamps, on the clock of ContextRecorder::NowMicros(), or -1. The
+// handler records a point right before V8 takes a sample, so the point of a
+// sample is the last one at or before it. A point is only matched with one
+// sample: a sample whose point was dropped has none, rather than that of an
+// earlier sample.
+std::vector<ptrdiff_t> SamplePoints(
+    const std::vector<ContextRecorder::Point>& points,
+    const std::vector<int64_t>& timestamps);
+
+// Returns the context in which each sample at the given timestamps was
+// taken, as matched by SamplePoints(); 0 for a sample without a point.
+std::vector<uint32_t> SampleContexts(
+    const std::vector<ContextRecorder::Point>& points,
+    const std::vector<int64_t>& timestamps);
+
+#endif  // PPROF_BINDINGS_CONTEXT_RECORDER_H_
@@ -0,0 +1,290 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cpu-time-sampler.h"
+
+#include <algorithm>
+#include <chrono>
+
+ThreadCpuClock::ThreadCpuClock() {
+#if defined(_WIN32)
+  // GetCurrentThread() returns a pseudo handle, which only refers to the
+  // calling thread when used by it.
+  if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(),
+                       GetCurrentProcess(), &thread_,
+                       THREAD_QUERY_LIMITED_INFORMATION, FALSE, 0)) {
+    thread_ = NULL;
+  }
+#elif defined(__APPLE__)
+  thread_ = mach_thread_self();
+#else
+  valid_ = pthread_getcpuclockid(pthread_self(), &clock_) == 0;
+#endif
+}
+
+ThreadCpuClock::~ThreadCpuClock() {
+#if defined(_WIN32)
+  if (thread_) {
+    CloseHandle(thread_);
+  }
+#elif defined(__APPLE__)
+  mach_port_deallocate(mach_task_self(), thread_);
+#endif
+}
+
+int64_t ThreadCpuClock::Nanos() const {
+#if defined(_WIN32)
+  FILETIME creation, exit, kernel, user;
+  if (!thread_ || !GetThreadTimes(thread_, &creation, &exit, &kernel, &user)) {
+    return -1;
+  }
+  // FILETIME counts 100 nanosecond intervals.
+  auto ticks = [](const FILETIME& time) {
+    return (static_cast<int64_t>(time.dwHighDateTime) << 32) |
+           time.dwLowDateTime;
+  };
+  return (ticks(kernel) + ticks(user)) * 100;
+#elif defined(__APPLE__)
+  thread_basic_info_data_t info;
+  mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+  if (thread_info(thread_, THREAD_BASIC_INFO,
+                  reinterpret_cast<thread_info_t>(&info),
+                  &count) != KERN_SUCCESS) {
+    return -1;
+  }
+  int64_t seconds = static_cast<int64_t>(info.user_time.seconds) +
+                    info.system_time.seconds;
+  int64_t micros = seconds * 1000000 + info.user_time.microseconds +
+                   info.system_time.microseconds;
+  return micros * 1000;
+#else
+  struct timespec time;
+  if (!valid_ || clock_gettime(clock_, &time) != 0) {
+    return -1;
+  }
+  return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+#endif
+}
+
+namespace {
+
+#if !defined(_WIN32)
+// Interval at which the points recorded by the samplers are drained. The
+// ring of a recorder holds ContextRecorder::kCapacity points, so it only
+// overflows if V8 samples a thread more often than every few microseconds.
+const int64_t kDrainIntervalMicros = 10000;
+
+// Samplers whose recorders are drained by the drainer thread, which runs
+// while there are any. lifecycleMutex guards starting and joining the
+// thread; drainerMutex guards the samplers, and is held while they are
+// drained, so that a sampler is not drained once it is unregistered.
+std::mutex lifecycleMutex;
+std::mutex drainerMutex;
+std::condition_variable drainerWake;
+std::vector<CpuTimeSampler*> drainerSamplers;
+bool drainerStopping = false;
+std::thread drainerThread;
+
+void RunDrainer() {
+  std::unique_lock<std::mutex> lock(drainerMutex);
+  while (!drainerWake.wait_for(lock,
+                               std::chrono::microseconds(kDrainIntervalMicros),
+                               [] { return drainerStopping; })) {
+    for (CpuTimeSampler* sampler : drainerSamplers) {
+      sampler->Drain();
+    }
+  }
+}
+
+void RegisterSampler(CpuTimeSampler* sampler) {
+  std::lock_guard<std::mutex> lifecycle(lifecycleMutex);
+  {
+    std::lock_guard<std::mutex> lock(drainerMutex);
+    drainerSamplers.push_back(sampler);
+    drainerStopping = false;
+  }
+  if (!drainerThread.joinable()) {
+    drainerThread = std::thread(RunDrainer);
+  }
+}
+
+void UnregisterSampler(CpuTimeSampler* sampler) {
+  std::lock_guard<std::mutex> lifecycle(lifecycleMutex);
+  bool last;
+  {
+    std::lock_guard<std::mutex> lock(drainerMutex);
+    drainerSamplers.erase(
+        std::find(drainerSamplers.begin(), drainerSamplers.end(), sampler));
+    last = drainerSamplers.empty();
+    drainerStopping = last;
+  }
+  if (last) {
+    drainerWake.notify_one();
+    drainerThread.join();
+  }
+}
+#endif
+
+}  // namespace
+
+CpuTimeSampler::CpuTimeSampler(int64_t intervalMicros)
+    : intervalMicros_(std::max<int64_t>(intervalMicros, 1)) {
+#if defined(_WIN32)
+  Sample();
+  thread_ = std::thread(&CpuTimeSampler::Run, this);
+#else
+  RegisterSampler(this);
+#endif
+}
+
+CpuTimeSampler::~CpuTimeSampler() {
+#if defined(_WIN32)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_one();
+  thread_.join();
+#else
+  UnregisterSampler(this);
+#endif
+  std::lock_guard<std::mutex> lock(mutex_);
+  recorder_.reset();
+}
+
+int64_t CpuTimeSampler::NowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void CpuTimeSampler::SetIntervalMicros(int64_t intervalMicros) {
+  intervalMicros_.store(std::max<int64_t>(intervalMicros, 1));
+}
+
+std::vector<int64_t> CpuTimeSampler::SampleCpuNanos(
+    const std::vector<int64_t>& timestamps, int64_t offsetMicros) {
+  std::vector<int64_t> cpuNanos(timestamps.size(), -1);
+  if (ContextRecorder::Supported()) {
+    std::vector<ContextRecorder::Point> points = ContextPoints();
+    std::vector<ptrdiff_t> indices = SamplePoints(points, timestamps);
+    for (size_t i = 0; i < indices.size(); i++) {
+      if (indices[i] >= 0) {
+        cpuNanos[i] = points[indices[i]].cpuNanos;
+      }
+    }
+    return cpuNanos;
+  }
+  Sample();
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < timestamps.size(); i++) {
+    cpuNanos[i] = InterpolateCpuNanos(points_, timestamps[i] + offsetMicros);
+  }
+  return cpuNanos;
+}
+
+void CpuTimeSampler::Trim(int64_t timeMicros, int64_t contextMicros) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto first = std::upper_bound(
+      points_.begin(), points_.end(), timeMicros,
+      [](int64_t time, const Point& point) { return time < point.timeMicros; });
+  if (first != points_.begin()) {
+    points_.erase(points_.begin(), first - 1);
+  }
+  contextPoints_.erase(
+      contextPoints_.begin(),
+      std::lower_bound(contextPoints_.begin(), contextPoints_.end(),
+                       contextMicros,
+                       [](const ContextRecorder::Point& point, int64_t time) {
+                         return point.timeMicros < time;
+                       }));
+}
+
+void CpuTimeSampler::StartRecording(const std::atomic<uint32_t>* context) {
+  if (!ContextRecorder::Supported()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (recorder_) {
+    ContextRecorder::Install();
+  } else {
+    recorder_.reset(new ContextRecorder(context));
+  }
+}
+
+int64_t CpuTimeSampler::SampleNanos() {
+  if (!ContextRecorder::Supported()) {
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  return recorder_ ? recorder_->HandlerNanos() : 0;
+}
+
+std::vector<ContextRecorder::Point> CpuTimeSampler::ContextPoints() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (recorder_) {
+    recorder_->Drain(&contextPoints_);
+  }
+  return contextPoints_;
+}
+
+void CpuTimeSampler::Drain() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (recorder_) {
+    recorder_->Drain(&contextPoints_);
+  }
+}
+
+void CpuTimeSampler::Sample() {
+  int64_t cpuNanos = std::max<int64_t>(clock_.Nanos(), 0);
+  std::lock_guard<std::mutex> lock(mutex_);
+  points_.push_back({NowMicros(), cpuNanos});
+}
+
+void CpuTimeSampler::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!wake_.wait_for(lock, std::chrono::microseconds(intervalMicros_),
+                         [this] { return stopping_; })) {
+    lock.unlock();
+    Sample();
+    lock.lock();
+  }
+}
+
+int64_t InterpolateCpuNanos(const std::vector<CpuTimeSampler::Point>& points,
+                            int64_t timeMicros) {
+  if (points.empty()) {
+    return 0;
+  }
+  auto next = std::lower_bound(points.begin(), points.end(), timeMicros,
+                               [](const CpuTimeSampler::Point& point,
+                                  int64_t time) {
+                                 return point.timeMicros < time;
+                               });
+  if (next == points.begin()) {
+    return points.front().cpuNanos;
+  }
+  if (next == points.end()) {
+    return points.back().cpuNanos;
+  }
+  const CpuTimeSampler::Point& previous = *(next - 1);
+  int64_t span = next->timeMicros - previous.timeMicros;
+  if (span <= 0) {
+    return next->cpuNanos;
+  }
+  return previous.cpuNanos + (next->cpuNanos - previous.cpuNanos) *
+                                 (timeMicros - previous.timeMicros) / span;
+}
@@ -0,0 +1,154 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PPROF_BINDINGS_CPU_TIME_SAMPLER_H_
+#define PPROF_BINDINGS_CPU_TIME_SAMPLER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "context-recorder.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+// The CPU clock of a thread, which can be read from any thread.
+class ThreadCpuClock {
+ public:
+  // Creates the clock of the calling thread.
+  ThreadCpuClock();
+  ~ThreadCpuClock();
+
+  ThreadCpuClock(const ThreadCpuClock&) = delete;
+  ThreadCpuClock& operator=(const ThreadCpuClock&) = delete;
+
+  // Returns the CPU time used by the thread, in nanoseconds, or -1 if the
+  // clock cannot be read on this platform.
+  int64_t Nanos() const;
+
+ private:
+#if defined(_WIN32)
+  HANDLE thread_;
+#elif defined(__APPLE__)
+  mach_port_t thread_;
+#else
+  clockid_t clock_;
+  bool valid_;
+#endif
+};
+
+// Records the CPU time used by the thread which creates it, and its context,
+// so that they can be attributed to the samples of a CPU profile taken over
+// the same period; the CPU profiler of V8 only records wall time.
+//
+// Where V8 samples threads with signals, a ContextRecorder of the thread
+// reads its CPU clock right before each sample, so that each sample is
+// charged the CPU time actually used since the previous one. The points of
+// the recorders of all samplers are drained by one thread for the process.
+// On Windows, where neither is possible, the CPU clock of the thread is read
+// at the sampling interval on a thread of the sampler, and the CPU time at a
+// sample is interpolated between the readings around it; contexts are not
+// supported. Does not depend on V8.
+class CpuTimeSampler {
+ public:
+  // The CPU time which had been used by the thread at a time, in
+  // microseconds on the clock of NowMicros(). The CPU time is 0 if the clock
+  // cannot be read on this platform.
+  struct Point {
+    int64_t timeMicros;
+    int64_t cpuNanos;
+  };
+
+  explicit CpuTimeSampler(int64_t intervalMicros);
+  ~CpuTimeSampler();
+
+  CpuTimeSampler(const CpuTimeSampler&) = delete;
+  CpuTimeSampler& operator=(const CpuTimeSampler&) = delete;
+
+  // Returns the current time on a monotonic clock, in microseconds.
+  static int64_t NowMicros();
+
+  // Returns the CPU time used by the thread so far, in nanoseconds, or -1 if
+  // the clock cannot be read on this platform.
+  int64_t CpuNanos() const { return clock_.Nanos(); }
+
+  // Sets the interval at which the CPU clock is read on Windows, when the
+  // sampling interval of the profiles started next changes.
+  void SetIntervalMicros(int64_t intervalMicros);
+
+  // Starts recording the CPU time of the thread, and the context which it
+  // stores in *context, which must outlive the sampler, each time the CPU
+  // profiler samples it; see ContextRecorder. Must be called by the sampled
+  // thread each time a profile is started, once it is running.
+  void StartRecording(const std::atomic<uint32_t>* context);
+
+  // Returns the CPU time which the thread had used when each sample at the
+  // given timestamps was taken, or -1 if it is not known. Timestamps are on
+  // the clock of ContextRecorder::NowMicros() where the recorder is
+  // supported, and on that of NowMicros() minus offsetMicros otherwise.
+  std::vector<int64_t> SampleCpuNanos(const std::vector<int64_t>& timestamps,
+                                      int64_t offsetMicros);
+
+  // Returns the CPU time in nanoseconds which the thread has spent taking
+  // samples since it started recording, as measured by ContextRecorder, or
+  // -1 where the recorder is not supported.
+  int64_t SampleNanos();
+
+  // Drops the points read from the CPU clock before timeMicros, except the
+  // last one, which is still needed to interpolate the CPU time at
+  // timeMicros. Drops the points recorded before contextMicros too, on the
+  // clock of ContextRecorder::NowMicros().
+  void Trim(int64_t timeMicros, int64_t contextMicros);
+
+  // Returns the points recorded so far, in increasing order of time.
+  std::vector<ContextRecorder::Point> ContextPoints();
+
+  // Moves the points recorded since the last call out of the ring of the
+  // recorder, before it overflows.
+  void Drain();
+
+ private:
+  void Sample();
+  void Run();
+
+  ThreadCpuClock clock_;
+  std::atomic<int64_t> intervalMicros_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+  std::vector<Point> points_;
+  std::unique_ptr<ContextRecorder> recorder_;
+  std::vector<ContextRecorder::Point> contextPoints_;
+  std::thread thread_;
+};
+
+// Returns the CPU time used at timeMicros, interpolated linearly between the
+// points around it, or clamped to the first or last point.
+int64_t InterpolateCpuNanos(const std::vector<CpuTimeSampler::Point>& points,
+                            int64_t timeMicros);
+
+#endif  // PPROF_BINDINGS_CPU_TIME_SAMPLER_H_
@@ -0,0 +1,317 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "profile-aggregator.h"
+
+#include <algorithm>
+
+namespace {
+
+// Name of the nodes into which subtrees are folded, as in pruned profiles.
+const char kTruncatedName[] = "(truncated)";
+
+const size_t kNoNode = static_cast<size_t>(-1);
+
+bool SameLabels(const std::vector<ProfileBuilder::Label>& a,
+                const std::vector<ProfileBuilder::Label>& b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++) {
+    if (a[i].key != b[i].key || a[i].str != b[i].str ||
+        a[i].num != b[i].num || a[i].numUnit != b[i].numUnit) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+ProfileAggregator::ProfileAggregator(size_t maxStacks)
+    : maxStacks_(maxStacks) {
+  Clear();
+}
+
+bool ProfileAggregator::SetSampleTypes(
+    const std::vector<ValueType>& sampleTypes) {
+  if (profileCount_ == 0 && stackCount() == 0) {
+    sampleTypes_ = sampleTypes;
+    return true;
+  }
+  if (sampleTypes.size() != sampleTypes_.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < sampleTypes.size(); i++) {
+    if (sampleTypes[i].type != sampleTypes_[i].type ||
+        sampleTypes[i].unit != sampleTypes_[i].unit) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void ProfileAggregator::SetPeriodType(const std::string& type,
+                                      const std::string& unit) {
+  periodType_ = {type, unit};
+  weightIndex_ = 0;
+  for (size_t i = 0; i < sampleTypes_.size(); i++) {
+    if (sampleTypes_[i].type == type && sampleTypes_[i].unit == unit) {
+      weightIndex_ = i;
+    }
+  }
+}
+
+void ProfileAggregator::SetTimeNanos(int64_t timeNanos) {
+  if (profileCount_ == 0) {
+    timeNanos_ = timeNanos;
+  }
+}
+
+int64_t ProfileAggregator::StringId(const std::string& str) {
+  auto it = stringIds_.find(str);
+  if (it != stringIds_.end()) {
+    return it->second;
+  }
+  int64_t id = strings_.size();
+  auto inserted = stringIds_.emplace(str, id);
+  strings_.push_back(&inserted.first->first);
+  return id;
+}
+
+uint64_t ProfileAggregator::LocationId(int32_t scriptId,
+                                       const std::string& name,
+                                       const std::string& scriptName,
+                                       int64_t line, int64_t column) {
+  LocationKey key = {scriptId, line, column, name};
+  auto it = locationIds_.find(key);
+  if (it != locationIds_.end()) {
+    return it->second;
+  }
+  locations_.push_back({scriptId, name, scriptName, line, column});
+  uint64_t id = locations_.size() - 1;
+  locationIds_.emplace(std::move(key), id);
+  return id;
+}
+
+size_t ProfileAggregator::Child(size_t parent, uint64_t location) {
+  auto inserted = children_.emplace(ChildKey{parent, location}, nodes_.size());
+  if (inserted.second) {
+    nodes_.push_back({parent, location, {}});
+  }
+  return inserted.first->second;
+}
+
+void ProfileAggregator::MergeSample(const Sample& sample, Node* node) {
+  for (Sample& merged : node->samples) {
+    if (SameLabels(merged.labels, sample.labels)) {
+      if (merged.values.size() < sample.values.size()) {
+        merged.values.resize(sample.values.size());
+      }
+      for (size_t i = 0; i < sample.values.size(); i++) {
+        merged.values[i] += sample.values[i];
+      }
+      return;
+    }
+  }
+  node->samples.push_back(sample);
+}
+
+void ProfileAggregator::AddSample(const std::vector<uint64_t>& path,
+                                  const int64_t* values, size_t valueCount,
+                                  const std::vector<Label>& labels) {
+  size_t common = 0;
+  while (common < path.size() && common < lastPath_.size() &&
+         path[common] == lastPath_[common]) {
+    common++;
+  }
+  lastPath_.resize(common);
+  lastNodes_.resize(common);
+  size_t node = common > 0 ? lastNodes_[common - 1] : 0;
+  for (size_t i = common; i < path.size(); i++) {
+    node = Child(node, path[i]);
+    lastPath_.push_back(path[i]);
+    lastNodes_.push_back(node);
+  }
+  MergeSample({labels, std::vector<int64_t>(values, values + valueCount)},
+              &nodes_[node]);
+}
+
+void ProfileAggregator::Fold() {
+  if (maxStacks_ == 0 || stackCount() <= maxStacks_) {
+    return;
+  }
+  size_t nodeCount = nodes_.size();
+  std::vector<int64_t> weights(nodeCount, 0);
+  // Number of nodes in the subtree of each node which are not folded.
+  std::vector<size_t> sizes(nodeCount, 1);
+  for (size_t i = nodeCount - 1; i > 0; i--) {
+    for (const Sample& sample : nodes_[i].samples) {
+      if (weightIndex_ < sample.values.size()) {
+        weights[i] += sample.values[weightIndex_];
+      }
+    }
+    weights[nodes_[i].parent] += weights[i];
+    sizes[nodes_[i].parent] += sizes[i];
+  }
+
+  // The weight of a subtree is at least that of any of its nodes, so with
+  // ties broken by depth, the descendants of a node are visited before it,
+  // and no node is visited once an ancestor has been folded.
+  std::vector<size_t> order;
+  for (size_t i = 1; i < nodeCount; i++) {
+    order.push_back(i);
+  }
+  std::sort(order.begin(), order.end(), [&weights](size_t a, size_t b) {
+    return weights[a] != weights[b] ? weights[a] < weights[b] : a > b;
+  });
+
+  uint64_t truncated = LocationId(0, kTruncatedName, "", 0, 0);
+  // The node into which each node is folded, if it is.
+  std::vector<size_t> folded(nodeCount, kNoNode);
+  size_t stacks = stackCount();
+  for (size_t node : order) {
+    if (stacks <= maxStacks_) {
+      break;
+    }
+    size_t parent = nodes_[node].parent;
+    if (nodes_[node].location == truncated) {
+      continue;
+    }
+    size_t target = Child(parent, truncated);
+    if (target == folded.size()) {
+      folded.push_back(kNoNode);
+      sizes.push_back(1);
+      for (size_t a = parent; a != kNoNode; a = nodes_[a].parent) {
+        sizes[a]++;
+      }
+      stacks++;
+    }
+    folded[node] = target;
+    size_t removed = sizes[node];
+    for (size_t a = parent; a != kNoNode; a = nodes_[a].parent) {
+      sizes[a] -= removed;
+    }
+    stacks -= removed;
+  }
+
+  // The descendants of a folded node are folded into the same node, which is
+  // itself folded if its parent is.
+  for (size_t i = 1; i < nodes_.size(); i++) {
+    if (folded[i] == kNoNode && folded[nodes_[i].parent] != kNoNode) {
+      folded[i] = folded[nodes_[i].parent];
+    }
+  }
+  for (size_t i = 1; i < nodes_.size(); i++) {
+    if (folded[i] == kNoNode) {
+      continue;
+    }
+    size_t target = folded[i];
+    while (folded[target] != kNoNode) {
+      target = folded[target];
+    }
+    for (const Sample& sample : nodes_[i].samples) {
+      MergeSample(sample, &nodes_[target]);
+    }
+  }
+
+  std::vector<size_t> indices(nodes_.size(), kNoNode);
+  std::vector<Node> kept;
+  children_.clear();
+  for (size_t i = 0; i < nodes_.size(); i++) {
+    if (folded[i] != kNoNode) {
+      continue;
+    }
+    indices[i] = kept.size();
+    Node& node = nodes_[i];
+    if (i > 0) {
+      node.parent = indices[node.parent];
+      children_.emplace(ChildKey{node.parent, node.location}, kept.size());
+    }
+    kept.push_back(std::move(node));
+  }
+  nodes_.swap(kept);
+  lastPath_.clear();
+  lastNodes_.clear();
+}
+
+std::string ProfileAggregator::Serialize() const {
+  ProfileBuilder builder;
+  for (const ValueType& sampleType : sampleTypes_) {
+    builder.AddSampleType(sampleType.type, sampleType.unit);
+  }
+  if (!periodType_.type.empty()) {
+    builder.SetPeriodType(periodType_.type, periodType_.unit);
+  }
+  builder.SetPeriod(period_);
+  builder.SetTimeNanos(timeNanos_);
+  builder.SetDurationNanos(durationNanos_);
+
+  // IDs of the locations of the aggregator in builder, once added.
+  std::vector<uint64_t> locationIds(locations_.size(), 0);
+  std::vector<uint64_t> path;
+  std::vector<Label> labels;
+  for (size_t i = 1; i < nodes_.size(); i++) {
+    const Node& node = nodes_[i];
+    if (node.samples.empty()) {
+      continue;
+    }
+    path.clear();
+    for (size_t n = i; n != 0; n = nodes_[n].parent) {
+      uint64_t location = nodes_[n].location;
+      if (!locationIds[location]) {
+        const Location& l = locations_[location];
+        locationIds[location] = builder.LocationId(
+            l.scriptId, l.name, l.scriptName, l.line, l.column);
+      }
+      path.push_back(locationIds[location]);
+    }
+    std::reverse(path.begin(), path.end());
+    for (const Sample& sample : node.samples) {
+      labels.clear();
+      for (const Label& label : sample.labels) {
+        labels.push_back(
+            {builder.StringId(*strings_[label.key]),
+             builder.StringId(*strings_[label.str]), label.num,
+             label.numUnit ? builder.StringId(*strings_[label.numUnit]) : 0});
+      }
+      std::vector<int64_t> values = sample.values;
+      values.resize(sampleTypes_.size());
+      builder.AddSample(path, values.data(), values.size(), labels);
+    }
+  }
+  return builder.Serialize();
+}
+
+void ProfileAggregator::Clear() {
+  sampleTypes_.clear();
+  periodType_ = {"", ""};
+  weightIndex_ = 0;
+  period_ = 0;
+  timeNanos_ = 0;
+  durationNanos_ = 0;
+  profileCount_ = 0;
+  stringIds_.clear();
+  strings_.clear();
+  StringId("");
+  locationIds_.clear();
+  // Location ID 0 is not used, so that 0 can mean no location.
+  locations_.assign(1, Location{0, "", "", 0, 0});
+  nodes_.assign(1, Node{kNoNode, 0, {}});
+  children_.clear();
+  lastPath_.clear();
+  lastNodes_.clear();
+}
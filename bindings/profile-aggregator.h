@@ -0,0 +1,179 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PPROF_BINDINGS_PROFILE_AGGREGATOR_H_
+#define PPROF_BINDINGS_PROFILE_AGGREGATOR_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "profile-builder.h"
+
+// Merges successive profiles into one call tree keyed by the stack of
+// locations of each sample, so that many profiles can be serialized as one.
+// The samples of a stack with the same labels are merged by adding their
+// values.
+//
+// Samples are added with the same StringId(), LocationId() and AddSample()
+// calls as to a ProfileBuilder, so the code which adds the samples of a
+// profile to a builder can add them to an aggregator instead. String and
+// location IDs are those of the aggregator.
+//
+// When maxStacks is not 0, Fold() keeps the tree to at most maxStacks
+// stacks, i.e. nodes, by folding the subtrees with the least weight into a
+// "(truncated)" child of their parent. The weight of a subtree is the sum of
+// the values of its samples for the period type, e.g. the wall time of a
+// time profile. Like ProfileBuilder, the aggregator does not depend on V8.
+class ProfileAggregator {
+ public:
+  using Label = ProfileBuilder::Label;
+
+  struct ValueType {
+    std::string type;
+    std::string unit;
+  };
+
+  explicit ProfileAggregator(size_t maxStacks);
+  ProfileAggregator(const ProfileAggregator&) = delete;
+  ProfileAggregator& operator=(const ProfileAggregator&) = delete;
+
+  // Sets the sample types of the profiles to merge. Returns false, without
+  // changing them, if profiles with other sample types have been merged
+  // since the aggregator was created or cleared.
+  bool SetSampleTypes(const std::vector<ValueType>& sampleTypes);
+  void SetPeriodType(const std::string& type, const std::string& unit);
+  // The period of the merged profile is that of the last profile merged.
+  void SetPeriod(int64_t period) { period_ = period; }
+  // The time of the merged profile is that of the first profile merged.
+  void SetTimeNanos(int64_t timeNanos);
+  // The duration of the merged profile is the sum of the durations of the
+  // profiles merged.
+  void AddDurationNanos(int64_t durationNanos) {
+    durationNanos_ += durationNanos;
+  }
+
+  int64_t StringId(const std::string& str);
+  uint64_t LocationId(int32_t scriptId, const std::string& name,
+                      const std::string& scriptName, int64_t line,
+                      int64_t column);
+  // Adds the values of a sample to those of the samples of its stack with
+  // the same labels. path lists location IDs from the root of the call tree
+  // to the sampled location.
+  void AddSample(const std::vector<uint64_t>& path, const int64_t* values,
+                 size_t valueCount,
+                 const std::vector<Label>& labels = std::vector<Label>());
+
+  // Folds the subtrees with the least weight until there are at most
+  // maxStacks stacks, if maxStacks is not 0. Called once a profile has been
+  // merged, so that the cap is not applied to a partly merged profile.
+  void Fold();
+
+  // Number of distinct stacks, i.e. nodes of the merged call tree other than
+  // its root.
+  size_t stackCount() const { return nodes_.size() - 1; }
+  size_t profileCount() const { return profileCount_; }
+  void EndProfile() { profileCount_++; }
+
+  // Returns the merged profile serialized as profile.proto.
+  std::string Serialize() const;
+
+  // Removes the merged profiles, so that the next profile merged starts a
+  // new one.
+  void Clear();
+
+ private:
+  struct Location {
+    int32_t scriptId;
+    std::string name;
+    std::string scriptName;
+    int64_t line;
+    int64_t column;
+  };
+  struct LocationKey {
+    int32_t scriptId;
+    int64_t line;
+    int64_t column;
+    std::string name;
+    bool operator==(const LocationKey& other) const {
+      return scriptId == other.scriptId && line == other.line &&
+             column == other.column && name == other.name;
+    }
+  };
+  struct LocationKeyHash {
+    size_t operator()(const LocationKey& key) const {
+      size_t h = std::hash<std::string>()(key.name);
+      h = h * 31 + key.scriptId;
+      h = h * 31 + static_cast<size_t>(key.line);
+      return h * 31 + static_cast<size_t>(key.column);
+    }
+  };
+  struct Sample {
+    std::vector<Label> labels;
+    std::vector<int64_t> values;
+  };
+  struct Node {
+    size_t parent;
+    uint64_t location;
+    std::vector<Sample> samples;
+  };
+  struct ChildKey {
+    size_t parent;
+    uint64_t location;
+    bool operator==(const ChildKey& other) const {
+      return parent == other.parent && location == other.location;
+    }
+  };
+  struct ChildKeyHash {
+    size_t operator()(const ChildKey& key) const {
+      return std::hash<uint64_t>()(key.location) * 31 + key.parent;
+    }
+  };
+
+  // Returns the index of the child of parent at location, adding it if
+  // needed.
+  size_t Child(size_t parent, uint64_t location);
+  static void MergeSample(const Sample& sample, Node* node);
+
+  size_t maxStacks_;
+  std::vector<ValueType> sampleTypes_;
+  ValueType periodType_;
+  // Index of the value of the period type in the values of samples.
+  size_t weightIndex_ = 0;
+  int64_t period_ = 0;
+  int64_t timeNanos_ = 0;
+  int64_t durationNanos_ = 0;
+  size_t profileCount_ = 0;
+
+  std::unordered_map<std::string, int64_t> stringIds_;
+  std::vector<const std::string*> strings_;
+  std::unordered_map<LocationKey, uint64_t, LocationKeyHash> locationIds_;
+  // Locations by ID; IDs start at 1.
+  std::vector<Location> locations_;
+
+  // nodes_[0] is the root. Each node comes after its parent.
+  std::vector<Node> nodes_;
+  std::unordered_map<ChildKey, size_t, ChildKeyHash> children_;
+
+  // The path and nodes of the last sample added, whose common prefix with
+  // the next one is not looked up again: samples are usually added in the
+  // order of a walk of the tree of a profile.
+  std::vector<uint64_t> lastPath_;
+  std::vector<size_t> lastNodes_;
+};
+
+#endif  // PPROF_BINDINGS_PROFILE_AGGREGATOR_H_
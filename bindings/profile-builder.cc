@@ -0,0 +1,133 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "profile-builder.h"
+
+#include "profile-fields.h"
+
+using namespace profile_fields;
+
+ProfileBuilder::ProfileBuilder() { StringId(""); }
+
+int64_t ProfileBuilder::StringId(const std::string& str) {
+  auto it = stringIds_.find(str);
+  if (it != stringIds_.end()) {
+    return it->second;
+  }
+  int64_t id = strings_.size();
+  auto inserted = stringIds_.emplace(str, id);
+  strings_.push_back(&inserted.first->first);
+  return id;
+}
+
+void ProfileBuilder::AddSampleType(const std::string& type,
+                                   const std::string& unit) {
+  ProtoWriter valueType;
+  valueType.WriteInt64(kValueTypeType, StringId(type));
+  valueType.WriteInt64(kValueTypeUnit, StringId(unit));
+  sampleTypes_.WriteMessage(kProfileSampleType, valueType);
+}
+
+void ProfileBuilder::SetPeriodType(const std::string& type,
+                                   const std::string& unit) {
+  periodType_.Clear();
+  periodType_.WriteInt64(kValueTypeType, StringId(type));
+  periodType_.WriteInt64(kValueTypeUnit, StringId(unit));
+}
+
+uint64_t ProfileBuilder::FunctionId(int32_t scriptId, const std::string& name,
+                                    const std::string& scriptName) {
+  FunctionKey key = {scriptId, name};
+  auto it = functionIds_.find(key);
+  if (it != functionIds_.end()) {
+    return it->second;
+  }
+  uint64_t id = ++functionCount_;
+  functionIds_.emplace(std::move(key), id);
+
+  int64_t nameId = StringId(name.empty() ? "(anonymous)" : name);
+  ProtoWriter function;
+  function.WriteUint64(kFunctionId, id);
+  function.WriteInt64(kFunctionName, nameId);
+  function.WriteInt64(kFunctionSystemName, nameId);
+  function.WriteInt64(kFunctionFilename, StringId(scriptName));
+  functions_.WriteMessage(kProfileFunction, function);
+  return id;
+}
+
+uint64_t ProfileBuilder::LocationId(int32_t scriptId, const std::string& name,
+                                    const std::string& scriptName,
+                                    int64_t line, int64_t column) {
+  LocationKey key = {scriptId, line, column, name};
+  auto it = locationIds_.find(key);
+  if (it != locationIds_.end()) {
+    return it->second;
+  }
+  uint64_t id = ++locationCount_;
+  locationIds_.emplace(std::move(key), id);
+
+  ProtoWriter lineMessage;
+  lineMessage.WriteUint64(kLineFunctionId,
+                          FunctionId(scriptId, name, scriptName));
+  lineMessage.WriteInt64(kLineLine, line);
+  ProtoWriter location;
+  location.WriteUint64(kLocationId, id);
+  location.WriteMessage(kLocationLine, lineMessage);
+  locations_.WriteMessage(kProfileLocation, location);
+  return id;
+}
+
+void ProfileBuilder::AddSample(const std::vector<uint64_t>& path,
+                               const int64_t* values, size_t valueCount,
+                               const std::vector<Label>& labels) {
+  scratch_.assign(path.rbegin(), path.rend());
+  ProtoWriter sample;
+  sample.WritePacked(kSampleLocationId, scratch_);
+  sample.WritePacked(kSampleValue, values, valueCount);
+  for (const Label& label : labels) {
+    ProtoWriter labelMessage;
+    labelMessage.WriteInt64(kLabelKey, label.key);
+    labelMessage.WriteInt64(kLabelStr, label.str);
+    labelMessage.WriteInt64(kLabelNum, label.num);
+    if (label.numUnit) {
+      labelMessage.WriteInt64(kLabelNumUnit, label.numUnit);
+    }
+    sample.WriteMessage(kSampleLabel, labelMessage);
+  }
+  samples_.WriteMessage(kProfileSample, sample);
+  sampleCount_++;
+}
+
+std::string ProfileBuilder::Serialize() const {
+  ProtoWriter profile;
+  profile.Append(sampleTypes_.data());
+  profile.Append(samples_.data());
+  profile.Append(locations_.data());
+  profile.Append(functions_.data());
+  for (const std::string* str : strings_) {
+    profile.WriteString(kProfileStringTable, *str);
+  }
+  profile.WriteInt64(kProfileTimeNanos, timeNanos_);
+  profile.WriteInt64(kProfileDurationNanos, durationNanos_);
+  if (periodType_.size() > 0) {
+    profile.WriteMessage(kProfilePeriodType, periodType_);
+  }
+  profile.WriteInt64(kProfilePeriod, period_);
+  for (int64_t comment : comments_) {
+    profile.WriteInt64(kProfileComment, comment);
+  }
+  return profile.data();
+}
@@ -0,0 +1,139 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PPROF_BINDINGS_PROFILE_BUILDER_H_
+#define PPROF_BINDINGS_PROFILE_BUILDER_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "proto-writer.h"
+
+// Builds a profile.proto message
+// (https://github.com/google/pprof/blob/master/proto/profile.proto).
+//
+// Functions and locations are deduplicated the same way as in
+// ts/src/profile-serializer.ts: functions by script ID and name, locations by
+// script ID, line, column and name. The builder does not depend on V8, so it
+// may be used off the main thread.
+class ProfileBuilder {
+ public:
+  // A label of a sample. key, str and numUnit are indices in the string
+  // table; numUnit is only written when it is not 0.
+  struct Label {
+    int64_t key;
+    int64_t str;
+    int64_t num;
+    int64_t numUnit;
+  };
+
+  ProfileBuilder();
+
+  // Returns the index of str in the string table, adding it if needed.
+  int64_t StringId(const std::string& str);
+
+  void AddSampleType(const std::string& type, const std::string& unit);
+  void SetPeriodType(const std::string& type, const std::string& unit);
+  void SetPeriod(int64_t period) { period_ = period; }
+  void SetTimeNanos(int64_t timeNanos) { timeNanos_ = timeNanos; }
+  void SetDurationNanos(int64_t durationNanos) {
+    durationNanos_ = durationNanos;
+  }
+  void AddComment(const std::string& comment) {
+    comments_.push_back(StringId(comment));
+  }
+
+  // Returns the ID of the function, adding it if needed. IDs start at 1.
+  uint64_t FunctionId(int32_t scriptId, const std::string& name,
+                      const std::string& scriptName);
+
+  // Returns the ID of the location, adding it and its function if needed.
+  // IDs start at 1.
+  uint64_t LocationId(int32_t scriptId, const std::string& name,
+                      const std::string& scriptName, int64_t line,
+                      int64_t column);
+
+  // Appends a sample. path lists location IDs from the root of the call tree
+  // to the sampled location; it is reversed when written, since pprof lists
+  // the leaf first.
+  void AddSample(const std::vector<uint64_t>& path, const int64_t* values,
+                 size_t valueCount,
+                 const std::vector<Label>& labels = std::vector<Label>());
+
+  size_t sampleCount() const { return sampleCount_; }
+
+  // Returns the serialized profile.
+  std::string Serialize() const;
+
+ private:
+  struct FunctionKey {
+    int32_t scriptId;
+    std::string name;
+    bool operator==(const FunctionKey& other) const {
+      return scriptId == other.scriptId && name == other.name;
+    }
+  };
+  struct FunctionKeyHash {
+    size_t operator()(const FunctionKey& key) const {
+      return std::hash<std::string>()(key.name) * 31 + key.scriptId;
+    }
+  };
+  struct LocationKey {
+    int32_t scriptId;
+    int64_t line;
+    int64_t column;
+    std::string name;
+    bool operator==(const LocationKey& other) const {
+      return scriptId == other.scriptId && line == other.line &&
+             column == other.column && name == other.name;
+    }
+  };
+  struct LocationKeyHash {
+    size_t operator()(const LocationKey& key) const {
+      size_t h = std::hash<std::string>()(key.name);
+      h = h * 31 + key.scriptId;
+      h = h * 31 + static_cast<size_t>(key.line);
+      return h * 31 + static_cast<size_t>(key.column);
+    }
+  };
+
+  std::unordered_map<std::string, int64_t> stringIds_;
+  std::vector<const std::string*> strings_;
+  std::unordered_map<FunctionKey, uint64_t, FunctionKeyHash> functionIds_;
+  std::unordered_map<LocationKey, uint64_t, LocationKeyHash> locationIds_;
+
+  // Encoded repeated message fields. Samples are encoded as they are added so
+  // that the builder does not hold a copy of every stack.
+  ProtoWriter sampleTypes_;
+  ProtoWriter samples_;
+  ProtoWriter locations_;
+  ProtoWriter functions_;
+  ProtoWriter periodType_;
+
+  size_t sampleCount_ = 0;
+  uint64_t functionCount_ = 0;
+  uint64_t locationCount_ = 0;
+  int64_t period_ = 0;
+  int64_t timeNanos_ = 0;
+  int64_t durationNanos_ = 0;
+  std::vector<int64_t> comments_;
+
+  std::vector<uint64_t> scratch_;
+};
+
+#endif  // PPROF_BINDINGS_PROFILE_BUILDER_H_
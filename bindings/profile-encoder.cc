@@ -0,0 +1,373 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "profile-encoder.h"
+
+#include <memory>
+#include <vector>
+
+#include "profile-fields.h"
+#include "proto-writer.h"
+#include "zlib.h"
+
+using namespace profile_fields;
+using namespace v8;
+
+namespace {
+
+// Number of fields of the entries of the flattened tables. Each entry is a
+// mask of the fields which are set, followed by each field as two 32-bit
+// words, low then high.
+const size_t kProfileFieldCount = 6;
+const size_t kValueTypeFieldCount = 2;
+const size_t kLabelFieldCount = 4;
+const size_t kMappingFieldCount = 10;
+const size_t kLocationFieldCount = 3;
+const size_t kLineFieldCount = 2;
+const size_t kFunctionFieldCount = 5;
+
+// Indices of the fields of ProfileTables.header, as flattened by
+// ts/src/profile-encoder.ts.
+const size_t kHeaderDropFrames = 0;
+const size_t kHeaderKeepFrames = 1;
+const size_t kHeaderTimeNanos = 2;
+const size_t kHeaderDurationNanos = 3;
+const size_t kHeaderPeriod = 4;
+const size_t kHeaderDefaultSampleType = 5;
+
+constexpr size_t EntrySize(size_t fieldCount) { return 1 + 2 * fieldCount; }
+
+// Number of words per entry in the flattened tables. Locations end with
+// their number of lines.
+const size_t kHeaderSize = EntrySize(kProfileFieldCount);
+const size_t kValueTypeSize = EntrySize(kValueTypeFieldCount);
+const size_t kSampleSize = 3;
+const size_t kLabelSize = EntrySize(kLabelFieldCount);
+const size_t kMappingSize = EntrySize(kMappingFieldCount);
+const size_t kLocationSize = EntrySize(kLocationFieldCount) + 1;
+const size_t kLineSize = EntrySize(kLineFieldCount);
+const size_t kFunctionSize = EntrySize(kFunctionFieldCount);
+
+// Flattened profile tables, copied out of JavaScript so that they can be
+// encoded on a worker thread.
+struct ProfileTables {
+  std::vector<uint32_t> header;
+  std::vector<uint32_t> periodType;
+  std::vector<std::string> stringTable;
+  std::vector<uint32_t> comments;
+  std::vector<uint32_t> sampleTypes;
+  std::vector<uint32_t> samples;
+  std::vector<uint32_t> sampleLocationIds;
+  std::vector<uint32_t> sampleValues;
+  std::vector<uint32_t> labels;
+  std::vector<uint32_t> mappings;
+  std::vector<uint32_t> locations;
+  std::vector<uint32_t> lines;
+  std::vector<uint32_t> functions;
+};
+
+// Returns the int64 stored in words as its low and high 32 bits.
+int64_t Int64At(const uint32_t* words) {
+  return static_cast<int64_t>(static_cast<uint64_t>(words[1]) << 32 |
+                              words[0]);
+}
+
+// Writes the index-th field of entry if it is set. Unlike
+// ProtoWriter::WriteInt64(), zero values are written too, matching protobufjs
+// for fields which are present.
+void WriteOptional(ProtoWriter* writer, int field, const uint32_t* entry,
+                   size_t index) {
+  if (!(entry[0] & (1u << index))) {
+    return;
+  }
+  writer->WriteTag(field, ProtoWriter::kVarint);
+  writer->WriteVarint(static_cast<uint64_t>(Int64At(entry + 1 + 2 * index)));
+}
+
+void WritePackedInt64s(ProtoWriter* writer, int field, const uint32_t* words,
+                       size_t count, std::vector<int64_t>* scratch) {
+  scratch->resize(count);
+  for (size_t i = 0; i < count; i++) {
+    (*scratch)[i] = Int64At(words + 2 * i);
+  }
+  writer->WritePacked(field, *scratch);
+}
+
+void WriteValueType(ProtoWriter* writer, int field, const uint32_t* valueType) {
+  ProtoWriter message;
+  WriteOptional(&message, kValueTypeType, valueType, 0);
+  WriteOptional(&message, kValueTypeUnit, valueType, 1);
+  writer->WriteMessage(field, message);
+}
+
+// Encodes the tables following the field order used by protobufjs, so that
+// the output is identical to perftools.profiles.Profile.encode().
+void EncodeProfileTables(const ProfileTables& t, ProtoWriter* out) {
+  std::vector<int64_t> scratch;
+  ProtoWriter message;
+
+  for (size_t i = 0; i < t.sampleTypes.size(); i += kValueTypeSize) {
+    WriteValueType(out, kProfileSampleType, &t.sampleTypes[i]);
+  }
+
+  size_t locationIdOffset = 0;
+  size_t valueOffset = 0;
+  size_t labelOffset = 0;
+  for (size_t i = 0; i < t.samples.size(); i += kSampleSize) {
+    size_t locationIdCount = t.samples[i];
+    size_t valueCount = t.samples[i + 1];
+    size_t labelCount = t.samples[i + 2];
+    message.Clear();
+    WritePackedInt64s(&message, kSampleLocationId,
+                      t.sampleLocationIds.data() + 2 * locationIdOffset,
+                      locationIdCount, &scratch);
+    WritePackedInt64s(&message, kSampleValue,
+                      t.sampleValues.data() + 2 * valueOffset, valueCount,
+                      &scratch);
+    for (size_t j = 0; j < labelCount; j++) {
+      const uint32_t* label = &t.labels[(labelOffset + j) * kLabelSize];
+      ProtoWriter labelMessage;
+      WriteOptional(&labelMessage, kLabelKey, label, 0);
+      WriteOptional(&labelMessage, kLabelStr, label, 1);
+      WriteOptional(&labelMessage, kLabelNum, label, 2);
+      WriteOptional(&labelMessage, kLabelNumUnit, label, 3);
+      message.WriteMessage(kSampleLabel, labelMessage);
+    }
+    locationIdOffset += locationIdCount;
+    valueOffset += valueCount;
+    labelOffset += labelCount;
+    out->WriteMessage(kProfileSample, message);
+  }
+
+  for (size_t i = 0; i < t.mappings.size(); i += kMappingSize) {
+    // Mapping fields are numbered in order, starting at 1.
+    message.Clear();
+    for (size_t k = 0; k < kMappingFieldCount; k++) {
+      WriteOptional(&message, k + 1, &t.mappings[i], k);
+    }
+    out->WriteMessage(kProfileMapping, message);
+  }
+
+  size_t lineOffset = 0;
+  for (size_t i = 0; i < t.locations.size(); i += kLocationSize) {
+    const uint32_t* location = &t.locations[i];
+    message.Clear();
+    WriteOptional(&message, kLocationId, location, 0);
+    WriteOptional(&message, kLocationMappingId, location, 1);
+    WriteOptional(&message, kLocationAddress, location, 2);
+    size_t lineCount = location[kLocationSize - 1];
+    for (size_t j = 0; j < lineCount; j++) {
+      const uint32_t* line = &t.lines[(lineOffset + j) * kLineSize];
+      ProtoWriter lineMessage;
+      WriteOptional(&lineMessage, kLineFunctionId, line, 0);
+      WriteOptional(&lineMessage, kLineLine, line, 1);
+      message.WriteMessage(kLocationLine, lineMessage);
+    }
+    lineOffset += lineCount;
+    out->WriteMessage(kProfileLocation, message);
+  }
+
+  for (size_t i = 0; i < t.functions.size(); i += kFunctionSize) {
+    const uint32_t* function = &t.functions[i];
+    message.Clear();
+    WriteOptional(&message, kFunctionId, function, 0);
+    WriteOptional(&message, kFunctionName, function, 1);
+    WriteOptional(&message, kFunctionSystemName, function, 2);
+    WriteOptional(&message, kFunctionFilename, function, 3);
+    WriteOptional(&message, kFunctionStartLine, function, 4);
+    out->WriteMessage(kProfileFunction, message);
+  }
+
+  for (const std::string& str : t.stringTable) {
+    out->WriteString(kProfileStringTable, str);
+  }
+
+  const uint32_t* h = t.header.data();
+  WriteOptional(out, kProfileDropFrames, h, kHeaderDropFrames);
+  WriteOptional(out, kProfileKeepFrames, h, kHeaderKeepFrames);
+  WriteOptional(out, kProfileTimeNanos, h, kHeaderTimeNanos);
+  WriteOptional(out, kProfileDurationNanos, h, kHeaderDurationNanos);
+  if (!t.periodType.empty()) {
+    WriteValueType(out, kProfilePeriodType, t.periodType.data());
+  }
+  WriteOptional(out, kProfilePeriod, h, kHeaderPeriod);
+  WritePackedInt64s(out, kProfileComment, t.comments.data(),
+                    t.comments.size() / 2, &scratch);
+  WriteOptional(out, kProfileDefaultSampleType, h, kHeaderDefaultSampleType);
+}
+
+// Returns false if tables[key] is not a Uint32Array.
+bool CopyWords(Local<Object> tables, const char* key,
+               std::vector<uint32_t>* out) {
+  Local<Value> value =
+      Nan::Get(tables, Nan::New(key).ToLocalChecked()).ToLocalChecked();
+  if (!value->IsUint32Array()) {
+    return false;
+  }
+  Nan::TypedArrayContents<uint32_t> contents(value);
+  out->assign(*contents, *contents + contents.length());
+  return true;
+}
+
+// Returns false if tables.stringTable is not an array.
+bool CopyStrings(Local<Object> tables, std::vector<std::string>* out) {
+  Local<Value> value =
+      Nan::Get(tables, Nan::New("stringTable").ToLocalChecked())
+          .ToLocalChecked();
+  if (!value->IsArray()) {
+    return false;
+  }
+  Local<Array> array = value.As<Array>();
+  uint32_t length = array->Length();
+  out->reserve(length);
+  for (uint32_t i = 0; i < length; i++) {
+    // The length is passed, since strings may contain NUL characters.
+    Nan::Utf8String str(Nan::Get(array, i).ToLocalChecked());
+    out->emplace_back(*str, str.length());
+  }
+  return true;
+}
+
+// Adds count to *offset, if count entries fit in a table of size entries
+// from *offset on.
+bool AddCount(uint32_t count, size_t size, size_t* offset) {
+  if (count > size - *offset) {
+    return false;
+  }
+  *offset += count;
+  return true;
+}
+
+// Checks that the tables are whole entries and that the counts in them add
+// up to the sizes of the tables they index, so that encoding does not read
+// out of bounds.
+bool ValidateTables(const ProfileTables& t) {
+  if (t.header.size() != kHeaderSize ||
+      (!t.periodType.empty() && t.periodType.size() != kValueTypeSize) ||
+      t.comments.size() % 2 != 0 ||
+      t.sampleTypes.size() % kValueTypeSize != 0 ||
+      t.samples.size() % kSampleSize != 0 ||
+      t.sampleLocationIds.size() % 2 != 0 ||
+      t.sampleValues.size() % 2 != 0 ||
+      t.labels.size() % kLabelSize != 0 ||
+      t.mappings.size() % kMappingSize != 0 ||
+      t.locations.size() % kLocationSize != 0 ||
+      t.lines.size() % kLineSize != 0 ||
+      t.functions.size() % kFunctionSize != 0) {
+    return false;
+  }
+  size_t locationIds = 0, values = 0, labels = 0, lines = 0;
+  for (size_t i = 0; i < t.samples.size(); i += kSampleSize) {
+    if (!AddCount(t.samples[i], t.sampleLocationIds.size() / 2,
+                  &locationIds) ||
+        !AddCount(t.samples[i + 1], t.sampleValues.size() / 2, &values) ||
+        !AddCount(t.samples[i + 2], t.labels.size() / kLabelSize, &labels)) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < t.locations.size(); i += kLocationSize) {
+    if (!AddCount(t.locations[i + kLocationSize - 1],
+                  t.lines.size() / kLineSize, &lines)) {
+      return false;
+    }
+  }
+  return locationIds * 2 == t.sampleLocationIds.size() &&
+         values * 2 == t.sampleValues.size() &&
+         labels * kLabelSize == t.labels.size() &&
+         lines * kLineSize == t.lines.size();
+}
+
+class EncodeProfileWorker : public Nan::AsyncWorker {
+ public:
+  EncodeProfileWorker(Nan::Callback* callback, ProfileTables* tables)
+      : Nan::AsyncWorker(callback, "pprof:EncodeProfile"), tables_(tables) {}
+
+  void Execute() override {
+    ProtoWriter writer;
+    EncodeProfileTables(*tables_, &writer);
+    tables_.reset();
+    if (!GzipCompress(writer.data(), &encoded_)) {
+      SetErrorMessage("Failed to compress profile.");
+    }
+  }
+
+  void HandleOKCallback() override {
+    Nan::HandleScope scope;
+    Local<Value> argv[] = {
+        Nan::Null(),
+        Nan::CopyBuffer(encoded_.data(), encoded_.size()).ToLocalChecked()};
+    callback->Call(2, argv, async_resource);
+  }
+
+ private:
+  std::unique_ptr<ProfileTables> tables_;
+  std::string encoded_;
+};
+
+}  // namespace
+
+bool GzipCompress(const std::string& data, std::string* out) {
+  z_stream stream = {};
+  // 16 is added to the window bits to write a gzip header, as zlib.gzip()
+  // does.
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  out->resize(deflateBound(&stream, data.size()));
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = data.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&(*out)[0]);
+  stream.avail_out = out->size();
+  int result = deflate(&stream, Z_FINISH);
+  out->resize(stream.total_out);
+  deflateEnd(&stream);
+  return result == Z_STREAM_END;
+}
+
+NAN_METHOD(EncodeProfile) {
+  if (info.Length() != 2) {
+    return Nan::ThrowTypeError("EncodeProfile must have two arguments.");
+  }
+  if (!info[0]->IsObject()) {
+    return Nan::ThrowTypeError("First argument must be an object.");
+  }
+  if (!info[1]->IsFunction()) {
+    return Nan::ThrowTypeError("Second argument must be a function.");
+  }
+  Local<Object> tables = info[0].As<Object>();
+  std::unique_ptr<ProfileTables> t(new ProfileTables());
+  bool ok = CopyWords(tables, "header", &t->header) &&
+            CopyWords(tables, "periodType", &t->periodType) &&
+            CopyStrings(tables, &t->stringTable) &&
+            CopyWords(tables, "comments", &t->comments) &&
+            CopyWords(tables, "sampleTypes", &t->sampleTypes) &&
+            CopyWords(tables, "samples", &t->samples) &&
+            CopyWords(tables, "sampleLocationIds", &t->sampleLocationIds) &&
+            CopyWords(tables, "sampleValues", &t->sampleValues) &&
+            CopyWords(tables, "labels", &t->labels) &&
+            CopyWords(tables, "mappings", &t->mappings) &&
+            CopyWords(tables, "locations", &t->locations) &&
+            CopyWords(tables, "lines", &t->lines) &&
+            CopyWords(tables, "functions", &t->functions);
+  if (!ok || !ValidateTables(*t)) {
+    return Nan::ThrowTypeError("First argument must be valid profile tables.");
+  }
+
+  Nan::Callback* callback = new Nan::Callback(info[1].As<Function>());
+  Nan::AsyncQueueWorker(new EncodeProfileWorker(callback, t.release()));
+}
@@ -0,0 +1,35 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PPROF_BINDINGS_PROFILE_ENCODER_H_
+#define PPROF_BINDINGS_PROFILE_ENCODER_H_
+
+#include <string>
+
+#include "nan.h"
+
+// Compresses data in gzip format. Returns false if zlib fails.
+bool GzipCompress(const std::string& data, std::string* out);
+
+// Signature:
+// encodeProfile(tables: ProfileTables,
+//               callback: (err: Error|null, buffer?: Buffer) => void)
+//
+// Encodes a profile flattened by ts/src/profile-encoder.ts and gzips it on a
+// libuv worker thread.
+NAN_METHOD(EncodeProfile);
+
+#endif  // PPROF_BINDINGS_PROFILE_ENCODER_H_
@@ -0,0 +1,64 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PPROF_BINDINGS_PROFILE_FIELDS_H_
+#define PPROF_BINDINGS_PROFILE_FIELDS_H_
+
+// Field numbers from third_party/proto/profile.proto.
+namespace profile_fields {
+const int kProfileSampleType = 1;
+const int kProfileSample = 2;
+const int kProfileMapping = 3;
+const int kProfileLocation = 4;
+const int kProfileFunction = 5;
+const int kProfileStringTable = 6;
+const int kProfileDropFrames = 7;
+const int kProfileKeepFrames = 8;
+const int kProfileTimeNanos = 9;
+const int kProfileDurationNanos = 10;
+const int kProfilePeriodType = 11;
+const int kProfilePeriod = 12;
+const int kProfileComment = 13;
+const int kProfileDefaultSampleType = 14;
+
+const int kValueTypeType = 1;
+const int kValueTypeUnit = 2;
+
+const int kSampleLocationId = 1;
+const int kSampleValue = 2;
+const int kSampleLabel = 3;
+
+const int kLabelKey = 1;
+const int kLabelStr = 2;
+const int kLabelNum = 3;
+const int kLabelNumUnit = 4;
+
+const int kLocationId = 1;
+const int kLocationMappingId = 2;
+const int kLocationAddress = 3;
+const int kLocationLine = 4;
+
+const int kLineFunctionId = 1;
+const int kLineLine = 2;
+
+const int kFunctionId = 1;
+const int kFunctionName = 2;
+const int kFunctionSystemName = 3;
+const int kFunctionFilename = 4;
+const int kFunctionStartLine = 5;
+}  // namespace profile_fields
+
+#endif  // PPROF_BINDINGS_PROFILE_FIELDS_H_
@@ -14,254 +14,3062 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "context-recorder.h"
+#include "cpu-time-sampler.h"
 #include "nan.h"
+#include "profile-aggregator.h"
+#include "profile-builder.h"
+#include "profile-encoder.h"
+#include "source-map-decoder.h"
 #include "v8-profiler.h"
+#include "v8-shim.h"
 
 using namespace v8;
 
+// Names of the properties of the nodes of translated profiles.
+enum ProfileNodeKey {
+  kNameKey,
+  kScriptNameKey,
+  kScriptIdKey,
+  kLineNumberKey,
+  kColumnNumberKey,
+  kHitCountKey,
+  kChildrenKey,
+  kIdKey,
+  kParentIdKey,
+  kAllocationsKey,
+  kSizeBytesKey,
+  kCountKey,
+  kCpuTimeKey,
+  kContextsKey,
+  kContextKey,
+  kLocationKeyKey,
+  kFunctionKeyKey,
+  kProfileNodeKeyCount
+};
+
+const char* const kProfileNodeKeyNames[kProfileNodeKeyCount] = {
+    "name",     "scriptName", "scriptId", "lineNumber",
+    "columnNumber", "hitCount", "children", "id",
+    "parentId", "allocations", "sizeBytes", "count",
+    "cpuTime",  "contexts",   "context", "locationKey",
+    "functionKey"};
+
+// The property names of translated profile nodes, internalized once for each
+// isolate, so that translating a profile does not create them or look them
+// up in the string table again for every node.
+class ProfileNodeKeys {
+ public:
+  explicit ProfileNodeKeys(Isolate* isolate) {
+    Nan::HandleScope scope;
+    for (int i = 0; i < kProfileNodeKeyCount; i++) {
+      keys_[i].Reset(String::NewFromUtf8(isolate, kProfileNodeKeyNames[i],
+                                         NewStringType::kInternalized)
+                         .ToLocalChecked());
+    }
+  }
+
+  ~ProfileNodeKeys() {
+    for (Nan::Persistent<String>& key : keys_) {
+      key.Reset();
+    }
+  }
+
+  Local<String> Get(ProfileNodeKey key) const { return Nan::New(keys_[key]); }
+
+ private:
+  Nan::Persistent<String> keys_[kProfileNodeKeyCount];
+};
+
+// Local handles to the keys of an isolate, created once per translation.
+class NodeKeys {
+ public:
+  explicit NodeKeys(const ProfileNodeKeys& keys) {
+    for (int i = 0; i < kProfileNodeKeyCount; i++) {
+      keys_[i] = keys.Get(static_cast<ProfileNodeKey>(i));
+    }
+  }
+
+  Local<String> operator[](ProfileNodeKey key) const { return keys_[key]; }
+
+ private:
+  Local<String> keys_[kProfileNodeKeyCount];
+};
+
+// Cost of the last collection of a profile by the native module, as
+// reported by getTranslationStats(). The time is measured with uv_hrtime(),
+// which is monotonic, from before the profile is copied out of V8 until it
+// has been translated or serialized.
+struct TranslationStats {
+  uint64_t nanos = 0;
+  // Nodes of the profile, root included, before any pruning.
+  uint32_t nodeCount = 0;
+  // Hits of a time profile, or sampled objects of an allocation profile.
+  uint64_t sampleCount = 0;
+  // CPU time the profiled thread spent taking the samples of a time profile,
+  // or -1 if it was not measured.
+  int64_t sampleNanos = -1;
+
+  Local<Object> ToObject() const {
+    Local<Object> stats = Nan::New<Object>();
+    Nan::Set(stats, Nan::New<String>("nanos").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(nanos)));
+    Nan::Set(stats, Nan::New<String>("nodeCount").ToLocalChecked(),
+             Nan::New<Number>(nodeCount));
+    Nan::Set(stats, Nan::New<String>("sampleCount").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(sampleCount)));
+    Nan::Set(stats, Nan::New<String>("sampleNanos").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(sampleNanos)));
+    return stats;
+  }
+};
+
 // Sampling Heap Profiler
 
-Local<Value> TranslateAllocationProfile(AllocationProfile::Node* node) {
-  Local<Object> js_node = Nan::New<Object>();
-
-  Nan::Set(js_node, Nan::New<String>("name").ToLocalChecked(), node->name);
-  Nan::Set(js_node, Nan::New<String>("scriptName").ToLocalChecked(),
-           node->script_name);
-  Nan::Set(js_node, Nan::New<String>("scriptId").ToLocalChecked(),
-           Nan::New<Integer>(node->script_id));
-  Nan::Set(js_node, Nan::New<String>("lineNumber").ToLocalChecked(),
-           Nan::New<Integer>(node->line_number));
-  Nan::Set(js_node, Nan::New<String>("columnNumber").ToLocalChecked(),
-           Nan::New<Integer>(node->column_number));
-
-  Local<Array> children = Nan::New<Array>(node->children.size());
-  for (size_t i = 0; i < node->children.size(); i++) {
-    Nan::Set(children, i, TranslateAllocationProfile(node->children[i]));
-  }
-  Nan::Set(js_node, Nan::New<String>("children").ToLocalChecked(), children);
-  Local<Array> allocations = Nan::New<Array>(node->allocations.size());
-  for (size_t i = 0; i < node->allocations.size(); i++) {
-    AllocationProfile::Allocation alloc = node->allocations[i];
-    Local<Object> js_alloc = Nan::New<Object>();
-    Nan::Set(js_alloc, Nan::New<String>("sizeBytes").ToLocalChecked(),
-             Nan::New<Number>(alloc.size));
-    Nan::Set(js_alloc, Nan::New<String>("count").ToLocalChecked(),
-             Nan::New<Number>(alloc.count));
-    Nan::Set(allocations, i, js_alloc);
-  }
-  Nan::Set(js_node, Nan::New<String>("allocations").ToLocalChecked(),
-           allocations);
-  return js_node;
+// State of the heap profiler of an isolate, used to report the changes in
+// the allocation profile since it was last reported.
+struct HeapProfilerState {
+  // Samples and nodes of the allocation profile already reported, which are
+  // still in it.
+  std::unordered_set<uint64_t> reportedSamples;
+  std::unordered_set<uint32_t> reportedNodes;
+  ProfileNodeKeys keys;
+  TranslationStats lastStats;
+  // Template of the ProfileAggregator class of the isolate.
+  Nan::Persistent<FunctionTemplate> aggregatorTemplate;
+
+  explicit HeapProfilerState(Isolate* isolate) : keys(isolate) {}
+
+  void Reset() {
+    reportedSamples.clear();
+    reportedNodes.clear();
+  }
+
+  static void Cleanup(void* arg) {
+    HeapProfilerState* state = static_cast<HeapProfilerState*>(arg);
+    state->aggregatorTemplate.Reset();
+    delete state;
+  }
+};
+
+HeapProfilerState* GetHeapProfilerState(
+    const Nan::FunctionCallbackInfo<Value>& info) {
+  return static_cast<HeapProfilerState*>(info.Data().As<External>()->Value());
+}
+
+// Records the cost of a collection which started at startNanos, as returned
+// by uv_hrtime().
+void RecordAllocationProfileStats(HeapProfilerState* state,
+                                  AllocationProfile::Node* root,
+                                  uint64_t startNanos) {
+  TranslationStats& stats = state->lastStats;
+  stats.nanos = uv_hrtime() - startNanos;
+  stats.nodeCount = 0;
+  stats.sampleCount = 0;
+  std::vector<AllocationProfile::Node*> nodes = {root};
+  while (!nodes.empty()) {
+    AllocationProfile::Node* node = nodes.back();
+    nodes.pop_back();
+    stats.nodeCount++;
+    for (const AllocationProfile::Allocation& alloc : node->allocations) {
+      stats.sampleCount += alloc.count;
+    }
+    nodes.insert(nodes.end(), node->children.begin(), node->children.end());
+  }
+}
+
+// Returns a typed array with a copy of values.
+template <typename T, typename Array>
+Local<Array> CreateTypedArray(const std::vector<T>& values) {
+  Local<ArrayBuffer> buffer =
+      ArrayBuffer::New(v8::Isolate::GetCurrent(), values.size() * sizeof(T));
+  Local<Array> array = Array::New(buffer, 0, values.size());
+  Nan::TypedArrayContents<T> contents(array);
+  std::copy(values.begin(), values.end(), *contents);
+  return array;
+}
+
+// Translates the allocation profile tree under root. The tree is walked with
+// an explicit stack, so that deep trees cannot overflow the native stack.
+Local<Value> TranslateAllocationProfile(AllocationProfile::Node* root,
+                                        const ProfileNodeKeys& profileKeys) {
+  NodeKeys keys(profileKeys);
+  // A node still to be translated, and where to store it in the children of
+  // its parent. The root has no parent.
+  struct PendingNode {
+    AllocationProfile::Node* node;
+    Local<Array> parent;
+    uint32_t index;
+  };
+  std::vector<PendingNode> pending;
+  pending.push_back({root, Local<Array>(), 0});
+  Local<Object> js_root;
+  while (!pending.empty()) {
+    PendingNode next = pending.back();
+    pending.pop_back();
+    AllocationProfile::Node* node = next.node;
+
+    Local<Array> children = Nan::New<Array>(node->children.size());
+    for (size_t i = 0; i < node->children.size(); i++) {
+      pending.push_back({node->children[i], children, uint32_t(i)});
+    }
+    Local<Array> allocations = Nan::New<Array>(node->allocations.size());
+    for (size_t i = 0; i < node->allocations.size(); i++) {
+      AllocationProfile::Allocation alloc = node->allocations[i];
+      Local<Object> js_alloc = Nan::New<Object>();
+      Local<String> allocKeys[] = {keys[kSizeBytesKey], keys[kCountKey]};
+      Local<Value> allocValues[] = {Nan::New<Number>(alloc.size),
+                                    Nan::New<Number>(alloc.count)};
+      DefineProperties(js_alloc, allocKeys, allocValues, 2);
+      Nan::Set(allocations, i, js_alloc);
+    }
+
+    Local<Object> js_node = Nan::New<Object>();
+    Local<String> nodeKeys[] = {keys[kNameKey],         keys[kScriptNameKey],
+                                keys[kScriptIdKey],     keys[kLineNumberKey],
+                                keys[kColumnNumberKey], keys[kChildrenKey],
+                                keys[kAllocationsKey]};
+    Local<Value> nodeValues[] = {node->name,
+                                 node->script_name,
+                                 Nan::New<Integer>(node->script_id),
+                                 Nan::New<Integer>(node->line_number),
+                                 Nan::New<Integer>(node->column_number),
+                                 children,
+                                 allocations};
+    DefineProperties(js_node, nodeKeys, nodeValues, 7);
+
+    if (next.parent.IsEmpty()) {
+      js_root = js_node;
+    } else {
+      Nan::Set(next.parent, next.index, js_node);
+    }
+  }
+  return js_root;
+}
+
+// The distinct strings of a profile translated into columns, which refer to
+// them by index.
+class ProfileStrings {
+ public:
+  int32_t Add(const std::string& str) {
+    auto it = ids_.find(str);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+    int32_t id = strings_.size();
+    auto inserted = ids_.emplace(str, id);
+    strings_.push_back(&inserted.first->first);
+    return id;
+  }
+
+  // V8 keeps the names of a CPU profile interned, so they are first looked
+  // up by address, without hashing their contents.
+  int32_t Add(const char* str) {
+    auto it = pointerIds_.find(str);
+    if (it != pointerIds_.end()) {
+      return it->second;
+    }
+    int32_t id = Add(std::string(str));
+    pointerIds_.emplace(str, id);
+    return id;
+  }
+
+  Local<Array> ToArray() const {
+    Local<Array> array = Nan::New<Array>(strings_.size());
+    for (size_t i = 0; i < strings_.size(); i++) {
+      Nan::Set(array, i, Nan::New<String>(*strings_[i]).ToLocalChecked());
+    }
+    return array;
+  }
+
+ private:
+  std::unordered_map<std::string, int32_t> ids_;
+  std::unordered_map<const char*, int32_t> pointerIds_;
+  std::vector<const std::string*> strings_;
+};
+
+// Dense keys, from 0, of the distinct locations and functions of the nodes
+// of a profile, keyed as ts/src/profile-serializer.ts keys them: locations by
+// script ID, line, column and name, and functions by script ID and name.
+// Names are identified by an integer, such as their index in ProfileStrings,
+// so that no key is built from strings.
+class LocationKeys {
+ public:
+  struct Keys {
+    int32_t location;
+    int32_t function;
+  };
+
+  Keys Get(int32_t scriptId, uintptr_t name, int32_t line, int32_t column) {
+    Key location = {scriptId, name, line, column};
+    auto it = locations_.find(location);
+    if (it != locations_.end()) {
+      return it->second;
+    }
+    auto function =
+        functions_.emplace(Key{scriptId, name, 0, 0}, functions_.size());
+    Keys keys = {static_cast<int32_t>(locations_.size()),
+                 function.first->second};
+    locations_.emplace(location, keys);
+    return keys;
+  }
+
+ private:
+  struct Key {
+    int32_t scriptId;
+    uintptr_t name;
+    int32_t line;
+    int32_t column;
+    bool operator==(const Key& other) const {
+      return scriptId == other.scriptId && name == other.name &&
+             line == other.line && column == other.column;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      size_t h = std::hash<uintptr_t>()(key.name);
+      h = h * 31 + key.scriptId;
+      h = h * 31 + key.line;
+      return h * 31 + key.column;
+    }
+  };
+
+  std::unordered_map<Key, Keys, KeyHash> locations_;
+  std::unordered_map<Key, int32_t, KeyHash> functions_;
+};
+
+// Columns of the nodes of a profile tree (see ProfileNodeColumns in
+// ts/src/v8-types.ts).
+struct ProfileNodeColumns {
+  std::vector<int32_t> parents;
+  std::vector<int32_t> names;
+  std::vector<int32_t> scriptNames;
+  std::vector<int32_t> scriptIds;
+  std::vector<int32_t> lineNumbers;
+  std::vector<int32_t> columnNumbers;
+  std::vector<int32_t> locationKeys;
+  std::vector<int32_t> functionKeys;
+  LocationKeys keys;
+
+  // Adds a node, and returns its index.
+  int32_t Add(int32_t parent, int32_t name, int32_t scriptName,
+              int32_t scriptId, int32_t lineNumber, int32_t columnNumber) {
+    parents.push_back(parent);
+    names.push_back(name);
+    scriptNames.push_back(scriptName);
+    scriptIds.push_back(scriptId);
+    lineNumbers.push_back(lineNumber);
+    columnNumbers.push_back(columnNumber);
+    LocationKeys::Keys nodeKeys =
+        keys.Get(scriptId, name, lineNumber, columnNumber);
+    locationKeys.push_back(nodeKeys.location);
+    functionKeys.push_back(nodeKeys.function);
+    return parents.size() - 1;
+  }
+
+  Local<Object> ToObject() const {
+    Local<Object> nodes = Nan::New<Object>();
+    Nan::Set(nodes, Nan::New<String>("parents").ToLocalChecked(),
+             CreateTypedArray<int32_t, Int32Array>(parents));
+    Nan::Set(nodes, Nan::New<String>("names").ToLocalChecked(),
+             CreateTypedArray<int32_t, Int32Array>(names));
+    Nan::Set(nodes, Nan::New<String>("scriptNames").ToLocalChecked(),
+             CreateTypedArray<int32_t, Int32Array>(scriptNames));
+    Nan::Set(nodes, Nan::New<String>("scriptIds").ToLocalChecked(),
+             CreateTypedArray<int32_t, Int32Array>(scriptIds));
+    Nan::Set(nodes, Nan::New<String>("lineNumbers").ToLocalChecked(),
+             CreateTypedArray<int32_t, Int32Array>(lineNumbers));
+    Nan::Set(nodes, Nan::New<String>("columnNumbers").ToLocalChecked(),
+             CreateTypedArray<int32_t, Int32Array>(columnNumbers));
+    Nan::Set(nodes, Nan::New<String>("locationKeys").ToLocalChecked(),
+             CreateTypedArray<int32_t, Int32Array>(locationKeys));
+    Nan::Set(nodes, Nan::New<String>("functionKeys").ToLocalChecked(),
+             CreateTypedArray<int32_t, Int32Array>(functionKeys));
+    return nodes;
+  }
+};
+
+// Allocations of a node merged by size bucket: count objects of bytes bytes
+// in total, each of which is at most bucket bytes.
+struct AllocationBucket {
+  uint64_t bucket;
+  uint64_t count;
+  uint64_t bytes;
+};
+
+// Returns the size bucket of an allocation of size bytes: the smallest power
+// of two which is at least size.
+uint64_t AllocationSizeBucket(uint64_t size) {
+  uint64_t bucket = 1;
+  while (bucket < size) {
+    bucket <<= 1;
+  }
+  return bucket;
+}
+
+// Returns the allocations merged by size bucket, in increasing order of their
+// buckets, as bucketAllocations() in ts/src/profile-serializer.ts merges them.
+std::vector<AllocationBucket> BucketAllocations(
+    const std::vector<AllocationProfile::Allocation>& allocations) {
+  std::vector<AllocationBucket> buckets;
+  for (const AllocationProfile::Allocation& alloc : allocations) {
+    uint64_t bucket = AllocationSizeBucket(alloc.size);
+    uint64_t bytes = static_cast<uint64_t>(alloc.size) * alloc.count;
+    auto merged = std::find_if(
+        buckets.begin(), buckets.end(),
+        [bucket](const AllocationBucket& b) { return b.bucket == bucket; });
+    if (merged != buckets.end()) {
+      merged->count += alloc.count;
+      merged->bytes += bytes;
+    } else {
+      buckets.push_back({bucket, alloc.count, bytes});
+    }
+  }
+  std::sort(buckets.begin(), buckets.end(),
+            [](const AllocationBucket& a, const AllocationBucket& b) {
+              return a.bucket < b.bucket;
+            });
+  return buckets;
+}
+
+// Translates the allocation profile tree under root into columns (see
+// AllocationProfileColumns in ts/src/v8-types.ts), which takes a few
+// allocations rather than several objects per node. When externalBytes is
+// positive, an "(external)" node is added for external memory. Nodes are in
+// the order in which serializeHeapProfile() in ts/src/profile-serializer.ts
+// visits the translated tree.
+Local<Object> TranslateAllocationProfileColumns(AllocationProfile::Node* root,
+                                                int64_t externalBytes) {
+  ProfileStrings strings;
+  ProfileNodeColumns nodes;
+  std::vector<int32_t> allocationNodes;
+  std::vector<double> buckets;
+  std::vector<uint32_t> counts;
+  std::vector<double> bytes;
+  // Script names are looked up by script ID, rather than converted for each
+  // node.
+  std::unordered_map<int, int32_t> scriptNames;
+
+  std::vector<std::pair<AllocationProfile::Node*, int32_t>> pending;
+  pending.push_back({root, -1});
+  while (!pending.empty()) {
+    AllocationProfile::Node* node = pending.back().first;
+    int32_t parent = pending.back().second;
+    pending.pop_back();
+
+    int32_t scriptName;
+    auto it = node->script_id ? scriptNames.find(node->script_id)
+                              : scriptNames.end();
+    if (it != scriptNames.end()) {
+      scriptName = it->second;
+    } else {
+      scriptName =
+          strings.Add(std::string(*Nan::Utf8String(node->script_name)));
+      if (node->script_id) {
+        scriptNames[node->script_id] = scriptName;
+      }
+    }
+    int32_t index = nodes.Add(
+        parent, strings.Add(std::string(*Nan::Utf8String(node->name))),
+        scriptName, node->script_id, node->line_number, node->column_number);
+    for (const AllocationBucket& bucket :
+         BucketAllocations(node->allocations)) {
+      allocationNodes.push_back(index);
+      buckets.push_back(bucket.bucket);
+      counts.push_back(bucket.count);
+      bytes.push_back(bucket.bytes);
+    }
+    for (AllocationProfile::Node* child : node->children) {
+      pending.push_back({child, index});
+    }
+    // The external node is the last child of the root, which is visited
+    // first.
+    if (parent == -1 && externalBytes > 0) {
+      int32_t external =
+          nodes.Add(index, strings.Add(std::string("(external)")),
+                    strings.Add(std::string()), 0, 0, 0);
+      allocationNodes.push_back(external);
+      buckets.push_back(AllocationSizeBucket(externalBytes));
+      counts.push_back(1);
+      bytes.push_back(externalBytes);
+    }
+  }
+
+  Local<Object> allocations = Nan::New<Object>();
+  Nan::Set(allocations, Nan::New<String>("nodes").ToLocalChecked(),
+           CreateTypedArray<int32_t, Int32Array>(allocationNodes));
+  Nan::Set(allocations, Nan::New<String>("buckets").ToLocalChecked(),
+           CreateTypedArray<double, Float64Array>(buckets));
+  Nan::Set(allocations, Nan::New<String>("counts").ToLocalChecked(),
+           CreateTypedArray<uint32_t, Uint32Array>(counts));
+  Nan::Set(allocations, Nan::New<String>("bytes").ToLocalChecked(),
+           CreateTypedArray<double, Float64Array>(bytes));
+
+  Local<Object> profile = Nan::New<Object>();
+  Nan::Set(profile, Nan::New<String>("strings").ToLocalChecked(),
+           strings.ToArray());
+  Nan::Set(profile, Nan::New<String>("nodes").ToLocalChecked(),
+           nodes.ToObject());
+  Nan::Set(profile, Nan::New<String>("allocations").ToLocalChecked(),
+           allocations);
+  return profile;
+}
+
+NAN_METHOD(StartSamplingHeapProfiler) {
+  if (info.Length() == 2) {
+    if (!info[0]->IsUint32()) {
+      return Nan::ThrowTypeError("First argument type must be uint32.");
+    }
+    if (!info[1]->IsNumber()) {
+      return Nan::ThrowTypeError("First argument type must be Integer.");
+    }
+
+    uint64_t sample_interval = Nan::To<uint32_t>(info[0]).FromJust();
+    int stack_depth = Nan::To<int32_t>(info[1]).FromJust();
+
+    info.GetIsolate()->GetHeapProfiler()->StartSamplingHeapProfiler(
+        sample_interval, stack_depth);
+  } else {
+    info.GetIsolate()->GetHeapProfiler()->StartSamplingHeapProfiler();
+  }
+  GetHeapProfilerState(info)->Reset();
+}
+
+// Signature:
+// stopSamplingHeapProfiler()
+NAN_METHOD(StopSamplingHeapProfiler) {
+  info.GetIsolate()->GetHeapProfiler()->StopSamplingHeapProfiler();
+  GetHeapProfilerState(info)->Reset();
+}
+
+// Signature:
+// getAllocationProfile(): AllocationProfileNode
+NAN_METHOD(GetAllocationProfile) {
+  HeapProfilerState* state = GetHeapProfilerState(info);
+  uint64_t startNanos = uv_hrtime();
+  std::unique_ptr<v8::AllocationProfile> profile(
+      info.GetIsolate()->GetHeapProfiler()->GetAllocationProfile());
+  AllocationProfile::Node* root = profile->GetRootNode();
+  Local<Value> translated = TranslateAllocationProfile(root, state->keys);
+  RecordAllocationProfileStats(state, root, startNanos);
+  info.GetReturnValue().Set(translated);
+}
+
+// Signature:
+// getAllocationProfileColumns(externalBytes: number): AllocationProfileColumns
+//
+// When externalBytes is positive, an "(external)" node is added for external
+// memory.
+NAN_METHOD(GetAllocationProfileColumns) {
+  if (info.Length() != 1) {
+    return Nan::ThrowTypeError(
+        "GetAllocationProfileColumns must have one argument.");
+  }
+  if (!info[0]->IsNumber()) {
+    return Nan::ThrowTypeError("First argument must be a number.");
+  }
+  int64_t externalBytes = info[0].As<Number>()->Value();
+  uint64_t startNanos = uv_hrtime();
+  std::unique_ptr<v8::AllocationProfile> profile(
+      info.GetIsolate()->GetHeapProfiler()->GetAllocationProfile());
+  AllocationProfile::Node* root = profile->GetRootNode();
+  Local<Object> translated =
+      TranslateAllocationProfileColumns(root, externalBytes);
+  RecordAllocationProfileStats(GetHeapProfilerState(info), root, startNanos);
+  info.GetReturnValue().Set(translated);
+}
+
+// An allocation profile copied out of V8, so that it can be serialized
+// without V8, e.g. on a libuv worker thread. Nodes whose script name contains
+// ignoreSamplePath are left out along with their descendants, unless
+// ignoreSamplePath is empty.
+class CopiedAllocationProfile {
+ public:
+  CopiedAllocationProfile(AllocationProfile::Node* root,
+                          const std::string& ignoreSamplePath) {
+    // Script names are looked up by script ID, rather than converted for
+    // each node.
+    std::unordered_map<int, size_t> scriptNames;
+    std::vector<std::pair<AllocationProfile::Node*, size_t>> pending;
+    for (AllocationProfile::Node* child : root->children) {
+      pending.push_back({child, 0});
+    }
+    while (!pending.empty()) {
+      AllocationProfile::Node* node = pending.back().first;
+      size_t depth = pending.back().second;
+      pending.pop_back();
+
+      size_t scriptName;
+      auto it = node->script_id ? scriptNames.find(node->script_id)
+                                : scriptNames.end();
+      if (it != scriptNames.end()) {
+        scriptName = it->second;
+      } else {
+        scriptName = scriptNames_.size();
+        scriptNames_.push_back(*Nan::Utf8String(node->script_name));
+        if (node->script_id) {
+          scriptNames[node->script_id] = scriptName;
+        }
+      }
+      if (!ignoreSamplePath.empty() &&
+          scriptNames_[scriptName].find(ignoreSamplePath) !=
+              std::string::npos) {
+        continue;
+      }
+      nodes_.push_back({*Nan::Utf8String(node->name), scriptName,
+                        node->script_id, node->line_number,
+                        node->column_number, depth, node->allocations});
+      for (AllocationProfile::Node* child : node->children) {
+        pending.push_back({child, depth + 1});
+      }
+    }
+  }
+
+  // Returns the profile serialized as profile.proto. When externalBytes is
+  // positive, an "(external)" sample is added for external memory. Each
+  // sample has a "bytes" label with the size bucket of its objects.
+  std::string Serialize(int64_t intervalBytes, int64_t timeNanos,
+                        int64_t externalBytes) const {
+    ProfileBuilder builder;
+    builder.AddSampleType("objects", "count");
+    builder.AddSampleType("space", "bytes");
+    builder.SetPeriodType("space", "bytes");
+    builder.SetPeriod(intervalBytes);
+    builder.SetTimeNanos(timeNanos);
+    AddSamples(externalBytes, &builder);
+    return builder.Serialize();
+  }
+
+  // Adds the samples of the profile to builder, which is ProfileBuilder, or
+  // ProfileAggregator.
+  template <typename Builder>
+  void AddSamples(int64_t externalBytes, Builder* builder) const {
+    int64_t bytesKey = builder->StringId("bytes");
+    std::vector<uint64_t> path;
+    if (externalBytes > 0) {
+      path.push_back(builder->LocationId(0, "(external)", "", 0, 0));
+      int64_t values[] = {1, externalBytes};
+      builder->AddSample(
+          path, values, 2,
+          {{bytesKey, 0,
+            static_cast<int64_t>(AllocationSizeBucket(externalBytes)),
+            bytesKey}});
+    }
+    for (const Node& node : nodes_) {
+      path.resize(node.depth);
+      path.push_back(builder->LocationId(
+          node.scriptId, node.name, scriptNames_[node.scriptName],
+          node.lineNumber, node.columnNumber));
+      for (const AllocationBucket& bucket :
+           BucketAllocations(node.allocations)) {
+        int64_t values[] = {static_cast<int64_t>(bucket.count),
+                            static_cast<int64_t>(bucket.bytes)};
+        builder->AddSample(
+            path, values, 2,
+            {{bytesKey, 0, static_cast<int64_t>(bucket.bucket), bytesKey}});
+      }
+    }
+  }
+
+ private:
+  struct Node {
+    std::string name;
+    // Index of the script name in scriptNames_.
+    size_t scriptName;
+    int scriptId;
+    int lineNumber;
+    int columnNumber;
+    // Depth in the stacks of samples; the children of the root have depth 0.
+    size_t depth;
+    std::vector<AllocationProfile::Allocation> allocations;
+  };
+
+  // Nodes in the order in which serialize() in ts/src/profile-serializer.ts
+  // visits the translated profile, in which the external node is the last
+  // child of the root. Each node comes after its parent.
+  std::vector<Node> nodes_;
+  std::vector<std::string> scriptNames_;
+};
+
+// Serializes a profile copied out of V8 and gzips it on a libuv worker
+// thread, so that only the copy blocks the event loop.
+class ProfileToPprofWorker : public Nan::AsyncWorker {
+ public:
+  ProfileToPprofWorker(Nan::Callback* callback,
+                       std::function<std::string()> serialize)
+      : Nan::AsyncWorker(callback, "pprof:ProfileToPprof"),
+        serialize_(std::move(serialize)) {}
+
+  void Execute() override {
+    uint64_t startNanos = uv_hrtime();
+    std::string encoded = serialize_();
+    // Releases the copied profile before the callback runs.
+    serialize_ = nullptr;
+    if (!GzipCompress(encoded, &compressed_)) {
+      SetErrorMessage("Failed to compress profile.");
+    }
+    encodeNanos_ = uv_hrtime() - startNanos;
+  }
+
+  void HandleOKCallback() override {
+    Nan::HandleScope scope;
+    Local<Value> argv[] = {
+        Nan::Null(),
+        Nan::CopyBuffer(compressed_.data(), compressed_.size())
+            .ToLocalChecked(),
+        Nan::New<Number>(static_cast<double>(encodeNanos_))};
+    callback->Call(3, argv, async_resource);
+  }
+
+ private:
+  std::function<std::string()> serialize_;
+  std::string compressed_;
+  uint64_t encodeNanos_ = 0;
+};
+
+// A ProfileAggregator owned by a JavaScript object, into which the time and
+// heap profilers merge their profiles.
+//
+// Signature:
+// new ProfileAggregator(maxStacks: number)
+class ProfileAggregatorWrap : public Nan::ObjectWrap {
+ public:
+  // Returns the template of the class, which is created once for each
+  // isolate and kept by the profiler states to recognize its instances.
+  static Local<FunctionTemplate> Init() {
+    Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(New);
+    tpl->SetClassName(Nan::New("ProfileAggregator").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+    // The methods have the signature of the template, so V8 only calls them
+    // on its instances.
+    Nan::SetPrototypeMethod(tpl, "stackCount", StackCount);
+    Nan::SetPrototypeMethod(tpl, "profileCount", ProfileCount);
+    Nan::SetPrototypeMethod(tpl, "flushToPprofAsync", FlushToPprofAsync);
+    return tpl;
+  }
+
+  // Returns the aggregator of value, or NULL, with an exception thrown, if
+  // value is not an instance of tpl, the template of the class.
+  static ProfileAggregator* Get(const Nan::Persistent<FunctionTemplate>& tpl,
+                                Local<Value> value) {
+    if (!Nan::New(tpl)->HasInstance(value)) {
+      Nan::ThrowTypeError("Expected a ProfileAggregator.");
+      return NULL;
+    }
+    return Unwrap(value)->aggregator_.get();
+  }
+
+ private:
+  static ProfileAggregatorWrap* Unwrap(Local<Value> value) {
+    return Nan::ObjectWrap::Unwrap<ProfileAggregatorWrap>(value.As<Object>());
+  }
+
+  explicit ProfileAggregatorWrap(uint32_t maxStacks)
+      : maxStacks_(maxStacks),
+        aggregator_(new ProfileAggregator(maxStacks)) {}
+
+  static NAN_METHOD(New) {
+    if (!info.IsConstructCall()) {
+      return Nan::ThrowTypeError("ProfileAggregator must be called with new.");
+    }
+    if (info.Length() != 1 || !info[0]->IsUint32()) {
+      return Nan::ThrowTypeError(
+          "First argument must be a non-negative integer.");
+    }
+    ProfileAggregatorWrap* wrap =
+        new ProfileAggregatorWrap(info[0].As<Uint32>()->Value());
+    wrap->Wrap(info.This());
+    info.GetReturnValue().Set(info.This());
+  }
+
+  // Signature:
+  // stackCount(): number
+  //
+  // Returns the number of distinct stacks of the merged profile.
+  static NAN_METHOD(StackCount) {
+    ProfileAggregator* aggregator = Unwrap(info.This())->aggregator_.get();
+    info.GetReturnValue().Set(
+        Nan::New<Number>(static_cast<double>(aggregator->stackCount())));
+  }
+
+  // Signature:
+  // profileCount(): number
+  //
+  // Returns the number of profiles merged since the last flush.
+  static NAN_METHOD(ProfileCount) {
+    ProfileAggregator* aggregator = Unwrap(info.This())->aggregator_.get();
+    info.GetReturnValue().Set(
+        Nan::New<Number>(static_cast<double>(aggregator->profileCount())));
+  }
+
+  // Signature:
+  // flushToPprofAsync(callback: (err: Error|null, buffer?: Buffer,
+  //                              encodeNanos?: number) => void)
+  //
+  // Passes the merged profile to callback gzipped in pprof format, once it
+  // has been serialized and gzipped on a libuv worker thread, along with the
+  // time that took. The aggregator is emptied, so that the profiles merged
+  // from then on make up the next profile.
+  static NAN_METHOD(FlushToPprofAsync) {
+    if (info.Length() != 1 || !info[0]->IsFunction()) {
+      return Nan::ThrowTypeError("First argument must be a function.");
+    }
+    ProfileAggregatorWrap* wrap = Unwrap(info.This());
+    std::shared_ptr<ProfileAggregator> flushed(wrap->aggregator_.release());
+    wrap->aggregator_.reset(new ProfileAggregator(wrap->maxStacks_));
+
+    Nan::Callback* callback = new Nan::Callback(info[0].As<Function>());
+    Nan::AsyncQueueWorker(new ProfileToPprofWorker(
+        callback, [flushed] { return flushed->Serialize(); }));
+  }
+
+  uint32_t maxStacks_;
+  std::unique_ptr<ProfileAggregator> aggregator_;
+};
+
+// Signature:
+// getAllocationProfileToPprof(intervalBytes: number, timeNanos: number,
+//                             ignoreSamplePath: string,
+//                             externalBytes: number): Buffer
+//
+// Returns the allocation profile serialized as profile.proto. Nodes whose
+// script name contains ignoreSamplePath are skipped along with their
+// descendants, unless ignoreSamplePath is empty. When externalBytes is
+// positive, an "(external)" sample is added for external memory. Each sample
+// has a "bytes" label with the size bucket of its objects.
+NAN_METHOD(GetAllocationProfileToPprof) {
+  if (info.Length() != 4) {
+    return Nan::ThrowTypeError(
+        "GetAllocationProfileToPprof must have four arguments.");
+  }
+  if (!info[0]->IsNumber()) {
+    return Nan::ThrowTypeError("First argument must be a number.");
+  }
+  if (!info[1]->IsNumber()) {
+    return Nan::ThrowTypeError("Second argument must be a number.");
+  }
+  if (!info[2]->IsString()) {
+    return Nan::ThrowTypeError("Third argument must be a string.");
+  }
+  if (!info[3]->IsNumber()) {
+    return Nan::ThrowTypeError("Fourth argument must be a number.");
+  }
+  int64_t intervalBytes = info[0].As<Number>()->Value();
+  int64_t timeNanos = info[1].As<Number>()->Value();
+  std::string ignoreSamplePath = *Nan::Utf8String(info[2]);
+  int64_t externalBytes = info[3].As<Number>()->Value();
+
+  uint64_t startNanos = uv_hrtime();
+  std::unique_ptr<v8::AllocationProfile> profile(
+      info.GetIsolate()->GetHeapProfiler()->GetAllocationProfile());
+  AllocationProfile::Node* root = profile->GetRootNode();
+  std::string encoded =
+      CopiedAllocationProfile(root, ignoreSamplePath)
+          .Serialize(intervalBytes, timeNanos, externalBytes);
+  RecordAllocationProfileStats(GetHeapProfilerState(info), root, startNanos);
+  info.GetReturnValue().Set(
+      Nan::CopyBuffer(encoded.data(), encoded.size()).ToLocalChecked());
+}
+
+// Signature:
+// getAllocationProfileToPprofAsync(intervalBytes: number, timeNanos: number,
+//                                  ignoreSamplePath: string,
+//                                  externalBytes: number,
+//                                  callback: (err: Error|null,
+//                                             buffer?: Buffer,
+//                                             encodeNanos?: number) => void)
+//
+// Like getAllocationProfileToPprof(), but only copies the allocation profile
+// on this thread, and passes it to callback gzipped, once it has been
+// serialized and gzipped on a libuv worker thread, along with the time that
+// took. The translation stats are the cost of the copy.
+NAN_METHOD(GetAllocationProfileToPprofAsync) {
+  if (info.Length() != 5) {
+    return Nan::ThrowTypeError(
+        "GetAllocationProfileToPprofAsync must have five arguments.");
+  }
+  if (!info[0]->IsNumber()) {
+    return Nan::ThrowTypeError("First argument must be a number.");
+  }
+  if (!info[1]->IsNumber()) {
+    return Nan::ThrowTypeError("Second argument must be a number.");
+  }
+  if (!info[2]->IsString()) {
+    return Nan::ThrowTypeError("Third argument must be a string.");
+  }
+  if (!info[3]->IsNumber()) {
+    return Nan::ThrowTypeError("Fourth argument must be a number.");
+  }
+  if (!info[4]->IsFunction()) {
+    return Nan::ThrowTypeError("Fifth argument must be a function.");
+  }
+  int64_t intervalBytes = info[0].As<Number>()->Value();
+  int64_t timeNanos = info[1].As<Number>()->Value();
+  std::string ignoreSamplePath = *Nan::Utf8String(info[2]);
+  int64_t externalBytes = info[3].As<Number>()->Value();
+
+  uint64_t startNanos = uv_hrtime();
+  std::unique_ptr<v8::AllocationProfile> profile(
+      info.GetIsolate()->GetHeapProfiler()->GetAllocationProfile());
+  AllocationProfile::Node* root = profile->GetRootNode();
+  std::shared_ptr<CopiedAllocationProfile> copied =
+      std::make_shared<CopiedAllocationProfile>(root, ignoreSamplePath);
+  RecordAllocationProfileStats(GetHeapProfilerState(info), root, startNanos);
+
+  Nan::Callback* callback = new Nan::Callback(info[4].As<Function>());
+  Nan::AsyncQueueWorker(new ProfileToPprofWorker(
+      callback, [copied, intervalBytes, timeNanos, externalBytes] {
+        return copied->Serialize(intervalBytes, timeNanos, externalBytes);
+      }));
+}
+
+// Signature:
+// addAllocationProfileToAggregate(intervalBytes: number, timeNanos: number,
+//                                 ignoreSamplePath: string,
+//                                 externalBytes: number,
+//                                 aggregator: ProfileAggregator)
+//
+// Merges the allocation profile, as getAllocationProfileToPprof() would
+// serialize it, into aggregator. The values of the samples of each stack
+// are added up, so the merged profile is the sum of the heap profiles, as
+// merged by pprof.
+NAN_METHOD(AddAllocationProfileToAggregate) {
+  if (info.Length() != 5) {
+    return Nan::ThrowTypeError(
+        "AddAllocationProfileToAggregate must have five arguments.");
+  }
+  if (!info[0]->IsNumber()) {
+    return Nan::ThrowTypeError("First argument must be a number.");
+  }
+  if (!info[1]->IsNumber()) {
+    return Nan::ThrowTypeError("Second argument must be a number.");
+  }
+  if (!info[2]->IsString()) {
+    return Nan::ThrowTypeError("Third argument must be a string.");
+  }
+  if (!info[3]->IsNumber()) {
+    return Nan::ThrowTypeError("Fourth argument must be a number.");
+  }
+  HeapProfilerState* state = GetHeapProfilerState(info);
+  ProfileAggregator* aggregator =
+      ProfileAggregatorWrap::Get(state->aggregatorTemplate, info[4]);
+  if (!aggregator) {
+    return;
+  }
+  int64_t intervalBytes = info[0].As<Number>()->Value();
+  int64_t timeNanos = info[1].As<Number>()->Value();
+  std::string ignoreSamplePath = *Nan::Utf8String(info[2]);
+  int64_t externalBytes = info[3].As<Number>()->Value();
+  if (!aggregator->SetSampleTypes({{"objects", "count"}, {"space", "bytes"}})) {
+    return Nan::ThrowError(
+        "Profiles with different sample types cannot be aggregated.");
+  }
+
+  uint64_t startNanos = uv_hrtime();
+  std::unique_ptr<v8::AllocationProfile> profile(
+      info.GetIsolate()->GetHeapProfiler()->GetAllocationProfile());
+  AllocationProfile::Node* root = profile->GetRootNode();
+  aggregator->SetPeriodType("space", "bytes");
+  aggregator->SetPeriod(intervalBytes);
+  aggregator->SetTimeNanos(timeNanos);
+  CopiedAllocationProfile(root, ignoreSamplePath)
+      .AddSamples(externalBytes, aggregator);
+  aggregator->Fold();
+  aggregator->EndProfile();
+  RecordAllocationProfileStats(state, root, startNanos);
+}
+
+// Signature:
+// getTranslationStats(): TranslationStats
+//
+// Returns the cost of the last profile collected by getAllocationProfile(),
+// getAllocationProfileColumns(), getAllocationProfileToPprof(),
+// getAllocationProfileToPprofAsync() or addAllocationProfileToAggregate().
+NAN_METHOD(GetHeapTranslationStats) {
+  info.GetReturnValue().Set(GetHeapProfilerState(info)->lastStats.ToObject());
+}
+
+// Signature:
+// getAllocationProfileDelta(): AllocationProfileDelta
+//
+// Returns the changes in the allocation profile since it was last returned,
+// or since the heap profiler was started: the nodes and samples which were
+// added, and the IDs of the samples which were removed because their objects
+// were freed. Only the added nodes are translated into JavaScript objects.
+// Supported in Node 12 and later.
+NAN_METHOD(GetAllocationProfileDelta) {
+#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
+  HeapProfilerState* state = GetHeapProfilerState(info);
+  std::unique_ptr<v8::AllocationProfile> profile(
+      info.GetIsolate()->GetHeapProfiler()->GetAllocationProfile());
+  NodeKeys keys(state->keys);
+
+  Local<Array> nodes = Nan::New<Array>();
+  uint32_t nodeCount = 0;
+  // Node IDs are not reused, so the nodes which are no longer in the profile
+  // are forgotten.
+  std::unordered_set<uint32_t> liveNodes;
+  std::vector<std::pair<AllocationProfile::Node*, uint32_t>> entries;
+  entries.push_back({profile->GetRootNode(), 0});
+  while (!entries.empty()) {
+    AllocationProfile::Node* node = entries.back().first;
+    uint32_t parentId = entries.back().second;
+    entries.pop_back();
+    liveNodes.insert(node->node_id);
+    if (!state->reportedNodes.count(node->node_id)) {
+      Local<Object> js_node = Nan::New<Object>();
+      Local<String> nodeKeys[] = {keys[kIdKey],         keys[kParentIdKey],
+                                  keys[kNameKey],       keys[kScriptNameKey],
+                                  keys[kScriptIdKey],   keys[kLineNumberKey],
+                                  keys[kColumnNumberKey]};
+      Local<Value> nodeValues[] = {Nan::New<Integer>(node->node_id),
+                                   Nan::New<Integer>(parentId),
+                                   node->name,
+                                   node->script_name,
+                                   Nan::New<Integer>(node->script_id),
+                                   Nan::New<Integer>(node->line_number),
+                                   Nan::New<Integer>(node->column_number)};
+      DefineProperties(js_node, nodeKeys, nodeValues, 7);
+      Nan::Set(nodes, nodeCount++, js_node);
+    }
+    for (AllocationProfile::Node* child : node->children) {
+      entries.push_back({child, node->node_id});
+    }
+  }
+
+  std::vector<double> sampleIds;
+  std::vector<uint32_t> nodeIds;
+  std::vector<double> sizes;
+  std::vector<uint32_t> counts;
+  std::unordered_set<uint64_t> liveSamples;
+  for (const AllocationProfile::Sample& sample : profile->GetSamples()) {
+    liveSamples.insert(sample.sample_id);
+    if (!state->reportedSamples.count(sample.sample_id)) {
+      sampleIds.push_back(sample.sample_id);
+      nodeIds.push_back(sample.node_id);
+      sizes.push_back(sample.size);
+      counts.push_back(sample.count);
+    }
+  }
+  std::vector<double> freedSampleIds;
+  for (uint64_t id : state->reportedSamples) {
+    if (!liveSamples.count(id)) {
+      freedSampleIds.push_back(id);
+    }
+  }
+  state->reportedSamples.swap(liveSamples);
+  state->reportedNodes.swap(liveNodes);
+
+  Local<Object> samples = Nan::New<Object>();
+  Nan::Set(samples, Nan::New<String>("sampleIds").ToLocalChecked(),
+           CreateTypedArray<double, Float64Array>(sampleIds));
+  Nan::Set(samples, Nan::New<String>("nodeIds").ToLocalChecked(),
+           CreateTypedArray<uint32_t, Uint32Array>(nodeIds));
+  Nan::Set(samples, Nan::New<String>("sizes").ToLocalChecked(),
+           CreateTypedArray<double, Float64Array>(sizes));
+  Nan::Set(samples, Nan::New<String>("counts").ToLocalChecked(),
+           CreateTypedArray<uint32_t, Uint32Array>(counts));
+
+  Local<Object> delta = Nan::New<Object>();
+  Nan::Set(delta, Nan::New<String>("nodes").ToLocalChecked(), nodes);
+  Nan::Set(delta, Nan::New<String>("samples").ToLocalChecked(), samples);
+  Nan::Set(delta, Nan::New<String>("freedSampleIds").ToLocalChecked(),
+           CreateTypedArray<double, Float64Array>(freedSampleIds));
+  info.GetReturnValue().Set(delta);
+#else
+  Nan::ThrowError(
+      "Allocation profile deltas are only supported in Node 12 and later.");
+#endif
+}
+
+// Time profiler
+struct TimeProfilerState;
+
+// A function run on the thread of a time profiler state.
+typedef std::function<void(TimeProfilerState*)> TimeProfilerTask;
+
+// Guards threads, and the tasks of each state.
+std::mutex threadsMutex;
+// States of all threads which have loaded the module, so that a profile can
+// be collected from all of them.
+std::vector<TimeProfilerState*> threads;
+
+void RunTimeProfilerTasks(Isolate* isolate);
+
+class ThreadsProfile;
+void AbandonThreadsProfiles(TimeProfilerState* state);
+
+// State of the time profiler. There is one for each isolate loading the
+// module, so that the main thread and worker threads can be profiled at the
+// same time.
+struct TimeProfilerState {
+  CpuProfilers cpuProfilers;
+  Isolate* isolate;
+  // Thread ID used to label samples, as set by setThreadId().
+  int threadId = 0;
+  // Tasks posted by other threads, guarded by threadsMutex.
+  std::vector<TimeProfilerTask> tasks;
+  // Wakes up the event loop of the thread to run tasks.
+  uv_async_t* async;
+  ProfileNodeKeys keys;
+  TranslationStats lastStats;
+  // Template of the ProfileAggregator class of the isolate.
+  Nan::Persistent<FunctionTemplate> aggregatorTemplate;
+  // The context of the thread, as set by setContext(). It is only stored by
+  // the thread, and read when V8 samples the thread.
+  std::atomic<uint32_t> context{0};
+  // Records the CPU time and the context of the thread when V8 samples it,
+  // and the cost of sampling it, while profiles which record them are
+  // running.
+  std::unique_ptr<CpuTimeSampler> cpuTimeSampler;
+  // A running profile which records CPU time, contexts or the cost of its
+  // samples, the time at which it was started on the clock of the sampler,
+  // and on that of the context points, and the CPU time the thread had used
+  // then, and spent taking samples, or -1.
+  struct SampledProfile {
+    int64_t startMicros;
+    int64_t contextStartMicros;
+    int64_t startCpuNanos;
+    int64_t startSampleNanos;
+    bool cpuTime;
+    bool contexts;
+  };
+  std::unordered_map<std::string, SampledProfile> sampledProfiles;
+  // Profiles of all threads collected by this thread, which are waiting for
+  // other threads to add their profiles.
+  std::vector<std::shared_ptr<ThreadsProfile>> threadsProfiles;
+  // Why this thread did not start the profiles which another thread asked
+  // it to start with startProfilingAllThreads(), by name, until it is asked
+  // to stop them.
+  std::unordered_map<std::string, std::string> threadsProfileErrors;
+
+  explicit TimeProfilerState(Isolate* isolate)
+      : cpuProfilers(isolate), isolate(isolate), keys(isolate) {
+    async = new uv_async_t;
+    uv_async_init(node::GetCurrentEventLoop(isolate), async, RunAsyncTasks);
+    // Waiting for tasks does not keep the thread alive.
+    uv_unref(reinterpret_cast<uv_handle_t*>(async));
+    async->data = isolate;
+    std::lock_guard<std::mutex> lock(threadsMutex);
+    threads.push_back(this);
+  }
+
+  // Runs task on the thread of this state, as soon as the thread runs
+  // JavaScript or its event loop. threadsMutex must be held.
+  void PostTask(TimeProfilerTask task) {
+    tasks.push_back(std::move(task));
+    uv_async_send(async);
+    isolate->RequestInterrupt(RunInterruptTasks, NULL);
+  }
+
+  static void RunAsyncTasks(uv_async_t* handle) {
+    RunTimeProfilerTasks(static_cast<Isolate*>(handle->data));
+  }
+
+  static void RunInterruptTasks(Isolate* isolate, void*) {
+    RunTimeProfilerTasks(isolate);
+  }
+
+  // Releases the state, and the CPU profilers created for it, when the
+  // environment of the isolate (e.g. a worker thread) exits.
+  static void Cleanup(void* arg) {
+    TimeProfilerState* state = static_cast<TimeProfilerState*>(arg);
+    Nan::HandleScope scope;
+    AbandonThreadsProfiles(state);
+    std::vector<TimeProfilerTask> tasks;
+    {
+      std::lock_guard<std::mutex> lock(threadsMutex);
+      threads.erase(std::find(threads.begin(), threads.end(), state));
+      tasks.swap(state->tasks);
+    }
+    // Tasks already posted are run, so that threads waiting for them do not
+    // wait until they time out.
+    for (TimeProfilerTask& task : tasks) {
+      task(state);
+    }
+    uv_close(reinterpret_cast<uv_handle_t*>(state->async), [](uv_handle_t* h) {
+      delete reinterpret_cast<uv_async_t*>(h);
+    });
+    state->cpuProfilers.Dispose();
+    state->aggregatorTemplate.Reset();
+    delete state;
+  }
+};
+
+// Runs the tasks posted to the state of isolate, if any. The state is looked
+// up rather than passed, since an interrupt may be run after the state is
+// released.
+void RunTimeProfilerTasks(Isolate* isolate) {
+  TimeProfilerState* state = NULL;
+  std::vector<TimeProfilerTask> tasks;
+  {
+    std::lock_guard<std::mutex> lock(threadsMutex);
+    for (TimeProfilerState* thread : threads) {
+      if (thread->isolate == isolate) {
+        state = thread;
+        tasks.swap(thread->tasks);
+        break;
+      }
+    }
+  }
+  if (tasks.empty()) {
+    return;
+  }
+  Nan::HandleScope scope;
+  for (TimeProfilerTask& task : tasks) {
+    task(state);
+  }
+}
+
+// Returns the state of the time profiler, which is the data of the time
+// profiler functions.
+TimeProfilerState* GetTimeProfilerState(
+    const Nan::FunctionCallbackInfo<Value>& info) {
+  return static_cast<TimeProfilerState*>(info.Data().As<External>()->Value());
+}
+
+// Records the cost of a collection which started at startNanos, as returned
+// by uv_hrtime(), of a profile whose samples cost sampleNanos, or -1.
+void RecordTimeProfileStats(TimeProfilerState* state,
+                            const CpuProfile* profile, uint64_t startNanos,
+                            int64_t sampleNanos) {
+  TranslationStats& stats = state->lastStats;
+  stats.nanos = uv_hrtime() - startNanos;
+  stats.sampleNanos = sampleNanos;
+  stats.nodeCount = 0;
+  stats.sampleCount = 0;
+  std::vector<const CpuProfileNode*> nodes = {profile->GetTopDownRoot()};
+  while (!nodes.empty()) {
+    const CpuProfileNode* node = nodes.back();
+    nodes.pop_back();
+    stats.nodeCount++;
+    stats.sampleCount += node->GetHitCount();
+    for (int i = 0; i < node->GetChildrenCount(); i++) {
+      nodes.push_back(node->GetChild(i));
+    }
+  }
+}
+
+// Limits on the call tree of a time profile. Nodes deeper than maxDepth,
+// where the children of the root have depth 1, and subtrees with fewer than
+// minHitCount hits in total are pruned. The hits of the pruned children of a
+// node are folded into a single "(truncated)" child of the node. A limit of 0
+// means no limit.
+//
+// Node is CpuProfileNode, or CopiedProfileNode for a profile copied out of V8,
+// here and in the functions which walk the entries of a time profile.
+class TimeProfilePruning {
+ public:
+  TimeProfilePruning(const CpuProfile* profile, uint32_t maxDepth,
+                     uint32_t minHitCount)
+      : TimeProfilePruning(profile->GetTopDownRoot(), maxDepth, minHitCount) {}
+
+  template <typename Node>
+  TimeProfilePruning(const Node* root, uint32_t maxDepth, uint32_t minHitCount)
+      : maxDepth_(maxDepth), minHitCount_(minHitCount) {
+    if (maxDepth == 0 && minHitCount == 0) {
+      return;
+    }
+    // Computes the total hits of every subtree without recursion, since the
+    // trees of deeply recursive code would overflow the native stack.
+    // Parents come before their children in nodes, so that the totals are
+    // accumulated from the leaves up by walking it backwards.
+    std::vector<std::pair<const Node*, size_t>> nodes;
+    nodes.push_back({root, 0});
+    unsigned int maxId = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+      const Node* node = nodes[i].first;
+      maxId = std::max(maxId, node->GetNodeId());
+      int32_t count = node->GetChildrenCount();
+      for (int32_t j = 0; j < count; j++) {
+        nodes.push_back({node->GetChild(j), i});
+      }
+    }
+    subtreeHits_.assign(maxId + 1, 0);
+    for (size_t i = nodes.size(); i-- > 0;) {
+      const Node* node = nodes[i].first;
+      uint64_t& hits = subtreeHits_[node->GetNodeId()];
+      hits += node->GetHitCount();
+      if (i > 0) {
+        subtreeHits_[nodes[nodes[i].second].first->GetNodeId()] += hits;
+      }
+    }
+  }
+
+  // Returns whether node, at the given depth, is kept.
+  template <typename Node>
+  bool Keeps(const Node* node, size_t depth) const {
+    return (maxDepth_ == 0 || depth <= maxDepth_) &&
+           (minHitCount_ == 0 ||
+            subtreeHits_[node->GetNodeId()] >= minHitCount_);
+  }
+
+  // Returns the total hits of the pruned children of node, which is at the
+  // given depth.
+  template <typename Node>
+  unsigned int PrunedHits(const Node* node, size_t depth) const {
+    if (subtreeHits_.empty()) {
+      return 0;
+    }
+    uint64_t pruned = 0;
+    int32_t count = node->GetChildrenCount();
+    for (int32_t i = 0; i < count; i++) {
+      const Node* child = node->GetChild(i);
+      if (!Keeps(child, depth + 1)) {
+        pruned += subtreeHits_[child->GetNodeId()];
+      }
+    }
+    return static_cast<unsigned int>(std::min<uint64_t>(pruned, UINT_MAX));
+  }
+
+ private:
+  uint32_t maxDepth_;
+  uint32_t minHitCount_;
+  // Total hits of the subtree of each node, by node ID. Empty when there are
+  // no limits.
+  std::vector<uint64_t> subtreeHits_;
+};
+
+// CPU time used by the profiled thread, attributed to the nodes of a profile
+// which recorded its samples: the CPU time used between a sample and the
+// previous one (or the start of the profile) is attributed to the node of the
+// sample.
+class TimeProfileCpu {
+ public:
+  // sampler recorded the CPU time of the thread while the profile ran. The
+  // profile was started at startMicros on the clock of the sampler, when the
+  // thread had used startCpuNanos of CPU time, or -1 if unknown.
+  TimeProfileCpu(const CpuProfile* profile, CpuTimeSampler* sampler,
+                 int64_t startMicros, int64_t startCpuNanos) {
+    // Parents come before their children in nodes, as in TimeProfilePruning.
+    std::vector<std::pair<const CpuProfileNode*, size_t>> nodes;
+    nodes.push_back({profile->GetTopDownRoot(), 0});
+    unsigned int maxId = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+      const CpuProfileNode* node = nodes[i].first;
+      maxId = std::max(maxId, node->GetNodeId());
+      int32_t count = node->GetChildrenCount();
+      for (int32_t j = 0; j < count; j++) {
+        nodes.push_back({node->GetChild(j), i});
+      }
+    }
+    selfNanos_.assign(maxId + 1, 0);
+    subtreeNanos_.assign(maxId + 1, 0);
+
+    int count = profile->GetSamplesCount();
+    std::vector<int64_t> timestamps(count);
+    for (int i = 0; i < count; i++) {
+      timestamps[i] = profile->GetSampleTimestamp(i);
+    }
+    // Where the CPU time is not recorded with each sample, it is read on the
+    // clock of the sampler, to which the clock of V8 is offset.
+    std::vector<int64_t> cpuNanos = sampler->SampleCpuNanos(
+        timestamps, startMicros - profile->GetStartTime());
+    int64_t previous = startCpuNanos;
+    sampleNanos_.assign(count, 0);
+    for (int i = 0; i < count; i++) {
+      int64_t cpu = cpuNanos[i];
+      unsigned int id = profile->GetSample(i)->GetNodeId();
+      if (cpu < 0) {
+        continue;
+      }
+      if (previous >= 0 && cpu > previous && id <= maxId) {
+        sampleNanos_[i] = cpu - previous;
+        selfNanos_[id] += cpu - previous;
+      }
+      previous = std::max(previous, cpu);
+    }
+
+    for (size_t i = nodes.size(); i-- > 0;) {
+      unsigned int id = nodes[i].first->GetNodeId();
+      subtreeNanos_[id] += selfNanos_[id];
+      if (i > 0) {
+        subtreeNanos_[nodes[nodes[i].second].first->GetNodeId()] +=
+            subtreeNanos_[id];
+      }
+    }
+  }
+
+  // Returns the CPU time of hitCount of the hits of node. In line number
+  // mode, the CPU time of a node is shared between its lines in proportion
+  // to their hits, since samples only refer to the node.
+  template <typename Node>
+  int64_t SelfNanos(const Node* node, unsigned int hitCount) const {
+    int64_t self = selfNanos_[node->GetNodeId()];
+    unsigned int hits = node->GetHitCount();
+    if (hits == 0 || hitCount >= hits) {
+      return self;
+    }
+    return self * hitCount / hits;
+  }
+
+  // Returns the CPU time attributed to the sample with the given index.
+  int64_t SampleNanos(int index) const { return sampleNanos_[index]; }
+
+  // Returns the CPU time of the children of node, which is at the given
+  // depth, which pruning removes.
+  template <typename Node>
+  int64_t PrunedNanos(const Node* node, size_t depth,
+                      const TimeProfilePruning& pruning) const {
+    int64_t pruned = 0;
+    int32_t count = node->GetChildrenCount();
+    for (int32_t i = 0; i < count; i++) {
+      const Node* child = node->GetChild(i);
+      if (!pruning.Keeps(child, depth + 1)) {
+        pruned += subtreeNanos_[child->GetNodeId()];
+      }
+    }
+    return pruned;
+  }
+
+ private:
+  // CPU time of the samples of each node, and of its subtree, by node ID.
+  std::vector<int64_t> selfNanos_;
+  std::vector<int64_t> subtreeNanos_;
+  std::vector<int64_t> sampleNanos_;
+};
+
+// The hits of a node, or of an entry of the call tree, which were sampled in
+// one context, and their CPU time.
+struct ContextHits {
+  uint32_t context;
+  unsigned int hitCount;
+  int64_t cpuNanos;
+};
+
+// The contexts which samples of a profile were taken in, as set by
+// setContext(), attributed to the nodes of the samples. Hits are split
+// between contexts in proportion to the samples taken in each, since the
+// hit counts of V8 are not guaranteed to match its samples, and in line
+// number mode samples only refer to the node of a function.
+class TimeProfileContexts {
+ public:
+  // points were recorded by a ContextRecorder of the profiled thread, on the
+  // clock which V8 timestamps samples with. When cpu is not NULL, the
+  // contexts have the CPU time of their samples.
+  TimeProfileContexts(const CpuProfile* profile,
+                      const std::vector<ContextRecorder::Point>& points,
+                      const TimeProfileCpu* cpu) {
+    int count = profile->GetSamplesCount();
+    std::vector<int64_t> timestamps(count);
+    for (int i = 0; i < count; i++) {
+      timestamps[i] = profile->GetSampleTimestamp(i);
+    }
+    std::vector<uint32_t> contexts = SampleContexts(points, timestamps);
+    for (int i = 0; i < count; i++) {
+      uint32_t context = contexts[i];
+      std::vector<ContextHits>& hits =
+          byNode_[profile->GetSample(i)->GetNodeId()];
+      auto it = std::find_if(
+          hits.begin(), hits.end(),
+          [context](const ContextHits& h) { return h.context == context; });
+      if (it == hits.end()) {
+        hits.push_back({context, 0, 0});
+        it = hits.end() - 1;
+      }
+      it->hitCount++;
+      it->cpuNanos += cpu ? cpu->SampleNanos(i) : 0;
+    }
+    for (auto& node : byNode_) {
+      std::sort(node.second.begin(), node.second.end(),
+                [](const ContextHits& a, const ContextHits& b) {
+                  return a.context < b.context;
+                });
+    }
+  }
+
+  // Splits hitCount of the hits of node, and their CPU time, between the
+  // contexts of its samples, onto hits.
+  template <typename Node>
+  void Split(const Node* node, unsigned int hitCount, int64_t cpuNanos,
+             std::vector<ContextHits>* hits) const {
+    auto it = byNode_.find(node->GetNodeId());
+    if (it == byNode_.end()) {
+      Apportion(std::vector<ContextHits>(), hitCount, cpuNanos, hits);
+      return;
+    }
+    unsigned int nodeHits = node->GetHitCount();
+    if (nodeHits == 0 || hitCount >= nodeHits) {
+      Apportion(it->second, hitCount, cpuNanos, hits);
+      return;
+    }
+    // In line number mode, the CPU time of each context is shared between
+    // lines as TimeProfileCpu::SelfNanos() shares it.
+    std::vector<ContextHits> shares = it->second;
+    for (ContextHits& share : shares) {
+      share.cpuNanos = share.cpuNanos * hitCount / nodeHits;
+    }
+    Apportion(shares, hitCount, cpuNanos, hits);
+  }
+
+  // Splits the hits of the children of node, which is at the given depth,
+  // which pruning removes, onto hits.
+  template <typename Node>
+  void SplitPruned(const Node* node, size_t depth,
+                   const TimeProfilePruning& pruning, unsigned int hitCount,
+                   int64_t cpuNanos, std::vector<ContextHits>* hits) const {
+    std::vector<ContextHits> merged;
+    std::vector<const Node*> stack;
+    int32_t count = node->GetChildrenCount();
+    for (int32_t i = 0; i < count; i++) {
+      if (!pruning.Keeps(node->GetChild(i), depth + 1)) {
+        stack.push_back(node->GetChild(i));
+      }
+    }
+    while (!stack.empty()) {
+      const Node* next = stack.back();
+      stack.pop_back();
+      auto it = byNode_.find(next->GetNodeId());
+      if (it != byNode_.end()) {
+        for (const ContextHits& share : it->second) {
+          Merge(share, &merged);
+        }
+      }
+      for (int32_t i = 0; i < next->GetChildrenCount(); i++) {
+        stack.push_back(next->GetChild(i));
+      }
+    }
+    Apportion(merged, hitCount, cpuNanos, hits);
+  }
+
+ private:
+  static void Merge(const ContextHits& share, std::vector<ContextHits>* to) {
+    auto it = std::lower_bound(
+        to->begin(), to->end(), share.context,
+        [](const ContextHits& h, uint32_t context) {
+          return h.context < context;
+        });
+    if (it != to->end() && it->context == share.context) {
+      it->hitCount += share.hitCount;
+      it->cpuNanos += share.cpuNanos;
+    } else {
+      to->insert(it, share);
+    }
+  }
+
+  // Appends hitCount hits to hits, split between the contexts of shares in
+  // proportion to their hits; the rounding is carried from one context to
+  // the next, so that the split hits add up to hitCount. The contexts keep
+  // their CPU time. Without shares, the hits are in context 0, with
+  // cpuNanos.
+  static void Apportion(const std::vector<ContextHits>& shares,
+                        unsigned int hitCount, int64_t cpuNanos,
+                        std::vector<ContextHits>* hits) {
+    uint64_t total = 0;
+    for (const ContextHits& share : shares) {
+      total += share.hitCount;
+    }
+    if (total == 0) {
+      if (hitCount > 0 || cpuNanos > 0) {
+        hits->push_back({0, hitCount, cpuNanos});
+      }
+      return;
+    }
+    uint64_t cumulative = 0;
+    unsigned int assigned = 0;
+    for (const ContextHits& share : shares) {
+      cumulative += share.hitCount;
+      unsigned int upTo = static_cast<unsigned int>(
+          (2 * cumulative * hitCount + total) / (2 * total));
+      unsigned int count = upTo - assigned;
+      assigned = upTo;
+      if (count > 0 || share.cpuNanos > 0) {
+        hits->push_back({share.context, count, share.cpuNanos});
+      }
+    }
+  }
+
+  std::unordered_map<unsigned int, std::vector<ContextHits>> byNode_;
+};
+
+// Name of the node into which the hits of pruned subtrees are folded.
+const char kTruncatedNodeName[] = "(truncated)";
+
+// An entry of the call tree as it is translated or written to profile.proto.
+// In line number mode, a CpuProfileNode expands into one entry per line tick
+// and one entry per call site.
+template <typename Node>
+struct BasicTimeProfileEntry {
+  // Node whose function, script and script ID describe this entry, or NULL
+  // for the "(truncated)" entry into which pruned subtrees are folded.
+  const Node* function;
+  // Node whose children become the children of this entry, if any.
+  const Node* expand;
+  int line;
+  int column;
+  unsigned int hitCount;
+  size_t depth;
+  // CPU time of the hits, when CPU time was recorded.
+  int64_t cpuNanos;
+  // The hits split by the context they were sampled in, when contexts were
+  // recorded.
+  std::vector<ContextHits> contexts;
+};
+
+using TimeProfileEntry = BasicTimeProfileEntry<CpuProfileNode>;
+
+// Splits the hits of the entries from first on, which were pushed for the
+// children of node at nodeDepth in the profile tree, by context.
+template <typename Node>
+void SplitTimeProfileContexts(const Node* node, size_t nodeDepth,
+                              const TimeProfilePruning& pruning,
+                              const TimeProfileContexts* contexts,
+                              std::vector<BasicTimeProfileEntry<Node>>* entries,
+                              size_t first) {
+  if (!contexts) {
+    return;
+  }
+  for (size_t i = first; i < entries->size(); i++) {
+    BasicTimeProfileEntry<Node>& entry = (*entries)[i];
+    if (entry.hitCount == 0 && entry.cpuNanos == 0) {
+      continue;
+    }
+    if (entry.function) {
+      contexts->Split(entry.function, entry.hitCount, entry.cpuNanos,
+                      &entry.contexts);
+    } else {
+      contexts->SplitPruned(node, nodeDepth, pruning, entry.hitCount,
+                            entry.cpuNanos, &entry.contexts);
+    }
+  }
+}
+
+// Pushes the entries which are children of node onto entries, at the given
+// depth in the stacks of samples. The children which pruning removes are
+// folded into one "(truncated)" entry. When cpu is not NULL, the entries have
+// their CPU time, and when contexts is not NULL, their hits by context.
+template <typename Node>
+void PushTimeProfileChildEntries(
+    const Node* node, size_t depth, bool includeLineInfo,
+    const TimeProfilePruning& pruning, const TimeProfileCpu* cpu,
+    const TimeProfileContexts* contexts,
+    std::vector<BasicTimeProfileEntry<Node>>* entries) {
+  size_t first = entries->size();
+  int32_t count = node->GetChildrenCount();
+  // The depth of node in the profile tree. In line number mode, the children
+  // of the root are expanded in place, so node is one level deeper than the
+  // entries it expands into.
+  size_t nodeDepth = includeLineInfo ? depth + 1 : depth;
+  unsigned int prunedHits = pruning.PrunedHits(node, nodeDepth);
+  int64_t prunedNanos = cpu ? cpu->PrunedNanos(node, nodeDepth, pruning) : 0;
+  auto selfNanos = [cpu](const Node* fn, unsigned int hitCount) {
+    return cpu ? cpu->SelfNanos(fn, hitCount) : 0;
+  };
+  if (includeLineInfo) {
+    const std::vector<ProfileLineTick>& ticks = GetLineTicks(node);
+    if (!ticks.empty()) {
+      for (const ProfileLineTick& tick : ticks) {
+        entries->push_back({node, nullptr, tick.line, 0, tick.hitCount, depth,
+                            selfNanos(node, tick.hitCount), {}});
+      }
+    } else if (node->GetHitCount() > 0) {
+      entries->push_back({node, nullptr, node->GetLineNumber(),
+                          node->GetColumnNumber(), node->GetHitCount(), depth,
+                          selfNanos(node, node->GetHitCount()), {}});
+    }
+    for (int32_t i = 0; i < count; i++) {
+      const Node* child = node->GetChild(i);
+      if (pruning.Keeps(child, nodeDepth + 1)) {
+        entries->push_back({node, child, child->GetLineNumber(),
+                            child->GetColumnNumber(), 0, depth, 0, {}});
+      }
+    }
+    if (prunedHits > 0) {
+      entries->push_back(
+          {nullptr, nullptr, 0, 0, prunedHits, depth, prunedNanos, {}});
+    }
+    SplitTimeProfileContexts(node, nodeDepth, pruning, contexts, entries,
+                             first);
+    return;
+  }
+  for (int32_t i = 0; i < count; i++) {
+    const Node* child = node->GetChild(i);
+    if (pruning.Keeps(child, nodeDepth + 1)) {
+      entries->push_back({child, child, child->GetLineNumber(),
+                          child->GetColumnNumber(), child->GetHitCount(),
+                          depth, selfNanos(child, child->GetHitCount()), {}});
+    }
+  }
+  if (prunedHits > 0) {
+    entries->push_back(
+        {nullptr, nullptr, 0, 0, prunedHits, depth, prunedNanos, {}});
+  }
+  SplitTimeProfileContexts(node, nodeDepth, pruning, contexts, entries,
+                           first);
+}
+
+// Pushes the entries which are children of the root of the profile tree onto
+// entries, at depth 0 in the stacks of samples.
+template <typename Node>
+void PushTimeProfileRootEntries(
+    const Node* root, bool includeLineInfo, const TimeProfilePruning& pruning,
+    const TimeProfileCpu* cpu, const TimeProfileContexts* contexts,
+    std::vector<BasicTimeProfileEntry<Node>>* entries) {
+  if (!includeLineInfo) {
+    PushTimeProfileChildEntries(root, 0, false, pruning, cpu, contexts,
+                                entries);
+    return;
+  }
+  // The root itself is not part of any stack, so each of its children is
+  // expanded in place.
+  for (int32_t i = 0; i < root->GetChildrenCount(); i++) {
+    if (pruning.Keeps(root->GetChild(i), 1)) {
+      PushTimeProfileChildEntries(root->GetChild(i), 0, true, pruning, cpu,
+                                  contexts, entries);
+    }
+  }
+  unsigned int prunedHits = pruning.PrunedHits(root, 0);
+  if (prunedHits > 0) {
+    entries->push_back({nullptr, nullptr, 0, 0, prunedHits, 0,
+                        cpu ? cpu->PrunedNanos(root, 0, pruning) : 0, {}});
+    SplitTimeProfileContexts(root, 0, pruning, contexts, entries,
+                             entries->size() - 1);
+  }
+}
+
+// Translates time profile trees into JavaScript objects. The tree is walked
+// with an explicit stack, so that deep trees cannot overflow the native
+// stack, and every node is created with the same properties in the same
+// order, so that the nodes share a hidden class.
+class TimeProfileTranslator {
+ public:
+  // When cpu is not NULL, every node has its CPU time, and when contexts is
+  // not NULL, its hits by context.
+  TimeProfileTranslator(const ProfileNodeKeys& keys, bool includeLineInfo,
+                        bool includeIds, const TimeProfilePruning& pruning,
+                        const TimeProfileCpu* cpu,
+                        const TimeProfileContexts* contexts)
+      : keys_(keys),
+        includeLineInfo_(includeLineInfo),
+        includeIds_(includeIds),
+        pruning_(pruning),
+        cpu_(cpu),
+        contexts_(contexts) {}
+
+  // In profiles with line level accurate line numbers, a node's line number
+  // and column number refer to the line/column from which the function was
+  // called. When includeIds is true, the nodes for the self time of a
+  // function (one per line tick) have the ID of its CpuProfileNode, since
+  // samples refer to it.
+  Local<Object> Translate(const CpuProfileNode* root) {
+    entries_.clear();
+    PushTimeProfileRootEntries(root, includeLineInfo_, pruning_, cpu_,
+                               contexts_, &entries_);
+    unsigned int rootHits = includeLineInfo_ ? 0 : root->GetHitCount();
+    Local<Object> js_root = CreateNode(
+        root->GetFunctionName(), root->GetFunctionNameStr(),
+        root->GetScriptResourceName(), root->GetScriptId(),
+        root->GetLineNumber(), root->GetColumnNumber(),
+        rootHits, cpu_ ? cpu_->SelfNanos(root, rootHits) : 0, NULL,
+        PendingChildren(), includeIds_ ? root : NULL);
+    while (!pending_.empty()) {
+      PendingNode next = std::move(pending_.back());
+      pending_.pop_back();
+      const TimeProfileEntry& entry = next.entry;
+      entries_.clear();
+      if (entry.expand) {
+        PushTimeProfileChildEntries(entry.expand, entry.depth + 1,
+                                    includeLineInfo_, pruning_, cpu_,
+                                    contexts_, &entries_);
+      }
+      Local<Array> children = PendingChildren();
+      Local<Object> js_node;
+      if (!entry.function) {
+        if (truncatedName_.IsEmpty()) {
+          truncatedName_ =
+              Nan::New<String>(kTruncatedNodeName).ToLocalChecked();
+        }
+        js_node = CreateNode(truncatedName_, kTruncatedNodeName,
+                             Nan::EmptyString(), 0, 0, 0, entry.hitCount,
+                             entry.cpuNanos, &entry.contexts, children, NULL);
+      } else {
+        const CpuProfileNode* fn = entry.function;
+        // Samples refer to the node of a function, not to the entries for
+        // the call sites in it, which expand into another node.
+        bool sampled =
+            includeIds_ && (entry.expand == NULL || entry.expand == fn);
+        js_node = CreateNode(next.name, fn->GetFunctionNameStr(),
+                             next.scriptName, fn->GetScriptId(), entry.line,
+                             entry.column, entry.hitCount, entry.cpuNanos,
+                             &entry.contexts, children, sampled ? fn : NULL);
+      }
+      Nan::Set(next.parent, next.index, js_node);
+    }
+    return js_root;
+  }
+
+ private:
+  // An entry still to be translated, where to store it in the children of
+  // its parent, and the names of its function.
+  struct PendingNode {
+    TimeProfileEntry entry;
+    Local<Array> parent;
+    uint32_t index;
+    Local<String> name;
+    Local<String> scriptName;
+  };
+
+  // Returns an array for the nodes of the entries just pushed, which are
+  // stored in it once they are translated.
+  Local<Array> PendingChildren() {
+    Local<Array> children = Nan::New<Array>(entries_.size());
+    // V8 creates and internalizes the names of a node each time they are
+    // asked for. In line number mode, the line ticks and call sites of a
+    // node are entries of the same function, which only needs its names
+    // once.
+    const CpuProfileNode* named = NULL;
+    Local<String> name;
+    Local<String> scriptName;
+    for (size_t i = 0; i < entries_.size(); i++) {
+      const CpuProfileNode* fn = entries_[i].function;
+      if (fn && fn != named) {
+        name = fn->GetFunctionName();
+        scriptName = fn->GetScriptResourceName();
+        named = fn;
+      }
+      pending_.push_back({entries_[i], children, uint32_t(i), name,
+                          scriptName});
+    }
+    return children;
+  }
+
+  // Creates a node of the translated profile tree. If sampled is not NULL,
+  // the node also has the ID of that node, which samples recorded by the
+  // profiler refer to. When contexts are recorded, nodes without hits have
+  // undefined contexts, so that all nodes have the same properties. The keys
+  // of the location and function of the node identify its name by nameStr,
+  // which V8 interns.
+  Local<Object> CreateNode(Local<String> name, const char* nameStr,
+                           Local<String> scriptName, int scriptId,
+                           int lineNumber, int columnNumber,
+                           unsigned int hitCount, int64_t cpuNanos,
+                           const std::vector<ContextHits>* contexts,
+                           Local<Array> children,
+                           const CpuProfileNode* sampled) {
+    Local<String> keys[kProfileNodeKeyCount];
+    Local<Value> values[kProfileNodeKeyCount];
+    size_t count = 0;
+    auto add = [&](ProfileNodeKey key, Local<Value> value) {
+      keys[count] = keys_[key];
+      values[count++] = value;
+    };
+    add(kNameKey, name);
+    add(kScriptNameKey, scriptName);
+    add(kScriptIdKey, Nan::New<Integer>(scriptId));
+    add(kLineNumberKey, Nan::New<Integer>(lineNumber));
+    add(kColumnNumberKey, Nan::New<Integer>(columnNumber));
+    add(kHitCountKey, Nan::New<Integer>(hitCount));
+    LocationKeys::Keys nodeKeys =
+        locationKeys_.Get(scriptId, reinterpret_cast<uintptr_t>(nameStr),
+                          lineNumber, columnNumber);
+    add(kLocationKeyKey, Nan::New<Integer>(nodeKeys.location));
+    add(kFunctionKeyKey, Nan::New<Integer>(nodeKeys.function));
+    if (cpu_) {
+      add(kCpuTimeKey, Nan::New<Number>(static_cast<double>(cpuNanos)));
+    }
+    if (contexts_) {
+      if (contexts && !contexts->empty()) {
+        add(kContextsKey, CreateContexts(*contexts));
+      } else {
+        add(kContextsKey, Nan::Undefined());
+      }
+    }
+    add(kChildrenKey, children);
+    if (sampled) {
+      add(kIdKey, Nan::New<Integer>(sampled->GetNodeId()));
+    }
+    Local<Object> js_node = Nan::New<Object>();
+    DefineProperties(js_node, keys, values, count);
+    return js_node;
+  }
+
+  Local<Array> CreateContexts(const std::vector<ContextHits>& contexts) {
+    Local<Array> js_contexts = Nan::New<Array>(contexts.size());
+    for (size_t i = 0; i < contexts.size(); i++) {
+      Local<String> keys[] = {keys_[kContextKey], keys_[kHitCountKey],
+                              keys_[kCpuTimeKey]};
+      Local<Value> values[] = {
+          Nan::New<Number>(contexts[i].context),
+          Nan::New<Integer>(contexts[i].hitCount),
+          Nan::New<Number>(static_cast<double>(contexts[i].cpuNanos))};
+      Local<Object> js_context = Nan::New<Object>();
+      DefineProperties(js_context, keys, values, cpu_ ? 3 : 2);
+      Nan::Set(js_contexts, i, js_context);
+    }
+    return js_contexts;
+  }
+
+  NodeKeys keys_;
+  bool includeLineInfo_;
+  bool includeIds_;
+  const TimeProfilePruning& pruning_;
+  const TimeProfileCpu* cpu_;
+  const TimeProfileContexts* contexts_;
+  // Created for the first "(truncated)" node, if any.
+  Local<String> truncatedName_;
+  LocationKeys locationKeys_;
+  std::vector<PendingNode> pending_;
+  // Entries pushed for the children of the node being translated.
+  std::vector<TimeProfileEntry> entries_;
+};
+
+// Returns the samples recorded by the profiler as columns: the node ID of
+// each sample, and the time in microseconds since the previous sample (or
+// since the start of the profile, for the first sample).
+Local<Object> TranslateTimeProfileSamples(const CpuProfile* profile) {
+  int count = profile->GetSamplesCount();
+  Local<Int32Array> timeDeltas = Int32Array::New(
+      ArrayBuffer::New(v8::Isolate::GetCurrent(), count * sizeof(int32_t)), 0,
+      count);
+  Local<Uint32Array> nodeIds = Uint32Array::New(
+      ArrayBuffer::New(v8::Isolate::GetCurrent(), count * sizeof(uint32_t)),
+      0, count);
+  Nan::TypedArrayContents<int32_t> deltas(timeDeltas);
+  Nan::TypedArrayContents<uint32_t> ids(nodeIds);
+  int64_t previous = profile->GetStartTime();
+  for (int i = 0; i < count; i++) {
+    int64_t timestamp = profile->GetSampleTimestamp(i);
+    int64_t delta = timestamp - previous;
+    // Clamp, in the unlikely case that samples are more than 35 minutes
+    // apart.
+    if (delta > INT32_MAX) {
+      delta = INT32_MAX;
+    } else if (delta < INT32_MIN) {
+      delta = INT32_MIN;
+    }
+    (*deltas)[i] = static_cast<int32_t>(delta);
+    (*ids)[i] = profile->GetSample(i)->GetNodeId();
+    previous = timestamp;
+  }
+
+  Local<Object> samples = Nan::New<Object>();
+  Nan::Set(samples, Nan::New<String>("timeDeltas").ToLocalChecked(),
+           timeDeltas);
+  Nan::Set(samples, Nan::New<String>("nodeIds").ToLocalChecked(), nodeIds);
+  return samples;
+}
+
+// Sets the strings and nodes of js_profile to the tree of profile as columns
+// (see TimeProfileColumns in ts/src/v8-types.ts), with the nodes in the order
+// in which serializeTimeProfile() in ts/src/profile-serializer.ts visits the
+// translated tree. The tree is walked as by TimeProfileTranslator.
+void SetTimeProfileColumns(Local<Object> js_profile, const CpuProfile* profile,
+                           bool includeLineInfo, bool includeIds,
+                           const TimeProfilePruning& pruning,
+                           const TimeProfileCpu* cpu,
+                           const TimeProfileContexts* contexts) {
+  ProfileStrings strings;
+  ProfileNodeColumns nodes;
+  std::vector<int32_t> hitCounts;
+  std::vector<double> cpuTimes;
+  std::vector<uint32_t> ids;
+  // The hits of nodes by context, as in AllocationProfileColumns.
+  std::vector<int32_t> contextNodes;
+  std::vector<uint32_t> contextIds;
+  std::vector<int32_t> contextHitCounts;
+  std::vector<double> contextCpuTimes;
+  int32_t truncatedName = -1;
+  int32_t emptyName = -1;
+  auto add = [&](int32_t parent, const TimeProfileEntry& entry,
+                 const CpuProfileNode* sampled) {
+    const CpuProfileNode* fn = entry.function;
+    int32_t index;
+    if (fn) {
+      index = nodes.Add(parent, strings.Add(fn->GetFunctionNameStr()),
+                        strings.Add(fn->GetScriptResourceNameStr()),
+                        fn->GetScriptId(), entry.line, entry.column);
+    } else {
+      if (truncatedName < 0) {
+        truncatedName = strings.Add(std::string(kTruncatedNodeName));
+        emptyName = strings.Add(std::string());
+      }
+      index = nodes.Add(parent, truncatedName, emptyName, 0, 0, 0);
+    }
+    hitCounts.push_back(entry.hitCount);
+    if (cpu) {
+      cpuTimes.push_back(entry.cpuNanos);
+    }
+    if (includeIds) {
+      ids.push_back(sampled ? sampled->GetNodeId() : 0);
+    }
+    for (const ContextHits& hits : entry.contexts) {
+      contextNodes.push_back(index);
+      contextIds.push_back(hits.context);
+      contextHitCounts.push_back(hits.hitCount);
+      contextCpuTimes.push_back(hits.cpuNanos);
+    }
+    return index;
+  };
+
+  const CpuProfileNode* root = profile->GetTopDownRoot();
+  unsigned int rootHits = includeLineInfo ? 0 : root->GetHitCount();
+  add(-1,
+      {root, root, root->GetLineNumber(), root->GetColumnNumber(), rootHits, 0,
+       cpu ? cpu->SelfNanos(root, rootHits) : 0, {}},
+      root);
+  std::vector<TimeProfileEntry> entries;
+  std::vector<std::pair<TimeProfileEntry, int32_t>> pending;
+  PushTimeProfileRootEntries(root, includeLineInfo, pruning, cpu, contexts,
+                             &entries);
+  for (const TimeProfileEntry& entry : entries) {
+    pending.push_back({entry, 0});
+  }
+  while (!pending.empty()) {
+    TimeProfileEntry entry = std::move(pending.back().first);
+    int32_t parent = pending.back().second;
+    pending.pop_back();
+    const CpuProfileNode* fn = entry.function;
+    bool sampled = fn && (entry.expand == NULL || entry.expand == fn);
+    int32_t index = add(parent, entry, sampled ? fn : NULL);
+    if (entry.expand) {
+      entries.clear();
+      PushTimeProfileChildEntries(entry.expand, entry.depth + 1,
+                                  includeLineInfo, pruning, cpu, contexts,
+                                  &entries);
+      for (const TimeProfileEntry& child : entries) {
+        pending.push_back({child, index});
+      }
+    }
+  }
+
+  Local<Object> js_nodes = nodes.ToObject();
+  Nan::Set(js_nodes, Nan::New<String>("hitCounts").ToLocalChecked(),
+           CreateTypedArray<int32_t, Int32Array>(hitCounts));
+  if (cpu) {
+    Nan::Set(js_nodes, Nan::New<String>("cpuTimes").ToLocalChecked(),
+             CreateTypedArray<double, Float64Array>(cpuTimes));
+  }
+  if (includeIds) {
+    Nan::Set(js_nodes, Nan::New<String>("ids").ToLocalChecked(),
+             CreateTypedArray<uint32_t, Uint32Array>(ids));
+  }
+  Nan::Set(js_profile, Nan::New<String>("strings").ToLocalChecked(),
+           strings.ToArray());
+  Nan::Set(js_profile, Nan::New<String>("nodes").ToLocalChecked(), js_nodes);
+  if (contexts) {
+    Local<Object> js_contexts = Nan::New<Object>();
+    Nan::Set(js_contexts, Nan::New<String>("nodes").ToLocalChecked(),
+             CreateTypedArray<int32_t, Int32Array>(contextNodes));
+    Nan::Set(js_contexts, Nan::New<String>("contexts").ToLocalChecked(),
+             CreateTypedArray<uint32_t, Uint32Array>(contextIds));
+    Nan::Set(js_contexts, Nan::New<String>("hitCounts").ToLocalChecked(),
+             CreateTypedArray<int32_t, Int32Array>(contextHitCounts));
+    if (cpu) {
+      Nan::Set(js_contexts, Nan::New<String>("cpuTimes").ToLocalChecked(),
+               CreateTypedArray<double, Float64Array>(contextCpuTimes));
+    }
+    Nan::Set(js_profile, Nan::New<String>("contexts").ToLocalChecked(),
+             js_contexts);
+  }
+}
+
+// Samples may refer to nodes which pruning removed from the translated tree.
+// When columns is true, the tree is translated into columns rather than
+// objects. When cpu is not NULL, the nodes have their CPU time, and when
+// contexts is not NULL, their hits by context.
+Local<Value> TranslateTimeProfile(const CpuProfile* profile,
+                                  bool includeLineInfo,
+                                  const TimeProfilePruning& pruning,
+                                  const TimeProfileCpu* cpu,
+                                  const TimeProfileContexts* contexts,
+                                  const ProfileNodeKeys& keys,
+                                  bool columns = false) {
+  Local<Object> js_profile = Nan::New<Object>();
+  Nan::Set(js_profile, Nan::New<String>("title").ToLocalChecked(),
+           profile->GetTitle());
+
+  // Nodes need IDs only if some samples refer to them.
+  bool includeIds = profile->GetSamplesCount() > 0;
+  includeLineInfo = includeLineInfo && kCallerLineNumbersSupported;
+  if (columns) {
+    SetTimeProfileColumns(js_profile, profile, includeLineInfo, includeIds,
+                          pruning, cpu, contexts);
+  } else {
+    TimeProfileTranslator translator(keys, includeLineInfo, includeIds,
+                                     pruning, cpu, contexts);
+    Nan::Set(js_profile, Nan::New<String>("topDownRoot").ToLocalChecked(),
+             translator.Translate(profile->GetTopDownRoot()));
+  }
+  Nan::Set(js_profile, Nan::New<String>("startTime").ToLocalChecked(),
+           Nan::New<Number>(profile->GetStartTime()));
+  Nan::Set(js_profile, Nan::New<String>("endTime").ToLocalChecked(),
+           Nan::New<Number>(profile->GetEndTime()));
+  if (includeIds) {
+    Nan::Set(js_profile, Nan::New<String>("samples").ToLocalChecked(),
+             TranslateTimeProfileSamples(profile));
+  }
+  return js_profile;
+}
+
+// Maps the script IDs of one thread to the script IDs of a profile merged
+// from several threads. Scripts are identified by name, since script IDs are
+// only unique within an isolate, so that locations in the same script are
+// merged across threads.
+class MergedScriptIds {
+ public:
+  explicit MergedScriptIds(std::unordered_map<std::string, int32_t>* byName)
+      : byName_(byName) {}
+
+  int32_t Get(int32_t scriptId, const char* scriptName) {
+    // Script ID 0 is used for nodes which are not in a script.
+    if (scriptId == 0) {
+      return 0;
+    }
+    auto it = ids_.find(scriptId);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+    auto inserted = byName_->emplace(scriptName, byName_->size() + 1);
+    ids_[scriptId] = inserted.first->second;
+    return inserted.first->second;
+  }
+
+ private:
+  std::unordered_map<std::string, int32_t>* byName_;
+  std::unordered_map<int32_t, int32_t> ids_;
+};
+
+// Adds a sample to builder for every entry of the profile tree under root
+// with hits. Builder is ProfileBuilder, or ProfileAggregator. Entries
+// are visited in the same order as serialize() in
+// ts/src/profile-serializer.ts visits the translated profile. If scriptIds is
+// not NULL, it maps the script IDs of the profile to those of builder. Each
+// sample has the given labels. Subtrees which pruning removes are folded into
+// "(truncated)" entries. When cpu is not NULL, each sample has a third value,
+// its CPU time. When contexts is not NULL, the hits of each entry are split
+// into one sample per context, with a "context" label unless the context is
+// 0.
+template <typename Node, typename Builder>
+void AddTimeProfileSamples(
+    const Node* root, bool includeLineInfo, int64_t intervalMicros,
+    const TimeProfilePruning& pruning, const TimeProfileCpu* cpu,
+    const TimeProfileContexts* contexts, Builder* builder,
+    MergedScriptIds* scriptIds = NULL,
+    const std::vector<ProfileBuilder::Label>& labels =
+        std::vector<ProfileBuilder::Label>()) {
+  std::vector<BasicTimeProfileEntry<Node>> entries;
+  std::vector<uint64_t> path;
+  std::vector<ProfileBuilder::Label> contextLabels = labels;
+  int64_t contextKey = contexts ? builder->StringId("context") : 0;
+  PushTimeProfileRootEntries(root, includeLineInfo, pruning, cpu, contexts,
+                             &entries);
+
+  while (!entries.empty()) {
+    BasicTimeProfileEntry<Node> entry = std::move(entries.back());
+    entries.pop_back();
+    const Node* fn = entry.function;
+    path.resize(entry.depth);
+    if (fn) {
+      int32_t scriptId = fn->GetScriptId();
+      if (scriptIds) {
+        scriptId = scriptIds->Get(scriptId, fn->GetScriptResourceNameStr());
+      }
+      path.push_back(builder->LocationId(scriptId, fn->GetFunctionNameStr(),
+                                         fn->GetScriptResourceNameStr(),
+                                         entry.line, entry.column));
+    } else {
+      path.push_back(builder->LocationId(0, kTruncatedNodeName, "", 0, 0));
+    }
+    if (contexts) {
+      for (const ContextHits& hits : entry.contexts) {
+        int64_t values[] = {hits.hitCount, hits.hitCount * intervalMicros,
+                            hits.cpuNanos};
+        contextLabels.resize(labels.size());
+        if (hits.context != 0) {
+          contextLabels.push_back({contextKey, 0, hits.context, 0});
+        }
+        builder->AddSample(path, values, cpu ? 3 : 2, contextLabels);
+      }
+    } else if (entry.hitCount > 0) {
+      int64_t values[] = {entry.hitCount, entry.hitCount * intervalMicros,
+                          entry.cpuNanos};
+      builder->AddSample(path, values, cpu ? 3 : 2, labels);
+    }
+    if (entry.expand) {
+      PushTimeProfileChildEntries(entry.expand, entry.depth + 1,
+                                  includeLineInfo, pruning, cpu, contexts,
+                                  &entries);
+    }
+  }
+}
+
+// Returns the profile serialized as profile.proto. The string, function and
+// location tables are built natively, so no JavaScript objects are created
+// for the nodes of the profile. When cpu is not NULL, the samples have a
+// "cpu" value in nanoseconds, and when contexts is not NULL, a "context"
+// label. Profile is CpuProfile, or CopiedCpuProfile.
+template <typename Profile>
+std::string SerializeTimeProfile(const Profile* profile, bool includeLineInfo,
+                                 int64_t intervalMicros, int64_t timeNanos,
+                                 const TimeProfilePruning& pruning,
+                                 const TimeProfileCpu* cpu,
+                                 const TimeProfileContexts* contexts) {
+  ProfileBuilder builder;
+  builder.AddSampleType("sample", "count");
+  builder.AddSampleType("wall", "microseconds");
+  if (cpu) {
+    builder.AddSampleType("cpu", "nanoseconds");
+  }
+  builder.SetPeriodType("wall", "microseconds");
+  builder.SetPeriod(intervalMicros);
+  builder.SetTimeNanos(timeNanos);
+  builder.SetDurationNanos(
+      (profile->GetEndTime() - profile->GetStartTime()) * 1000);
+  AddTimeProfileSamples(profile->GetTopDownRoot(), includeLineInfo,
+                        intervalMicros, pruning, cpu, contexts, &builder);
+  return builder.Serialize();
+}
+
+// A CPU profile copied out of V8, so that it can be serialized without V8,
+// e.g. on a libuv worker thread. Its nodes have the accessors of
+// CpuProfileNode which the serialization uses.
+class CopiedCpuProfile {
+ public:
+  class Node {
+   public:
+    unsigned int GetNodeId() const { return id_; }
+    unsigned int GetHitCount() const { return hitCount_; }
+    int GetScriptId() const { return scriptId_; }
+    int GetLineNumber() const { return lineNumber_; }
+    int GetColumnNumber() const { return columnNumber_; }
+    const char* GetFunctionNameStr() const { return functionName_; }
+    const char* GetScriptResourceNameStr() const { return scriptName_; }
+    int GetChildrenCount() const { return childCount_; }
+    const Node* GetChild(int index) const { return children_ + index; }
+    const std::vector<ProfileLineTick>& GetLineTicks() const {
+      return lineTicks_;
+    }
+
+   private:
+    friend class CopiedCpuProfile;
+
+    unsigned int id_;
+    unsigned int hitCount_;
+    int scriptId_;
+    int lineNumber_;
+    int columnNumber_;
+    const char* functionName_;
+    const char* scriptName_;
+    int childCount_;
+    const Node* children_;
+    std::vector<ProfileLineTick> lineTicks_;
+  };
+
+  explicit CopiedCpuProfile(const CpuProfile* profile)
+      : startTime_(profile->GetStartTime()), endTime_(profile->GetEndTime()) {
+    // The children of each node are next to each other, after their parent,
+    // so that GetChild() can index them.
+    std::vector<const CpuProfileNode*> sources = {profile->GetTopDownRoot()};
+    std::vector<size_t> firstChildren;
+    for (size_t i = 0; i < sources.size(); i++) {
+      firstChildren.push_back(sources.size());
+      const CpuProfileNode* source = sources[i];
+      for (int j = 0; j < source->GetChildrenCount(); j++) {
+        sources.push_back(source->GetChild(j));
+      }
+    }
+    nodes_.resize(sources.size());
+    for (size_t i = 0; i < sources.size(); i++) {
+      const CpuProfileNode* source = sources[i];
+      Node& node = nodes_[i];
+      node.id_ = source->GetNodeId();
+      node.hitCount_ = source->GetHitCount();
+      node.scriptId_ = source->GetScriptId();
+      node.lineNumber_ = source->GetLineNumber();
+      node.columnNumber_ = source->GetColumnNumber();
+      node.functionName_ = Intern(source->GetFunctionNameStr());
+      node.scriptName_ = Intern(source->GetScriptResourceNameStr());
+      node.childCount_ = source->GetChildrenCount();
+      node.children_ = nodes_.data() + firstChildren[i];
+      node.lineTicks_ = GetLineTicks(source);
+    }
+  }
+
+  const Node* GetTopDownRoot() const { return &nodes_[0]; }
+  int64_t GetStartTime() const { return startTime_; }
+  int64_t GetEndTime() const { return endTime_; }
+
+ private:
+  // Returns a copy of str which lives as long as the profile. V8 keeps one
+  // copy of each of the strings of its profiles, so they are deduplicated by
+  // address.
+  const char* Intern(const char* str) {
+    auto it = strings_.find(str);
+    if (it == strings_.end()) {
+      it = strings_
+               .emplace(str,
+                        std::unique_ptr<std::string>(new std::string(str)))
+               .first;
+    }
+    return it->second->c_str();
+  }
+
+  std::vector<Node> nodes_;
+  std::unordered_map<const char*, std::unique_ptr<std::string>> strings_;
+  int64_t startTime_;
+  int64_t endTime_;
+};
+
+const std::vector<ProfileLineTick>& GetLineTicks(
+    const CopiedCpuProfile::Node* node) {
+  return node->GetLineTicks();
+}
+
+// Starts a profile with the given name on the CPU profilers of state.
+// Returns an error message, or NULL if the profile was started.
+const char* StartCpuProfile(TimeProfilerState* state, Local<String> name,
+                            bool includeLineInfo, bool newProfiler,
+                            bool recordSamples, bool cpuTime, bool contexts,
+                            bool sampleCost) {
+  if (contexts && !ContextRecorder::Supported()) {
+    return "Contexts are not supported on this platform.";
+  }
+  // The CPU time and contexts are attributed to the nodes of the samples.
+  bool sampled = cpuTime || contexts;
+  // The cost of the samples is only measured by the recorder.
+  bool recorded = sampled || (sampleCost && ContextRecorder::Supported());
+  // The sampler is started before the profile, so that the first samples of
+  // the profile come after its first points.
+  int64_t startMicros = CpuTimeSampler::NowMicros();
+  int64_t contextStartMicros = ContextRecorder::NowMicros();
+  int64_t startCpuNanos = -1;
+  int64_t startSampleNanos = -1;
+  if (recorded) {
+    if (state->cpuTimeSampler) {
+      // The interval may have changed since the sampler was created, e.g.
+      // when profiling continuously with an adaptive interval.
+      state->cpuTimeSampler->SetIntervalMicros(
+          state->cpuProfilers.SamplingIntervalMicros());
+    } else {
+      state->cpuTimeSampler.reset(
+          new CpuTimeSampler(state->cpuProfilers.SamplingIntervalMicros()));
+    }
+    startCpuNanos = state->cpuTimeSampler->CpuNanos();
+    startSampleNanos = state->cpuTimeSampler->SampleNanos();
+  }
+  const char* error = state->cpuProfilers.StartProfiling(
+      name, includeLineInfo, newProfiler, recordSamples || sampled);
+  if (error) {
+    if (state->sampledProfiles.empty()) {
+      state->cpuTimeSampler.reset();
+    }
+    return error;
+  }
+  if (recorded) {
+    // The signal handler of V8 is installed once a profile runs.
+    state->cpuTimeSampler->StartRecording(&state->context);
+    state->sampledProfiles[*Nan::Utf8String(name)] = {
+        startMicros,      contextStartMicros, startCpuNanos,
+        startSampleNanos, cpuTime,            contexts};
+  }
+  return NULL;
+}
+
+// Signature:
+// startProfiling(runName: string, includeLineInfo: boolean,
+//                newProfiler: boolean, recordSamples: boolean,
+//                cpuTime: boolean, contexts: boolean, sampleCost: boolean)
+//
+// Profiles with different names may run at the same time. When newProfiler
+// is true, the profile is started on a new CPU profiler (Node 12 and later).
+// When recordSamples is true, the node and timestamp of each sample are
+// recorded, and returned in the samples field of the translated profile.
+// When cpuTime is true, the CPU time used by this thread is sampled while the
+// profile runs, and each node of the profile has the CPU time used by its
+// samples. When contexts is true, the context set by setContext() is recorded
+// each time V8 samples this thread, and the hits of each node are split by
+// context; this is not supported on Windows. When sampleCost is true, the
+// CPU time this thread spends taking the samples of the profile is measured,
+// and reported by getTranslationStats() once it is stopped; it is not
+// measured on Windows.
+NAN_METHOD(StartProfiling) {
+  if (info.Length() != 7) {
+    return Nan::ThrowTypeError("StartProfiling must have seven arguments.");
+  }
+  if (!info[0]->IsString()) {
+    return Nan::ThrowTypeError("First argument must be a string.");
+  }
+  if (!info[1]->IsBoolean()) {
+    return Nan::ThrowTypeError("Second argument must be a boolean.");
+  }
+  if (!info[2]->IsBoolean()) {
+    return Nan::ThrowTypeError("Third argument must be a boolean.");
+  }
+  if (!info[3]->IsBoolean()) {
+    return Nan::ThrowTypeError("Fourth argument must be a boolean.");
+  }
+  if (!info[4]->IsBoolean()) {
+    return Nan::ThrowTypeError("Fifth argument must be a boolean.");
+  }
+  if (!info[5]->IsBoolean()) {
+    return Nan::ThrowTypeError("Sixth argument must be a boolean.");
+  }
+  if (!info[6]->IsBoolean()) {
+    return Nan::ThrowTypeError("Seventh argument must be a boolean.");
+  }
+
+  Local<String> name =
+      Nan::MaybeLocal<String>(info[0].As<String>()).ToLocalChecked();
+  bool includeLineInfo =
+      Nan::MaybeLocal<Boolean>(info[1].As<Boolean>()).ToLocalChecked()->Value();
+  bool newProfiler =
+      Nan::MaybeLocal<Boolean>(info[2].As<Boolean>()).ToLocalChecked()->Value();
+  bool recordSamples =
+      Nan::MaybeLocal<Boolean>(info[3].As<Boolean>()).ToLocalChecked()->Value();
+  bool cpuTime =
+      Nan::MaybeLocal<Boolean>(info[4].As<Boolean>()).ToLocalChecked()->Value();
+  bool contexts =
+      Nan::MaybeLocal<Boolean>(info[5].As<Boolean>()).ToLocalChecked()->Value();
+  bool sampleCost =
+      Nan::MaybeLocal<Boolean>(info[6].As<Boolean>()).ToLocalChecked()->Value();
+
+  const char* error = StartCpuProfile(
+      GetTimeProfilerState(info), name, includeLineInfo, newProfiler,
+      recordSamples, cpuTime, contexts, sampleCost);
+  if (error) {
+    return Nan::ThrowError(error);
+  }
 }
 
-NAN_METHOD(StartSamplingHeapProfiler) {
-  if (info.Length() == 2) {
-    if (!info[0]->IsUint32()) {
-      return Nan::ThrowTypeError("First argument type must be uint32.");
+// The CPU time and contexts of a stopped profile; either is NULL if the
+// profile was not started with it. sampleNanos is the CPU time spent taking
+// its samples, or -1 if it was not measured.
+struct SampledTimeProfile {
+  std::unique_ptr<TimeProfileCpu> cpu;
+  std::unique_ptr<TimeProfileContexts> contexts;
+  int64_t sampleNanos = -1;
+};
+
+// Returns the CPU time and contexts of the stopped profile with the given
+// name. The sampler stops once no other profile needs it.
+SampledTimeProfile StopSampledProfile(TimeProfilerState* state,
+                                      Local<String> name,
+                                      const CpuProfile* profile) {
+  SampledTimeProfile sampled;
+  auto it = state->sampledProfiles.find(*Nan::Utf8String(name));
+  if (it == state->sampledProfiles.end()) {
+    return sampled;
+  }
+  if (profile) {
+    int64_t sampleNanos = state->cpuTimeSampler->SampleNanos();
+    if (sampleNanos >= 0 && it->second.startSampleNanos >= 0) {
+      sampled.sampleNanos = sampleNanos - it->second.startSampleNanos;
     }
-    if (!info[1]->IsNumber()) {
-      return Nan::ThrowTypeError("First argument type must be Integer.");
+    if (it->second.cpuTime) {
+      sampled.cpu.reset(new TimeProfileCpu(
+          profile, state->cpuTimeSampler.get(), it->second.startMicros,
+          it->second.startCpuNanos));
+    }
+    if (it->second.contexts) {
+      sampled.contexts.reset(new TimeProfileContexts(
+          profile, state->cpuTimeSampler->ContextPoints(), sampled.cpu.get()));
     }
+  }
+  state->sampledProfiles.erase(it);
+  if (state->sampledProfiles.empty()) {
+    state->cpuTimeSampler.reset();
+  } else {
+    int64_t startMicros = std::numeric_limits<int64_t>::max();
+    int64_t contextStartMicros = std::numeric_limits<int64_t>::max();
+    for (const auto& running : state->sampledProfiles) {
+      startMicros = std::min(startMicros, running.second.startMicros);
+      contextStartMicros =
+          std::min(contextStartMicros, running.second.contextStartMicros);
+    }
+    state->cpuTimeSampler->Trim(startMicros, contextStartMicros);
+  }
+  return sampled;
+}
 
-#if NODE_MODULE_VERSION > NODE_8_0_MODULE_VERSION
-    uint64_t sample_interval = info[0].As<Integer>()->Value();
-    int stack_depth = info[1].As<Integer>()->Value();
-#else
-    uint64_t sample_interval = info[0].As<Integer>()->Uint32Value();
-    int stack_depth = info[1].As<Integer>()->IntegerValue();
-#endif
+// Stops the profile named by the arguments of stopProfiling() or
+// stopProfilingToColumns(), and returns it translated into objects or into
+// columns.
+void StopTimeProfile(const Nan::FunctionCallbackInfo<Value>& info,
+                     bool columns) {
+  if (info.Length() != 4) {
+    return Nan::ThrowTypeError("StopProfling must have four arguments.");
+  }
+  if (!info[0]->IsString()) {
+    return Nan::ThrowTypeError("First argument must be a string.");
+  }
+  if (!info[1]->IsBoolean()) {
+    return Nan::ThrowTypeError("Second argument must be a boolean.");
+  }
+  if (!info[2]->IsUint32()) {
+    return Nan::ThrowTypeError(
+        "Third argument must be a non-negative integer.");
+  }
+  if (!info[3]->IsUint32()) {
+    return Nan::ThrowTypeError(
+        "Fourth argument must be a non-negative integer.");
+  }
+  Local<String> name =
+      Nan::MaybeLocal<String>(info[0].As<String>()).ToLocalChecked();
+  bool includeLineInfo =
+      Nan::MaybeLocal<Boolean>(info[1].As<Boolean>()).ToLocalChecked()->Value();
+  uint32_t maxDepth = info[2].As<Uint32>()->Value();
+  uint32_t minHitCount = info[3].As<Uint32>()->Value();
 
-    info.GetIsolate()->GetHeapProfiler()->StartSamplingHeapProfiler(
-        sample_interval, stack_depth);
-  } else {
-    info.GetIsolate()->GetHeapProfiler()->StartSamplingHeapProfiler();
+  TimeProfilerState* state = GetTimeProfilerState(info);
+  uint64_t startNanos = uv_hrtime();
+  CpuProfile* profile = state->cpuProfilers.StopProfiling(name);
+  SampledTimeProfile sampled = StopSampledProfile(state, name, profile);
+  if (!profile) {
+    return Nan::ThrowError(
+        "StopProfiling called without an active CPU profiler.");
   }
+  Local<Value> translated_profile = TranslateTimeProfile(
+      profile, includeLineInfo,
+      TimeProfilePruning(profile, maxDepth, minHitCount), sampled.cpu.get(),
+      sampled.contexts.get(), state->keys, columns);
+  RecordTimeProfileStats(state, profile, startNanos, sampled.sampleNanos);
+  state->cpuProfilers.DeleteProfile(profile);
+  info.GetReturnValue().Set(translated_profile);
 }
 
 // Signature:
-// stopSamplingHeapProfiler()
-NAN_METHOD(StopSamplingHeapProfiler) {
-  info.GetIsolate()->GetHeapProfiler()->StopSamplingHeapProfiler();
-}
+// stopProfiling(runName: string, includeLineInfo: boolean, maxDepth: number,
+//               minHitCount: number): TimeProfile
+//
+// Nodes deeper than maxDepth, and subtrees with fewer than minHitCount hits,
+// are folded into "(truncated)" nodes; a limit of 0 means no limit.
+NAN_METHOD(StopProfiling) { StopTimeProfile(info, false); }
 
 // Signature:
-// getAllocationProfile(): AllocationProfileNode
-NAN_METHOD(GetAllocationProfile) {
-  std::unique_ptr<v8::AllocationProfile> profile(
-      info.GetIsolate()->GetHeapProfiler()->GetAllocationProfile());
-  AllocationProfile::Node* root = profile->GetRootNode();
-  info.GetReturnValue().Set(TranslateAllocationProfile(root));
+// stopProfilingToColumns(runName: string, includeLineInfo: boolean,
+//                        maxDepth: number,
+//                        minHitCount: number): TimeProfileColumns
+//
+// As stopProfiling(), but the tree is returned as columns, which takes a few
+// allocations rather than several objects per node.
+NAN_METHOD(StopProfilingToColumns) { StopTimeProfile(info, true); }
+
+// Signature:
+// stopProfilingToPprof(runName: string, includeLineInfo: boolean,
+//                      intervalMicros: number, timeNanos: number,
+//                      maxDepth: number, minHitCount: number): Buffer
+//
+// The profile is pruned as by stopProfiling().
+NAN_METHOD(StopProfilingToPprof) {
+  if (info.Length() != 6) {
+    return Nan::ThrowTypeError("StopProfilingToPprof must have six arguments.");
+  }
+  if (!info[0]->IsString()) {
+    return Nan::ThrowTypeError("First argument must be a string.");
+  }
+  if (!info[1]->IsBoolean()) {
+    return Nan::ThrowTypeError("Second argument must be a boolean.");
+  }
+  if (!info[2]->IsNumber()) {
+    return Nan::ThrowTypeError("Third argument must be a number.");
+  }
+  if (!info[3]->IsNumber()) {
+    return Nan::ThrowTypeError("Fourth argument must be a number.");
+  }
+  if (!info[4]->IsUint32()) {
+    return Nan::ThrowTypeError(
+        "Fifth argument must be a non-negative integer.");
+  }
+  if (!info[5]->IsUint32()) {
+    return Nan::ThrowTypeError(
+        "Sixth argument must be a non-negative integer.");
+  }
+  Local<String> name =
+      Nan::MaybeLocal<String>(info[0].As<String>()).ToLocalChecked();
+  bool includeLineInfo =
+      Nan::MaybeLocal<Boolean>(info[1].As<Boolean>()).ToLocalChecked()->Value();
+  int64_t intervalMicros = info[2].As<Number>()->Value();
+  int64_t timeNanos = info[3].As<Number>()->Value();
+  uint32_t maxDepth = info[4].As<Uint32>()->Value();
+  uint32_t minHitCount = info[5].As<Uint32>()->Value();
+
+  TimeProfilerState* state = GetTimeProfilerState(info);
+  uint64_t startNanos = uv_hrtime();
+  CpuProfile* profile = state->cpuProfilers.StopProfiling(name);
+  SampledTimeProfile sampled = StopSampledProfile(state, name, profile);
+  if (!profile) {
+    return Nan::ThrowError(
+        "StopProfiling called without an active CPU profiler.");
+  }
+  std::string encoded = SerializeTimeProfile(
+      profile, includeLineInfo, intervalMicros, timeNanos,
+      TimeProfilePruning(profile, maxDepth, minHitCount), sampled.cpu.get(),
+      sampled.contexts.get());
+  RecordTimeProfileStats(state, profile, startNanos, sampled.sampleNanos);
+  state->cpuProfilers.DeleteProfile(profile);
+  info.GetReturnValue().Set(
+      Nan::CopyBuffer(encoded.data(), encoded.size()).ToLocalChecked());
 }
 
-// Time profiler
-#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
-// For Node 12 and Node 14, a new CPU profiler object will be created each
-// time profiling is started to work around
-// https://bugs.chromium.org/p/v8/issues/detail?id=11051.
-CpuProfiler* cpuProfiler;
-// Default sampling interval is 1000us.
-int samplingIntervalUS = 1000;
-#elif NODE_MODULE_VERSION > NODE_8_0_MODULE_VERSION
-// This profiler exists for the lifetime of the program. Not calling
-// CpuProfiler::Dispose() is intentional.
-CpuProfiler* cpuProfiler = CpuProfiler::New(v8::Isolate::GetCurrent());
-#else
-CpuProfiler* cpuProfiler = v8::Isolate::GetCurrent()->GetCpuProfiler();
-#endif
+// Signature:
+// stopProfilingToPprofAsync(runName: string, includeLineInfo: boolean,
+//                           intervalMicros: number, timeNanos: number,
+//                           maxDepth: number, minHitCount: number,
+//                           callback: (err: Error|null, buffer?: Buffer,
+//                                      encodeNanos?: number) => void)
+//
+// Like stopProfilingToPprof(), but only copies the profile, and attributes
+// its CPU time and contexts to its nodes, on this thread. The profile is
+// pruned, serialized and gzipped on a libuv worker thread, then passed to
+// callback along with the time that took. The translation stats are the
+// cost of the work on this thread.
+NAN_METHOD(StopProfilingToPprofAsync) {
+  if (info.Length() != 7) {
+    return Nan::ThrowTypeError(
+        "StopProfilingToPprofAsync must have seven arguments.");
+  }
+  if (!info[0]->IsString()) {
+    return Nan::ThrowTypeError("First argument must be a string.");
+  }
+  if (!info[1]->IsBoolean()) {
+    return Nan::ThrowTypeError("Second argument must be a boolean.");
+  }
+  if (!info[2]->IsNumber()) {
+    return Nan::ThrowTypeError("Third argument must be a number.");
+  }
+  if (!info[3]->IsNumber()) {
+    return Nan::ThrowTypeError("Fourth argument must be a number.");
+  }
+  if (!info[4]->IsUint32()) {
+    return Nan::ThrowTypeError(
+        "Fifth argument must be a non-negative integer.");
+  }
+  if (!info[5]->IsUint32()) {
+    return Nan::ThrowTypeError(
+        "Sixth argument must be a non-negative integer.");
+  }
+  if (!info[6]->IsFunction()) {
+    return Nan::ThrowTypeError("Seventh argument must be a function.");
+  }
+  Local<String> name =
+      Nan::MaybeLocal<String>(info[0].As<String>()).ToLocalChecked();
+  bool includeLineInfo =
+      Nan::MaybeLocal<Boolean>(info[1].As<Boolean>()).ToLocalChecked()->Value();
+  int64_t intervalMicros = info[2].As<Number>()->Value();
+  int64_t timeNanos = info[3].As<Number>()->Value();
+  uint32_t maxDepth = info[4].As<Uint32>()->Value();
+  uint32_t minHitCount = info[5].As<Uint32>()->Value();
 
-Local<Object> CreateTimeNode(Local<String> name, Local<String> scriptName,
-                             Local<Integer> scriptId, Local<Integer> lineNumber,
-                             Local<Integer> columnNumber,
-                             Local<Integer> hitCount, Local<Array> children) {
-  Local<Object> js_node = Nan::New<Object>();
-  Nan::Set(js_node, Nan::New<String>("name").ToLocalChecked(), name);
-  Nan::Set(js_node, Nan::New<String>("scriptName").ToLocalChecked(),
-           scriptName);
-  Nan::Set(js_node, Nan::New<String>("scriptId").ToLocalChecked(), scriptId);
-  Nan::Set(js_node, Nan::New<String>("lineNumber").ToLocalChecked(),
-           lineNumber);
-  Nan::Set(js_node, Nan::New<String>("columnNumber").ToLocalChecked(),
-           columnNumber);
-  Nan::Set(js_node, Nan::New<String>("hitCount").ToLocalChecked(), hitCount);
-  Nan::Set(js_node, Nan::New<String>("children").ToLocalChecked(), children);
-
-  return js_node;
-}
-
-#if NODE_MODULE_VERSION > NODE_11_0_MODULE_VERSION
-Local<Object> TranslateLineNumbersTimeProfileNode(const CpuProfileNode* parent,
-                                                  const CpuProfileNode* node);
-
-Local<Array> GetLineNumberTimeProfileChildren(const CpuProfileNode* parent,
-                                              const CpuProfileNode* node) {
-  unsigned int index = 0;
-  Local<Array> children;
-  int32_t count = node->GetChildrenCount();
+  TimeProfilerState* state = GetTimeProfilerState(info);
+  uint64_t startNanos = uv_hrtime();
+  CpuProfile* profile = state->cpuProfilers.StopProfiling(name);
+  std::shared_ptr<SampledTimeProfile> sampled =
+      std::make_shared<SampledTimeProfile>(
+          StopSampledProfile(state, name, profile));
+  if (!profile) {
+    return Nan::ThrowError(
+        "StopProfiling called without an active CPU profiler.");
+  }
+  std::shared_ptr<CopiedCpuProfile> copied =
+      std::make_shared<CopiedCpuProfile>(profile);
+  RecordTimeProfileStats(state, profile, startNanos, sampled->sampleNanos);
+  state->cpuProfilers.DeleteProfile(profile);
 
-  unsigned int hitLineCount = node->GetHitLineCount();
-  unsigned int hitCount = node->GetHitCount();
-  if (hitLineCount > 0) {
-    std::vector<CpuProfileNode::LineTick> entries(hitLineCount);
-    node->GetLineTicks(&entries[0], hitLineCount);
-    children = Nan::New<Array>(count + hitLineCount);
-    for (const CpuProfileNode::LineTick entry : entries) {
-      Nan::Set(children, index++,
-               CreateTimeNode(
-                   node->GetFunctionName(), node->GetScriptResourceName(),
-                   Nan::New<Integer>(node->GetScriptId()),
-                   Nan::New<Integer>(entry.line), Nan::New<Integer>(0),
-                   Nan::New<Integer>(entry.hit_count), Nan::New<Array>(0)));
-    }
-  } else if (hitCount > 0) {
-    // Handle nodes for pseudo-functions like "process" and "garbage collection"
-    // which do not have hit line counts.
-    children = Nan::New<Array>(count + 1);
-    Nan::Set(
-        children, index++,
-        CreateTimeNode(node->GetFunctionName(), node->GetScriptResourceName(),
-                       Nan::New<Integer>(node->GetScriptId()),
-                       Nan::New<Integer>(node->GetLineNumber()),
-                       Nan::New<Integer>(node->GetColumnNumber()),
-                       Nan::New<Integer>(hitCount), Nan::New<Array>(0)));
-  } else {
-    children = Nan::New<Array>(count);
+  Nan::Callback* callback = new Nan::Callback(info[6].As<Function>());
+  Nan::AsyncQueueWorker(new ProfileToPprofWorker(
+      callback, [copied, sampled, includeLineInfo, intervalMicros, timeNanos,
+                 maxDepth, minHitCount] {
+        return SerializeTimeProfile(
+            copied.get(), includeLineInfo, intervalMicros, timeNanos,
+            TimeProfilePruning(copied->GetTopDownRoot(), maxDepth,
+                               minHitCount),
+            sampled->cpu.get(), sampled->contexts.get());
+      }));
+}
+
+// Signature:
+// stopProfilingToAggregate(runName: string, includeLineInfo: boolean,
+//                          intervalMicros: number, timeNanos: number,
+//                          maxDepth: number, minHitCount: number,
+//                          aggregator: ProfileAggregator)
+//
+// Merges the profile, pruned and sampled as by stopProfilingToPprof(), into
+// aggregator. Profiles with and without CPU time cannot be merged into the
+// same aggregator, since they do not have the same sample types.
+NAN_METHOD(StopProfilingToAggregate) {
+  if (info.Length() != 7) {
+    return Nan::ThrowTypeError(
+        "StopProfilingToAggregate must have seven arguments.");
   }
+  if (!info[0]->IsString()) {
+    return Nan::ThrowTypeError("First argument must be a string.");
+  }
+  if (!info[1]->IsBoolean()) {
+    return Nan::ThrowTypeError("Second argument must be a boolean.");
+  }
+  if (!info[2]->IsNumber()) {
+    return Nan::ThrowTypeError("Third argument must be a number.");
+  }
+  if (!info[3]->IsNumber()) {
+    return Nan::ThrowTypeError("Fourth argument must be a number.");
+  }
+  if (!info[4]->IsUint32()) {
+    return Nan::ThrowTypeError(
+        "Fifth argument must be a non-negative integer.");
+  }
+  if (!info[5]->IsUint32()) {
+    return Nan::ThrowTypeError(
+        "Sixth argument must be a non-negative integer.");
+  }
+  TimeProfilerState* state = GetTimeProfilerState(info);
+  ProfileAggregator* aggregator =
+      ProfileAggregatorWrap::Get(state->aggregatorTemplate, info[6]);
+  if (!aggregator) {
+    return;
+  }
+  Local<String> name =
+      Nan::MaybeLocal<String>(info[0].As<String>()).ToLocalChecked();
+  bool includeLineInfo =
+      Nan::MaybeLocal<Boolean>(info[1].As<Boolean>()).ToLocalChecked()->Value();
+  int64_t intervalMicros = info[2].As<Number>()->Value();
+  int64_t timeNanos = info[3].As<Number>()->Value();
+  uint32_t maxDepth = info[4].As<Uint32>()->Value();
+  uint32_t minHitCount = info[5].As<Uint32>()->Value();
 
-  for (int32_t i = 0; i < count; i++) {
-    Nan::Set(children, index++,
-             TranslateLineNumbersTimeProfileNode(node, node->GetChild(i)));
-  };
+  uint64_t startNanos = uv_hrtime();
+  CpuProfile* profile = state->cpuProfilers.StopProfiling(name);
+  SampledTimeProfile sampled = StopSampledProfile(state, name, profile);
+  if (!profile) {
+    return Nan::ThrowError(
+        "StopProfiling called without an active CPU profiler.");
+  }
+  std::vector<ProfileAggregator::ValueType> sampleTypes = {
+      {"sample", "count"}, {"wall", "microseconds"}};
+  if (sampled.cpu) {
+    sampleTypes.push_back({"cpu", "nanoseconds"});
+  }
+  if (!aggregator->SetSampleTypes(sampleTypes)) {
+    state->cpuProfilers.DeleteProfile(profile);
+    return Nan::ThrowError(
+        "Profiles with different sample types cannot be aggregated.");
+  }
+  aggregator->SetPeriodType("wall", "microseconds");
+  aggregator->SetPeriod(intervalMicros);
+  aggregator->SetTimeNanos(timeNanos);
+  aggregator->AddDurationNanos(
+      (profile->GetEndTime() - profile->GetStartTime()) * 1000);
+  AddTimeProfileSamples(profile->GetTopDownRoot(), includeLineInfo,
+                        intervalMicros,
+                        TimeProfilePruning(profile, maxDepth, minHitCount),
+                        sampled.cpu.get(), sampled.contexts.get(),
+                        aggregator);
+  aggregator->Fold();
+  aggregator->EndProfile();
+  RecordTimeProfileStats(state, profile, startNanos, sampled.sampleNanos);
+  state->cpuProfilers.DeleteProfile(profile);
+}
 
-  return children;
+// Signature:
+// getTranslationStats(): TranslationStats
+//
+// Returns the cost of the last profile stopped by stopProfiling(),
+// stopProfilingToColumns(), stopProfilingToPprof(),
+// stopProfilingToPprofAsync() or stopProfilingToAggregate() on this thread.
+NAN_METHOD(GetTimeTranslationStats) {
+  info.GetReturnValue().Set(GetTimeProfilerState(info)->lastStats.ToObject());
 }
 
-Local<Object> TranslateLineNumbersTimeProfileNode(const CpuProfileNode* parent,
-                                                  const CpuProfileNode* node) {
-  return CreateTimeNode(
-      parent->GetFunctionName(), parent->GetScriptResourceName(),
-      Nan::New<Integer>(parent->GetScriptId()),
-      Nan::New<Integer>(node->GetLineNumber()),
-      Nan::New<Integer>(node->GetColumnNumber()), Nan::New<Integer>(0),
-      GetLineNumberTimeProfileChildren(parent, node));
+// Signature:
+// setSamplingInterval(intervalMicros: number)
+NAN_METHOD(SetSamplingInterval) {
+  int us = Nan::To<int32_t>(info[0]).FromJust();
+  GetTimeProfilerState(info)->cpuProfilers.SetSamplingInterval(us);
 }
 
-// In profiles with line level accurate line numbers, a node's line number
-// and column number refer to the line/column from which the function was
-// called.
-Local<Value> TranslateLineNumbersTimeProfileRoot(const CpuProfileNode* node) {
-  int32_t count = node->GetChildrenCount();
-  std::vector<Local<Array>> childrenArrs(count);
-  int32_t childCount = 0;
-  for (int32_t i = 0; i < count; i++) {
-    Local<Array> c = GetLineNumberTimeProfileChildren(node, node->GetChild(i));
-    childCount = childCount + c->Length();
-    childrenArrs[i] = c;
+// Signature:
+// setThreadId(threadId: number)
+//
+// Sets the ID of the thread, used to label samples of profiles collected from
+// all threads.
+NAN_METHOD(SetThreadId) {
+  if (info.Length() != 1 || !info[0]->IsNumber()) {
+    return Nan::ThrowTypeError("First argument must be a number.");
   }
+  GetTimeProfilerState(info)->threadId = info[0].As<Number>()->Value();
+}
 
-  Local<Array> children = Nan::New<Array>(childCount);
-  int32_t idx = 0;
-  for (int32_t i = 0; i < count; i++) {
-    Local<Array> arr = childrenArrs[i];
-    for (uint32_t j = 0; j < arr->Length(); j++) {
-      Nan::Set(children, idx, Nan::Get(arr, j).ToLocalChecked());
-      idx++;
+// Signature:
+// setContext(context: number)
+//
+// Sets the context of this thread, such as the ID of the request it is
+// serving, which labels the samples of profiles started with contexts until
+// it is set again; 0 is no context. This only stores it atomically, where
+// the signal handler which V8 samples the thread with reads it, so that it
+// can be called on every switch between asynchronous contexts.
+NAN_METHOD(SetContext) {
+  if (!info[0]->IsUint32()) {
+    return Nan::ThrowTypeError(
+        "First argument must be a non-negative integer.");
+  }
+  GetTimeProfilerState(info)->context.store(info[0].As<Uint32>()->Value(),
+                                            std::memory_order_relaxed);
+}
+
+// Maximum time to wait for other threads to stop profiling. A thread which
+// does not run JavaScript or its event loop in time, e.g. because it is
+// blocked in a synchronous call, is left out of the profile.
+const uint64_t kThreadsProfileTimeoutMillis = 1000;
+
+// A profile collected from several threads and merged into one profile, in
+// which each sample has a "thread" label with the ID of its thread. The
+// profile of each thread is pruned with the given limits.
+class ThreadsProfile : public std::enable_shared_from_this<ThreadsProfile> {
+ public:
+  ThreadsProfile(bool includeLineInfo, int64_t intervalMicros,
+                 int64_t timeNanos, uint32_t maxDepth, uint32_t minHitCount)
+      : includeLineInfo_(includeLineInfo),
+        intervalMicros_(intervalMicros),
+        maxDepth_(maxDepth),
+        minHitCount_(minHitCount) {
+    builder_.AddSampleType("sample", "count");
+    builder_.AddSampleType("wall", "microseconds");
+    builder_.SetPeriodType("wall", "microseconds");
+    builder_.SetPeriod(intervalMicros);
+    builder_.SetTimeNanos(timeNanos);
+    threadKey_ = builder_.StringId("thread");
+  }
+
+  // Adds the profile of a thread. Called on that thread.
+  void Add(const CpuProfile* profile, int threadId) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_) {
+      return;
+    }
+    int64_t durationNanos =
+        (profile->GetEndTime() - profile->GetStartTime()) * 1000;
+    if (durationNanos > durationNanos_) {
+      durationNanos_ = durationNanos;
+      builder_.SetDurationNanos(durationNanos);
     }
+    MergedScriptIds scriptIds(&scriptIdsByName_);
+    AddTimeProfileSamples(profile->GetTopDownRoot(), includeLineInfo_,
+                          intervalMicros_,
+                          TimeProfilePruning(profile, maxDepth_, minHitCount_),
+                          NULL, NULL, &builder_, &scriptIds,
+                          {{threadKey_, 0, threadId, 0}});
   }
 
-  return CreateTimeNode(node->GetFunctionName(), node->GetScriptResourceName(),
-                        Nan::New<Integer>(node->GetScriptId()),
-                        Nan::New<Integer>(node->GetLineNumber()),
-                        Nan::New<Integer>(node->GetColumnNumber()),
-                        Nan::New<Integer>(0), children);
-}
-#endif
+  // Records that a thread did not start profiling, and why. Called on that
+  // thread instead of Add().
+  void AddError(const std::string& error) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!closed_) {
+      errors_[error]++;
+    }
+  }
 
-Local<Value> TranslateTimeProfileNode(const CpuProfileNode* node) {
-  int32_t count = node->GetChildrenCount();
-  Local<Array> children = Nan::New<Array>(count);
-  for (int32_t i = 0; i < count; i++) {
-    Nan::Set(children, i, TranslateTimeProfileNode(node->GetChild(i)));
+  // Called before asking another thread to add its profile.
+  void ExpectThread() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_++;
   }
 
-  return CreateTimeNode(node->GetFunctionName(), node->GetScriptResourceName(),
-                        Nan::New<Integer>(node->GetScriptId()),
-                        Nan::New<Integer>(node->GetLineNumber()),
-                        Nan::New<Integer>(node->GetColumnNumber()),
-                        Nan::New<Integer>(node->GetHitCount()), children);
-}
+  // Called by a thread once it has added its profile, or found that it has
+  // no profile to add. The last one wakes up the thread collecting the
+  // profile.
+  void FinishThread() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--pending_ > 0 || !waiting_) {
+        return;
+      }
+    }
+    std::shared_ptr<ThreadsProfile> self = shared_from_this();
+    std::lock_guard<std::mutex> lock(threadsMutex);
+    for (TimeProfilerState* thread : threads) {
+      if (thread->isolate == isolate_) {
+        thread->PostTask([self](TimeProfilerState*) { self->Close(); });
+        break;
+      }
+    }
+  }
 
-Local<Value> TranslateTimeProfile(const CpuProfile* profile,
-                                  bool includeLineInfo) {
-  Local<Object> js_profile = Nan::New<Object>();
-  Nan::Set(js_profile, Nan::New<String>("title").ToLocalChecked(),
-           profile->GetTitle());
+  // Queues worker, which serializes the profile, once every thread asked has
+  // added its profile, or after the timeout. Called on the thread collecting
+  // the profile, whose state is given, and whose event loop is kept alive by
+  // a timer meanwhile rather than blocking a thread of the libuv pool.
+  void QueueWhenFinished(TimeProfilerState* state, Nan::AsyncWorker* worker) {
+    state_ = state;
+    isolate_ = state->isolate;
+    worker_ = worker;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      waiting_ = pending_ > 0;
+    }
+    if (!waiting_) {
+      Close();
+      return;
+    }
+    state->threadsProfiles.push_back(shared_from_this());
+    timer_ = new uv_timer_t;
+    uv_timer_init(node::GetCurrentEventLoop(isolate_), timer_);
+    timer_->data = this;
+    uv_timer_start(
+        timer_,
+        [](uv_timer_t* timer) {
+          static_cast<ThreadsProfile*>(timer->data)->Close();
+        },
+        kThreadsProfileTimeoutMillis, 0);
+  }
 
-#if NODE_MODULE_VERSION > NODE_11_0_MODULE_VERSION
-  if (includeLineInfo) {
-    Nan::Set(js_profile, Nan::New<String>("topDownRoot").ToLocalChecked(),
-             TranslateLineNumbersTimeProfileRoot(profile->GetTopDownRoot()));
-  } else {
-    Nan::Set(js_profile, Nan::New<String>("topDownRoot").ToLocalChecked(),
-             TranslateTimeProfileNode(profile->GetTopDownRoot()));
+  // Drops the profile without calling back, when the environment of the
+  // thread collecting it exits.
+  void Abandon() {
+    if (StopWaiting()) {
+      delete worker_;
+      worker_ = NULL;
+    }
+  }
+
+  // Returns the merged profile serialized as profile.proto, once closed.
+  std::string Serialize() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return builder_.Serialize();
+  }
+
+ private:
+  // Stops adding profiles and queues the worker; called on the thread
+  // collecting the profile. Threads which have not added their profiles by
+  // now are left out, which the profile says in a comment.
+  void Close() {
+    std::shared_ptr<ThreadsProfile> self = shared_from_this();
+    if (!StopWaiting()) {
+      return;
+    }
+    Nan::AsyncQueueWorker(worker_);
+    worker_ = NULL;
+  }
+
+  // Closes the profile, and releases what waiting for other threads used.
+  // Returns false if the profile was already closed.
+  bool StopWaiting() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (closed_) {
+        return false;
+      }
+      closed_ = true;
+      for (const auto& error : errors_) {
+        builder_.AddComment("Threads which did not start profiling: " +
+                            std::to_string(error.second) + ". " +
+                            error.first);
+      }
+      if (pending_ > 0) {
+        builder_.AddComment(
+            "Threads which did not add their profiles in time: " +
+            std::to_string(pending_));
+      }
+    }
+    if (timer_) {
+      uv_close(reinterpret_cast<uv_handle_t*>(timer_), [](uv_handle_t* h) {
+        delete reinterpret_cast<uv_timer_t*>(h);
+      });
+      timer_ = NULL;
+      std::vector<std::shared_ptr<ThreadsProfile>>& waiting =
+          state_->threadsProfiles;
+      waiting.erase(std::find(waiting.begin(), waiting.end(),
+                              shared_from_this()));
+    }
+    return true;
+  }
+
+  std::mutex mutex_;
+  ProfileBuilder builder_;
+  std::unordered_map<std::string, int32_t> scriptIdsByName_;
+  bool includeLineInfo_;
+  int64_t intervalMicros_;
+  uint32_t maxDepth_;
+  uint32_t minHitCount_;
+  int64_t threadKey_;
+  int64_t durationNanos_ = 0;
+  // Number of threads which did not start profiling, by reason.
+  std::map<std::string, int> errors_;
+  int pending_ = 0;
+  // Set once the thread collecting the profile waits for the others, after
+  // which the last of them wakes it up.
+  bool waiting_ = false;
+  // Set once the profile stops waiting, after which profiles arriving late
+  // are dropped.
+  bool closed_ = false;
+  // Only used by the thread collecting the profile.
+  TimeProfilerState* state_ = NULL;
+  Isolate* isolate_ = NULL;
+  Nan::AsyncWorker* worker_ = NULL;
+  uv_timer_t* timer_ = NULL;
+};
+
+void AbandonThreadsProfiles(TimeProfilerState* state) {
+  std::vector<std::shared_ptr<ThreadsProfile>> waiting =
+      state->threadsProfiles;
+  for (const std::shared_ptr<ThreadsProfile>& profile : waiting) {
+    profile->Abandon();
   }
-#else
-  Nan::Set(js_profile, Nan::New<String>("topDownRoot").ToLocalChecked(),
-           TranslateTimeProfileNode(profile->GetTopDownRoot()));
-#endif
-  Nan::Set(js_profile, Nan::New<String>("startTime").ToLocalChecked(),
-           Nan::New<Number>(profile->GetStartTime()));
-  Nan::Set(js_profile, Nan::New<String>("endTime").ToLocalChecked(),
-           Nan::New<Number>(profile->GetEndTime()));
-  return js_profile;
 }
 
+// Serializes and gzips a ThreadsProfile once the threads have added their
+// profiles, off the main thread.
+class ThreadsProfileWorker : public Nan::AsyncWorker {
+ public:
+  ThreadsProfileWorker(Nan::Callback* callback,
+                       std::shared_ptr<ThreadsProfile> profile)
+      : Nan::AsyncWorker(callback, "pprof:ThreadsProfile"),
+        profile_(std::move(profile)) {}
+
+  void Execute() override {
+    std::string encoded = profile_->Serialize();
+    profile_.reset();
+    if (!GzipCompress(encoded, &compressed_)) {
+      SetErrorMessage("Failed to compress profile.");
+    }
+  }
+
+  void HandleOKCallback() override {
+    Nan::HandleScope scope;
+    Local<Value> argv[] = {Nan::Null(),
+                           Nan::CopyBuffer(compressed_.data(),
+                                           compressed_.size())
+                               .ToLocalChecked()};
+    callback->Call(2, argv, async_resource);
+  }
+
+ private:
+  std::shared_ptr<ThreadsProfile> profile_;
+  std::string compressed_;
+};
+
 // Signature:
-// startProfiling(runName: string, includeLineInfo: boolean)
-NAN_METHOD(StartProfiling) {
-  if (info.Length() != 2) {
-    return Nan::ThrowTypeError("StartProfiling must have two arguments.");
+// startProfilingAllThreads(runName: string, includeLineInfo: boolean,
+//                          intervalMicros: number)
+//
+// Starts a profile with the given name on this thread, and asks every other
+// thread which has loaded the module to start one too. A thread which is
+// already profiling is left as is, rather than have its profiles sampled at
+// another interval than they report; it is counted in a comment of the
+// merged profile, as is a thread which failed to start profiling.
+//
+// Only this thread is told when it is idle, by the idle notifier which
+// profileAllThreads() starts: the idle notifier of Node can only be started
+// from JavaScript on the thread itself. Time other threads spend waiting in
+// their event loops is therefore attributed to (program) rather than (idle).
+NAN_METHOD(StartProfilingAllThreads) {
+  if (info.Length() != 3) {
+    return Nan::ThrowTypeError(
+        "StartProfilingAllThreads must have three arguments.");
   }
   if (!info[0]->IsString()) {
     return Nan::ThrowTypeError("First argument must be a string.");
@@ -269,50 +3077,58 @@ NAN_METHOD(StartProfiling) {
   if (!info[1]->IsBoolean()) {
     return Nan::ThrowTypeError("Second argument must be a boolean.");
   }
-
-#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
-  // Since the CPU profiler is created and destroyed each time a CPU
-  // profile is collected, there cannot be multiple CPU profiling requests
-  // inflight in parallel.
-  if (cpuProfiler) {
-    return Nan::ThrowError("CPU profiler is already started.");
-  }
-  cpuProfiler = CpuProfiler::New(v8::Isolate::GetCurrent());
-  cpuProfiler->SetSamplingInterval(samplingIntervalUS);
-#endif
-
+  if (!info[2]->IsNumber()) {
+    return Nan::ThrowTypeError("Third argument must be a number.");
+  }
   Local<String> name =
       Nan::MaybeLocal<String>(info[0].As<String>()).ToLocalChecked();
-
-  // Sample counts and timestamps are not used, so we do not need to record
-  // samples.
-  const bool recordSamples = false;
-
-// Line level accurate line information is not available in Node 11 or earlier.
-#if NODE_MODULE_VERSION > NODE_11_0_MODULE_VERSION
   bool includeLineInfo =
       Nan::MaybeLocal<Boolean>(info[1].As<Boolean>()).ToLocalChecked()->Value();
-  if (includeLineInfo) {
-    cpuProfiler->StartProfiling(name, CpuProfilingMode::kCallerLineNumbers,
-                                recordSamples);
-  } else {
-    cpuProfiler->StartProfiling(name, recordSamples);
+  int intervalMicros = info[2].As<Number>()->Value();
+
+  TimeProfilerState* current = GetTimeProfilerState(info);
+  auto start = [includeLineInfo, intervalMicros](TimeProfilerState* state,
+                                                 Local<String> name) {
+    state->cpuProfilers.SetSamplingInterval(intervalMicros);
+    return StartCpuProfile(state, name, includeLineInfo, false, false, false,
+                           false, false);
+  };
+  const char* error = start(current, name);
+  if (error) {
+    return Nan::ThrowError(error);
+  }
+
+  std::string runName = *Nan::Utf8String(name);
+  std::lock_guard<std::mutex> lock(threadsMutex);
+  for (TimeProfilerState* thread : threads) {
+    if (thread != current) {
+      thread->PostTask([start, runName](TimeProfilerState* state) {
+        const char* error =
+            state->cpuProfilers.IsProfiling()
+                ? "Another CPU profile was already running."
+                : start(state, Nan::New<String>(runName).ToLocalChecked());
+        if (error) {
+          state->threadsProfileErrors[runName] = error;
+        }
+      });
+    }
   }
-#else
-  cpuProfiler->StartProfiling(name, recordSamples);
-#endif
 }
 
 // Signature:
-// stopProfiling(runName: string, includeLineInfo: boolean): TimeProfile
-NAN_METHOD(StopProfiling) {
-#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
-  if (!cpuProfiler) {
-    return Nan::ThrowError("StopProfiling called without an active CPU profiler.");
-  }
-#endif
-  if (info.Length() != 2) {
-    return Nan::ThrowTypeError("StopProfling must have two arguments.");
+// stopProfilingAllThreadsToPprof(runName: string, includeLineInfo: boolean,
+//                                intervalMicros: number, timeNanos: number,
+//                                maxDepth: number, minHitCount: number,
+//                                callback: (err: Error|null,
+//                                           buffer?: Buffer) => void)
+//
+// Stops the profiles started by startProfilingAllThreads(), and passes them to
+// callback merged into one profile, gzipped in pprof format. Each profile is
+// pruned as by stopProfiling().
+NAN_METHOD(StopProfilingAllThreadsToPprof) {
+  if (info.Length() != 7) {
+    return Nan::ThrowTypeError(
+        "StopProfilingAllThreadsToPprof must have seven arguments.");
   }
   if (!info[0]->IsString()) {
     return Nan::ThrowTypeError("First argument must be a string.");
@@ -320,66 +3136,212 @@ NAN_METHOD(StopProfiling) {
   if (!info[1]->IsBoolean()) {
     return Nan::ThrowTypeError("Second argument must be a boolean.");
   }
+  if (!info[2]->IsNumber()) {
+    return Nan::ThrowTypeError("Third argument must be a number.");
+  }
+  if (!info[3]->IsNumber()) {
+    return Nan::ThrowTypeError("Fourth argument must be a number.");
+  }
+  if (!info[4]->IsUint32()) {
+    return Nan::ThrowTypeError(
+        "Fifth argument must be a non-negative integer.");
+  }
+  if (!info[5]->IsUint32()) {
+    return Nan::ThrowTypeError(
+        "Sixth argument must be a non-negative integer.");
+  }
+  if (!info[6]->IsFunction()) {
+    return Nan::ThrowTypeError("Seventh argument must be a function.");
+  }
   Local<String> name =
       Nan::MaybeLocal<String>(info[0].As<String>()).ToLocalChecked();
   bool includeLineInfo =
       Nan::MaybeLocal<Boolean>(info[1].As<Boolean>()).ToLocalChecked()->Value();
+  int64_t intervalMicros = info[2].As<Number>()->Value();
+  int64_t timeNanos = info[3].As<Number>()->Value();
+  uint32_t maxDepth = info[4].As<Uint32>()->Value();
+  uint32_t minHitCount = info[5].As<Uint32>()->Value();
 
-  CpuProfile* profile = cpuProfiler->StopProfiling(name);
-  Local<Value> translated_profile =
-      TranslateTimeProfile(profile, includeLineInfo);
-  profile->Delete();
-#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
-  // Dispose of CPU profiler to work around memory leak.
-  cpuProfiler->Dispose();
-  cpuProfiler = NULL;
-#endif
-  info.GetReturnValue().Set(translated_profile);
-}
+  TimeProfilerState* current = GetTimeProfilerState(info);
+  CpuProfile* profile = current->cpuProfilers.StopProfiling(name);
+  if (!profile) {
+    return Nan::ThrowError(
+        "StopProfiling called without an active CPU profiler.");
+  }
+  std::shared_ptr<ThreadsProfile> merged = std::make_shared<ThreadsProfile>(
+      includeLineInfo, intervalMicros, timeNanos, maxDepth, minHitCount);
+  merged->Add(profile, current->threadId);
+  current->cpuProfilers.DeleteProfile(profile);
 
-// Signature:
-// setSamplingInterval(intervalMicros: number)
-NAN_METHOD(SetSamplingInterval) {
-#if NODE_MODULE_VERSION > NODE_8_0_MODULE_VERSION
-  int us = info[0].As<Integer>()->Value();
-#else
-  int us = info[0].As<Integer>()->IntegerValue();
-#endif
-#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
-  samplingIntervalUS = us;
-#else
-  cpuProfiler->SetSamplingInterval(us);
-#endif
+  std::string runName = *Nan::Utf8String(name);
+  {
+    std::lock_guard<std::mutex> lock(threadsMutex);
+    for (TimeProfilerState* thread : threads) {
+      if (thread == current) {
+        continue;
+      }
+      merged->ExpectThread();
+      thread->PostTask([merged, runName](TimeProfilerState* state) {
+        auto error = state->threadsProfileErrors.find(runName);
+        if (error != state->threadsProfileErrors.end()) {
+          merged->AddError(error->second);
+          state->threadsProfileErrors.erase(error);
+          merged->FinishThread();
+          return;
+        }
+        CpuProfile* profile = state->cpuProfilers.StopProfiling(
+            Nan::New<String>(runName).ToLocalChecked());
+        if (profile) {
+          merged->Add(profile, state->threadId);
+          state->cpuProfilers.DeleteProfile(profile);
+        }
+        merged->FinishThread();
+      });
+    }
+  }
+
+  Nan::Callback* callback = new Nan::Callback(info[6].As<Function>());
+  merged->QueueWhenFinished(current,
+                            new ThreadsProfileWorker(callback, merged));
 }
 
 NAN_MODULE_INIT(InitAll) {
+  // The module is initialized once for each thread loading it, so each thread
+  // has its own time profiler state.
+  Isolate* isolate = v8::Isolate::GetCurrent();
+  TimeProfilerState* state = new TimeProfilerState(isolate);
+  node::AddEnvironmentCleanupHook(isolate, TimeProfilerState::Cleanup, state);
+  Local<External> stateData = Nan::New<External>(state);
+
   Local<Object> timeProfiler = Nan::New<Object>();
-  Nan::Set(timeProfiler, Nan::New("startProfiling").ToLocalChecked(),
-           Nan::GetFunction(Nan::New<FunctionTemplate>(StartProfiling))
+  Nan::Set(
+      timeProfiler, Nan::New("startProfiling").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(StartProfiling, stateData))
+          .ToLocalChecked());
+  Nan::Set(
+      timeProfiler, Nan::New("stopProfiling").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(StopProfiling, stateData))
+          .ToLocalChecked());
+  Nan::Set(timeProfiler, Nan::New("stopProfilingToColumns").ToLocalChecked(),
+           Nan::GetFunction(
+               Nan::New<FunctionTemplate>(StopProfilingToColumns, stateData))
                .ToLocalChecked());
-  Nan::Set(timeProfiler, Nan::New("stopProfiling").ToLocalChecked(),
-           Nan::GetFunction(Nan::New<FunctionTemplate>(StopProfiling))
+  Nan::Set(timeProfiler, Nan::New("stopProfilingToPprof").ToLocalChecked(),
+           Nan::GetFunction(
+               Nan::New<FunctionTemplate>(StopProfilingToPprof, stateData))
+               .ToLocalChecked());
+  Nan::Set(timeProfiler, Nan::New("stopProfilingToPprofAsync").ToLocalChecked(),
+           Nan::GetFunction(Nan::New<FunctionTemplate>(
+                                StopProfilingToPprofAsync, stateData))
+               .ToLocalChecked());
+  Nan::Set(timeProfiler, Nan::New("stopProfilingToAggregate").ToLocalChecked(),
+           Nan::GetFunction(Nan::New<FunctionTemplate>(
+                                StopProfilingToAggregate, stateData))
                .ToLocalChecked());
   Nan::Set(timeProfiler, Nan::New("setSamplingInterval").ToLocalChecked(),
-           Nan::GetFunction(Nan::New<FunctionTemplate>(SetSamplingInterval))
+           Nan::GetFunction(
+               Nan::New<FunctionTemplate>(SetSamplingInterval, stateData))
                .ToLocalChecked());
-  Nan::Set(target, Nan::New<String>("timeProfiler").ToLocalChecked(),
-           timeProfiler);
-
-  Local<Object> heapProfiler = Nan::New<Object>();
   Nan::Set(
-      heapProfiler, Nan::New("startSamplingHeapProfiler").ToLocalChecked(),
-      Nan::GetFunction(Nan::New<FunctionTemplate>(StartSamplingHeapProfiler))
+      timeProfiler, Nan::New("setThreadId").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(SetThreadId, stateData))
           .ToLocalChecked());
   Nan::Set(
-      heapProfiler, Nan::New("stopSamplingHeapProfiler").ToLocalChecked(),
-      Nan::GetFunction(Nan::New<FunctionTemplate>(StopSamplingHeapProfiler))
+      timeProfiler, Nan::New("setContext").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(SetContext, stateData))
           .ToLocalChecked());
+  Nan::Set(timeProfiler, Nan::New("startProfilingAllThreads").ToLocalChecked(),
+           Nan::GetFunction(
+               Nan::New<FunctionTemplate>(StartProfilingAllThreads, stateData))
+               .ToLocalChecked());
+  Nan::Set(timeProfiler,
+           Nan::New("stopProfilingAllThreadsToPprof").ToLocalChecked(),
+           Nan::GetFunction(Nan::New<FunctionTemplate>(
+                                StopProfilingAllThreadsToPprof, stateData))
+               .ToLocalChecked());
+  Nan::Set(timeProfiler, Nan::New("getTranslationStats").ToLocalChecked(),
+           Nan::GetFunction(
+               Nan::New<FunctionTemplate>(GetTimeTranslationStats, stateData))
+               .ToLocalChecked());
+  Nan::Set(target, Nan::New<String>("timeProfiler").ToLocalChecked(),
+           timeProfiler);
+
+  HeapProfilerState* heapState = new HeapProfilerState(isolate);
+  node::AddEnvironmentCleanupHook(isolate, HeapProfilerState::Cleanup,
+                                  heapState);
+  Local<External> heapStateData = Nan::New<External>(heapState);
+
+  Local<Object> heapProfiler = Nan::New<Object>();
+  Nan::Set(heapProfiler, Nan::New("startSamplingHeapProfiler").ToLocalChecked(),
+           Nan::GetFunction(Nan::New<FunctionTemplate>(
+                                StartSamplingHeapProfiler, heapStateData))
+               .ToLocalChecked());
+  Nan::Set(heapProfiler, Nan::New("stopSamplingHeapProfiler").ToLocalChecked(),
+           Nan::GetFunction(Nan::New<FunctionTemplate>(
+                                StopSamplingHeapProfiler, heapStateData))
+               .ToLocalChecked());
   Nan::Set(heapProfiler, Nan::New("getAllocationProfile").ToLocalChecked(),
-           Nan::GetFunction(Nan::New<FunctionTemplate>(GetAllocationProfile))
+           Nan::GetFunction(Nan::New<FunctionTemplate>(GetAllocationProfile,
+                                                       heapStateData))
+               .ToLocalChecked());
+  Nan::Set(heapProfiler,
+           Nan::New("getAllocationProfileColumns").ToLocalChecked(),
+           Nan::GetFunction(Nan::New<FunctionTemplate>(
+                                GetAllocationProfileColumns, heapStateData))
+               .ToLocalChecked());
+  Nan::Set(heapProfiler,
+           Nan::New("getAllocationProfileToPprof").ToLocalChecked(),
+           Nan::GetFunction(Nan::New<FunctionTemplate>(
+                                GetAllocationProfileToPprof, heapStateData))
+               .ToLocalChecked());
+  Nan::Set(heapProfiler,
+           Nan::New("getAllocationProfileToPprofAsync").ToLocalChecked(),
+           Nan::GetFunction(
+               Nan::New<FunctionTemplate>(GetAllocationProfileToPprofAsync,
+                                          heapStateData))
+               .ToLocalChecked());
+  Nan::Set(heapProfiler,
+           Nan::New("addAllocationProfileToAggregate").ToLocalChecked(),
+           Nan::GetFunction(
+               Nan::New<FunctionTemplate>(AddAllocationProfileToAggregate,
+                                          heapStateData))
+               .ToLocalChecked());
+  Nan::Set(heapProfiler, Nan::New("getAllocationProfileDelta").ToLocalChecked(),
+           Nan::GetFunction(Nan::New<FunctionTemplate>(
+                                GetAllocationProfileDelta, heapStateData))
+               .ToLocalChecked());
+  Nan::Set(heapProfiler, Nan::New("getTranslationStats").ToLocalChecked(),
+           Nan::GetFunction(Nan::New<FunctionTemplate>(
+                                GetHeapTranslationStats, heapStateData))
                .ToLocalChecked());
   Nan::Set(target, Nan::New<String>("heapProfiler").ToLocalChecked(),
            heapProfiler);
+
+  Local<FunctionTemplate> aggregatorTemplate = ProfileAggregatorWrap::Init();
+  state->aggregatorTemplate.Reset(aggregatorTemplate);
+  heapState->aggregatorTemplate.Reset(aggregatorTemplate);
+  Local<Object> profileAggregator = Nan::New<Object>();
+  Nan::Set(profileAggregator, Nan::New("ProfileAggregator").ToLocalChecked(),
+           Nan::GetFunction(aggregatorTemplate).ToLocalChecked());
+  Nan::Set(target, Nan::New<String>("profileAggregator").ToLocalChecked(),
+           profileAggregator);
+
+  Local<Object> profileEncoder = Nan::New<Object>();
+  Nan::Set(profileEncoder, Nan::New("encodeProfile").ToLocalChecked(),
+           Nan::GetFunction(Nan::New<FunctionTemplate>(EncodeProfile))
+               .ToLocalChecked());
+  Nan::Set(target, Nan::New<String>("profileEncoder").ToLocalChecked(),
+           profileEncoder);
+
+  Local<Object> sourceMapDecoder = Nan::New<Object>();
+  Nan::Set(sourceMapDecoder, Nan::New("decodeMappings").ToLocalChecked(),
+           Nan::GetFunction(Nan::New<FunctionTemplate>(DecodeSourceMapMappings))
+               .ToLocalChecked());
+  Nan::Set(sourceMapDecoder, Nan::New("parseSourceMapFile").ToLocalChecked(),
+           Nan::GetFunction(Nan::New<FunctionTemplate>(ParseSourceMapFile))
+               .ToLocalChecked());
+  Nan::Set(target, Nan::New<String>("sourceMapDecoder").ToLocalChecked(),
+           sourceMapDecoder);
 }
 
-NODE_MODULE(google_cloud_profiler, InitAll);
+NAN_MODULE_WORKER_ENABLED(google_cloud_profiler, InitAll);
@@ -0,0 +1,116 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PPROF_BINDINGS_PROTO_WRITER_H_
+#define PPROF_BINDINGS_PROTO_WRITER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Minimal protocol buffer wire format writer. It supports only what is needed
+// to write profile.proto messages: varint scalars, packed varints, strings and
+// nested messages.
+class ProtoWriter {
+ public:
+  static const int kVarint = 0;
+  static const int kLengthDelimited = 2;
+
+  void WriteVarint(uint64_t value) {
+    while (value >= 0x80) {
+      buf_.push_back(static_cast<char>((value & 0x7f) | 0x80));
+      value >>= 7;
+    }
+    buf_.push_back(static_cast<char>(value));
+  }
+
+  void WriteTag(int field, int wireType) {
+    WriteVarint((static_cast<uint64_t>(field) << 3) | wireType);
+  }
+
+  // Writes a uint64 (or int64, as two's complement) field. As in proto3,
+  // fields with the default value of zero are omitted.
+  void WriteUint64(int field, uint64_t value) {
+    if (value == 0) {
+      return;
+    }
+    WriteTag(field, kVarint);
+    WriteVarint(value);
+  }
+
+  void WriteInt64(int field, int64_t value) {
+    WriteUint64(field, static_cast<uint64_t>(value));
+  }
+
+  void WriteBytes(int field, const char* data, size_t length) {
+    WriteTag(field, kLengthDelimited);
+    WriteVarint(length);
+    buf_.append(data, length);
+  }
+
+  // Unlike other fields, strings are always written, since the position of
+  // an empty string matters in a repeated string field.
+  void WriteString(int field, const std::string& value) {
+    WriteBytes(field, value.data(), value.size());
+  }
+
+  void WriteMessage(int field, const ProtoWriter& message) {
+    WriteBytes(field, message.buf_.data(), message.buf_.size());
+  }
+
+  template <typename T>
+  void WritePacked(int field, const T* values, size_t count) {
+    if (count == 0) {
+      return;
+    }
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++) {
+      length += VarintSize(static_cast<uint64_t>(values[i]));
+    }
+    WriteTag(field, kLengthDelimited);
+    WriteVarint(length);
+    for (size_t i = 0; i < count; i++) {
+      WriteVarint(static_cast<uint64_t>(values[i]));
+    }
+  }
+
+  template <typename T>
+  void WritePacked(int field, const std::vector<T>& values) {
+    WritePacked(field, values.data(), values.size());
+  }
+
+  void Append(const std::string& encoded) { buf_.append(encoded); }
+
+  void Clear() { buf_.clear(); }
+
+  size_t size() const { return buf_.size(); }
+  const std::string& data() const { return buf_; }
+  std::string& data() { return buf_; }
+
+  static size_t VarintSize(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+      value >>= 7;
+      size++;
+    }
+    return size;
+  }
+
+ private:
+  std::string buf_;
+};
+
+#endif  // PPROF_BINDINGS_PROTO_WRITER_H_
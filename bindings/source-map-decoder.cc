@@ -0,0 +1,635 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "source-map-decoder.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+
+#ifdef _WIN32
+#include <fstream>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace v8;
+
+namespace {
+
+const char kBase64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Values of base64 digits by character, and -1 for other characters.
+struct Base64Values {
+  int8_t values[256];
+
+  Base64Values() {
+    std::memset(values, -1, sizeof(values));
+    for (int i = 0; i < 64; i++) {
+      values[static_cast<uint8_t>(kBase64Chars[i])] = i;
+    }
+  }
+};
+
+// Returns the value of a base64 digit, or -1 if c is not one.
+int Base64Value(char c) {
+  static const Base64Values digits;
+  return digits.values[static_cast<uint8_t>(c)];
+}
+
+// Sorts the mappings of each generated line by column, for the rare source
+// maps whose segments are out of order.
+void SortLines(MappingTable* table) {
+  std::vector<size_t> order;
+  std::vector<int32_t> values;
+  std::vector<int32_t>* arrays[] = {&table->columns, &table->sources,
+                                    &table->sourceLines, &table->sourceColumns,
+                                    &table->names};
+  for (size_t line = 1; line < table->lineStarts.size(); line++) {
+    size_t start = table->lineStarts[line - 1];
+    size_t end = table->lineStarts[line];
+    order.clear();
+    for (size_t i = start; i < end; i++) {
+      order.push_back(i);
+    }
+    const std::vector<int32_t>& columns = table->columns;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return columns[a] < columns[b];
+    });
+    for (std::vector<int32_t>* array : arrays) {
+      values.clear();
+      for (size_t i : order) {
+        values.push_back((*array)[i]);
+      }
+      std::copy(values.begin(), values.end(), array->begin() + start);
+    }
+  }
+}
+
+// Appends the UTF-8 encoding of a code point.
+void AppendUtf8(std::string* out, uint32_t c) {
+  if (c < 0x80) {
+    out->push_back(c);
+  } else if (c < 0x800) {
+    out->push_back(0xC0 | (c >> 6));
+    out->push_back(0x80 | (c & 0x3F));
+  } else if (c < 0x10000) {
+    out->push_back(0xE0 | (c >> 12));
+    out->push_back(0x80 | ((c >> 6) & 0x3F));
+    out->push_back(0x80 | (c & 0x3F));
+  } else {
+    out->push_back(0xF0 | (c >> 18));
+    out->push_back(0x80 | ((c >> 12) & 0x3F));
+    out->push_back(0x80 | ((c >> 6) & 0x3F));
+    out->push_back(0x80 | (c & 0x3F));
+  }
+}
+
+bool IsSurrogate(uint32_t c) { return c >= 0xD800 && c < 0xE000; }
+
+// Scans JSON text in place, without copying strings which have no escapes.
+class JsonScanner {
+ public:
+  JsonScanner(const char* data, size_t length)
+      : p_(data), end_(data + length) {}
+
+  // Skips whitespace, then returns the next character, or 0 at the end.
+  char Peek() {
+    while (p_ < end_ &&
+           (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')) {
+      p_++;
+    }
+    return p_ < end_ ? *p_ : 0;
+  }
+
+  bool Consume(char c) {
+    if (Peek() != c) {
+      return false;
+    }
+    p_++;
+    return true;
+  }
+
+  bool ConsumeLiteral(const char* literal) {
+    size_t length = std::strlen(literal);
+    Peek();
+    if (static_cast<size_t>(end_ - p_) < length ||
+        std::memcmp(p_, literal, length) != 0) {
+      return false;
+    }
+    p_ += length;
+    return true;
+  }
+
+  bool AtEnd() { return Peek() == 0; }
+
+  // Parses a string. If it has no escapes, *data and *length refer to it in
+  // place; otherwise it is decoded into *buffer, which they refer to.
+  bool ParseString(const char** data, size_t* length, std::string* buffer) {
+    if (!Consume('"')) {
+      return false;
+    }
+    const char* start = p_;
+    while (p_ < end_ && *p_ != '"' && *p_ != '\\') {
+      p_++;
+    }
+    if (p_ == end_) {
+      return false;
+    }
+    if (*p_ == '"') {
+      *data = start;
+      *length = p_ - start;
+      p_++;
+      return true;
+    }
+    buffer->assign(start, p_);
+    while (p_ < end_) {
+      char c = *p_++;
+      if (c == '"') {
+        *data = buffer->data();
+        *length = buffer->size();
+        return true;
+      }
+      if (c != '\\') {
+        buffer->push_back(c);
+        continue;
+      }
+      if (p_ == end_) {
+        return false;
+      }
+      c = *p_++;
+      switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+          buffer->push_back(c);
+          break;
+        case 'b':
+          buffer->push_back('\b');
+          break;
+        case 'f':
+          buffer->push_back('\f');
+          break;
+        case 'n':
+          buffer->push_back('\n');
+          break;
+        case 'r':
+          buffer->push_back('\r');
+          break;
+        case 't':
+          buffer->push_back('\t');
+          break;
+        case 'u': {
+          uint32_t code;
+          if (!ParseHex4(&code)) {
+            return false;
+          }
+          if (code >= 0xD800 && code < 0xDC00 && end_ - p_ >= 2 &&
+              p_[0] == '\\' && p_[1] == 'u') {
+            p_ += 2;
+            uint32_t low;
+            if (!ParseHex4(&low)) {
+              return false;
+            }
+            if (low >= 0xDC00 && low < 0xE000) {
+              code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            } else {
+              AppendUtf8(buffer, 0xFFFD);
+              code = low;
+            }
+          }
+          AppendUtf8(buffer, IsSurrogate(code) ? 0xFFFD : code);
+          break;
+        }
+        default:
+          return false;
+      }
+    }
+    return false;
+  }
+
+  bool ParseString(std::string* out) {
+    const char* data;
+    size_t length;
+    std::string buffer;
+    if (!ParseString(&data, &length, &buffer)) {
+      return false;
+    }
+    out->assign(data, length);
+    return true;
+  }
+
+  // Parses a string or null, which is parsed as an empty string.
+  bool ParseOptionalString(std::string* out) {
+    if (Peek() == 'n') {
+      out->clear();
+      return ConsumeLiteral("null");
+    }
+    return ParseString(out);
+  }
+
+  // Parses an array of strings or nulls.
+  bool ParseStringArray(std::vector<std::string>* out) {
+    out->clear();
+    if (!Consume('[')) {
+      return false;
+    }
+    if (Consume(']')) {
+      return true;
+    }
+    do {
+      out->emplace_back();
+      if (!ParseOptionalString(&out->back())) {
+        return false;
+      }
+    } while (Consume(','));
+    return Consume(']');
+  }
+
+  // Skips a value of any type, without decoding it or checking that arrays
+  // and objects in it are well formed.
+  bool SkipValue() {
+    int depth = 0;
+    do {
+      char c = Peek();
+      if (c == '"') {
+        if (!SkipString()) {
+          return false;
+        }
+      } else if (c == '{' || c == '[') {
+        p_++;
+        depth++;
+      } else if (c == '}' || c == ']' || c == ',' || c == ':') {
+        if (depth == 0) {
+          return false;
+        }
+        p_++;
+        if (c == '}' || c == ']') {
+          depth--;
+        }
+      } else {
+        const char* start = p_;
+        while (p_ < end_ && (std::isalnum(static_cast<unsigned char>(*p_)) ||
+                             *p_ == '-' || *p_ == '+' || *p_ == '.')) {
+          p_++;
+        }
+        if (p_ == start) {
+          return false;
+        }
+      }
+    } while (depth > 0);
+    return true;
+  }
+
+ private:
+  bool SkipString() {
+    p_++;
+    while (p_ < end_) {
+      char c = *p_++;
+      if (c == '"') {
+        return true;
+      }
+      if (c == '\\') {
+        p_++;
+      }
+    }
+    return false;
+  }
+
+  bool ParseHex4(uint32_t* code) {
+    if (end_ - p_ < 4) {
+      return false;
+    }
+    *code = 0;
+    for (int i = 0; i < 4; i++) {
+      char c = *p_++;
+      int digit;
+      if (c >= '0' && c <= '9') {
+        digit = c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        digit = c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        digit = c - 'A' + 10;
+      } else {
+        return false;
+      }
+      *code = (*code << 4) | digit;
+    }
+    return true;
+  }
+
+  const char* p_;
+  const char* end_;
+};
+
+template <typename T, typename Array>
+Local<Array> CreateTypedArray(const std::vector<T>& values) {
+  Local<ArrayBuffer> buffer =
+      ArrayBuffer::New(Isolate::GetCurrent(), values.size() * sizeof(T));
+  Local<Array> array = Array::New(buffer, 0, values.size());
+  Nan::TypedArrayContents<T> contents(array);
+  std::copy(values.begin(), values.end(), *contents);
+  return array;
+}
+
+Local<Object> CreateMappingTables(const MappingTable& table) {
+  Local<Object> tables = Nan::New<Object>();
+  Nan::Set(tables, Nan::New("lineStarts").ToLocalChecked(),
+           CreateTypedArray<uint32_t, Uint32Array>(table.lineStarts));
+  Nan::Set(tables, Nan::New("columns").ToLocalChecked(),
+           CreateTypedArray<int32_t, Int32Array>(table.columns));
+  Nan::Set(tables, Nan::New("sources").ToLocalChecked(),
+           CreateTypedArray<int32_t, Int32Array>(table.sources));
+  Nan::Set(tables, Nan::New("sourceLines").ToLocalChecked(),
+           CreateTypedArray<int32_t, Int32Array>(table.sourceLines));
+  Nan::Set(tables, Nan::New("sourceColumns").ToLocalChecked(),
+           CreateTypedArray<int32_t, Int32Array>(table.sourceColumns));
+  Nan::Set(tables, Nan::New("names").ToLocalChecked(),
+           CreateTypedArray<int32_t, Int32Array>(table.names));
+  return tables;
+}
+
+Local<Array> CreateStringArray(const std::vector<std::string>& strings) {
+  Local<Array> array = Nan::New<Array>(strings.size());
+  for (size_t i = 0; i < strings.size(); i++) {
+    Nan::Set(array, i, Nan::New(strings[i]).ToLocalChecked());
+  }
+  return array;
+}
+
+}  // namespace
+
+bool DecodeMappings(const char* data, size_t length, MappingTable* table,
+                    std::string* error) {
+  size_t lineCount = 1;
+  size_t maxCount = 1;
+  for (size_t i = 0; i < length; i++) {
+    if (data[i] == ';') {
+      lineCount++;
+      maxCount++;
+    } else if (data[i] == ',') {
+      maxCount++;
+    }
+  }
+  table->lineStarts.assign(lineCount + 1, 0);
+  table->columns.clear();
+  table->sources.clear();
+  table->sourceLines.clear();
+  table->sourceColumns.clear();
+  table->names.clear();
+  table->columns.reserve(maxCount);
+  table->sources.reserve(maxCount);
+  table->sourceLines.reserve(maxCount);
+  table->sourceColumns.reserve(maxCount);
+  table->names.reserve(maxCount);
+
+  int64_t fields[5];
+  size_t line = 0;
+  int64_t column = 0;
+  int64_t source = 0;
+  int64_t sourceLine = 0;
+  int64_t sourceColumn = 0;
+  int64_t name = 0;
+  bool sorted = true;
+  size_t i = 0;
+  while (i < length) {
+    if (data[i] == ';') {
+      table->lineStarts[++line] = table->columns.size();
+      column = 0;
+      i++;
+      continue;
+    }
+    if (data[i] == ',') {
+      i++;
+      continue;
+    }
+    int fieldCount = 0;
+    while (i < length && data[i] != ',' && data[i] != ';') {
+      if (fieldCount == 5) {
+        *error = "Too many fields in source map segment";
+        return false;
+      }
+      uint64_t value = 0;
+      int shift = 0;
+      int digit;
+      do {
+        digit = i < length ? Base64Value(data[i++]) : -1;
+        if (digit < 0 || shift > 30) {
+          *error = "Invalid base64 VLQ in source map mappings";
+          return false;
+        }
+        value |= static_cast<uint64_t>(digit & 31) << shift;
+        shift += 5;
+      } while (digit & 32);
+      int64_t magnitude = static_cast<int64_t>(value >> 1);
+      fields[fieldCount++] = (value & 1) ? -magnitude : magnitude;
+    }
+    if (fieldCount != 1 && fieldCount != 4 && fieldCount != 5) {
+      *error = "Invalid source map segment";
+      return false;
+    }
+    column += fields[0];
+    if (table->columns.size() > table->lineStarts[line] &&
+        column < table->columns.back()) {
+      sorted = false;
+    }
+    table->columns.push_back(column);
+    if (fieldCount == 1) {
+      table->sources.push_back(-1);
+      table->sourceLines.push_back(0);
+      table->sourceColumns.push_back(0);
+      table->names.push_back(-1);
+    } else {
+      source += fields[1];
+      sourceLine += fields[2];
+      sourceColumn += fields[3];
+      table->sources.push_back(source);
+      table->sourceLines.push_back(sourceLine + 1);
+      table->sourceColumns.push_back(sourceColumn);
+      if (fieldCount == 5) {
+        name += fields[4];
+        table->names.push_back(name);
+      } else {
+        table->names.push_back(-1);
+      }
+    }
+  }
+  std::fill(table->lineStarts.begin() + line + 1, table->lineStarts.end(),
+            table->columns.size());
+  if (!sorted) {
+    SortLines(table);
+  }
+  return true;
+}
+
+NAN_METHOD(DecodeSourceMapMappings) {
+  if (info.Length() != 1 || !info[0]->IsString()) {
+    return Nan::ThrowTypeError("decodeMappings must have a string argument.");
+  }
+  Nan::Utf8String mappings(info[0]);
+  MappingTable table;
+  std::string error;
+  if (!DecodeMappings(*mappings, mappings.length(), &table, &error)) {
+    return Nan::ThrowError(error.c_str());
+  }
+  info.GetReturnValue().Set(CreateMappingTables(table));
+}
+
+bool ParseSourceMap(const char* data, size_t length, SourceMap* map,
+                    std::string* error) {
+  const char kBom[] = "\xEF\xBB\xBF";
+  const char kXssiPrefix[] = ")]}'";
+  if (length >= 3 && std::memcmp(data, kBom, 3) == 0) {
+    data += 3;
+    length -= 3;
+  }
+  // As in the source-map module, skip the line of a prefix protecting
+  // against cross-site script inclusion.
+  if (length >= 4 && std::memcmp(data, kXssiPrefix, 4) == 0) {
+    const char* newline =
+        static_cast<const char*>(std::memchr(data, '\n', length));
+    size_t skipped = newline ? newline - data + 1 : length;
+    data += skipped;
+    length -= skipped;
+  }
+
+  JsonScanner json(data, length);
+  bool hasMappings = false;
+  bool ok = json.Consume('{');
+  if (ok && !json.Consume('}')) {
+    do {
+      std::string key;
+      if (!json.ParseString(&key) || !json.Consume(':')) {
+        ok = false;
+        break;
+      }
+      if (key == "file") {
+        map->hasFile = json.Peek() != 'n';
+        ok = json.ParseOptionalString(&map->file);
+      } else if (key == "sourceRoot") {
+        ok = json.ParseOptionalString(&map->sourceRoot);
+      } else if (key == "sources") {
+        ok = json.ParseStringArray(&map->sources);
+      } else if (key == "names") {
+        ok = json.ParseStringArray(&map->names);
+      } else if (key == "mappings") {
+        const char* mappings;
+        size_t mappingsLength;
+        std::string buffer;
+        ok = json.ParseString(&mappings, &mappingsLength, &buffer);
+        if (ok &&
+            !DecodeMappings(mappings, mappingsLength, &map->mappings, error)) {
+          return false;
+        }
+        hasMappings = true;
+      } else if (key == "sections") {
+        *error = "Index source maps are not supported";
+        return false;
+      } else {
+        ok = json.SkipValue();
+      }
+    } while (ok && json.Consume(','));
+    ok = ok && json.Consume('}');
+  }
+  if (!ok || !json.AtEnd()) {
+    *error = "Invalid JSON in source map";
+    return false;
+  }
+  if (!hasMappings) {
+    *error = "No mappings in source map";
+    return false;
+  }
+  return true;
+}
+
+bool ReadSourceMap(const std::string& path, SourceMap* map,
+                   std::string* error) {
+#ifdef _WIN32
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    *error = "Could not read source map file " + path;
+    return false;
+  }
+  std::string contents((std::istreambuf_iterator<char>(in)),
+                       std::istreambuf_iterator<char>());
+  return ParseSourceMap(contents.data(), contents.size(), map, error);
+#else
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    *error = "Could not read source map file " + path + ": " +
+             std::strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    *error = "Could not read source map file " + path + ": " +
+             std::strerror(errno);
+    close(fd);
+    return false;
+  }
+  size_t length = st.st_size;
+  if (length == 0) {
+    close(fd);
+    return ParseSourceMap("", 0, map, error);
+  }
+  void* data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    *error = "Could not map source map file " + path + ": " +
+             std::strerror(errno);
+    return false;
+  }
+  // The file is read once from start to end; its pages are not dirtied, so
+  // the kernel may reclaim them at any time.
+  madvise(data, length, MADV_SEQUENTIAL);
+  bool ok = ParseSourceMap(static_cast<const char*>(data), length, map, error);
+  munmap(data, length);
+  return ok;
+#endif
+}
+
+NAN_METHOD(ParseSourceMapFile) {
+  if (info.Length() != 1 || !info[0]->IsString()) {
+    return Nan::ThrowTypeError(
+        "parseSourceMapFile must have a string argument.");
+  }
+  Nan::Utf8String path(info[0]);
+  SourceMap map;
+  std::string error;
+  if (!ReadSourceMap(std::string(*path, path.length()), &map, &error)) {
+    return Nan::ThrowError(error.c_str());
+  }
+  Local<Object> result = Nan::New<Object>();
+  if (map.hasFile) {
+    Nan::Set(result, Nan::New("file").ToLocalChecked(),
+             Nan::New(map.file).ToLocalChecked());
+  }
+  Nan::Set(result, Nan::New("sourceRoot").ToLocalChecked(),
+           Nan::New(map.sourceRoot).ToLocalChecked());
+  Nan::Set(result, Nan::New("sources").ToLocalChecked(),
+           CreateStringArray(map.sources));
+  Nan::Set(result, Nan::New("names").ToLocalChecked(),
+           CreateStringArray(map.names));
+  Nan::Set(result, Nan::New("mappings").ToLocalChecked(),
+           CreateMappingTables(map.mappings));
+  info.GetReturnValue().Set(result);
+}
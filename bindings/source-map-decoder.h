@@ -0,0 +1,83 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PPROF_BINDINGS_SOURCE_MAP_DECODER_H_
+#define PPROF_BINDINGS_SOURCE_MAP_DECODER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "nan.h"
+
+// Mappings of a source map, sorted by generated position, with the same
+// layout as MappingIndex in ts/src/sourcemapper/mapping-index.ts: mapping i
+// is at the 0-based generated column columns[i], and the mappings of the
+// 1-based generated line l are those in [lineStarts[l-1], lineStarts[l]).
+// Source and name indices are -1 for mappings without them.
+struct MappingTable {
+  std::vector<uint32_t> lineStarts;
+  std::vector<int32_t> columns;
+  std::vector<int32_t> sources;
+  std::vector<int32_t> sourceLines;
+  std::vector<int32_t> sourceColumns;
+  std::vector<int32_t> names;
+};
+
+// Decodes the base64 VLQ "mappings" field of a source map. Returns false and
+// sets error if the mappings are not valid. Does not depend on V8.
+bool DecodeMappings(const char* data, size_t length, MappingTable* table,
+                    std::string* error);
+
+// Fields of a source map file used to map locations.
+struct SourceMap {
+  bool hasFile = false;
+  std::string file;
+  std::string sourceRoot;
+  // Sources and names which are null are empty.
+  std::vector<std::string> sources;
+  std::vector<std::string> names;
+  MappingTable mappings;
+};
+
+// Parses source map JSON, skipping fields which are not used, such as
+// sourcesContent. Index maps, which have sections, are not supported. Returns
+// false and sets error if the source map is not valid. Does not depend on V8.
+bool ParseSourceMap(const char* data, size_t length, SourceMap* map,
+                    std::string* error);
+
+// Parses a source map file in place from a read-only memory mapping of it,
+// so that the file is never copied. Returns false and sets error if the file
+// cannot be read or is not a valid source map.
+bool ReadSourceMap(const std::string& path, SourceMap* map,
+                   std::string* error);
+
+// Signature:
+// decodeMappings(mappings: string): MappingTables
+//
+// Decodes mappings into typed arrays with the fields of MappingTable.
+NAN_METHOD(DecodeSourceMapMappings);
+
+// Signature:
+// parseSourceMapFile(path: string): {file?: string, sourceRoot: string,
+//                                    sources: string[], names: string[],
+//                                    mappings: MappingTables}
+//
+// Reads a source map file with ReadSourceMap().
+NAN_METHOD(ParseSourceMapFile);
+
+#endif  // PPROF_BINDINGS_SOURCE_MAP_DECODER_H_
@@ -0,0 +1,177 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "v8-shim.h"
+
+#include <algorithm>
+
+using namespace v8;
+
+std::vector<ProfileLineTick> GetLineTicks(const CpuProfileNode* node) {
+  std::vector<ProfileLineTick> ticks;
+#if NODE_MODULE_VERSION > NODE_11_0_MODULE_VERSION
+  unsigned int count = node->GetHitLineCount();
+  if (count > 0) {
+    std::vector<CpuProfileNode::LineTick> lineTicks(count);
+    node->GetLineTicks(&lineTicks[0], count);
+    for (const CpuProfileNode::LineTick& tick : lineTicks) {
+      ticks.push_back({tick.line, tick.hit_count});
+    }
+  }
+#endif
+  return ticks;
+}
+
+void DefineProperties(Local<Object> object, const Local<String>* keys,
+                      const Local<Value>* values, size_t count) {
+  Local<Context> context = Nan::GetCurrentContext();
+  for (size_t i = 0; i < count; i++) {
+    object->CreateDataProperty(context, keys[i], values[i]).FromJust();
+  }
+}
+
+CpuProfilers::CpuProfilers(Isolate* isolate) : isolate_(isolate) {
+#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
+  // A profiler is created when profiling is started.
+#elif NODE_MODULE_VERSION > NODE_8_0_MODULE_VERSION
+  profiler_ = CpuProfiler::New(isolate);
+#else
+  profiler_ = isolate->GetCpuProfiler();
+#endif
+}
+
+void CpuProfilers::SetSamplingInterval(int intervalMicros) {
+  samplingIntervalMicros_ = intervalMicros;
+#if NODE_MODULE_VERSION < NODE_12_0_MODULE_VERSION
+  profiler_->SetSamplingInterval(intervalMicros);
+#endif
+}
+
+const char* CpuProfilers::StartProfiling(Local<String> name,
+                                         bool includeLineInfo,
+                                         bool newProfiler,
+                                         bool recordSamples) {
+#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
+  std::string runName = *Nan::Utf8String(name);
+  if (running_.count(runName)) {
+    return "A CPU profile with this name is already running.";
+  }
+  if (newProfiler) {
+    // Profiles running on the previous profiler keep it alive until they are
+    // stopped.
+    current_ = NULL;
+  }
+  if (!current_) {
+    current_ = CpuProfiler::New(isolate_);
+    current_->SetSamplingInterval(samplingIntervalMicros_);
+  }
+  running_[runName] = current_;
+  CpuProfiler* profiler = current_;
+#else
+  CpuProfiler* profiler = profiler_;
+  runningCount_++;
+#endif
+
+#if NODE_MODULE_VERSION > NODE_11_0_MODULE_VERSION
+  if (includeLineInfo) {
+    profiler->StartProfiling(name, CpuProfilingMode::kCallerLineNumbers,
+                             recordSamples);
+    return NULL;
+  }
+#endif
+  profiler->StartProfiling(name, recordSamples);
+  return NULL;
+}
+
+bool CpuProfilers::IsProfiling() const {
+#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
+  return !running_.empty();
+#else
+  return runningCount_ > 0;
+#endif
+}
+
+CpuProfile* CpuProfilers::StopProfiling(Local<String> name) {
+#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
+  auto it = running_.find(*Nan::Utf8String(name));
+  if (it == running_.end()) {
+    return NULL;
+  }
+  CpuProfiler* profiler = it->second;
+  running_.erase(it);
+  CpuProfile* profile = profiler->StopProfiling(name);
+  if (profile) {
+    stopped_[profile] = profiler;
+  }
+  return profile;
+#else
+  CpuProfile* profile = profiler_->StopProfiling(name);
+  if (profile) {
+    runningCount_--;
+  }
+  return profile;
+#endif
+}
+
+void CpuProfilers::DeleteProfile(CpuProfile* profile) {
+  profile->Delete();
+#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
+  auto it = stopped_.find(profile);
+  CpuProfiler* profiler = it->second;
+  stopped_.erase(it);
+  for (const auto& running : running_) {
+    if (running.second == profiler) {
+      return;
+    }
+  }
+  for (const auto& other : stopped_) {
+    if (other.second == profiler) {
+      return;
+    }
+  }
+  if (profiler == current_) {
+    current_ = NULL;
+  }
+  profiler->Dispose();
+#endif
+}
+
+void CpuProfilers::Dispose() {
+#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
+  // Profiles still running are stopped first, since a profiler cannot be
+  // disposed of while it is profiling.
+  std::vector<CpuProfiler*> profilers;
+  if (current_) {
+    profilers.push_back(current_);
+  }
+  for (const auto& running : running_) {
+    CpuProfile* profile = running.second->StopProfiling(
+        Nan::New<String>(running.first).ToLocalChecked());
+    if (profile) {
+      profile->Delete();
+    }
+    if (std::find(profilers.begin(), profilers.end(), running.second) ==
+        profilers.end()) {
+      profilers.push_back(running.second);
+    }
+  }
+  for (CpuProfiler* profiler : profilers) {
+    profiler->Dispose();
+  }
+  current_ = NULL;
+  running_.clear();
+#endif
+}
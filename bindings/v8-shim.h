@@ -0,0 +1,127 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A thin layer over the V8 APIs used by the profilers which differ between
+// the versions of V8 in the supported versions of Node, so that the rest of
+// the addon does not test NODE_MODULE_VERSION. The CPU and heap profilers
+// are not part of N-API, so the addon is still built for each version.
+
+#ifndef PPROF_BINDINGS_V8_SHIM_H_
+#define PPROF_BINDINGS_V8_SHIM_H_
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "nan.h"
+#include "v8-profiler.h"
+
+// Whether CPU profiles can have line level accurate line numbers, i.e. the
+// hits of each node by line, and the line from which each node was called.
+// Not available in Node 11 or earlier.
+constexpr bool kCallerLineNumbersSupported =
+    NODE_MODULE_VERSION > NODE_11_0_MODULE_VERSION;
+
+// Hits of a node of a CPU profile on one line of its function.
+struct ProfileLineTick {
+  int line;
+  unsigned int hitCount;
+};
+
+// Returns the hits of node by line, or none if kCallerLineNumbersSupported
+// is false.
+std::vector<ProfileLineTick> GetLineTicks(const v8::CpuProfileNode* node);
+
+// Creates the given data properties on object, one CreateDataProperty() call
+// per key. Unlike Nan::Set(), this does not look up the prototype chain for
+// setters, so it is cheaper for the many objects of a translated profile.
+// V8 has no call which adds several properties to an existing object at once.
+void DefineProperties(v8::Local<v8::Object> object,
+                      const v8::Local<v8::String>* keys,
+                      const v8::Local<v8::Value>* values, size_t count);
+
+// The CPU profilers of an isolate, on which profiles are started and stopped
+// by name.
+//
+// In Node 12 and later, a CPU profiler is disposed of once no profile is
+// running on it, and a new one is created when profiling is next started, to
+// work around https://bugs.chromium.org/p/v8/issues/detail?id=11051.
+//
+// When profiling continuously, the next profile is started before the
+// previous one is stopped, so that there is no gap between them and the
+// profiler keeps running. The next profile may also be started on a new
+// profiler, which is how its sampling interval is changed; the previous
+// profiler is disposed of once the profile still running on it is stopped.
+//
+// In Node 11 and earlier, there is one profiler for the lifetime of the
+// isolate. It is not disposed of, since profiles which are still running
+// cannot be stopped when the isolate exits.
+class CpuProfilers {
+ public:
+  explicit CpuProfilers(v8::Isolate* isolate);
+
+  CpuProfilers(const CpuProfilers&) = delete;
+  CpuProfilers& operator=(const CpuProfilers&) = delete;
+
+  // Sampling interval in microseconds of the profiles started next.
+  int SamplingIntervalMicros() const { return samplingIntervalMicros_; }
+
+  // Sets the sampling interval of the profiles started on a new profiler. In
+  // Node 11 and earlier, this also changes the interval of running profiles.
+  void SetSamplingInterval(int intervalMicros);
+
+  // Starts a profile with the given name. When newProfiler is true, it is
+  // started on a new CPU profiler (Node 12 and later). When includeLineInfo
+  // is true and kCallerLineNumbersSupported, its nodes have line level
+  // accurate line numbers. Returns an error message, or NULL if the profile
+  // was started.
+  const char* StartProfiling(v8::Local<v8::String> name, bool includeLineInfo,
+                             bool newProfiler, bool recordSamples);
+
+  // Returns true if a profile is running.
+  bool IsProfiling() const;
+
+  // Stops the profile with the given name, which must then be released with
+  // DeleteProfile(). Returns NULL if no profile with this name is running.
+  v8::CpuProfile* StopProfiling(v8::Local<v8::String> name);
+
+  // Releases a profile returned by StopProfiling(), and the profiler it ran
+  // on once no other profile is running on it.
+  void DeleteProfile(v8::CpuProfile* profile);
+
+  // Stops the running profiles and disposes of the profilers, when the
+  // environment of the isolate exits.
+  void Dispose();
+
+ private:
+  v8::Isolate* isolate_;
+  int samplingIntervalMicros_ = 1000;
+#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
+  // The profiler on which profiles are started, or NULL until one is.
+  v8::CpuProfiler* current_ = NULL;
+  // Running profiles, by name, and the profiler each is running on.
+  std::unordered_map<std::string, v8::CpuProfiler*> running_;
+  // Stopped profiles not yet deleted, and the profiler each ran on.
+  std::unordered_map<v8::CpuProfile*, v8::CpuProfiler*> stopped_;
+#else
+  v8::CpuProfiler* profiler_;
+  // Number of running profiles.
+  int runningCount_ = 0;
+#endif
+};
+
+#endif  // PPROF_BINDINGS_V8_SHIM_H_
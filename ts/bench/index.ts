@@ -0,0 +1,203 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks the stages of collecting and serializing profiles. Each stage
+// runs in a process of its own, so that its peak RSS is its own.
+//
+// Usage: npm run bench -- [--stages=name,...] [--width=4] [--depth=8]
+//   [--strings=1000] [--iterations=10] [--workload=calltree|busybench]
+//   [--workloadMillis=500] [--json]
+
+import {fork} from 'child_process';
+import delay from 'delay';
+import {monitorEventLoopDelay} from 'perf_hooks';
+
+import {BenchOptions, stages} from './stages';
+
+const RUN_STAGE = '--run-stage';
+const MIB = 1024 * 1024;
+
+const DEFAULT_OPTIONS: BenchOptions = {
+  width: 4,
+  depth: 8,
+  strings: 1000,
+  iterations: 10,
+  workload: 'calltree',
+  workloadMillis: 500,
+  intervalMicros: 1000,
+  intervalBytes: 16 * 1024,
+};
+
+interface StageResult {
+  stage: string;
+  /** Wall times of the runs, in milliseconds. */
+  millis: number[];
+  /** Peak RSS of the process, in bytes. */
+  peakRss: number;
+  /** Growth of the peak RSS during the runs, in bytes. */
+  rssGrowth: number;
+  /** Longest time for which the event loop was blocked, in milliseconds. */
+  maxBlockedMillis: number;
+}
+
+function peakRss(): number {
+  return process.resourceUsage().maxRSS * 1024;
+}
+
+async function runStage(
+  name: string,
+  options: BenchOptions
+): Promise<StageResult> {
+  const gc = (global as unknown as {gc?: () => void}).gc;
+  const {before, run} = await stages[name].setup(options);
+  const rssBefore = peakRss();
+  const histogram = monitorEventLoopDelay({resolution: 1});
+  const millis: number[] = [];
+  for (let i = 0; i < options.iterations; i++) {
+    if (before) {
+      before();
+    }
+    if (gc) {
+      gc();
+    }
+    histogram.enable();
+    const start = process.hrtime();
+    await run();
+    const [seconds, nanos] = process.hrtime(start);
+    millis.push(seconds * 1000 + nanos / 1e6);
+    // Lets the histogram record the delay of a run which blocked the loop.
+    await delay(10);
+    histogram.disable();
+  }
+  return {
+    stage: name,
+    millis,
+    peakRss: peakRss(),
+    rssGrowth: peakRss() - rssBefore,
+    maxBlockedMillis: histogram.max / 1e6,
+  };
+}
+
+function forkStage(
+  name: string,
+  options: BenchOptions
+): Promise<StageResult> {
+  return new Promise((resolve, reject) => {
+    const args = [RUN_STAGE, name, JSON.stringify(options)];
+    const child = fork(__filename, args, {execArgv: ['--expose-gc']});
+    let result: StageResult | undefined;
+    child.on('message', message => {
+      result = message as StageResult;
+    });
+    child.on('error', reject);
+    child.on('exit', code => {
+      if (result) {
+        resolve(result);
+      } else {
+        reject(new Error(`stage ${name} exited with code ${code}`));
+      }
+    });
+  });
+}
+
+function parseArgs(args: string[]) {
+  const options: BenchOptions = {...DEFAULT_OPTIONS};
+  let names = Object.keys(stages);
+  let json = false;
+  for (const arg of args) {
+    const [key, value] = arg.replace(/^--/, '').split('=');
+    if (key === 'stages') {
+      names = value.split(',');
+      for (const name of names) {
+        if (!stages[name]) {
+          throw new Error(`unknown stage ${name}`);
+        }
+      }
+    } else if (key === 'json') {
+      json = true;
+    } else if (key === 'workload') {
+      if (value !== 'calltree' && value !== 'busybench') {
+        throw new Error(`unknown workload ${value}`);
+      }
+      options.workload = value;
+    } else if (key in options && !isNaN(Number(value))) {
+      (options as unknown as {[key: string]: number})[key] = Number(value);
+    } else {
+      throw new Error(`invalid argument ${arg}`);
+    }
+  }
+  return {options, names, json};
+}
+
+function median(values: number[]): number {
+  const sorted = values.slice().sort((a, b) => a - b);
+  return sorted[Math.floor(sorted.length / 2)];
+}
+
+function pad(str: string, width: number): string {
+  return str.length < width ? ' '.repeat(width - str.length) + str : str;
+}
+
+function printResults(results: StageResult[]) {
+  const header = ['median ms', 'min ms', 'max ms', 'RSS MiB', '+RSS MiB'];
+  const nameWidth = Math.max(...results.map(r => r.stage.length));
+  console.log(
+    [' '.repeat(nameWidth), ...header, 'blocked ms']
+      .map((str, i) => (i === 0 ? str : pad(str, 10)))
+      .join(' ')
+  );
+  for (const result of results) {
+    const columns = [
+      median(result.millis),
+      Math.min(...result.millis),
+      Math.max(...result.millis),
+      result.peakRss / MIB,
+      result.rssGrowth / MIB,
+      result.maxBlockedMillis,
+    ].map(value => pad(value.toFixed(1), 10));
+    const name = result.stage + ' '.repeat(nameWidth - result.stage.length);
+    console.log([name, ...columns].join(' '));
+  }
+}
+
+async function main(args: string[]) {
+  if (args[0] === RUN_STAGE) {
+    const result = await runStage(args[1], JSON.parse(args[2]));
+    // The IPC channel would otherwise keep the process running.
+    process.send!(result, () => process.disconnect());
+    return;
+  }
+  const {options, names, json} = parseArgs(args);
+  const results: StageResult[] = [];
+  for (const name of names) {
+    results.push(await forkStage(name, options));
+  }
+  if (json) {
+    console.log(JSON.stringify({options, results}, null, 2));
+  } else {
+    console.log(
+      `width ${options.width}, depth ${options.depth}, ` +
+        `${options.strings} strings, ${options.iterations} iterations, ` +
+        `${options.workload} workload`
+    );
+    printResults(results);
+  }
+}
+
+main(process.argv.slice(2)).catch(err => {
+  console.error(err);
+  process.exitCode = 1;
+});
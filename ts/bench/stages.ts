@@ -0,0 +1,225 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+import * as tmp from 'tmp';
+
+import * as heapProfiler from '../src/heap-profiler';
+import {ProfileAggregator} from '../src/profile-aggregator';
+import {encode} from '../src/profile-encoder';
+import {
+  serializeHeapProfile,
+  serializeHeapProfileColumns,
+  serializeTimeProfile,
+  serializeTimeProfileColumns,
+} from '../src/profile-serializer';
+import {SourceMapper} from '../src/sourcemapper/sourcemapper';
+import * as timeProfiler from '../src/time-profiler';
+import {
+  createHeapProfile,
+  createTimeProfile,
+  heapProfileColumns,
+  timeProfileColumns,
+  TreeShape,
+  writeSourceMaps,
+} from './synthetic';
+import {runBusyLoop, runCallTree} from './workloads';
+
+export interface BenchOptions extends TreeShape {
+  /** Number of timed runs of each stage. */
+  iterations: number;
+  /** Workload profiled by the stages which translate profiles of V8. */
+  workload: 'calltree' | 'busybench';
+  /** Time for which the workload runs before each run of those stages. */
+  workloadMillis: number;
+  intervalMicros: number;
+  intervalBytes: number;
+}
+
+/** One timed run of a stage. */
+export interface StageRun {
+  /** Untimed work before the run, such as running the workload. */
+  before?: () => void;
+  /** The work which is measured. */
+  run: () => unknown;
+}
+
+export interface Stage {
+  description: string;
+  /** Prepares the stage once, before its runs. */
+  setup(options: BenchOptions): Promise<StageRun>;
+}
+
+function runWorkload(options: BenchOptions) {
+  if (options.workload === 'busybench') {
+    runBusyLoop(options.workloadMillis);
+  } else {
+    runCallTree(options, options.workloadMillis);
+  }
+}
+
+// Each run translates the profile of the workload which ran before it.
+function timeTranslation(
+  start: (options: BenchOptions) => () => unknown
+): Stage['setup'] {
+  return async options => {
+    let stop: () => unknown;
+    return {
+      before: () => {
+        stop = start(options);
+        runWorkload(options);
+      },
+      run: () => stop(),
+    };
+  };
+}
+
+function heapTranslation(translate: () => unknown): Stage['setup'] {
+  return async options => {
+    heapProfiler.start(options.intervalBytes, 64);
+    return {
+      before: () => runWorkload(options),
+      run: translate,
+    };
+  };
+}
+
+async function sourceMapper(
+  options: BenchOptions,
+  lazy: boolean
+): Promise<{scriptDir: string; mapper: SourceMapper}> {
+  tmp.setGracefulCleanup();
+  const scriptDir = tmp.dirSync({unsafeCleanup: true}).name;
+  writeSourceMaps(options, scriptDir);
+  const mapper = await SourceMapper.create([scriptDir], {lazy});
+  return {scriptDir, mapper};
+}
+
+function sourceMappedSerialization(lazy: boolean): Stage['setup'] {
+  return async options => {
+    const {scriptDir, mapper} = await sourceMapper(options, lazy);
+    const prof = createTimeProfile(options, scriptDir);
+    return {
+      run: () => serializeTimeProfile(prof, options.intervalMicros, mapper),
+    };
+  };
+}
+
+export const stages: {[name: string]: Stage} = {
+  'time-translate': {
+    description: 'StopProfiling translation of a V8 time profile',
+    setup: timeTranslation(options =>
+      timeProfiler.startV8Profile(options.intervalMicros)
+    ),
+  },
+  'time-translate-columns': {
+    description: 'StopProfilingToColumns translation of a V8 time profile',
+    setup: timeTranslation(options =>
+      timeProfiler.startV8ProfileColumns(options.intervalMicros)
+    ),
+  },
+  'time-translate-pprof': {
+    description: 'StopProfilingToPprof serialization of a V8 time profile',
+    setup: timeTranslation(options =>
+      timeProfiler.startToPprof(options.intervalMicros)
+    ),
+  },
+  'time-translate-pprof-async': {
+    description: 'StopProfilingToPprofAsync copy, then worker serialization',
+    setup: timeTranslation(options =>
+      timeProfiler.startToPprofAsync(options.intervalMicros)
+    ),
+  },
+  'time-aggregate': {
+    description: 'StopProfilingToAggregate merge of a V8 time profile',
+    setup: timeTranslation(options =>
+      timeProfiler.startToAggregate(
+        new ProfileAggregator(),
+        options.intervalMicros
+      )
+    ),
+  },
+  'heap-translate': {
+    description: 'GetAllocationProfile translation of a V8 heap profile',
+    setup: heapTranslation(() => heapProfiler.v8Profile()),
+  },
+  'heap-translate-columns': {
+    description: 'GetAllocationProfileColumns translation',
+    setup: heapTranslation(() => heapProfiler.v8ProfileColumns()),
+  },
+  'heap-translate-pprof-async': {
+    description: 'GetAllocationProfileToPprofAsync copy and serialization',
+    setup: heapTranslation(() => heapProfiler.profileToPprof()),
+  },
+  'heap-aggregate': {
+    description: 'AddAllocationProfileToAggregate merge of a V8 heap profile',
+    setup: async options => {
+      const aggregator = new ProfileAggregator();
+      return heapTranslation(() => heapProfiler.addToAggregate(aggregator))(
+        options
+      );
+    },
+  },
+  'serialize-time': {
+    description: 'serializeTimeProfile of a synthetic tree',
+    setup: async options => {
+      const prof = createTimeProfile(options, '/bench');
+      return {run: () => serializeTimeProfile(prof, options.intervalMicros)};
+    },
+  },
+  'serialize-time-columns': {
+    description: 'serializeTimeProfileColumns of a synthetic tree',
+    setup: async options => {
+      const prof = timeProfileColumns(createTimeProfile(options, '/bench'));
+      return {
+        run: () => serializeTimeProfileColumns(prof, options.intervalMicros),
+      };
+    },
+  },
+  'serialize-heap': {
+    description: 'serializeHeapProfile of a synthetic tree',
+    setup: async options => {
+      const prof = createHeapProfile(options, '/bench');
+      return {
+        run: () => serializeHeapProfile(prof, 0, options.intervalBytes),
+      };
+    },
+  },
+  'serialize-heap-columns': {
+    description: 'serializeHeapProfileColumns of a synthetic tree',
+    setup: async options => {
+      const prof = heapProfileColumns(createHeapProfile(options, '/bench'));
+      return {
+        run: () => serializeHeapProfileColumns(prof, 0, options.intervalBytes),
+      };
+    },
+  },
+  'source-map': {
+    description: 'serializeTimeProfile with source maps parsed up front',
+    setup: sourceMappedSerialization(false),
+  },
+  'source-map-lazy': {
+    description: 'serializeTimeProfile with lazily parsed source maps',
+    setup: sourceMappedSerialization(true),
+  },
+  encode: {
+    description: 'encode of a serialized synthetic time profile',
+    setup: async options => {
+      const prof = createTimeProfile(options, '/bench');
+      const profile = serializeTimeProfile(prof, options.intervalMicros);
+      return {run: () => encode(profile)};
+    },
+  },
+};
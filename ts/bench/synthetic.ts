@@ -0,0 +1,255 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+import * as fs from 'fs';
+import * as path from 'path';
+import {SourceMapGenerator} from 'source-map';
+
+import {bucketAllocations} from '../src/profile-serializer';
+import {
+  AllocationProfileColumns,
+  AllocationProfileNode,
+  ProfileNode,
+  TimeProfile,
+  TimeProfileColumns,
+  TimeProfileNode,
+} from '../src/v8-types';
+
+/** Shape of a synthetic profile tree. */
+export interface TreeShape {
+  /** Number of children of each node which is not a leaf. */
+  width: number;
+  /** Number of levels below the root. */
+  depth: number;
+  /** Number of distinct function names; scripts are a tenth as many. */
+  strings: number;
+}
+
+// Lines of each synthetic script, which each have one source mapping.
+const SCRIPT_LINES = 1000;
+
+/**
+ * Deterministic pseudorandom numbers (a 32-bit xorshift), so that each run
+ * translates the same trees.
+ */
+export class Random {
+  constructor(private state = 0x2545f491) {}
+
+  /** @return an integer in [0, bound). */
+  next(bound: number): number {
+    let x = this.state;
+    x ^= x << 13;
+    x ^= x >>> 17;
+    x ^= x << 5;
+    this.state = x >>> 0;
+    return this.state % bound;
+  }
+}
+
+function scriptCount(shape: TreeShape): number {
+  return Math.max(1, Math.ceil(shape.strings / 10));
+}
+
+/** @return path of the given synthetic script in scriptDir. */
+export function scriptPath(scriptDir: string, script: number): string {
+  return path.join(scriptDir, `script${script}.js`);
+}
+
+function createTree<T extends ProfileNode>(
+  shape: TreeShape,
+  scriptDir: string,
+  createNode: (node: ProfileNode, random: Random) => T
+): T {
+  const random = new Random();
+  const newNode = () => {
+    const script = random.next(scriptCount(shape));
+    return createNode(
+      {
+        name: `function${random.next(shape.strings)}`,
+        scriptName: scriptPath(scriptDir, script),
+        scriptId: script + 1,
+        lineNumber: random.next(SCRIPT_LINES) + 1,
+        columnNumber: random.next(80) + 1,
+        children: [],
+      },
+      random
+    );
+  };
+  const root = createNode(
+    {
+      name: '(root)',
+      scriptName: '',
+      scriptId: 0,
+      lineNumber: 0,
+      columnNumber: 0,
+      children: [],
+    },
+    random
+  );
+  const pending = [{node: root as ProfileNode, depth: 0}];
+  while (pending.length > 0) {
+    const {node, depth} = pending.pop()!;
+    if (depth === shape.depth) {
+      continue;
+    }
+    for (let i = 0; i < shape.width; i++) {
+      const child = newNode();
+      node.children.push(child);
+      pending.push({node: child, depth: depth + 1});
+    }
+  }
+  return root;
+}
+
+/** @return a time profile whose tree has the given shape. */
+export function createTimeProfile(
+  shape: TreeShape,
+  scriptDir: string
+): TimeProfile {
+  const topDownRoot = createTree<TimeProfileNode>(
+    shape,
+    scriptDir,
+    (node, random) => ({...node, hitCount: random.next(10)})
+  );
+  return {startTime: 0, endTime: 10 * 1000 * 1000, topDownRoot};
+}
+
+/** @return a heap profile whose tree has the given shape. */
+export function createHeapProfile(
+  shape: TreeShape,
+  scriptDir: string
+): AllocationProfileNode {
+  return createTree<AllocationProfileNode>(shape, scriptDir, (node, random) => {
+    const allocations = [];
+    for (let i = random.next(3); i > 0; i--) {
+      allocations.push({
+        sizeBytes: 8 * (random.next(128) + 1),
+        count: random.next(16) + 1,
+      });
+    }
+    return {...node, allocations};
+  });
+}
+
+// Translates a tree into columns, in the order in which the native module
+// translates the trees of V8.
+function nodeColumns<T extends ProfileNode>(root: T) {
+  const strings: string[] = [];
+  const stringIndices = new Map<string, number>();
+  const stringIndex = (str: string) => {
+    let index = stringIndices.get(str);
+    if (index === undefined) {
+      index = strings.length;
+      strings.push(str);
+      stringIndices.set(str, index);
+    }
+    return index;
+  };
+  const ordered: T[] = [];
+  const parents: number[] = [];
+  const pending = [{node: root, parent: -1}];
+  while (pending.length > 0) {
+    const {node, parent} = pending.pop()!;
+    const index = ordered.length;
+    ordered.push(node);
+    parents.push(parent);
+    for (const child of node.children as T[]) {
+      pending.push({node: child, parent: index});
+    }
+  }
+  const nodes = {
+    parents: Int32Array.from(parents),
+    names: Int32Array.from(ordered, node => stringIndex(node.name || '')),
+    scriptNames: Int32Array.from(ordered, node => stringIndex(node.scriptName)),
+    scriptIds: Int32Array.from(ordered, node => node.scriptId || 0),
+    lineNumbers: Int32Array.from(ordered, node => node.lineNumber || 0),
+    columnNumbers: Int32Array.from(ordered, node => node.columnNumber || 0),
+  };
+  return {strings, ordered, nodes};
+}
+
+/** @return the time profile with its tree translated into columns. */
+export function timeProfileColumns(prof: TimeProfile): TimeProfileColumns {
+  const {strings, ordered, nodes} = nodeColumns(prof.topDownRoot);
+  return {
+    startTime: prof.startTime,
+    endTime: prof.endTime,
+    strings,
+    nodes: {
+      ...nodes,
+      hitCounts: Int32Array.from(
+        ordered,
+        node => (node as TimeProfileNode).hitCount
+      ),
+    },
+  };
+}
+
+/** @return the heap profile with its tree translated into columns. */
+export function heapProfileColumns(
+  root: AllocationProfileNode
+): AllocationProfileColumns {
+  const {strings, ordered, nodes} = nodeColumns(root);
+  const allocationNodes: number[] = [];
+  const buckets: number[] = [];
+  const counts: number[] = [];
+  const bytes: number[] = [];
+  ordered.forEach((node, index) => {
+    for (const bucket of bucketAllocations(node.allocations)) {
+      allocationNodes.push(index);
+      buckets.push(bucket.bucket);
+      counts.push(bucket.count);
+      bytes.push(bucket.bytes);
+    }
+  });
+  return {
+    strings,
+    nodes,
+    allocations: {
+      nodes: Int32Array.from(allocationNodes),
+      buckets: Float64Array.from(buckets),
+      counts: Uint32Array.from(counts),
+      bytes: Float64Array.from(bytes),
+    },
+  };
+}
+
+/**
+ * Writes the scripts which the nodes of synthetic trees refer to into
+ * scriptDir, each with a source map which maps every line to a line of a
+ * TypeScript source.
+ */
+export function writeSourceMaps(shape: TreeShape, scriptDir: string) {
+  const random = new Random();
+  for (let script = 0; script < scriptCount(shape); script++) {
+    const file = path.basename(scriptPath(scriptDir, script));
+    const generator = new SourceMapGenerator({file});
+    for (let line = 1; line <= SCRIPT_LINES; line++) {
+      generator.addMapping({
+        generated: {line, column: 0},
+        original: {line: random.next(10 * SCRIPT_LINES) + 1, column: 0},
+        source: `src/source${script}.ts`,
+        name: `function${random.next(shape.strings)}`,
+      });
+    }
+    const code = new Array(SCRIPT_LINES).fill('//').join('\n');
+    fs.writeFileSync(path.join(scriptDir, file), code);
+    fs.writeFileSync(
+      path.join(scriptDir, `${file}.map`),
+      generator.toString()
+    );
+  }
+}
@@ -0,0 +1,79 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+import {Random, TreeShape} from './synthetic';
+
+type Frame = (depth: number, seed: number) => number;
+
+/**
+ * Runs JavaScript whose call tree has about the given shape, so that the
+ * profiles V8 collects from it have trees to translate of that shape: each
+ * function calls `width` of `strings` distinct functions, `depth` deep,
+ * and the leaves allocate. Returns once durationMillis have passed.
+ */
+export function runCallTree(shape: TreeShape, durationMillis: number) {
+  const frames: Frame[] = [];
+  const call: Frame = (depth, seed) => {
+    if (depth === 0) {
+      const values = new Array<number>(64).fill(seed);
+      return values.reduce((sum, value) => sum + Math.sqrt(value), 0);
+    }
+    let sum = 0;
+    for (let i = 0; i < shape.width; i++) {
+      const next = (seed * 31 + i) % frames.length;
+      sum += frames[next](depth - 1, next + 1);
+    }
+    return sum;
+  };
+  const random = new Random();
+  for (let i = 0; i < Math.max(1, shape.strings); i++) {
+    // Each function has its own name and code, so V8 does not merge them.
+    frames.push(
+      new Function(
+        'call',
+        `return function function${i}(depth, seed) {
+          return call(depth, seed + ${random.next(1000)});
+        };`
+      )(call)
+    );
+  }
+  const end = Date.now() + durationMillis;
+  let sum = 0;
+  for (let seed = 1; Date.now() < end; seed++) {
+    sum += call(shape.depth, seed);
+  }
+  return sum;
+}
+
+/**
+ * Runs the loop of the busybench system test: fills 16 MiB of arrays with
+ * numbers until durationMillis have passed.
+ */
+export function runBusyLoop(durationMillis: number) {
+  const arrays: number[][] = [];
+  for (let i = 0; i < 16 * 16; i++) {
+    arrays[i] = new Array<number>(64 * 1024).fill(i);
+  }
+  const end = Date.now() + durationMillis;
+  while (Date.now() < end) {
+    for (let i = 0; i < arrays.length; i++) {
+      for (let j = 0; j < arrays[i].length; j++) {
+        arrays[i][j] = Math.sqrt(j * arrays[i][j]);
+      }
+    }
+  }
+  return arrays.length;
+}
@@ -0,0 +1,193 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+import {ProfileStats} from './profiler-stats';
+
+export interface AdaptiveIntervalOptions {
+  /**
+   * Fraction of wall time which the profiler may cost: 0.01 (the default)
+   * is 1%.
+   */
+  targetOverhead?: number;
+  /** Shortest sampling interval in microseconds; 1000 by default. */
+  minIntervalMicros?: number;
+  /** Longest sampling interval in microseconds; 100000 by default. */
+  maxIntervalMicros?: number;
+  /**
+   * Estimated cost in nanoseconds of taking one sample, used only where the
+   * profiler cannot measure it, i.e. when the sampleNanos of the stats of a
+   * window is -1, as on Windows; 10000 by default.
+   */
+  sampleCostNanos?: number;
+}
+
+// The interval changes by at most this factor from one window to the next,
+// so that a window whose cost is unusual does not make it oscillate.
+const MAX_INTERVAL_STEP = 2;
+
+/**
+ * Chooses the sampling interval of the time profiler for each profile, or
+ * window, from what the previous windows cost, so that the profiler costs
+ * about the target overhead. The cost of a window is the time taken to
+ * collect and serialize its profile, plus the CPU time the profiled thread
+ * spent taking its samples, all as measured by the profiler. Where the cost
+ * of the samples is not measured, it is estimated from their number. Since
+ * the number of samples, and so most of the cost, is inversely proportional
+ * to the interval, the interval is scaled by the ratio of the overhead of
+ * the last window to the target.
+ */
+export class AdaptiveInterval {
+  readonly targetOverhead: number;
+  readonly minIntervalMicros: number;
+  readonly maxIntervalMicros: number;
+  readonly sampleCostNanos: number;
+  private interval: number;
+
+  constructor(options: AdaptiveIntervalOptions = {}) {
+    this.targetOverhead = options.targetOverhead || 0.01;
+    this.minIntervalMicros = options.minIntervalMicros || 1000;
+    this.maxIntervalMicros = Math.max(
+      options.maxIntervalMicros || 100000,
+      this.minIntervalMicros
+    );
+    this.sampleCostNanos =
+      options.sampleCostNanos === undefined ? 10000 : options.sampleCostNanos;
+    this.interval = this.minIntervalMicros;
+  }
+
+  /** Sampling interval in microseconds of the next window. */
+  get intervalMicros(): number {
+    return this.interval;
+  }
+
+  /**
+   * @return fraction of the window which collecting its profile cost, given
+   * its stats.
+   */
+  overhead(windowMicros: number, stats: ProfileStats): number {
+    const sampleNanos =
+      stats.sampleNanos >= 0
+        ? stats.sampleNanos
+        : stats.sampleCount * this.sampleCostNanos;
+    const costNanos =
+      stats.translateNanos +
+      stats.serializeNanos +
+      stats.encodeNanos +
+      sampleNanos;
+    return costNanos / (windowMicros * 1000);
+  }
+
+  /**
+   * Updates the interval of the next window from the stats of a window which
+   * lasted windowMicros and was sampled every intervalMicros.
+   * @return the interval of the next window.
+   */
+  update(
+    windowMicros: number,
+    intervalMicros: number,
+    stats: ProfileStats
+  ): number {
+    if (windowMicros <= 0) {
+      return this.interval;
+    }
+    const ratio = this.overhead(windowMicros, stats) / this.targetOverhead;
+    const step = Math.min(
+      Math.max(ratio, 1 / MAX_INTERVAL_STEP),
+      MAX_INTERVAL_STEP
+    );
+    this.interval = Math.round(
+      Math.min(
+        Math.max(intervalMicros * step, this.minIntervalMicros),
+        this.maxIntervalMicros
+      )
+    );
+    return this.interval;
+  }
+}
+
+export interface AdaptiveHeapIntervalOptions {
+  /** Fewest live samples wanted in a heap profile; 1000 by default. */
+  minSamples?: number;
+  /** Most live samples wanted in a heap profile; 10000 by default. */
+  maxSamples?: number;
+  /** Shortest sampling interval in bytes; 16 KiB by default. */
+  minIntervalBytes?: number;
+  /** Longest sampling interval in bytes; 16 MiB by default. */
+  maxIntervalBytes?: number;
+}
+
+/**
+ * Chooses the sampling interval of the heap profiler so that the number of
+ * live samples, which is what the sampling heap profiler keeps and what
+ * collecting a profile costs, stays within a target range. The number of
+ * live samples is estimated as the size of the live heap divided by the
+ * interval.
+ *
+ * The live samples of a profile are not used themselves: restarting the
+ * sampling heap profiler discards them, so the next profile only has samples
+ * of objects allocated since, however large the heap is.
+ *
+ * The interval of a running sampling heap profiler cannot be changed, so it
+ * is only changed when the estimated number of samples leaves the range, and
+ * the interval is then set to aim at the middle of the range.
+ */
+export class AdaptiveHeapInterval {
+  readonly minSamples: number;
+  readonly maxSamples: number;
+  readonly minIntervalBytes: number;
+  readonly maxIntervalBytes: number;
+
+  constructor(options: AdaptiveHeapIntervalOptions = {}) {
+    this.minSamples = options.minSamples || 1000;
+    this.maxSamples = Math.max(options.maxSamples || 10000, this.minSamples);
+    this.minIntervalBytes = options.minIntervalBytes || 16 * 1024;
+    this.maxIntervalBytes = Math.max(
+      options.maxIntervalBytes || 16 * 1024 * 1024,
+      this.minIntervalBytes
+    );
+  }
+
+  private clamp(intervalBytes: number): number {
+    return Math.round(
+      Math.min(
+        Math.max(intervalBytes, this.minIntervalBytes),
+        this.maxIntervalBytes
+      )
+    );
+  }
+
+  /**
+   * @return the interval at which a heap of heapBytes live bytes would have
+   * the number of samples in the middle of the range.
+   */
+  initialIntervalBytes(heapBytes: number): number {
+    return this.clamp((heapBytes * 2) / (this.minSamples + this.maxSamples));
+  }
+
+  /**
+   * @return the interval at which to restart the sampling heap profiler,
+   * given that it samples every intervalBytes a heap of heapBytes live
+   * bytes, or undefined if it should keep running.
+   */
+  update(intervalBytes: number, heapBytes: number): number | undefined {
+    const sampleCount = heapBytes / intervalBytes;
+    if (sampleCount >= this.minSamples && sampleCount <= this.maxSamples) {
+      return undefined;
+    }
+    const next = this.initialIntervalBytes(heapBytes);
+    return next === intervalBytes ? undefined : next;
+  }
+}
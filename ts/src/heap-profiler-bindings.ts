@@ -16,7 +16,14 @@
 
 import * as path from 'path';
 
-import {AllocationProfileNode} from './v8-types';
+import {NativeProfileAggregator} from './profile-aggregator-bindings';
+import {
+  AllocationProfileColumns,
+  AllocationProfileDelta,
+  AllocationProfileNode,
+  GzippedProfile,
+  TranslationStats,
+} from './v8-types';
 
 const binary = require('@mapbox/node-pre-gyp');
 const bindingPath = binary.find(
@@ -43,3 +50,75 @@ export function stopSamplingHeapProfiler() {
 export function getAllocationProfile(): AllocationProfileNode {
   return profiler.heapProfiler.getAllocationProfile();
 }
+
+export function getAllocationProfileColumns(
+  externalBytes = 0
+): AllocationProfileColumns {
+  return profiler.heapProfiler.getAllocationProfileColumns(externalBytes);
+}
+
+export function getTranslationStats(): TranslationStats {
+  return profiler.heapProfiler.getTranslationStats();
+}
+
+// The native module does not know why the sampling heap profiler was
+// restarted, so reset is left to the caller.
+export function getAllocationProfileDelta(): Omit<
+  AllocationProfileDelta,
+  'reset'
+> {
+  return profiler.heapProfiler.getAllocationProfileDelta();
+}
+
+export function getAllocationProfileToPprof(
+  intervalBytes: number,
+  timeNanos: number,
+  ignoreSamplePath: string | undefined,
+  externalBytes: number
+): Buffer {
+  return profiler.heapProfiler.getAllocationProfileToPprof(
+    intervalBytes,
+    timeNanos,
+    ignoreSamplePath || '',
+    externalBytes
+  );
+}
+
+export function getAllocationProfileToPprofAsync(
+  intervalBytes: number,
+  timeNanos: number,
+  ignoreSamplePath: string | undefined,
+  externalBytes: number
+): Promise<GzippedProfile> {
+  return new Promise((resolve, reject) => {
+    profiler.heapProfiler.getAllocationProfileToPprofAsync(
+      intervalBytes,
+      timeNanos,
+      ignoreSamplePath || '',
+      externalBytes,
+      (err: Error | null, buffer: Buffer, encodeNanos: number) => {
+        if (err) {
+          reject(err);
+        } else {
+          resolve({buffer, encodeNanos});
+        }
+      }
+    );
+  });
+}
+
+export function addAllocationProfileToAggregate(
+  intervalBytes: number,
+  timeNanos: number,
+  ignoreSamplePath: string | undefined,
+  externalBytes: number,
+  aggregator: NativeProfileAggregator
+) {
+  profiler.heapProfiler.addAllocationProfileToAggregate(
+    intervalBytes,
+    timeNanos,
+    ignoreSamplePath || '',
+    externalBytes,
+    aggregator
+  );
+}
@@ -14,20 +14,50 @@
  * limitations under the License.
  */
 
+import {getHeapStatistics} from 'v8';
+
 import {perftools} from '../../proto/profile';
 
+import {AdaptiveHeapInterval} from './adaptive-interval';
+
 import {
+  addAllocationProfileToAggregate,
   getAllocationProfile,
+  getAllocationProfileColumns,
+  getAllocationProfileDelta,
+  getAllocationProfileToPprofAsync,
+  getTranslationStats,
   startSamplingHeapProfiler,
   stopSamplingHeapProfiler,
 } from './heap-profiler-bindings';
-import {serializeHeapProfile} from './profile-serializer';
+import {ProfileAggregator} from './profile-aggregator';
+import {ProfileStreamWriter} from './profile-encoder';
+import {
+  SampleSink,
+  serializeHeapProfile,
+  serializeHeapProfileColumns,
+  sharedStringTable,
+} from './profile-serializer';
+import {
+  gzippedWithStats,
+  measureSerialization,
+  newProfileStats,
+  setProfileStats,
+} from './profiler-stats';
 import {SourceMapper} from './sourcemapper/sourcemapper';
-import {AllocationProfileNode} from './v8-types';
+import {
+  AllocationProfileColumns,
+  AllocationProfileDelta,
+  AllocationProfileNode,
+} from './v8-types';
 
 let enabled = false;
 let heapIntervalBytes = 0;
 let heapStackDepth = 0;
+let heapAdaptiveInterval: AdaptiveHeapInterval | undefined;
+// Whether the adaptive interval restarted the sampling heap profiler since
+// the last delta was collected.
+let restartedSinceDelta = false;
 
 /*
  * Collects a heap profile when heapProfiler is enabled. Otherwise throws
@@ -42,6 +72,39 @@ export function v8Profile(): AllocationProfileNode {
   return getAllocationProfile();
 }
 
+/**
+ * Collects a heap profile when heapProfiler is enabled, translated into
+ * columns rather than a tree of objects. Otherwise throws an error.
+ */
+export function v8ProfileColumns(): AllocationProfileColumns {
+  if (!enabled) {
+    throw new Error('Heap profiler is not enabled.');
+  }
+  return getAllocationProfileColumns();
+}
+
+/**
+ * Collects the changes in the heap profile since heap profiling was started,
+ * or since this was last called: the nodes and samples which were not
+ * reported before, and the IDs of reported samples which have been freed.
+ * The sampling heap profiler keeps running, and only the changes are copied
+ * out of V8. Throws an error if heap profiler is not enabled.
+ *
+ * When an adaptive interval restarts the sampling heap profiler, the samples
+ * reported so far are dropped, and the next delta has reset set: it starts
+ * over with every node and sample of the new profile.
+ *
+ * Requires Node 12 or later.
+ */
+export function v8ProfileDelta(): AllocationProfileDelta {
+  if (!enabled) {
+    throw new Error('Heap profiler is not enabled.');
+  }
+  const delta = {...getAllocationProfileDelta(), reset: restartedSinceDelta};
+  restartedSinceDelta = false;
+  return delta;
+}
+
 /**
  * Collects a profile and returns it serialized in pprof format.
  * Throws if heap profiler is not enabled.
@@ -52,14 +115,18 @@ export function v8Profile(): AllocationProfileNode {
 export function profile(
   ignoreSamplePath?: string,
   sourceMapper?: SourceMapper
+): perftools.profiles.IProfile {
+  return serializeProfile(ignoreSamplePath, sourceMapper);
+}
+
+function serializeProfile(
+  ignoreSamplePath?: string,
+  sourceMapper?: SourceMapper
 ): perftools.profiles.IProfile {
   const startTimeNanos = Date.now() * 1000 * 1000;
   const result = v8Profile();
   // Add node for external memory usage.
-  // Current type definitions do not have external.
-  // TODO: remove any once type definition is updated to include external.
-  // eslint-disable-next-line @typescript-eslint/no-explicit-any
-  const {external}: {external: number} = process.memoryUsage() as any;
+  const external = externalMemory();
   if (external > 0) {
     const externalNode: AllocationProfileNode = {
       name: '(external)',
@@ -69,13 +136,143 @@ export function profile(
     };
     result.children.push(externalNode);
   }
-  return serializeHeapProfile(
-    result,
+  const stats = newProfileStats(getTranslationStats());
+  const profile = measureSerialization(stats, sourceMapper, () =>
+    serializeHeapProfile(
+      result,
+      startTimeNanos,
+      heapIntervalBytes,
+      ignoreSamplePath,
+      sourceMapper,
+      sharedStringTable
+    )
+  );
+  setProfileStats(profile, stats);
+  adaptInterval();
+  return profile;
+}
+
+// Serializes a profile collected as columns, with the node for external
+// memory usage added by the native module.
+function serializeProfileColumns(
+  ignoreSamplePath?: string,
+  sourceMapper?: SourceMapper,
+  sampleSink?: SampleSink
+): perftools.profiles.IProfile {
+  if (!enabled) {
+    throw new Error('Heap profiler is not enabled.');
+  }
+  const startTimeNanos = Date.now() * 1000 * 1000;
+  const prof = getAllocationProfileColumns(externalMemory());
+  const stats = newProfileStats(getTranslationStats());
+  const profile = measureSerialization(stats, sourceMapper, () =>
+    serializeHeapProfileColumns(
+      prof,
+      startTimeNanos,
+      heapIntervalBytes,
+      ignoreSamplePath,
+      sourceMapper,
+      sharedStringTable,
+      sampleSink
+    )
+  );
+  setProfileStats(profile, stats);
+  adaptInterval();
+  return profile;
+}
+
+/**
+ * Collects a profile and returns it gzipped in pprof format, ready to be
+ * written to a file or uploaded. Throws if heap profiler is not enabled.
+ *
+ * Unless a source mapper is specified, the profile is serialized by the
+ * native module without first being translated into JavaScript objects, on
+ * a worker thread, so that only copying it out of V8 blocks the event loop.
+ * Otherwise, it is translated into columns, and samples are encoded and
+ * gzipped in chunks as they are serialized.
+ *
+ * @param ignoreSamplePath
+ * @param sourceMapper
+ */
+export async function profileToPprof(
+  ignoreSamplePath?: string,
+  sourceMapper?: SourceMapper
+): Promise<Buffer> {
+  if (sourceMapper) {
+    const writer = new ProfileStreamWriter();
+    return writer.finish(
+      serializeProfileColumns(ignoreSamplePath, sourceMapper, samples =>
+        writer.writeSamples(samples)
+      )
+    );
+  }
+  if (!enabled) {
+    throw new Error('Heap profiler is not enabled.');
+  }
+  const startTimeNanos = Date.now() * 1000 * 1000;
+  const gzipped = getAllocationProfileToPprofAsync(
+    heapIntervalBytes,
     startTimeNanos,
+    ignoreSamplePath,
+    externalMemory()
+  );
+  const stats = newProfileStats(getTranslationStats());
+  adaptInterval();
+  return gzippedWithStats(gzipped, stats);
+}
+
+/**
+ * Collects a profile and merges it into aggregator, natively, without
+ * translating or serializing it. The merged profile, collected with
+ * aggregator.flush(), is the sum of the profiles merged into it, as merged
+ * by pprof. Throws if heap profiler is not enabled.
+ *
+ * @param aggregator
+ * @param ignoreSamplePath
+ */
+export function addToAggregate(
+  aggregator: ProfileAggregator,
+  ignoreSamplePath?: string
+) {
+  if (!enabled) {
+    throw new Error('Heap profiler is not enabled.');
+  }
+  addAllocationProfileToAggregate(
     heapIntervalBytes,
+    Date.now() * 1000 * 1000,
     ignoreSamplePath,
-    sourceMapper
+    externalMemory(),
+    aggregator.native
+  );
+  adaptInterval();
+}
+
+// Restarts the sampling heap profiler at the interval chosen by the adaptive
+// interval, if any, from the size of the live heap once a profile has been
+// collected. Since that profile was sampled at the previous interval, its
+// period is the interval which was in effect.
+function adaptInterval() {
+  if (!heapAdaptiveInterval) {
+    return;
+  }
+  const next = heapAdaptiveInterval.update(
+    heapIntervalBytes,
+    getHeapStatistics().used_heap_size
   );
+  if (next !== undefined) {
+    stopSamplingHeapProfiler();
+    heapIntervalBytes = next;
+    startSamplingHeapProfiler(heapIntervalBytes, heapStackDepth);
+    restartedSinceDelta = true;
+  }
+}
+
+function externalMemory(): number {
+  // Current type definitions do not have external.
+  // TODO: remove any once type definition is updated to include external.
+  // eslint-disable-next-line @typescript-eslint/no-explicit-any
+  const {external}: {external: number} = process.memoryUsage() as any;
+  return external;
 }
 
 /**
@@ -83,17 +280,34 @@ export function profile(
  * the same parameters, this is a noop. If heap profiler has already been
  * started with different parameters, this throws an error.
  *
+ * When adaptiveInterval is set, the interval is chosen by it instead, from
+ * the size of the live heap as reported by V8's heap statistics: when start()
+ * is called, then each time a profile is collected. When the number of live
+ * samples which that size amounts to leaves the target range, the sampling
+ * heap profiler is restarted at a new interval after the profile is
+ * collected, which discards the samples of objects allocated until then.
+ * The period of each profile is the interval it was sampled at.
+ *
  * @param intervalBytes - average number of bytes between samples.
  * @param stackDepth - maximum stack depth for samples collected.
+ * @param adaptiveInterval - chooses intervalBytes from the live heap.
  */
-export function start(intervalBytes: number, stackDepth: number) {
+export function start(
+  intervalBytes: number,
+  stackDepth: number,
+  adaptiveInterval?: AdaptiveHeapInterval
+) {
   if (enabled) {
     throw new Error(
       `Heap profiler is already started  with intervalBytes ${heapIntervalBytes} and stackDepth ${stackDepth}`
     );
   }
-  heapIntervalBytes = intervalBytes;
+  heapIntervalBytes = adaptiveInterval
+    ? adaptiveInterval.initialIntervalBytes(getHeapStatistics().used_heap_size)
+    : intervalBytes;
   heapStackDepth = stackDepth;
+  heapAdaptiveInterval = adaptiveInterval;
+  restartedSinceDelta = false;
   startSamplingHeapProfiler(heapIntervalBytes, heapStackDepth);
   enabled = true;
 }
@@ -102,6 +316,7 @@ export function start(intervalBytes: number, stackDepth: number) {
 export function stop() {
   if (enabled) {
     enabled = false;
+    heapAdaptiveInterval = undefined;
     stopSamplingHeapProfiler();
   }
 }
@@ -18,21 +18,63 @@ import {writeFileSync} from 'fs';
 import * as heapProfiler from './heap-profiler';
 import {encodeSync} from './profile-encoder';
 import * as timeProfiler from './time-profiler';
-export {AllocationProfileNode, TimeProfileNode, ProfileNode} from './v8-types';
+export {
+  AllocationColumns,
+  AllocationProfileColumns,
+  AllocationProfileDelta,
+  AllocationProfileDeltaNode,
+  AllocationProfileDeltaSamples,
+  AllocationProfileNode,
+  TimeProfile,
+  TimeProfileColumns,
+  TimeProfileContextColumns,
+  TimeProfileNode,
+  TimeProfileNodeColumns,
+  TimeProfileNodeContext,
+  TimeProfileSamples,
+  TranslationStats,
+  ProfileNode,
+  ProfileNodeColumns,
+} from './v8-types';
 
+export {
+  AdaptiveHeapInterval,
+  AdaptiveHeapIntervalOptions,
+  AdaptiveInterval,
+  AdaptiveIntervalOptions,
+} from './adaptive-interval';
+export {
+  ProfileAggregator,
+  ProfileAggregatorOptions,
+} from './profile-aggregator';
 export {encode, encodeSync} from './profile-encoder';
-export {SourceMapper} from './sourcemapper/sourcemapper';
+export {ProfileStats, profileStats} from './profiler-stats';
+export {SourceMapper, SourceMapperOptions} from './sourcemapper/sourcemapper';
 
 export const time = {
   profile: timeProfiler.profile,
   start: timeProfiler.start,
+  profileToPprof: timeProfiler.profileToPprof,
+  startToPprof: timeProfiler.startToPprof,
+  startToPprofAsync: timeProfiler.startToPprofAsync,
+  startToAggregate: timeProfiler.startToAggregate,
+  profileAllThreads: timeProfiler.profileAllThreads,
+  v8Profile: timeProfiler.v8Profile,
+  startV8Profile: timeProfiler.startV8Profile,
+  v8ProfileColumns: timeProfiler.v8ProfileColumns,
+  startV8ProfileColumns: timeProfiler.startV8ProfileColumns,
+  setContext: timeProfiler.setContext,
 };
 
 export const heap = {
   start: heapProfiler.start,
   stop: heapProfiler.stop,
   profile: heapProfiler.profile,
+  profileToPprof: heapProfiler.profileToPprof,
+  addToAggregate: heapProfiler.addToAggregate,
   v8Profile: heapProfiler.v8Profile,
+  v8ProfileColumns: heapProfiler.v8ProfileColumns,
+  v8ProfileDelta: heapProfiler.v8ProfileDelta,
 };
 
 // If loaded with --require, start profiling.
@@ -0,0 +1,61 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+import * as path from 'path';
+import * as path from 'path';
+
+import {GzippedProfile} from './v8-types';
+
+const binary = require('@mapbox/node-pre-gyp');
+const bindingPath = binary.find(
+  path.resolve(path.join(__dirname, '../../package.json'))
+);
+const profiler = require(bindingPath);
+
+/**
+ * Native aggregator into which stopProfilingToAggregate() and
+ * addAllocationProfileToAggregate() merge profiles.
+ */
+export interface NativeProfileAggregator {
+  stackCount(): number;
+  profileCount(): number;
+  flushToPprofAsync(
+    callback: (err: Error | null, buffer: Buffer, encodeNanos: number) => void
+  ): void;
+}
+
+// Wrappers around the native profile aggregator.
+
+export function newProfileAggregator(
+  maxStacks: number
+): NativeProfileAggregator {
+  return new profiler.profileAggregator.ProfileAggregator(maxStacks);
+}
+
+export function flushToPprofAsync(
+  aggregator: NativeProfileAggregator
+): Promise<GzippedProfile> {
+  return new Promise((resolve, reject) => {
+    aggregator.flushToPprofAsync(
+      (err: Error | null, buffer: Buffer, encodeNanos: number) => {
+        if (err) {
+          reject(err);
+        } else {
+          resolve({buffer, encodeNanos});
+        }
+      }
+    );
+  });
+}
@@ -0,0 +1,76 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+import * as path from 'path';
+import {
+  flushToPprofAsync,
+  NativeProfileAggregator,
+  newProfileAggregator,
+} from './profile-aggregator-bindings';
+import {gzippedWithStats, newProfileStats} from './profiler-stats';
+
+export interface ProfileAggregatorOptions {
+  /**
+   * Maximum number of distinct stacks of the merged profile; there is no
+   * limit by default. Once a profile has been merged, the subtrees of the
+   * call tree with the least weight (wall time, or bytes of heap profiles)
+   * are folded into "(truncated)" nodes until there are at most maxStacks.
+   */
+  maxStacks?: number;
+}
+
+/**
+ * Merges successive time profiles, or successive heap profiles, into one
+ * profile, so that e.g. an hour of profiles collected every minute can be
+ * written or uploaded as a single compact profile. Profiles are merged by
+ * the native module, into a call tree keyed by the stack of each sample, as
+ * they are collected by time.startToAggregate() or heap.addToAggregate().
+ * The values of the samples of a stack with the same labels are added up.
+ */
+export class ProfileAggregator {
+  readonly maxStacks: number;
+  readonly native: NativeProfileAggregator;
+
+  constructor(options: ProfileAggregatorOptions = {}) {
+    this.maxStacks = options.maxStacks || 0;
+    this.native = newProfileAggregator(this.maxStacks);
+  }
+
+  /** Number of distinct stacks of the merged profile. */
+  get stackCount(): number {
+    return this.native.stackCount();
+  }
+
+  /** Number of profiles merged since the aggregator was last flushed. */
+  get profileCount(): number {
+    return this.native.profileCount();
+  }
+
+  /**
+   * Resolves to the merged profile gzipped in pprof format, and empties the
+   * aggregator, so that the profiles merged from then on make up the next
+   * profile. The profile is serialized and gzipped on a libuv worker thread.
+   * The time of the profile is that of the first profile merged into it, its
+   * duration is the sum of their durations, and its period is that of the
+   * last one.
+   */
+  flush(): Promise<Buffer> {
+    const nodeCount = this.stackCount + 1;
+    return gzippedWithStats(
+      flushToPprofAsync(this.native),
+      newProfileStats({nanos: 0, nodeCount, sampleCount: 0})
+    );
+  }
+}
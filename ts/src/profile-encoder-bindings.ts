@@ -0,0 +1,77 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+import * as path from 'path';
+
+const binary = require('@mapbox/node-pre-gyp');
+const bindingPath = binary.find(
+  path.resolve(path.join(__dirname, '../../package.json'))
+);
+const profiler = require(bindingPath);
+
+/**
+ * A profile.proto message flattened into typed arrays, so that the native
+ * module can copy it cheaply and encode it on a worker thread. The layout
+ * must match bindings/profile-encoder.cc.
+ *
+ * Each int64 value is stored as two 32-bit words, low then high, since a
+ * double cannot hold every int64 exactly. The entries of message tables
+ * start with a mask of the fields which are set, bit i for the i-th field,
+ * followed by the two words of each field.
+ */
+export interface ProfileTables {
+  /**
+   * dropFrames, keepFrames, timeNanos, durationNanos, period and
+   * defaultSampleType.
+   */
+  header: Uint32Array;
+  /** type and unit of periodType, or empty if it is not set. */
+  periodType: Uint32Array;
+  stringTable: string[];
+  comments: Uint32Array;
+  /** type and unit of each sample type. */
+  sampleTypes: Uint32Array;
+  /** Number of location IDs, values and labels of each sample. */
+  samples: Uint32Array;
+  sampleLocationIds: Uint32Array;
+  sampleValues: Uint32Array;
+  /** key, str, num and numUnit of each label. */
+  labels: Uint32Array;
+  /** Fields of each mapping, in field number order. */
+  mappings: Uint32Array;
+  /** id, mappingId and address of each location, then its number of lines. */
+  locations: Uint32Array;
+  /** functionId and line of each line. */
+  lines: Uint32Array;
+  /** id, name, systemName, filename and startLine of each function. */
+  functions: Uint32Array;
+}
+
+// Wrapper around native profile encoder.
+
+export function encodeProfile(tables: ProfileTables): Promise<Buffer> {
+  return new Promise((resolve, reject) => {
+    profiler.profileEncoder.encodeProfile(
+      tables,
+      (err: Error | null, buffer: Buffer) => {
+        if (err) {
+          reject(err);
+        } else {
+          resolve(buffer);
+        }
+      }
+    );
+  });
+}
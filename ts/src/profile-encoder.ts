@@ -14,21 +14,378 @@
  * limitations under the License.
  */
 
-import * as pify from 'pify';
-import {gzip, gzipSync} from 'zlib';
+import {util, Writer} from 'protobufjs/minimal';
+import {gzipSync} from 'zlib';
 
 import {perftools} from '../../proto/profile';
+import {encodeProfile, ProfileTables} from './profile-encoder-bindings';
+import {elapsedNanos, profileStats, setProfileStats} from './profiler-stats';
 
-const gzipPromise = pify(gzip);
+type Int64 = number | Long;
 
+/**
+ * Encodes the profile in profile.proto format and gzips it. Both steps run
+ * on a libuv worker thread; only flattening the profile into typed arrays
+ * happens on the main thread.
+ */
 export async function encode(
   profile: perftools.profiles.IProfile
 ): Promise<Buffer> {
-  const buffer = perftools.profiles.Profile.encode(profile).finish();
-  return gzipPromise(buffer);
+  const start = process.hrtime();
+  const buffer = await encodeProfile(flattenProfile(profile));
+  recordEncoding(profile, buffer, elapsedNanos(start));
+  return buffer;
 }
 
 export function encodeSync(profile: perftools.profiles.IProfile): Buffer {
-  const buffer = perftools.profiles.Profile.encode(profile).finish();
-  return gzipSync(buffer);
+  const start = process.hrtime();
+  const buffer = gzipSync(perftools.profiles.Profile.encode(profile).finish());
+  recordEncoding(profile, buffer, elapsedNanos(start));
+  return buffer;
+}
+
+// Adds the encoding of a profile collected by a profiler to its stats,
+// which become the stats of the encoded profile too.
+function recordEncoding(
+  profile: perftools.profiles.IProfile,
+  buffer: Buffer,
+  nanos: number
+) {
+  const stats = profileStats(profile);
+  if (stats) {
+    stats.encodeNanos = nanos;
+    stats.encodedBytes = buffer.length;
+    setProfileStats(buffer, stats);
+  }
+}
+
+/**
+ * Number of bytes of encoded samples buffered by ProfileStreamWriter before
+ * they are gzipped.
+ */
+const STREAM_CHUNK_BYTES = 256 * 1024;
+
+// Tag of the sample field of profile.proto: field 2, length delimited.
+const PROFILE_SAMPLE_TAG = (2 << 3) | 2;
+
+/**
+ * Writes a profile in profile.proto format, gzipped, while it is being
+ * serialized: samples are encoded in chunks as they are written, and each
+ * chunk is gzipped as soon as it is full. The other fields, whose size
+ * depends only on the number of distinct locations, functions and strings,
+ * are written at the end. Each chunk is a gzip member, and concatenated gzip
+ * members are a valid gzip file.
+ *
+ * Chunks are gzipped synchronously, on the thread which serializes the
+ * profile. Serialization is one synchronous walk, so a chunk handed to the
+ * thread pool could not be released, nor written, until the walk returns;
+ * the whole encoded profile would then be held in memory. Gzipping on the
+ * main thread costs event loop time instead, but at most one chunk of
+ * encoded samples is buffered at any time.
+ *
+ * The gzipped chunks are written to out in order if it is specified, and
+ * otherwise returned by finish(). out cannot apply backpressure while the
+ * profile is serialized, so it may buffer the gzipped profile meanwhile;
+ * finish() waits for it to drain.
+ */
+export class ProfileStreamWriter {
+  private writer = Writer.create();
+  private readonly chunks: Buffer[] = [];
+  // Whether out has asked to wait for 'drain' before writing more.
+  private mustDrain = false;
+  // Time spent encoding and gzipping, and size of the gzipped chunks.
+  private encodeNanos = 0;
+  private encodedBytes = 0;
+
+  constructor(private readonly out?: NodeJS.WritableStream) {}
+
+  /**
+   * Number of bytes of encoded samples which are not gzipped yet.
+   */
+  get pendingBytes(): number {
+    return this.writer.len;
+  }
+
+  writeSamples(samples: perftools.profiles.ISample[]) {
+    const start = process.hrtime();
+    for (const sample of samples) {
+      perftools.profiles.Sample.encode(
+        sample,
+        this.writer.uint32(PROFILE_SAMPLE_TAG).fork()
+      ).ldelim();
+    }
+    if (this.writer.len >= STREAM_CHUNK_BYTES) {
+      this.flush();
+    }
+    this.encodeNanos += elapsedNanos(start);
+  }
+
+  /**
+   * Writes the fields of profile other than its samples and ends the output.
+   * @return the gzipped profile, or an empty buffer if it was written to out.
+   */
+  async finish(profile: perftools.profiles.IProfile): Promise<Buffer> {
+    const start = process.hrtime();
+    // Samples were written while the profile was serialized, so the time
+    // taken to encode them is moved from serialization to encoding.
+    const stats = profileStats(profile);
+    if (stats) {
+      stats.serializeNanos -= this.encodeNanos;
+    }
+    perftools.profiles.Profile.encode({...profile, sample: []}, this.writer);
+    this.flush();
+    this.encodeNanos += elapsedNanos(start);
+    let buffer: Buffer;
+    const out = this.out;
+    if (out) {
+      if (this.mustDrain) {
+        await new Promise(resolve => out.once('drain', resolve));
+      }
+      out.end();
+      buffer = Buffer.alloc(0);
+    } else {
+      buffer = Buffer.concat(this.chunks);
+    }
+    if (stats) {
+      stats.encodeNanos = this.encodeNanos;
+      stats.encodedBytes = this.encodedBytes;
+      setProfileStats(buffer, stats);
+    }
+    return buffer;
+  }
+
+  private flush() {
+    const data = this.writer.finish();
+    this.writer = Writer.create();
+    if (data.length === 0) {
+      return;
+    }
+    const chunk = gzipSync(data);
+    this.encodedBytes += chunk.length;
+    if (this.out) {
+      this.mustDrain = !this.out.write(chunk);
+    } else {
+      this.chunks.push(chunk);
+    }
+  }
+}
+
+/**
+ * Stores value at dest[offset] and dest[offset + 1], as its low and high 32
+ * bits, so that int64 values above 2^53 are kept exactly. Numbers are
+ * truncated as protobufjs truncates them.
+ */
+function setInt64(dest: Uint32Array, offset: number, value: Int64) {
+  if (typeof value === 'number' && value >= 0 && value < 0x100000000) {
+    dest[offset] = value;
+    dest[offset + 1] = 0;
+    return;
+  }
+  const bits = util.LongBits.from(value);
+  dest[offset] = bits.lo;
+  dest[offset + 1] = bits.hi;
+}
+
+/**
+ * Stores the named fields of message in the entry of dest at offset: a mask
+ * of the fields which perftools.profiles.Profile.encode() would write, then
+ * each field as two 32-bit words.
+ * @return the offset of the next entry.
+ */
+function setFields<T>(
+  dest: Uint32Array,
+  offset: number,
+  message: T,
+  names: Array<keyof T>
+): number {
+  let mask = 0;
+  for (let i = 0; i < names.length; i++) {
+    const value = message[names[i]] as unknown as Int64 | boolean | null;
+    if (
+      value !== null &&
+      value !== undefined &&
+      Object.prototype.hasOwnProperty.call(message, names[i])
+    ) {
+      mask |= 1 << i;
+      setInt64(
+        dest,
+        offset + 1 + 2 * i,
+        typeof value === 'boolean' ? Number(value) : value
+      );
+    }
+  }
+  dest[offset] = mask;
+  return offset + 1 + 2 * names.length;
+}
+
+function fill(dest: Uint32Array, offset: number, values: Int64[]): number {
+  for (const value of values) {
+    setInt64(dest, offset, value);
+    offset += 2;
+  }
+  return offset;
+}
+
+// Fields of the entries of the tables, in the order expected by
+// bindings/profile-encoder.cc.
+const PROFILE_FIELDS: Array<keyof perftools.profiles.IProfile> = [
+  'dropFrames',
+  'keepFrames',
+  'timeNanos',
+  'durationNanos',
+  'period',
+  'defaultSampleType',
+];
+const VALUE_TYPE_FIELDS: Array<keyof perftools.profiles.IValueType> = [
+  'type',
+  'unit',
+];
+const LABEL_FIELDS: Array<keyof perftools.profiles.ILabel> = [
+  'key',
+  'str',
+  'num',
+  'numUnit',
+];
+const MAPPING_FIELDS: Array<keyof perftools.profiles.IMapping> = [
+  'id',
+  'memoryStart',
+  'memoryLimit',
+  'fileOffset',
+  'filename',
+  'buildId',
+  'hasFunctions',
+  'hasFilenames',
+  'hasLineNumbers',
+  'hasInlineFrames',
+];
+const LOCATION_FIELDS: Array<keyof perftools.profiles.ILocation> = [
+  'id',
+  'mappingId',
+  'address',
+];
+const LINE_FIELDS: Array<keyof perftools.profiles.ILine> = [
+  'functionId',
+  'line',
+];
+const FUNCTION_FIELDS: Array<keyof perftools.profiles.IFunction> = [
+  'id',
+  'name',
+  'systemName',
+  'filename',
+  'startLine',
+];
+
+// Number of 32-bit words of an entry with the given fields.
+function entrySize(fields: unknown[]): number {
+  return 1 + 2 * fields.length;
+}
+
+/**
+ * Flattens the profile into the tables expected by the native encoder.
+ */
+export function flattenProfile(
+  profile: perftools.profiles.IProfile
+): ProfileTables {
+  const sampleTypes = profile.sampleType || [];
+  const samples = profile.sample || [];
+  const mappings = profile.mapping || [];
+  const locations = profile.location || [];
+  const functions = profile.function || [];
+  const periodType = profile.periodType;
+
+  let locationIdCount = 0;
+  let valueCount = 0;
+  let labelCount = 0;
+  for (const sample of samples) {
+    locationIdCount += sample.locationId ? sample.locationId.length : 0;
+    valueCount += sample.value ? sample.value.length : 0;
+    labelCount += sample.label ? sample.label.length : 0;
+  }
+  let lineCount = 0;
+  for (const location of locations) {
+    lineCount += location.line ? location.line.length : 0;
+  }
+
+  const hasPeriodType =
+    !!periodType &&
+    Object.prototype.hasOwnProperty.call(profile, 'periodType');
+  const comments = profile.comment || [];
+  const tables: ProfileTables = {
+    header: new Uint32Array(entrySize(PROFILE_FIELDS)),
+    periodType: new Uint32Array(
+      hasPeriodType ? entrySize(VALUE_TYPE_FIELDS) : 0
+    ),
+    stringTable: profile.stringTable || [],
+    comments: new Uint32Array(comments.length * 2),
+    sampleTypes: new Uint32Array(
+      sampleTypes.length * entrySize(VALUE_TYPE_FIELDS)
+    ),
+    samples: new Uint32Array(samples.length * 3),
+    sampleLocationIds: new Uint32Array(locationIdCount * 2),
+    sampleValues: new Uint32Array(valueCount * 2),
+    labels: new Uint32Array(labelCount * entrySize(LABEL_FIELDS)),
+    mappings: new Uint32Array(mappings.length * entrySize(MAPPING_FIELDS)),
+    // The number of lines follows the fields of each location.
+    locations: new Uint32Array(
+      locations.length * (entrySize(LOCATION_FIELDS) + 1)
+    ),
+    lines: new Uint32Array(lineCount * entrySize(LINE_FIELDS)),
+    functions: new Uint32Array(functions.length * entrySize(FUNCTION_FIELDS)),
+  };
+
+  setFields(tables.header, 0, profile, PROFILE_FIELDS);
+  if (periodType && hasPeriodType) {
+    setFields(tables.periodType, 0, periodType, VALUE_TYPE_FIELDS);
+  }
+  fill(tables.comments, 0, comments);
+
+  let i = 0;
+  for (const valueType of sampleTypes) {
+    i = setFields(tables.sampleTypes, i, valueType, VALUE_TYPE_FIELDS);
+  }
+
+  let locationIdOffset = 0;
+  let valueOffset = 0;
+  let labelOffset = 0;
+  i = 0;
+  for (const sample of samples) {
+    const locationIds = sample.locationId || [];
+    const values = sample.value || [];
+    const labels = sample.label || [];
+    tables.samples[i++] = locationIds.length;
+    tables.samples[i++] = values.length;
+    tables.samples[i++] = labels.length;
+    locationIdOffset = fill(
+      tables.sampleLocationIds,
+      locationIdOffset,
+      locationIds
+    );
+    valueOffset = fill(tables.sampleValues, valueOffset, values);
+    for (const label of labels) {
+      labelOffset = setFields(tables.labels, labelOffset, label, LABEL_FIELDS);
+    }
+  }
+
+  i = 0;
+  for (const mapping of mappings) {
+    i = setFields(tables.mappings, i, mapping, MAPPING_FIELDS);
+  }
+
+  let lineOffset = 0;
+  i = 0;
+  for (const location of locations) {
+    const lines = location.line || [];
+    i = setFields(tables.locations, i, location, LOCATION_FIELDS);
+    tables.locations[i++] = lines.length;
+    for (const line of lines) {
+      lineOffset = setFields(tables.lines, lineOffset, line, LINE_FIELDS);
+    }
+  }
+
+  i = 0;
+  for (const f of functions) {
+    i = setFields(tables.functions, i, f, FUNCTION_FIELDS);
+  }
+
+  return tables;
 }
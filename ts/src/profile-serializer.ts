@@ -21,14 +21,19 @@ import {
   SourceMapper,
 } from './sourcemapper/sourcemapper';
 import {
+  Allocation,
+  AllocationProfileColumns,
   AllocationProfileNode,
   ProfileNode,
+  ProfileNodeColumns,
   TimeProfile,
+  TimeProfileColumns,
+  TimeProfileContextColumns,
   TimeProfileNode,
 } from './v8-types';
 
 /**
- * A stack of function IDs.
+ * A stack of location IDs, starting with the leaf.
  */
 type Stack = number[];
 
@@ -42,11 +47,74 @@ type AppendEntryToSamples<T extends ProfileNode> = (
 ) => void;
 
 /**
- * Profile node and stack trace to that node.
+ * A function which converts the node with the given index of profile columns
+ * into zero or more samples, then appends those samples to samples. The
+ * stack trace to a node is built by calling stackOf with its index.
+ */
+type AppendColumnsNodeToSamples = (
+  index: number,
+  stackOf: (index: number) => Stack,
+  samples: perftools.profiles.Sample[]
+) => void;
+
+/**
+ * A function which takes samples as they are serialized, for example to
+ * encode them incrementally with a ProfileStreamWriter. The array is reused
+ * once the function returns.
+ */
+export type SampleSink = (samples: perftools.profiles.Sample[]) => void;
+
+/**
+ * Number of samples passed to a sample sink at once.
+ */
+const SAMPLES_PER_CHUNK = 1024;
+
+/**
+ * Profile node and the entry for its parent. Entries only point to their
+ * parent, so visiting a node costs the same at any depth; the stack trace to a
+ * node is built by stackOf() only for nodes which are converted into samples.
  */
 interface Entry<T extends ProfileNode> {
   node: T;
-  stack: Stack;
+  parent?: Entry<T>;
+  // ID of the location of node; set when the entry is visited.
+  locationId: number;
+}
+
+/**
+ * @return stack trace from the node of entry to the root.
+ */
+function stackOf<T extends ProfileNode>(entry: Entry<T>): Stack {
+  const stack: Stack = [];
+  for (let e: Entry<T> | undefined = entry; e; e = e.parent) {
+    stack.push(e.locationId);
+  }
+  return stack;
+}
+
+/**
+ * @return location of the node with the given index of profile columns.
+ */
+function columnsLocation(
+  strings: string[],
+  nodes: ProfileNodeColumns,
+  index: number
+): SourceLocation {
+  return {
+    file: strings[nodes.scriptNames[index]] || '',
+    line: nodes.lineNumbers[index],
+    column: nodes.columnNumbers[index],
+    name: strings[nodes.names[index]],
+  };
+}
+
+function nodeLocation(node: ProfileNode): SourceLocation {
+  return {
+    file: node.scriptName || '',
+    line: node.lineNumber,
+    column: node.columnNumber,
+    name: node.name,
+  };
 }
 
 function isGeneratedLocation(
@@ -62,32 +130,278 @@ function isGeneratedLocation(
 /**
  * Used to build string table and access strings and their ids within the table
  * when serializing a profile.
+ *
+ * A table may be reused across profiles, so that strings which appear in
+ * every profile are interned once instead of being hashed again. Script names
+ * are then looked up by script ID, which avoids hashing long paths again for
+ * each profile. Each profile still has only the strings it uses: the ids of
+ * the table are mapped to dense ids of the profile as strings are first used
+ * in it.
  */
-class StringTable {
-  strings: string[];
-  stringsMap: Map<string, number>;
+export class StringTable {
+  /** Strings of the profile being serialized, by their id in it. */
+  strings: string[] = [];
+  private readonly ids = new Map<string, number>();
+  private readonly scriptNames = new Map<number, {name: string; id: number}>();
+  // Strings of the table by their id.
+  private tableStrings: string[] = [];
+  // Ids in the profile, plus one, of the strings of the table by their id; 0
+  // for those which the profile does not use.
+  private profileIds: number[] = [];
+  // Ids in the table of the strings of the profile.
+  private tableIds: number[] = [];
+
+  /**
+   * @param maxStrings - once the table holds more than this many strings, it
+   * is cleared before it is used for the next profile. This bounds the memory
+   * used by strings of scripts which are no longer loaded.
+   */
+  constructor(readonly maxStrings = Infinity) {
+    this.startProfile();
+  }
 
-  constructor() {
+  /**
+   * Starts the strings of a new profile, which are the strings used from then
+   * on. Clears the table first if it holds more than maxStrings strings.
+   */
+  startProfile() {
+    if (this.tableStrings.length > this.maxStrings) {
+      this.clear();
+    }
+    for (const id of this.tableIds) {
+      this.profileIds[id] = 0;
+    }
     this.strings = [];
-    this.stringsMap = new Map<string, number>();
+    this.tableIds = [];
     this.getIndexOrAdd('');
   }
 
   /**
-   * @return index of str within the table. Also adds str to string table if
-   * str is not in the table already.
+   * @return index of str within the strings of the profile. Also adds str to
+   * the table if str is not in the table already.
    */
   getIndexOrAdd(str: string): number {
-    let idx = this.stringsMap.get(str);
-    if (idx !== undefined) {
-      return idx;
+    return this.profileIndex(this.tableId(str));
+  }
+
+  /**
+   * @return index of the name of the script with the given ID. Also adds the
+   * name to the string table if it is not in the table already.
+   */
+  getScriptNameIndex(scriptId: number | undefined, scriptName: string) {
+    // Script ID 0 is used for nodes which are not in a script, such as
+    // (program) and (garbage collector).
+    if (!scriptId) {
+      return this.getIndexOrAdd(scriptName);
+    }
+    const cached = this.scriptNames.get(scriptId);
+    // Comparing with the cached name is cheaper than hashing it, and detects
+    // a script ID which is used for another script.
+    if (cached !== undefined && cached.name === scriptName) {
+      return this.profileIndex(cached.id);
+    }
+    const id = this.tableId(scriptName);
+    this.scriptNames.set(scriptId, {name: scriptName, id});
+    return this.profileIndex(id);
+  }
+
+  /**
+   * Removes all strings from the table, and starts a new profile.
+   */
+  clear() {
+    this.ids.clear();
+    this.scriptNames.clear();
+    this.tableStrings = [];
+    this.profileIds = [];
+    this.tableIds = [];
+    this.startProfile();
+  }
+
+  private tableId(str: string): number {
+    let id = this.ids.get(str);
+    if (id === undefined) {
+      id = this.tableStrings.push(str) - 1;
+      this.ids.set(str, id);
+      this.profileIds.push(0);
+    }
+    return id;
+  }
+
+  private profileIndex(id: number): number {
+    let idx = this.profileIds[id];
+    if (!idx) {
+      this.tableIds.push(id);
+      idx = this.profileIds[id] = this.strings.push(this.tableStrings[id]);
+    }
+    return idx - 1;
+  }
+}
+
+/**
+ * Maximum number of strings kept in the string table shared by the time and
+ * heap profilers.
+ */
+const MAX_SHARED_STRINGS = 1 << 16;
+
+/**
+ * String table shared by the time and heap profilers, so that function and
+ * script names are interned once across profiles.
+ */
+export const sharedStringTable = new StringTable(MAX_SHARED_STRINGS);
+
+/**
+ * Locations and functions of a profile being serialized, each added once.
+ * Nodes translated by the native module have numeric keys of their location
+ * and function, by which they are looked up before building string keys.
+ */
+class LocationTable {
+  readonly locations: perftools.profiles.Location[] = [];
+  readonly functions: perftools.profiles.Function[] = [];
+  private readonly locationIdMap = new Map<string, number>();
+  private readonly functionIdMap = new Map<string, number>();
+  private readonly locationsByKey: perftools.profiles.Location[] = [];
+  private readonly functionsByKey: perftools.profiles.Function[] = [];
+
+  constructor(private readonly stringTable: StringTable) {}
+
+  /**
+   * @return location previously returned for the given location key, if any.
+   */
+  getKeyedLocation(
+    locationKey: number | undefined
+  ): perftools.profiles.Location | undefined {
+    return locationKey === undefined
+      ? undefined
+      : this.locationsByKey[locationKey];
+  }
+
+  /**
+   * @return location of a node in the script with the given ID, at the given
+   * generated location, or at sourceLoc if the location was source mapped to
+   * it. The keys of the location and function of the node, if any, are those
+   * with which they are looked up next.
+   */
+  getLocation(
+    scriptId: number | undefined,
+    profLoc: SourceLocation,
+    sourceLoc?: SourceLocation,
+    locationKey?: number,
+    functionKey?: number
+  ): perftools.profiles.Location {
+    const location = this.getMappedLocation(
+      scriptId,
+      sourceLoc || profLoc,
+      sourceLoc !== undefined,
+      functionKey
+    );
+    if (locationKey !== undefined) {
+      this.locationsByKey[locationKey] = location;
+    }
+    return location;
+  }
+
+  private getMappedLocation(
+    scriptId: number | undefined,
+    profLoc: SourceLocation,
+    mapped: boolean,
+    functionKey?: number
+  ): perftools.profiles.Location {
+    const keyStr = `${scriptId}:${profLoc.line}:${profLoc.column}:${profLoc.name}`;
+    let id = this.locationIdMap.get(keyStr);
+    if (id !== undefined) {
+      // id is index+1, since 0 is not valid id.
+      return this.locations[id - 1];
+    }
+    id = this.locations.length + 1;
+    this.locationIdMap.set(keyStr, id);
+    const line = this.getLine(
+      scriptId,
+      profLoc.file,
+      profLoc.name,
+      profLoc.line,
+      mapped,
+      // A source mapped name is not the one which the function key is of.
+      mapped ? undefined : functionKey
+    );
+    const location = new perftools.profiles.Location({id, line: [line]});
+    this.locations.push(location);
+    return location;
+  }
+
+  private getLine(
+    scriptId?: number,
+    scriptName?: string,
+    name?: string,
+    line?: number,
+    mapped?: boolean,
+    functionKey?: number
+  ): perftools.profiles.Line {
+    const f = this.getFunction(scriptId, scriptName, name, mapped, functionKey);
+    return new perftools.profiles.Line({functionId: f.id, line});
+  }
+
+  private getFunction(
+    scriptId?: number,
+    scriptName?: string,
+    name?: string,
+    mapped?: boolean,
+    functionKey?: number
+  ): perftools.profiles.Function {
+    if (functionKey !== undefined) {
+      const keyed = this.functionsByKey[functionKey];
+      if (keyed) {
+        return keyed;
+      }
+      const f = this.getFunction(scriptId, scriptName, name, mapped);
+      this.functionsByKey[functionKey] = f;
+      return f;
+    }
+    const keyStr = `${scriptId}:${name}`;
+    let id = this.functionIdMap.get(keyStr);
+    if (id !== undefined) {
+      // id is index+1, since 0 is not valid id.
+      return this.functions[id - 1];
     }
-    idx = this.strings.push(str) - 1;
-    this.stringsMap.set(str, idx);
-    return idx;
+    id = this.functions.length + 1;
+    this.functionIdMap.set(keyStr, id);
+    const nameId = this.stringTable.getIndexOrAdd(name || '(anonymous)');
+    // A source mapped file name is not the name of the script.
+    const filename = mapped
+      ? this.stringTable.getIndexOrAdd(scriptName || '')
+      : this.stringTable.getScriptNameIndex(scriptId, scriptName || '');
+    const f = new perftools.profiles.Function({
+      id,
+      name: nameId,
+      systemName: nameId,
+      filename,
+    });
+    this.functions.push(f);
+    return f;
   }
 }
 
+/**
+ * Sets the sample, location, function and string table fields of profile.
+ * Samples passed to sampleSink, if any, are not added to profile.
+ */
+function finishProfile(
+  profile: perftools.profiles.IProfile,
+  samples: perftools.profiles.Sample[],
+  locationTable: LocationTable,
+  stringTable: StringTable,
+  sampleSink?: SampleSink
+) {
+  if (sampleSink) {
+    sampleSink(samples);
+    samples.length = 0;
+  }
+  profile.sample = samples;
+  profile.location = locationTable.locations;
+  profile.function = locationTable.functions;
+  // The table starts a new array for the next profile.
+  profile.stringTable = stringTable.strings;
+}
+
 /**
  * Takes v8 profile and populates sample, location, and function fields of
  * profile.proto.
@@ -99,6 +413,8 @@ class StringTable {
  * @param appendToSamples - function which converts entry to sample(s)  and
  * appends these to end of an array of samples.
  * @param stringTable - string table for the existing profile.
+ * @param sampleSink - if specified, samples are passed to it in chunks as
+ * they are serialized, rather than added to the profile.
  */
 function serialize<T extends ProfileNode>(
   profile: perftools.profiles.IProfile,
@@ -106,108 +422,145 @@ function serialize<T extends ProfileNode>(
   appendToSamples: AppendEntryToSamples<T>,
   stringTable: StringTable,
   ignoreSamplesPath?: string,
-  sourceMapper?: SourceMapper
+  sourceMapper?: SourceMapper,
+  sampleSink?: SampleSink
 ) {
   const samples: perftools.profiles.Sample[] = [];
-  const locations: perftools.profiles.Location[] = [];
-  const functions: perftools.profiles.Function[] = [];
-  const functionIdMap = new Map<string, number>();
-  const locationIdMap = new Map<string, number>();
+  const locationTable = new LocationTable(stringTable);
 
   const entries: Array<Entry<T>> = (root.children as T[]).map((n: T) => ({
     node: n,
-    stack: [],
+    locationId: 0,
   }));
+  // Entries to convert into samples, with each parent before its children.
+  const visited: Array<Entry<T>> = [];
+  const generatedLocations: GeneratedLocation[] = [];
+  // Index of the generated location of each visited entry, or -1.
+  const generatedIndices: number[] = [];
   while (entries.length > 0) {
     const entry = entries.pop()!;
     const node = entry.node;
     if (ignoreSamplesPath && node.scriptName.indexOf(ignoreSamplesPath) > -1) {
       continue;
     }
-    const stack = entry.stack;
-    const location = getLocation(node, sourceMapper);
-    stack.unshift(location.id as number);
-    appendToSamples(entry, samples);
+    visited.push(entry);
+    const loc = sourceMapper ? nodeLocation(node) : undefined;
+    if (loc && isGeneratedLocation(loc)) {
+      generatedIndices.push(generatedLocations.length);
+      generatedLocations.push(loc);
+    } else {
+      generatedIndices.push(-1);
+    }
     for (const child of node.children as T[]) {
-      entries.push({node: child, stack: stack.slice()});
+      entries.push({node: child, parent: entry, locationId: 0});
     }
   }
+  // Source map all distinct locations at once, rather than once per node.
+  const sourceLocations = sourceMapper
+    ? sourceMapper.mappingInfos(generatedLocations)
+    : [];
+  for (let i = 0; i < visited.length; i++) {
+    const entry = visited[i];
+    const node = entry.node;
+    const generated = generatedIndices[i];
+    const location =
+      locationTable.getKeyedLocation(node.locationKey) ||
+      locationTable.getLocation(
+        node.scriptId,
+        nodeLocation(node),
+        generated < 0 ? undefined : sourceLocations[generated],
+        node.locationKey,
+        node.functionKey
+      );
+    entry.locationId = location.id as number;
+    appendToSamples(entry, samples);
+    if (sampleSink && samples.length >= SAMPLES_PER_CHUNK) {
+      sampleSink(samples);
+      samples.length = 0;
+    }
+  }
+  finishProfile(profile, samples, locationTable, stringTable, sampleSink);
+}
 
-  profile.sample = samples;
-  profile.location = locations;
-  profile.function = functions;
-  profile.stringTable = stringTable.strings;
-
-  function getLocation(
-    node: ProfileNode,
-    sourceMapper?: SourceMapper
-  ): perftools.profiles.Location {
-    let profLoc: SourceLocation = {
-      file: node.scriptName || '',
-      line: node.lineNumber,
-      column: node.columnNumber,
-      name: node.name,
-    };
+/**
+ * Takes the nodes of a v8 profile as columns and populates sample, location,
+ * and function fields of profile.proto, as serialize() does for a tree. Nodes
+ * are visited in the order of their indices, which come after the indices of
+ * their parents; node 0 is the root, which is not part of any stack.
+ */
+function serializeColumns(
+  profile: perftools.profiles.IProfile,
+  strings: string[],
+  nodes: ProfileNodeColumns,
+  appendToSamples: AppendColumnsNodeToSamples,
+  stringTable: StringTable,
+  ignoreSamplesPath?: string,
+  sourceMapper?: SourceMapper,
+  sampleSink?: SampleSink
+) {
+  const samples: perftools.profiles.Sample[] = [];
+  const locationTable = new LocationTable(stringTable);
+  const count = nodes.parents.length;
 
-    if (profLoc.line) {
-      if (sourceMapper && isGeneratedLocation(profLoc)) {
-        profLoc = sourceMapper.mappingInfo(profLoc);
+  // A node is skipped along with its descendants when its script name
+  // contains ignoreSamplesPath.
+  const skipped = new Uint8Array(count);
+  if (ignoreSamplesPath) {
+    const ignored = strings.map(str => str.indexOf(ignoreSamplesPath) > -1);
+    for (let i = 1; i < count; i++) {
+      if (skipped[nodes.parents[i]] || ignored[nodes.scriptNames[i]]) {
+        skipped[i] = 1;
       }
     }
-    const keyStr = `${node.scriptId}:${profLoc.line}:${profLoc.column}:${profLoc.name}`;
-    let id = locationIdMap.get(keyStr);
-    if (id !== undefined) {
-      // id is index+1, since 0 is not valid id.
-      return locations[id - 1];
-    }
-    id = locations.length + 1;
-    locationIdMap.set(keyStr, id);
-    const line = getLine(
-      node.scriptId,
-      profLoc.file,
-      profLoc.name,
-      profLoc.line
-    );
-    const location = new perftools.profiles.Location({id, line: [line]});
-    locations.push(location);
-    return location;
   }
-
-  function getLine(
-    scriptId?: number,
-    scriptName?: string,
-    name?: string,
-    line?: number
-  ): perftools.profiles.Line {
-    return new perftools.profiles.Line({
-      functionId: getFunction(scriptId, scriptName, name).id,
-      line,
-    });
+  // Source map all distinct locations at once, rather than once per node.
+  // Index of the generated location of each node, or -1.
+  const generatedIndices = new Int32Array(count).fill(-1);
+  let sourceLocations: SourceLocation[] = [];
+  if (sourceMapper) {
+    const generatedLocations: GeneratedLocation[] = [];
+    for (let i = 1; i < count; i++) {
+      const loc = columnsLocation(strings, nodes, i);
+      if (!skipped[i] && isGeneratedLocation(loc)) {
+        generatedIndices[i] = generatedLocations.length;
+        generatedLocations.push(loc);
+      }
+    }
+    sourceLocations = sourceMapper.mappingInfos(generatedLocations);
   }
 
-  function getFunction(
-    scriptId?: number,
-    scriptName?: string,
-    name?: string
-  ): perftools.profiles.Function {
-    const keyStr = `${scriptId}:${name}`;
-    let id = functionIdMap.get(keyStr);
-    if (id !== undefined) {
-      // id is index+1, since 0 is not valid id.
-      return functions[id - 1];
+  const {locationKeys, functionKeys} = nodes;
+  const locationIds = new Float64Array(count);
+  const stackOf = (index: number) => {
+    const stack: Stack = [];
+    for (let i = index; i > 0; i = nodes.parents[i]) {
+      stack.push(locationIds[i]);
+    }
+    return stack;
+  };
+  for (let i = 1; i < count; i++) {
+    if (skipped[i]) {
+      continue;
+    }
+    const locationKey = locationKeys ? locationKeys[i] : undefined;
+    const generated = generatedIndices[i];
+    const location =
+      locationTable.getKeyedLocation(locationKey) ||
+      locationTable.getLocation(
+        nodes.scriptIds[i],
+        columnsLocation(strings, nodes, i),
+        generated < 0 ? undefined : sourceLocations[generated],
+        locationKey,
+        functionKeys ? functionKeys[i] : undefined
+      );
+    locationIds[i] = location.id as number;
+    appendToSamples(i, stackOf, samples);
+    if (sampleSink && samples.length >= SAMPLES_PER_CHUNK) {
+      sampleSink(samples);
+      samples.length = 0;
     }
-    id = functions.length + 1;
-    functionIdMap.set(keyStr, id);
-    const nameId = stringTable.getIndexOrAdd(name || '(anonymous)');
-    const f = new perftools.profiles.Function({
-      id,
-      name: nameId,
-      systemName: nameId,
-      filename: stringTable.getIndexOrAdd(scriptName || ''),
-    });
-    functions.push(f);
-    return f;
   }
+  finishProfile(profile, samples, locationTable, stringTable, sampleSink);
 }
 
 /**
@@ -234,6 +587,19 @@ function createTimeValueType(table: StringTable): perftools.profiles.ValueType {
   });
 }
 
+/**
+ * @return value type for CPU time (type:cpu, units:nanoseconds), and adds
+ * strings used in this value type to the table.
+ */
+function createCpuTimeValueType(
+  table: StringTable
+): perftools.profiles.ValueType {
+  return new perftools.profiles.ValueType({
+    type: table.getIndexOrAdd('cpu'),
+    unit: table.getIndexOrAdd('nanoseconds'),
+  });
+}
+
 /**
  * @return value type for object counts (type:objects, units:count), and
  * adds strings used in this value type to the table.
@@ -260,37 +626,167 @@ function createAllocationValueType(
   });
 }
 
+/**
+ * Allocations of a node of an allocation profile merged by size bucket: count
+ * objects of bytes bytes in total, each of which is at most bucket bytes.
+ */
+export interface AllocationBucket {
+  bucket: number;
+  count: number;
+  bytes: number;
+}
+
+/**
+ * @return the size bucket of an allocation of sizeBytes: the smallest power
+ * of two which is at least sizeBytes.
+ */
+export function allocationSizeBucket(sizeBytes: number): number {
+  let bucket = 1;
+  while (bucket < sizeBytes) {
+    bucket *= 2;
+  }
+  return bucket;
+}
+
+/**
+ * @return the allocations merged by size bucket, in increasing order of
+ * their buckets, as they are merged by the native module.
+ */
+export function bucketAllocations(
+  allocations: Allocation[]
+): AllocationBucket[] {
+  const buckets: AllocationBucket[] = [];
+  for (const alloc of allocations) {
+    const bucket = allocationSizeBucket(alloc.sizeBytes);
+    const bytes = alloc.sizeBytes * alloc.count;
+    const merged = buckets.find(b => b.bucket === bucket);
+    if (merged) {
+      merged.count += alloc.count;
+      merged.bytes += bytes;
+    } else {
+      buckets.push({bucket, count: alloc.count, bytes});
+    }
+  }
+  return buckets.sort((a, b) => a.bucket - b.bucket);
+}
+
+/**
+ * @return label of a heap sample with the size bucket of its objects, in
+ * bytes.
+ */
+function createBytesLabel(
+  bucket: number,
+  table: StringTable
+): perftools.profiles.Label {
+  const bytes = table.getIndexOrAdd('bytes');
+  return new perftools.profiles.Label({
+    key: bytes,
+    num: bucket,
+    numUnit: bytes,
+  });
+}
+
+/**
+ * @return labels of a time sample taken in the given context: none for
+ * context 0.
+ */
+function contextLabels(
+  context: number,
+  table: StringTable
+): perftools.profiles.Label[] | undefined {
+  if (context === 0) {
+    return undefined;
+  }
+  return [
+    new perftools.profiles.Label({
+      key: table.getIndexOrAdd('context'),
+      num: context,
+    }),
+  ];
+}
+
+/**
+ * @return a time sample, with a CPU time value if cpuTime is defined.
+ */
+function createTimeSample(
+  locationId: Stack,
+  hitCount: number,
+  intervalMicros: number,
+  cpuTime: number | undefined,
+  label?: perftools.profiles.Label[]
+): perftools.profiles.Sample {
+  const value = [hitCount, hitCount * intervalMicros];
+  if (cpuTime !== undefined) {
+    value.push(cpuTime);
+  }
+  return new perftools.profiles.Sample(
+    label ? {locationId, value, label} : {locationId, value}
+  );
+}
+
 /**
  * Converts v8 time profile into into a profile proto.
  * (https://github.com/google/pprof/blob/master/proto/profile.proto)
+ * When the nodes have their CPU time, the samples have a third value, their
+ * CPU time in nanoseconds. When they have their hits by context, each node
+ * has a sample per context, with a "context" label.
  *
  * @param prof - profile to be converted.
  * @param intervalMicros - average time (microseconds) between samples.
+ * @param sourceMapper - used to map locations to source files.
+ * @param stringTable - table to which strings are added; a new table is used
+ * if not specified.
+ * @param sampleSink - if specified, samples are passed to it as they are
+ * serialized, and the returned profile has none.
  */
 export function serializeTimeProfile(
   prof: TimeProfile,
   intervalMicros: number,
-  sourceMapper?: SourceMapper
+  sourceMapper?: SourceMapper,
+  stringTable = new StringTable(),
+  sampleSink?: SampleSink
 ): perftools.profiles.IProfile {
+  stringTable.startProfile();
+  const cpuTime = prof.topDownRoot.cpuTime !== undefined;
   const appendTimeEntryToSamples: AppendEntryToSamples<TimeProfileNode> = (
     entry: Entry<TimeProfileNode>,
     samples: perftools.profiles.Sample[]
   ) => {
-    if (entry.node.hitCount > 0) {
-      const sample = new perftools.profiles.Sample({
-        locationId: entry.stack,
-        value: [entry.node.hitCount, entry.node.hitCount * intervalMicros],
-      });
-      samples.push(sample);
+    const node = entry.node;
+    if (node.contexts) {
+      const stack = stackOf(entry);
+      for (const hits of node.contexts) {
+        samples.push(
+          createTimeSample(
+            stack,
+            hits.hitCount,
+            intervalMicros,
+            cpuTime ? hits.cpuTime || 0 : undefined,
+            contextLabels(hits.context, stringTable)
+          )
+        );
+      }
+    } else if (node.hitCount > 0) {
+      samples.push(
+        createTimeSample(
+          stackOf(entry),
+          node.hitCount,
+          intervalMicros,
+          cpuTime ? node.cpuTime || 0 : undefined
+        )
+      );
     }
   };
 
-  const stringTable = new StringTable();
   const sampleValueType = createSampleCountValueType(stringTable);
   const timeValueType = createTimeValueType(stringTable);
+  const sampleType = [sampleValueType, timeValueType];
+  if (cpuTime) {
+    sampleType.push(createCpuTimeValueType(stringTable));
+  }
 
   const profile = {
-    sampleType: [sampleValueType, timeValueType],
+    sampleType,
     timeNanos: Date.now() * 1000 * 1000,
     durationNanos: (prof.endTime - prof.startTime) * 1000,
     periodType: timeValueType,
@@ -303,7 +799,8 @@ export function serializeTimeProfile(
     appendTimeEntryToSamples,
     stringTable,
     undefined,
-    sourceMapper
+    sourceMapper,
+    sampleSink
   );
 
   return profile;
@@ -313,37 +810,51 @@ export function serializeTimeProfile(
  * Converts v8 heap profile into into a profile proto.
  * (https://github.com/google/pprof/blob/master/proto/profile.proto)
  *
+ * The allocations of each node are merged by size bucket into one sample per
+ * bucket, with a numeric "bytes" label whose value is the bucket: objects of
+ * a bucket are at most that many bytes, and more than half as many.
+ *
  * @param prof - profile to be converted.
  * @param startTimeNanos - start time of profile, in nanoseconds (POSIX time).
  * @param durationsNanos - duration of the profile (wall clock time) in
  * nanoseconds.
  * @param intervalBytes - bytes allocated between samples.
+ * @param ignoreSamplesPath - samples from scripts whose name contains this
+ * path are skipped.
+ * @param sourceMapper - used to map locations to source files.
+ * @param stringTable - table to which strings are added; a new table is used
+ * if not specified.
+ * @param sampleSink - if specified, samples are passed to it as they are
+ * serialized, and the returned profile has none.
  */
 export function serializeHeapProfile(
   prof: AllocationProfileNode,
   startTimeNanos: number,
   intervalBytes: number,
   ignoreSamplesPath?: string,
-  sourceMapper?: SourceMapper
+  sourceMapper?: SourceMapper,
+  stringTable = new StringTable(),
+  sampleSink?: SampleSink
 ): perftools.profiles.IProfile {
+  stringTable.startProfile();
   const appendHeapEntryToSamples: AppendEntryToSamples<AllocationProfileNode> =
     (
       entry: Entry<AllocationProfileNode>,
       samples: perftools.profiles.Sample[]
     ) => {
       if (entry.node.allocations.length > 0) {
-        for (const alloc of entry.node.allocations) {
+        const stack = stackOf(entry);
+        for (const alloc of bucketAllocations(entry.node.allocations)) {
           const sample = new perftools.profiles.Sample({
-            locationId: entry.stack,
-            value: [alloc.count, alloc.sizeBytes * alloc.count],
-            // TODO: add tag for allocation size
+            locationId: stack,
+            value: [alloc.count, alloc.bytes],
+            label: [createBytesLabel(alloc.bucket, stringTable)],
           });
           samples.push(sample);
         }
       }
     };
 
-  const stringTable = new StringTable();
   const sampleValueType = createObjectCountValueType(stringTable);
   const allocationValueType = createAllocationValueType(stringTable);
 
@@ -360,7 +871,182 @@ export function serializeHeapProfile(
     appendHeapEntryToSamples,
     stringTable,
     ignoreSamplesPath,
-    sourceMapper
+    sourceMapper,
+    sampleSink
+  );
+  return profile;
+}
+
+/**
+ * Converts v8 time profile translated into columns into a profile proto,
+ * as serializeTimeProfile() does for a profile translated into a tree.
+ *
+ * @param prof - profile to be converted.
+ * @param intervalMicros - average time (microseconds) between samples.
+ * @param sourceMapper - used to map locations to source files.
+ * @param stringTable - table to which strings are added; a new table is used
+ * if not specified.
+ * @param sampleSink - if specified, samples are passed to it as they are
+ * serialized, and the returned profile has none.
+ */
+export function serializeTimeProfileColumns(
+  prof: TimeProfileColumns,
+  intervalMicros: number,
+  sourceMapper?: SourceMapper,
+  stringTable = new StringTable(),
+  sampleSink?: SampleSink
+): perftools.profiles.IProfile {
+  stringTable.startProfile();
+  const hitCounts = prof.nodes.hitCounts;
+  const cpuTimes = prof.nodes.cpuTimes;
+  const contexts = prof.contexts;
+  // As the allocations of a heap profile, the contexts of each node are at
+  // consecutive indices, in the order of the nodes.
+  let next = 0;
+  const appendContextsToSamples = (
+    index: number,
+    stackOf: (index: number) => Stack,
+    samples: perftools.profiles.Sample[],
+    contexts: TimeProfileContextColumns
+  ) => {
+    while (next < contexts.nodes.length && contexts.nodes[next] < index) {
+      next++;
+    }
+    if (next < contexts.nodes.length && contexts.nodes[next] === index) {
+      const stack = stackOf(index);
+      for (; contexts.nodes[next] === index; next++) {
+        samples.push(
+          createTimeSample(
+            stack,
+            contexts.hitCounts[next],
+            intervalMicros,
+            cpuTimes ? contexts.cpuTimes![next] : undefined,
+            contextLabels(contexts.contexts[next], stringTable)
+          )
+        );
+      }
+    }
+  };
+  const appendTimeNodeToSamples: AppendColumnsNodeToSamples = (
+    index: number,
+    stackOf: (index: number) => Stack,
+    samples: perftools.profiles.Sample[]
+  ) => {
+    if (contexts) {
+      appendContextsToSamples(index, stackOf, samples, contexts);
+      return;
+    }
+    const hitCount = hitCounts[index];
+    if (hitCount > 0) {
+      samples.push(
+        createTimeSample(
+          stackOf(index),
+          hitCount,
+          intervalMicros,
+          cpuTimes ? cpuTimes[index] : undefined
+        )
+      );
+    }
+  };
+
+  const sampleValueType = createSampleCountValueType(stringTable);
+  const timeValueType = createTimeValueType(stringTable);
+  const sampleType = [sampleValueType, timeValueType];
+  if (cpuTimes) {
+    sampleType.push(createCpuTimeValueType(stringTable));
+  }
+
+  const profile = {
+    sampleType,
+    timeNanos: Date.now() * 1000 * 1000,
+    durationNanos: (prof.endTime - prof.startTime) * 1000,
+    periodType: timeValueType,
+    period: intervalMicros,
+  };
+
+  serializeColumns(
+    profile,
+    prof.strings,
+    prof.nodes,
+    appendTimeNodeToSamples,
+    stringTable,
+    undefined,
+    sourceMapper,
+    sampleSink
+  );
+
+  return profile;
+}
+
+/**
+ * Converts v8 heap profile translated into columns into a profile proto, as
+ * serializeHeapProfile() does for a profile translated into a tree.
+ *
+ * @param prof - profile to be converted.
+ * @param startTimeNanos - start time of profile, in nanoseconds (POSIX time).
+ * @param intervalBytes - bytes allocated between samples.
+ * @param ignoreSamplesPath - samples from scripts whose name contains this
+ * path are skipped.
+ * @param sourceMapper - used to map locations to source files.
+ * @param stringTable - table to which strings are added; a new table is used
+ * if not specified.
+ * @param sampleSink - if specified, samples are passed to it as they are
+ * serialized, and the returned profile has none.
+ */
+export function serializeHeapProfileColumns(
+  prof: AllocationProfileColumns,
+  startTimeNanos: number,
+  intervalBytes: number,
+  ignoreSamplesPath?: string,
+  sourceMapper?: SourceMapper,
+  stringTable = new StringTable(),
+  sampleSink?: SampleSink
+): perftools.profiles.IProfile {
+  stringTable.startProfile();
+  // The allocations of each node are at consecutive indices, in the order of
+  // the nodes, so they are found with one index which only moves forward.
+  const allocations = prof.allocations;
+  let next = 0;
+  const appendHeapNodeToSamples: AppendColumnsNodeToSamples = (
+    index: number,
+    stackOf: (index: number) => Stack,
+    samples: perftools.profiles.Sample[]
+  ) => {
+    while (next < allocations.nodes.length && allocations.nodes[next] < index) {
+      next++;
+    }
+    if (next < allocations.nodes.length && allocations.nodes[next] === index) {
+      const stack = stackOf(index);
+      for (; allocations.nodes[next] === index; next++) {
+        const sample = new perftools.profiles.Sample({
+          locationId: stack,
+          value: [allocations.counts[next], allocations.bytes[next]],
+          label: [createBytesLabel(allocations.buckets[next], stringTable)],
+        });
+        samples.push(sample);
+      }
+    }
+  };
+
+  const sampleValueType = createObjectCountValueType(stringTable);
+  const allocationValueType = createAllocationValueType(stringTable);
+
+  const profile = {
+    sampleType: [sampleValueType, allocationValueType],
+    timeNanos: startTimeNanos,
+    periodType: allocationValueType,
+    period: intervalBytes,
+  };
+
+  serializeColumns(
+    profile,
+    prof.strings,
+    prof.nodes,
+    appendHeapNodeToSamples,
+    stringTable,
+    ignoreSamplesPath,
+    sourceMapper,
+    sampleSink
   );
   return profile;
 }
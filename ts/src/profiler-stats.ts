@@ -0,0 +1,131 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+import {SourceMapper} from './sourcemapper/sourcemapper';
+import {GzippedProfile, TranslationStats} from './v8-types';
+
+/**
+ * What collecting a profile cost, as measured by the profiler itself. Times
+ * are in nanoseconds, measured with monotonic clocks: uv_hrtime() in the
+ * native module, and process.hrtime() in JavaScript. Stages which did not
+ * run for a profile are 0.
+ */
+export interface ProfileStats {
+  /**
+   * Time taken by the native module to copy the profile out of V8 and
+   * translate it into JavaScript, or serialize it.
+   */
+  translateNanos: number;
+  /** Time taken to serialize the profile in JavaScript. */
+  serializeNanos: number;
+  /** Part of serializeNanos taken to map locations to their sources. */
+  sourceMapNanos: number;
+  /**
+   * Time taken to encode the profile in pprof format and gzip it. For a
+   * profile serialized on a worker thread, this is the time taken there to
+   * serialize and gzip it.
+   */
+  encodeNanos: number;
+  /** Size in bytes of the gzipped profile, once encoded. */
+  encodedBytes: number;
+  /** Nodes of the profile collected from V8, the root included. */
+  nodeCount: number;
+  /** Hits of a time profile, or sampled objects of a heap profile. */
+  sampleCount: number;
+  /**
+   * CPU time which the profiled thread spent taking the samples of a time
+   * profile, or -1 if it was not measured; see TimeProfileCollection.
+   */
+  sampleNanos: number;
+}
+
+// Stats of the profiles and encoded buffers returned by the profilers, which
+// are released along with them.
+const statsByResult = new WeakMap<object, ProfileStats>();
+
+/**
+ * Returns what collecting a profile returned by the time or heap profiler
+ * cost, or undefined for a profile not collected by them. The result may be
+ * a serialized profile, or the buffer of a profile encoded in pprof format.
+ * The stats of a serialized profile include its encoding once encode() or
+ * encodeSync() has encoded it.
+ */
+export function profileStats(result: object): ProfileStats | undefined {
+  return statsByResult.get(result);
+}
+
+export function setProfileStats(result: object, stats: ProfileStats) {
+  statsByResult.set(result, stats);
+}
+
+/**
+ * @return stats of a profile translated by the native module, with the
+ * JavaScript stages still to be measured.
+ */
+export function newProfileStats(translation: TranslationStats): ProfileStats {
+  return {
+    translateNanos: translation.nanos,
+    serializeNanos: 0,
+    sourceMapNanos: 0,
+    encodeNanos: 0,
+    encodedBytes: 0,
+    nodeCount: translation.nodeCount,
+    sampleCount: translation.sampleCount,
+    sampleNanos:
+      translation.sampleNanos === undefined ? -1 : translation.sampleNanos,
+  };
+}
+
+/** @return nanoseconds elapsed since start, as returned by process.hrtime(). */
+export function elapsedNanos(start: [number, number]): number {
+  const [seconds, nanos] = process.hrtime(start);
+  return seconds * 1e9 + nanos;
+}
+
+/**
+ * Serializes a profile with serialize(), and records the time it took in
+ * stats, along with the part of it which sourceMapper took.
+ */
+export function measureSerialization<T>(
+  stats: ProfileStats,
+  sourceMapper: SourceMapper | undefined,
+  serialize: () => T
+): T {
+  const mappingNanos = sourceMapper ? sourceMapper.mappingNanos : 0;
+  const start = process.hrtime();
+  const result = serialize();
+  stats.serializeNanos = elapsedNanos(start);
+  if (sourceMapper) {
+    stats.sourceMapNanos = sourceMapper.mappingNanos - mappingNanos;
+  }
+  return result;
+}
+
+/**
+ * Waits for a profile serialized and gzipped on a worker thread, and records
+ * the work done there as its encoding in stats, which become the stats of
+ * the gzipped profile.
+ */
+export async function gzippedWithStats(
+  gzipped: Promise<GzippedProfile>,
+  stats: ProfileStats
+): Promise<Buffer> {
+  const {buffer, encodeNanos} = await gzipped;
+  stats.encodeNanos = encodeNanos;
+  stats.encodedBytes = buffer.length;
+  setProfileStats(buffer, stats);
+  return buffer;
+}
@@ -0,0 +1,81 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+import * as path from 'path';
+
+const binary = require('@mapbox/node-pre-gyp');
+const bindingPath = binary.find(
+  path.resolve(path.join(__dirname, '../../package.json'))
+);
+const profiler = require(bindingPath);
+
+/**
+ * Mappings of a source map decoded by the native module, with the layout of
+ * MappingIndex in ts/src/sourcemapper/mapping-index.ts.
+ */
+export interface MappingTables {
+  lineStarts: Uint32Array;
+  columns: Int32Array;
+  sources: Int32Array;
+  sourceLines: Int32Array;
+  sourceColumns: Int32Array;
+  names: Int32Array;
+}
+
+/**
+ * Fields of a source map file parsed by the native module. Sources and names
+ * which are null are empty strings.
+ */
+export interface SourceMapTables {
+  file?: string;
+  sourceRoot: string;
+  sources: string[];
+  names: string[];
+  mappings: MappingTables;
+}
+
+// Wrappers around native source map decoder.
+
+export function hasSourceMapDecoder(): boolean {
+  return profiler.sourceMapDecoder !== undefined;
+}
+
+/**
+ * @return the decoded mappings, or undefined if the native module has no
+ * source map decoder.
+ */
+export function decodeMappings(mappings: string): MappingTables | undefined {
+  if (!hasSourceMapDecoder()) {
+    return undefined;
+  }
+  return profiler.sourceMapDecoder.decodeMappings(mappings);
+}
+
+/**
+ * Parses a source map file in place from a memory mapping of it, without
+ * reading it into a string.
+ *
+ * @return the parsed source map, or undefined if the native module has no
+ * source map decoder.
+ */
+export function parseSourceMapFile(
+  mapPath: string
+): SourceMapTables | undefined {
+  if (!hasSourceMapDecoder()) {
+    return undefined;
+  }
+  return profiler.sourceMapDecoder.parseSourceMapFile(mapPath);
+}
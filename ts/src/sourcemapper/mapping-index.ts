@@ -0,0 +1,241 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+import {decodeMappings} from '../source-map-decoder-bindings';
+
+const BASE64_CHARS =
+  'ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/';
+const BASE64_VALUES = new Int8Array(128).fill(-1);
+for (let i = 0; i < BASE64_CHARS.length; i++) {
+  BASE64_VALUES[BASE64_CHARS.charCodeAt(i)] = i;
+}
+const COMMA = ','.charCodeAt(0);
+const SEMICOLON = ';'.charCodeAt(0);
+// Base64 VLQ values have at most 7 digits, so that they fit in 32 bits.
+const MAX_VLQ_MULTIPLIER = 1 << 30;
+
+/**
+ * The mappings of a source map, decoded into flat typed arrays sorted by
+ * generated position, so that a parsed source map takes a few allocations
+ * rather than one object per mapping.
+ *
+ * Mapping i is at a 0-based generated column columns[i]. The mappings of the
+ * 1-based generated line l are those in [lineStarts[l-1], lineStarts[l]).
+ * A mapping without a source has a source index of -1, and one without a
+ * name has a name index of -1.
+ */
+export class MappingIndex {
+  constructor(
+    readonly lineStarts: Uint32Array,
+    readonly columns: Int32Array,
+    readonly sources: Int32Array,
+    readonly sourceLines: Int32Array,
+    readonly sourceColumns: Int32Array,
+    readonly names: Int32Array
+  ) {}
+
+  /**
+   * Decodes the base64 VLQ "mappings" field of a source map, with the faster
+   * native decoder when there is one.
+   */
+  static decode(mappings: string): MappingIndex {
+    const tables = decodeMappings(mappings);
+    if (tables === undefined) {
+      return MappingIndex.decodeInJs(mappings);
+    }
+    return new MappingIndex(
+      tables.lineStarts,
+      tables.columns,
+      tables.sources,
+      tables.sourceLines,
+      tables.sourceColumns,
+      tables.names
+    );
+  }
+
+  /**
+   * Decodes the "mappings" field of a source map in JavaScript.
+   */
+  static decodeInJs(mappings: string): MappingIndex {
+    let lineCount = 1;
+    let maxCount = 1;
+    for (let i = 0; i < mappings.length; i++) {
+      const c = mappings.charCodeAt(i);
+      if (c === SEMICOLON) {
+        lineCount++;
+        maxCount++;
+      } else if (c === COMMA) {
+        maxCount++;
+      }
+    }
+    const lineStarts = new Uint32Array(lineCount + 1);
+    const columns = new Int32Array(maxCount);
+    const sources = new Int32Array(maxCount);
+    const sourceLines = new Int32Array(maxCount);
+    const sourceColumns = new Int32Array(maxCount);
+    const names = new Int32Array(maxCount);
+
+    const fields = [0, 0, 0, 0, 0];
+    let line = 0;
+    let column = 0;
+    let source = 0;
+    let sourceLine = 0;
+    let sourceColumn = 0;
+    let name = 0;
+    let count = 0;
+    let sorted = true;
+    let i = 0;
+    while (i < mappings.length) {
+      const c = mappings.charCodeAt(i);
+      if (c === SEMICOLON) {
+        lineStarts[++line] = count;
+        column = 0;
+        i++;
+        continue;
+      }
+      if (c === COMMA) {
+        i++;
+        continue;
+      }
+      let fieldCount = 0;
+      while (i < mappings.length) {
+        const next = mappings.charCodeAt(i);
+        if (next === COMMA || next === SEMICOLON) {
+          break;
+        }
+        if (fieldCount === fields.length) {
+          throw new Error('Too many fields in source map segment');
+        }
+        let value = 0;
+        let multiplier = 1;
+        let digit;
+        do {
+          const code = mappings.charCodeAt(i++);
+          digit = code < 128 ? BASE64_VALUES[code] : -1;
+          if (digit < 0 || multiplier > MAX_VLQ_MULTIPLIER) {
+            throw new Error('Invalid base64 VLQ in source map mappings');
+          }
+          value += (digit & 31) * multiplier;
+          multiplier *= 32;
+        } while (digit & 32);
+        fields[fieldCount++] = value % 2 ? -(value - 1) / 2 : value / 2;
+      }
+      if (fieldCount !== 1 && fieldCount !== 4 && fieldCount !== 5) {
+        throw new Error('Invalid source map segment');
+      }
+      column += fields[0];
+      if (count > lineStarts[line] && column < columns[count - 1]) {
+        sorted = false;
+      }
+      columns[count] = column;
+      if (fieldCount === 1) {
+        sources[count] = -1;
+        sourceLines[count] = 0;
+        sourceColumns[count] = 0;
+        names[count] = -1;
+      } else {
+        source += fields[1];
+        sourceLine += fields[2];
+        sourceColumn += fields[3];
+        sources[count] = source;
+        sourceLines[count] = sourceLine + 1;
+        sourceColumns[count] = sourceColumn;
+        if (fieldCount === 5) {
+          name += fields[4];
+          names[count] = name;
+        } else {
+          names[count] = -1;
+        }
+      }
+      count++;
+    }
+    lineStarts.fill(count, line + 1);
+
+    const index = new MappingIndex(
+      lineStarts,
+      columns.slice(0, count),
+      sources.slice(0, count),
+      sourceLines.slice(0, count),
+      sourceColumns.slice(0, count),
+      names.slice(0, count)
+    );
+    if (!sorted) {
+      index.sortLines();
+    }
+    return index;
+  }
+
+  /** Size of the decoded mappings in bytes. */
+  get byteLength(): number {
+    return (
+      this.lineStarts.byteLength +
+      this.columns.byteLength +
+      this.sources.byteLength +
+      this.sourceLines.byteLength +
+      this.sourceColumns.byteLength +
+      this.names.byteLength
+    );
+  }
+
+  /**
+   * Returns the index of the mapping with the greatest generated column not
+   * after column on the given 1-based generated line, or -1 if there is none
+   * (as the greatest lower bound lookup of the source-map module does).
+   */
+  find(line: number, column: number): number {
+    if (line < 1 || line >= this.lineStarts.length) {
+      return -1;
+    }
+    let low = this.lineStarts[line - 1];
+    let high = this.lineStarts[line];
+    let found = -1;
+    while (low < high) {
+      const mid = (low + high) >>> 1;
+      if (this.columns[mid] <= column) {
+        found = mid;
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    return found;
+  }
+
+  // Sorts the mappings of each generated line by column, for the rare
+  // source maps whose segments are out of order.
+  private sortLines() {
+    const arrays = [
+      this.columns,
+      this.sources,
+      this.sourceLines,
+      this.sourceColumns,
+      this.names,
+    ];
+    for (let line = 1; line < this.lineStarts.length; line++) {
+      const start = this.lineStarts[line - 1];
+      const end = this.lineStarts[line];
+      const order: number[] = [];
+      for (let i = start; i < end; i++) {
+        order.push(i);
+      }
+      order.sort((a, b) => this.columns[a] - this.columns[b]);
+      for (const array of arrays) {
+        const values = order.map(i => array[i]);
+        array.set(values, start);
+      }
+    }
+  }
+}
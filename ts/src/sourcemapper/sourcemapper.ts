@@ -24,6 +24,12 @@ import * as path from 'path';
 import * as sourceMap from 'source-map';
 
 import * as scanner from '../../third_party/cloud-debug-nodejs/src/agent/io/scanner';
+import {elapsedNanos} from '../profiler-stats';
+import {
+  hasSourceMapDecoder,
+  parseSourceMapFile,
+} from '../source-map-decoder-bindings';
+import {MappingIndex} from './mapping-index';
 
 const pify = require('pify');
 const pLimit = require('p-limit');
@@ -31,12 +37,63 @@ const readFile = pify(fs.readFile);
 
 const CONCURRENCY = 10;
 const MAP_EXT = '.map';
+// Default limit on the memory used by source maps parsed in lazy mode.
+const DEFAULT_MAX_CACHE_BYTES = 64 * 1024 * 1024;
+// Maximum number of generated locations whose mapping is kept.
+const MAX_MAPPED_LOCATIONS = 1 << 16;
+// Estimated memory used by each source and name string of a parsed source
+// map, in addition to its characters.
+const STRING_OVERHEAD_BYTES = 32;
 
 export interface MapInfoCompiled {
   mapFileDir: string;
   mapConsumer: sourceMap.RawSourceMap;
 }
 
+// A source map parsed into a compact mapping index.
+interface MapInfoIndexed {
+  mapFileDir: string;
+  // The "file" attribute of the source map.
+  file?: string;
+  sources: string[];
+  names: string[];
+  mappings: MappingIndex;
+  // Estimated memory used by the parsed source map.
+  byteLength: number;
+}
+
+// A generated location waiting to be mapped, and its key in mappedLocations.
+interface PendingLocation {
+  key: string;
+  line: number;
+  column: number;
+}
+
+type PositionLookup = (line: number, column: number) => SourceLocation | null;
+
+export interface SourceMapperOptions {
+  /**
+   * When true, only the paths of the source map files are found when the
+   * source mapper is created, and each source map is parsed the first time a
+   * location in its generated file is mapped. The generated file of a source
+   * map is then the path of the map without the .map extension, rather than
+   * its "file" attribute.
+   */
+  lazy?: boolean;
+  /**
+   * In lazy mode, the least recently used source maps are dropped, to be
+   * parsed again when next needed, once the parsed source maps use about
+   * this many bytes. Defaults to 64 MiB.
+   */
+  maxCacheBytes?: number;
+  /**
+   * When true, source maps are decoded into compact typed arrays, natively
+   * when the native module has a source map decoder, rather than with the
+   * source-map module. This is always the case in lazy mode.
+   */
+  compactMappings?: boolean;
+}
+
 export interface GeneratedLocation {
   file: string;
   name?: string;
@@ -112,10 +169,54 @@ async function processSourceMap(
   infoMap.set(generatedPath, {mapFileDir: dir, mapConsumer: consumer});
 }
 
+/**
+ * Like processSourceMap(), but parses the source map into a compact mapping
+ * index.
+ */
+async function processCompactSourceMap(
+  parsedMaps: Map<string, MapInfoIndexed>,
+  mapPath: string
+): Promise<void> {
+  if (!mapPath || !mapPath.endsWith(MAP_EXT)) {
+    throw new Error(`The path "${mapPath}" does not specify a source map file`);
+  }
+  mapPath = path.normalize(mapPath);
+
+  let entry: MapInfoIndexed;
+  try {
+    entry = await readSourceMap(mapPath);
+  } catch (e) {
+    throw new Error(
+      'An error occurred while reading the sourceMap file ' + mapPath + ': ' + e
+    );
+  }
+  const generatedBase = entry.file
+    ? entry.file
+    : path.basename(mapPath, MAP_EXT);
+  parsedMaps.set(path.resolve(entry.mapFileDir, generatedBase), entry);
+}
+
 export class SourceMapper {
   infoMap: Map<string, MapInfoCompiled>;
+  // In lazy mode, the paths of the source map files by generated file.
+  private mapPaths = new Map<string, string>();
+  // Source maps parsed into compact mapping indices, by generated file, from
+  // least to most recently used.
+  private parsedMaps = new Map<string, MapInfoIndexed>();
+  private parsedBytes = 0;
+  // Whether source maps are parsed into compact mapping indices, which are
+  // in parsedMaps rather than infoMap.
+  private compact = false;
+  // Source locations of the generated locations mapped so far, by generated
+  // file, line and column; null for locations without a source.
+  private mappedLocations = new Map<string, SourceLocation | null>();
+  /** Total time in nanoseconds spent mapping locations, parsing included. */
+  mappingNanos = 0;
 
-  static async create(searchDirs: string[]): Promise<SourceMapper> {
+  static async create(
+    searchDirs: string[],
+    options: SourceMapperOptions = {}
+  ): Promise<SourceMapper> {
     const mapFiles: string[] = [];
     for (const dir of searchDirs) {
       try {
@@ -127,7 +228,45 @@ export class SourceMapper {
         throw new Error(`failed to get source maps from ${dir}: ${e}`);
       }
     }
-    return createFromMapFiles(mapFiles);
+    if (options.lazy) {
+      const mapper = new SourceMapper(
+        true,
+        options.maxCacheBytes ?? DEFAULT_MAX_CACHE_BYTES
+      );
+      mapper.compact = true;
+      for (const mapPath of mapFiles) {
+        mapper.mapPaths.set(
+          path.normalize(mapPath.slice(0, -MAP_EXT.length)),
+          mapPath
+        );
+      }
+      return mapper;
+    }
+    return SourceMapper.createFromMapFiles(mapFiles, options.compactMappings);
+  }
+
+  private static async createFromMapFiles(
+    mapFiles: string[],
+    compact = false
+  ): Promise<SourceMapper> {
+    const limit = pLimit(CONCURRENCY);
+    const mapper = new SourceMapper();
+    mapper.compact = compact;
+    const promises: Array<Promise<void>> = mapFiles.map(mapPath =>
+      limit(() =>
+        compact
+          ? processCompactSourceMap(mapper.parsedMaps, mapPath)
+          : processSourceMap(mapper.infoMap, mapPath)
+      )
+    );
+    try {
+      await Promise.all(promises);
+    } catch (err) {
+      throw new Error(
+        'An error occurred while processing the source map files' + err
+      );
+    }
+    return mapper;
   }
 
   /**
@@ -138,7 +277,7 @@ export class SourceMapper {
    *  processing the given source map files
    * @constructor
    */
-  constructor() {
+  constructor(readonly lazy = false, readonly maxCacheBytes = Infinity) {
     this.infoMap = new Map();
   }
 
@@ -174,6 +313,12 @@ export class SourceMapper {
    *  relative to the process's current working directory.
    */
   hasMappingInfo(inputPath: string): boolean {
+    if (this.lazy) {
+      return this.mapPaths.has(path.normalize(inputPath));
+    }
+    if (this.compact) {
+      return this.parsedMaps.has(path.normalize(inputPath));
+    }
     return this.getMappingInfo(inputPath) !== null;
   }
 
@@ -197,45 +342,337 @@ export class SourceMapper {
    *   with it then the input location is returned.
    */
   mappingInfo(location: GeneratedLocation): SourceLocation {
-    const inputPath = path.normalize(location.file);
+    return this.mappingInfos([location])[0];
+  }
+
+  /**
+   * Maps many generated locations at once: result i is the mapping of
+   * locations[i], as returned by mappingInfo(). Locations not mapped before
+   * are deduplicated, then looked up in order of position, one source map at
+   * a time. Results are kept, so that a location found in every profile is
+   * only looked up once.
+   */
+  mappingInfos(locations: GeneratedLocation[]): SourceLocation[] {
+    const start = process.hrtime();
+    try {
+      return this.mapLocations(locations);
+    } finally {
+      this.mappingNanos += elapsedNanos(start);
+    }
+  }
+
+  private mapLocations(locations: GeneratedLocation[]): SourceLocation[] {
+    const keys: string[] = [];
+    // Distinct locations, of which added were not mapped before.
+    const distinct = new Map<string, GeneratedLocation>();
+    let added = 0;
+    for (const location of locations) {
+      const key = `${location.file}:${location.line}:${location.column}`;
+      keys.push(key);
+      if (distinct.has(key)) {
+        continue;
+      }
+      distinct.set(key, location);
+      if (!this.mappedLocations.has(key)) {
+        added++;
+      }
+    }
+    if (this.mappedLocations.size + added > MAX_MAPPED_LOCATIONS) {
+      this.mappedLocations.clear();
+    }
+    // Locations not mapped before, by generated file.
+    const pending = new Map<string, PendingLocation[]>();
+    for (const [key, location] of distinct) {
+      if (this.mappedLocations.has(key)) {
+        continue;
+      }
+      this.mappedLocations.set(key, null);
+      const inputPath = path.normalize(location.file);
+      let batch = pending.get(inputPath);
+      if (batch === undefined) {
+        batch = [];
+        pending.set(inputPath, batch);
+      }
+      batch.push({key, line: location.line, column: location.column});
+    }
+    for (const [inputPath, batch] of pending) {
+      const lookup = this.getLookup(inputPath);
+      if (lookup === null) {
+        continue;
+      }
+      batch.sort((a, b) => a.line - b.line || a.column - b.column);
+      for (const {key, line, column} of batch) {
+        this.mappedLocations.set(key, lookup(line, column));
+      }
+    }
+    return locations.map((location, i) => {
+      const mapped = this.mappedLocations.get(keys[i]);
+      if (!mapped) {
+        return location;
+      }
+      return {...mapped, name: mapped.name || location.name};
+    });
+  }
+
+  /**
+   * Returns a function which maps a generated position in a file to its
+   * source location (or null when the position has no source), or null if
+   * the file has no source map.
+   */
+  private getLookup(inputPath: string): PositionLookup | null {
+    if (this.compact) {
+      const entry = this.getParsedMap(inputPath);
+      if (entry === null) {
+        return null;
+      }
+      const mappings = entry.mappings;
+      return (line, column) => {
+        const i = mappings.find(line, column);
+        if (i < 0 || mappings.sources[i] < 0) {
+          return null;
+        }
+        const nameIndex = mappings.names[i];
+        return {
+          file: path.resolve(
+            entry.mapFileDir,
+            entry.sources[mappings.sources[i]]
+          ),
+          line: mappings.sourceLines[i] || undefined,
+          name: (nameIndex >= 0 && entry.names[nameIndex]) || undefined,
+          column: mappings.sourceColumns[i] || undefined,
+        };
+      };
+    }
     const entry = this.getMappingInfo(inputPath);
     if (entry === null) {
-      return location;
+      return null;
     }
 
-    const generatedPos = {line: location.line, column: location.column};
-
     // TODO: Determine how to remove the explicit cast here.
     const consumer: sourceMap.SourceMapConsumer =
       entry.mapConsumer as {} as sourceMap.SourceMapConsumer;
 
-    const pos = consumer.originalPositionFor(generatedPos);
-    if (pos.source === null) {
-      return location;
-    }
-    return {
-      file: path.resolve(entry.mapFileDir, pos.source),
-      line: pos.line || undefined,
-      name: pos.name || location.name,
-      column: pos.column || undefined,
+    return (line, column) => {
+      const pos = consumer.originalPositionFor({line, column});
+      if (pos.source === null) {
+        return null;
+      }
+      return {
+        file: path.resolve(entry.mapFileDir, pos.source),
+        line: pos.line || undefined,
+        name: pos.name || undefined,
+        column: pos.column || undefined,
+      };
     };
   }
+
+  /**
+   * Returns the compact source map of a generated file, parsing it if needed
+   * in lazy mode, or null if the file has no valid source map.
+   */
+  private getParsedMap(inputPath: string): MapInfoIndexed | null {
+    let entry = this.parsedMaps.get(inputPath);
+    if (entry !== undefined) {
+      // Mark as most recently used.
+      this.parsedMaps.delete(inputPath);
+      this.parsedMaps.set(inputPath, entry);
+      return entry;
+    }
+    const mapPath = this.mapPaths.get(inputPath);
+    if (mapPath === undefined) {
+      return null;
+    }
+    try {
+      entry = readSourceMapSync(mapPath);
+    } catch (e) {
+      // Do not try to parse an invalid source map again.
+      this.mapPaths.delete(inputPath);
+      return null;
+    }
+    this.parsedMaps.set(inputPath, entry);
+    this.parsedBytes += entry.byteLength;
+    // Always keep the source map being used, even if it is over the limit.
+    for (const [file, parsed] of this.parsedMaps) {
+      if (this.parsedBytes <= this.maxCacheBytes || file === inputPath) {
+        break;
+      }
+      this.parsedMaps.delete(file);
+      this.parsedBytes -= parsed.byteLength;
+    }
+    return entry;
+  }
 }
 
-async function createFromMapFiles(mapFiles: string[]): Promise<SourceMapper> {
-  const limit = pLimit(CONCURRENCY);
-  const mapper = new SourceMapper();
-  const promises: Array<Promise<void>> = mapFiles.map(mapPath =>
-    limit(() => processSourceMap(mapper.infoMap, mapPath))
-  );
-  try {
-    await Promise.all(promises);
-  } catch (err) {
-    throw new Error(
-      'An error occurred while processing the source map files' + err
+/**
+ * Reads a source map file into a compact mapping index. The native module
+ * parses the file in place from a memory mapping of it, so that it is never
+ * read into a string; otherwise it is read and parsed in JavaScript.
+ * Index maps, which have sections, are not supported.
+ */
+function readSourceMapSync(mapPath: string): MapInfoIndexed {
+  const tables = parseSourceMapFile(mapPath);
+  if (tables !== undefined) {
+    const mappings = tables.mappings;
+    return indexSourceMap(
+      mapPath,
+      tables,
+      new MappingIndex(
+        mappings.lineStarts,
+        mappings.columns,
+        mappings.sources,
+        mappings.sourceLines,
+        mappings.sourceColumns,
+        mappings.names
+      )
     );
   }
-  return mapper;
+  return parseSourceMap(mapPath, fs.readFileSync(mapPath, 'utf8'));
+}
+
+async function readSourceMap(mapPath: string): Promise<MapInfoIndexed> {
+  if (hasSourceMapDecoder()) {
+    return readSourceMapSync(mapPath);
+  }
+  return parseSourceMap(mapPath, await readFile(mapPath, 'utf8'));
+}
+
+// Parses the contents of a source map file in JavaScript.
+function parseSourceMap(mapPath: string, contents: string): MapInfoIndexed {
+  const map = JSON.parse(contents);
+  if (map.sections) {
+    throw new Error('Index source maps are not supported');
+  }
+  if (typeof map.mappings !== 'string') {
+    throw new Error('No mappings in source map');
+  }
+  return indexSourceMap(mapPath, map, MappingIndex.decode(map.mappings));
+}
+
+function indexSourceMap(
+  mapPath: string,
+  map: {
+    file?: string;
+    sourceRoot?: string;
+    sources?: Array<string | null>;
+    names?: string[];
+  },
+  mappings: MappingIndex
+): MapInfoIndexed {
+  const sources = (map.sources || []).map(source =>
+    resolveSource(map.sourceRoot, source)
+  );
+  const names = map.names || [];
+  let byteLength = mappings.byteLength;
+  for (const str of [...sources, ...names]) {
+    byteLength += 2 * str.length + STRING_OVERHEAD_BYTES;
+  }
+  return {
+    mapFileDir: path.dirname(mapPath),
+    file: map.file,
+    sources,
+    names,
+    mappings,
+    byteLength,
+  };
+}
+
+// Matches URLs as the source-map module does: an optional scheme, then "//".
+const URL_REGEXP = /^(?:([\w+\-.]+):)?\/\/(?:(\w+:\w+)@)?([\w.-]*)(?::(\d+))?(.*)$/;
+
+/**
+ * Returns the path of a source of a source map, as SourceMapConsumer of the
+ * source-map module computes it, so that the compact and lazy modes find the
+ * same files as the default one: the source is normalized, made relative to
+ * an absolute sourceRoot which it is under, and appended to sourceRoot. A
+ * null source is the string "null", and URLs keep their scheme and host.
+ */
+function resolveSource(
+  sourceRoot: string | undefined,
+  source: string | null
+): string {
+  let root = sourceRoot ? normalizeSourcePath(sourceRoot) : '';
+  let url = normalizeSourcePath(String(source));
+  if (root && isAbsoluteSourcePath(root) && isAbsoluteSourcePath(url)) {
+    url = relativeSourcePath(root, url);
+  }
+  if (root) {
+    if (root[root.length - 1] !== '/' && url[0] !== '/') {
+      root += '/';
+    }
+    url = root + url;
+  }
+  return normalizeSourcePath(url);
+}
+
+function isAbsoluteSourcePath(p: string): boolean {
+  return p.charAt(0) === '/' || URL_REGEXP.test(p);
+}
+
+// Removes "." and ".." segments and repeated slashes from the path of p,
+// without resolving it, as util.normalize() of the source-map module does.
+function normalizeSourcePath(p: string): string {
+  const url = p.match(URL_REGEXP);
+  let urlPath = p;
+  if (url) {
+    if (!url[5]) {
+      return p;
+    }
+    urlPath = url[5];
+  }
+  const absolute = isAbsoluteSourcePath(urlPath);
+  const parts = urlPath.split(/\/+/);
+  for (let up = 0, i = parts.length - 1; i >= 0; i--) {
+    const part = parts[i];
+    if (part === '.') {
+      parts.splice(i, 1);
+    } else if (part === '..') {
+      up++;
+    } else if (up > 0) {
+      if (part === '') {
+        // Going above the root of an absolute path is a no-op.
+        parts.splice(i + 1, up);
+        up = 0;
+      } else {
+        parts.splice(i, 2);
+        up--;
+      }
+    }
+  }
+  urlPath = parts.join('/');
+  if (urlPath === '') {
+    urlPath = absolute ? '/' : '.';
+  }
+  if (!url) {
+    return urlPath;
+  }
+  const [, scheme, auth, host, port] = url;
+  return (
+    (scheme ? scheme + ':' : '') +
+    '//' +
+    (auth ? auth + '@' : '') +
+    (host || '') +
+    (port ? ':' + port : '') +
+    urlPath
+  );
+}
+
+// Returns p relative to root, as util.relative() of the source-map module
+// does, or p itself if they only share the root of the file system or URL.
+function relativeSourcePath(root: string, p: string): string {
+  root = root.replace(/\/$/, '');
+  let level = 0;
+  while (p.indexOf(root + '/') !== 0) {
+    const index = root.lastIndexOf('/');
+    if (index < 0) {
+      return p;
+    }
+    root = root.slice(0, index);
+    if (root.match(/^([^/]+:\/)?\/*$/)) {
+      return p;
+    }
+    ++level;
+  }
+  return '../'.repeat(level) + p.substr(root.length + 1);
 }
 
 async function getMapFiles(baseDir: string): Promise<string[]> {
@@ -14,7 +14,13 @@
  * limitations under the License.
  */
 import * as path from 'path';
-import {TimeProfile} from './v8-types';
+import {NativeProfileAggregator} from './profile-aggregator-bindings';
+import {
+  GzippedProfile,
+  TimeProfile,
+  TimeProfileColumns,
+  TranslationStats,
+} from './v8-types';
 
 const binary = require('@mapbox/node-pre-gyp');
 const bindingPath = binary.find(
@@ -22,18 +28,179 @@ const bindingPath = binary.find(
 );
 const profiler = require(bindingPath);
 
+/**
+ * ID of the thread which loaded this module: 0 for the main thread, or the
+ * ID of a worker thread. worker_threads requires a flag before Node 11.7.
+ */
+export const threadId: number = (() => {
+  try {
+    return require('worker_threads').threadId;
+  } catch (e) {
+    return 0;
+  }
+})();
+profiler.timeProfiler.setThreadId(threadId);
+
 // Wrappers around native time profiler functions.
-export function startProfiling(runName: string, includeLineInfo?: boolean) {
-  profiler.timeProfiler.startProfiling(runName, includeLineInfo || false);
+export function startProfiling(
+  runName: string,
+  includeLineInfo?: boolean,
+  newProfiler?: boolean,
+  recordSamples?: boolean,
+  cpuTime?: boolean,
+  contexts?: boolean,
+  sampleCost?: boolean
+) {
+  profiler.timeProfiler.startProfiling(
+    runName,
+    includeLineInfo || false,
+    newProfiler || false,
+    recordSamples || false,
+    cpuTime || false,
+    contexts || false,
+    sampleCost || false
+  );
 }
 
 export function stopProfiling(
   runName: string,
-  includeLineInfo?: boolean
+  includeLineInfo?: boolean,
+  maxDepth?: number,
+  minHitCount?: number
 ): TimeProfile {
-  return profiler.timeProfiler.stopProfiling(runName, includeLineInfo || false);
+  return profiler.timeProfiler.stopProfiling(
+    runName,
+    includeLineInfo || false,
+    maxDepth || 0,
+    minHitCount || 0
+  );
+}
+
+export function stopProfilingToColumns(
+  runName: string,
+  includeLineInfo?: boolean,
+  maxDepth?: number,
+  minHitCount?: number
+): TimeProfileColumns {
+  return profiler.timeProfiler.stopProfilingToColumns(
+    runName,
+    includeLineInfo || false,
+    maxDepth || 0,
+    minHitCount || 0
+  );
+}
+
+export function stopProfilingToPprof(
+  runName: string,
+  includeLineInfo: boolean | undefined,
+  intervalMicros: number,
+  timeNanos: number,
+  maxDepth?: number,
+  minHitCount?: number
+): Buffer {
+  return profiler.timeProfiler.stopProfilingToPprof(
+    runName,
+    includeLineInfo || false,
+    intervalMicros,
+    timeNanos,
+    maxDepth || 0,
+    minHitCount || 0
+  );
+}
+
+export function stopProfilingToPprofAsync(
+  runName: string,
+  includeLineInfo: boolean | undefined,
+  intervalMicros: number,
+  timeNanos: number,
+  maxDepth?: number,
+  minHitCount?: number
+): Promise<GzippedProfile> {
+  return new Promise((resolve, reject) => {
+    profiler.timeProfiler.stopProfilingToPprofAsync(
+      runName,
+      includeLineInfo || false,
+      intervalMicros,
+      timeNanos,
+      maxDepth || 0,
+      minHitCount || 0,
+      (err: Error | null, buffer: Buffer, encodeNanos: number) => {
+        if (err) {
+          reject(err);
+        } else {
+          resolve({buffer, encodeNanos});
+        }
+      }
+    );
+  });
+}
+
+export function stopProfilingToAggregate(
+  runName: string,
+  includeLineInfo: boolean | undefined,
+  intervalMicros: number,
+  timeNanos: number,
+  maxDepth: number | undefined,
+  minHitCount: number | undefined,
+  aggregator: NativeProfileAggregator
+) {
+  profiler.timeProfiler.stopProfilingToAggregate(
+    runName,
+    includeLineInfo || false,
+    intervalMicros,
+    timeNanos,
+    maxDepth || 0,
+    minHitCount || 0,
+    aggregator
+  );
 }
 
 export function setSamplingInterval(intervalMicros: number) {
   profiler.timeProfiler.setSamplingInterval(intervalMicros);
 }
+
+export const setContext: (context: number) => void =
+  profiler.timeProfiler.setContext;
+
+export function startProfilingAllThreads(
+  runName: string,
+  includeLineInfo: boolean | undefined,
+  intervalMicros: number
+) {
+  profiler.timeProfiler.startProfilingAllThreads(
+    runName,
+    includeLineInfo || false,
+    intervalMicros
+  );
+}
+
+export function stopProfilingAllThreadsToPprof(
+  runName: string,
+  includeLineInfo: boolean | undefined,
+  intervalMicros: number,
+  timeNanos: number,
+  maxDepth?: number,
+  minHitCount?: number
+): Promise<Buffer> {
+  return new Promise((resolve, reject) => {
+    profiler.timeProfiler.stopProfilingAllThreadsToPprof(
+      runName,
+      includeLineInfo || false,
+      intervalMicros,
+      timeNanos,
+      maxDepth || 0,
+      minHitCount || 0,
+      (err: Error | null, buffer: Buffer) => {
+        if (err) {
+          reject(err);
+        } else {
+          resolve(buffer);
+        }
+      }
+    );
+  });
+}
+
+export function getTranslationStats(): TranslationStats {
+  return profiler.timeProfiler.getTranslationStats();
+}
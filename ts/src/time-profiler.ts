@@ -16,22 +16,129 @@
 
 import delay from 'delay';
 
-import {serializeTimeProfile} from './profile-serializer';
+import {AdaptiveInterval} from './adaptive-interval';
+import {ProfileAggregator} from './profile-aggregator';
+import {ProfileStreamWriter} from './profile-encoder';
+import {
+  serializeTimeProfile,
+  serializeTimeProfileColumns,
+  sharedStringTable,
+} from './profile-serializer';
+import {
+  gzippedWithStats,
+  measureSerialization,
+  newProfileStats,
+  profileStats,
+  setProfileStats,
+} from './profiler-stats';
 import {SourceMapper} from './sourcemapper/sourcemapper';
 import {
+  getTranslationStats,
+  setContext as setThreadContext,
   setSamplingInterval,
   startProfiling,
+  startProfilingAllThreads,
   stopProfiling,
+  stopProfilingAllThreadsToPprof,
+  stopProfilingToAggregate,
+  stopProfilingToColumns,
+  stopProfilingToPprof,
+  stopProfilingToPprofAsync,
+  threadId,
 } from './time-profiler-bindings';
+import {TimeProfile, TimeProfileColumns} from './v8-types';
 
 let profiling = false;
 
 const DEFAULT_INTERVAL_MICROS: Microseconds = 1000;
 
+/**
+ * Number of consecutive profiles collected by restarting profiling before the
+ * next profile is started on a new CPU profiler, which releases the memory
+ * leaked by the previous one in Node 12 and later
+ * (https://bugs.chromium.org/p/v8/issues/detail?id=11051).
+ */
+const PROFILES_PER_CPU_PROFILER = 10;
+
+/**
+ * Whether profiles can be started on a new CPU profiler while others are
+ * running, which is how the sampling interval is changed between
+ * consecutive profiles; this needs Node 12 or later.
+ */
+const NEW_PROFILER_SUPPORTED =
+  Number(process.versions.node.split('.')[0]) >= 12;
+
+/**
+ * State of the profile currently being collected.
+ */
+interface ProfilingRun {
+  runName: string;
+  intervalMicros: Microseconds;
+  lineNumbers?: boolean;
+  recordSamples?: boolean;
+  cpuTime?: boolean;
+  contexts?: boolean;
+  sampleCost?: boolean;
+  // Number of profiles collected with the current CPU profiler.
+  profileCount: number;
+}
+
 type Microseconds = number;
 type Milliseconds = number;
 
-export interface TimeProfilerOptions {
+/**
+ * Limits on the call tree of a profile, which keep the profiles of deeply
+ * recursive code small. The hits of the nodes pruned from the children of a
+ * node are folded into a single child named "(truncated)". Pruning is done
+ * natively when profiling stops, so pruned nodes are never translated.
+ */
+export interface TimeProfilePruning {
+  /**
+   * Maximum depth of the nodes of the call tree, where the children of the
+   * root have depth 1. Deeper nodes are pruned. There is no limit by default.
+   */
+  maxDepth?: number;
+  /**
+   * Minimum total hit count of a subtree of the call tree. Subtrees with
+   * fewer hits are pruned. There is no minimum by default.
+   */
+  minHitCount?: number;
+}
+
+/**
+ * Options of how a profile is collected, besides where and how often it is
+ * sampled.
+ */
+export interface TimeProfileCollection extends TimeProfilePruning {
+  /**
+   * When set to true, the CPU time used by this thread is sampled along with
+   * the profile, and each sample of the profile has the CPU time used since
+   * the sample before it, in a "cpu" value in nanoseconds. The time profile
+   * alone cannot tell time spent running from time spent waiting for a lock
+   * or for I/O. This defaults to false.
+   */
+  cpuTime?: boolean;
+  /**
+   * When set to true, the context set with setContext() is sampled along
+   * with the profile, and the samples of each function are split by the
+   * context they were taken in, with a numeric "context" label unless it is
+   * 0. The context is recorded each time the profiler samples the thread,
+   * so each sample has the context set when it was taken. This is not
+   * supported on Windows, where starting the profile throws. This defaults
+   * to false.
+   */
+  contexts?: boolean;
+  /**
+   * When set to true, the CPU time this thread spends in the signal handler
+   * of the profiler, taking samples, is measured, and reported in the
+   * sampleNanos field of the stats of the profile. It is not measured on
+   * Windows. This is set when an adaptive interval is used, and defaults to
+   * false otherwise.
+   */
+  sampleCost?: boolean;
+}
+
+export interface TimeProfilerOptions extends TimeProfileCollection {
   /** time in milliseconds for which to collect profile. */
   durationMillis: Milliseconds;
   /** average time in microseconds between samples */
@@ -46,31 +153,463 @@ export interface TimeProfilerOptions {
    * This defaults to false.
    */
   lineNumbers?: boolean;
+
+  /**
+   * When set to true, the time and node of each sample are recorded, and
+   * returned in the samples field of profiles collected by v8Profile().
+   * This defaults to false.
+   */
+  recordSamples?: boolean;
+
+  /**
+   * When set, the sampling interval is chosen by adaptiveInterval instead of
+   * intervalMicros, which is updated with the cost of each profile collected
+   * by profile() or profileToPprof(). Pass the same instance to each call, so
+   * that the interval adapts from one profile to the next.
+   */
+  adaptiveInterval?: AdaptiveInterval;
 }
 
+/**
+ * Sets the context of this thread, a non-negative integer such as the ID of
+ * the endpoint or tenant of the request being served, until it is set again;
+ * 0 means no context. Profiles started with the contexts option label their
+ * samples with it. Setting the context is a single atomic store, so it can
+ * be done on every switch between asynchronous contexts, e.g. from the
+ * before hook of async_hooks with the store of an AsyncLocalStorage.
+ */
+export const setContext: (context: number) => void = setThreadContext;
+
 export async function profile(options: TimeProfilerOptions) {
   const stop = start(
     options.intervalMicros || DEFAULT_INTERVAL_MICROS,
     options.name,
     options.sourceMapper,
-    options.lineNumbers
+    options.lineNumbers,
+    options,
+    options.adaptiveInterval
   );
   await delay(options.durationMillis);
   return stop();
 }
 
+/**
+ * Starts profiling. The returned function stops profiling and returns the
+ * profile.
+ *
+ * When adaptiveInterval is set, it chooses the sampling interval instead of
+ * intervalMicros, and it is updated with the cost of each profile. The next
+ * profile is started before the current one is stopped, so a restarted
+ * profile is sampled at the interval chosen after the profile before the
+ * current one. The period of each profile is the interval it was sampled
+ * at. Before Node 12, the interval only changes when profiling is started.
+ */
 export function start(
   intervalMicros: Microseconds = DEFAULT_INTERVAL_MICROS,
   name?: string,
   sourceMapper?: SourceMapper,
-  lineNumbers?: boolean
+  lineNumbers?: boolean,
+  collection: TimeProfileCollection = {},
+  adaptiveInterval?: AdaptiveInterval
+) {
+  const run = startV8Profiling(
+    adaptiveInterval ? adaptiveInterval.intervalMicros : intervalMicros,
+    name,
+    lineNumbers,
+    false,
+    collection.cpuTime,
+    collection.contexts,
+    collection.sampleCost || !!adaptiveInterval
+  );
+  /**
+   * Stops profiling and returns the profile. If restart is true, the next
+   * profile is started before this one is stopped, so that consecutive
+   * profiles have no gap between them, and stop() may be called again to
+   * collect it.
+   */
+  return function stop(restart = false) {
+    const runIntervalMicros = run.intervalMicros;
+    const prof = stopV8Profiling(
+      run,
+      restart,
+      runName =>
+        stopProfiling(
+          runName,
+          lineNumbers,
+          collection.maxDepth,
+          collection.minHitCount
+        ),
+      adaptiveInterval && adaptiveInterval.intervalMicros
+    );
+    const stats = newProfileStats(getTranslationStats());
+    const profile = measureSerialization(stats, sourceMapper, () =>
+      serializeTimeProfile(
+        prof,
+        runIntervalMicros,
+        sourceMapper,
+        sharedStringTable
+      )
+    );
+    setProfileStats(profile, stats);
+    if (adaptiveInterval) {
+      adaptiveInterval.update(
+        prof.endTime - prof.startTime,
+        runIntervalMicros,
+        stats
+      );
+    }
+    return profile;
+  };
+}
+
+/**
+ * Collects a profile and returns it as translated from V8, without
+ * serializing it.
+ */
+export async function v8Profile(
+  options: TimeProfilerOptions
+): Promise<TimeProfile> {
+  const stop = startV8Profile(
+    options.intervalMicros || DEFAULT_INTERVAL_MICROS,
+    options.name,
+    options.lineNumbers,
+    options.recordSamples,
+    options
+  );
+  await delay(options.durationMillis);
+  return stop();
+}
+
+/**
+ * Starts profiling. The returned function stops profiling and returns the
+ * profile as translated from V8. If recordSamples is true, the profile
+ * includes the time and node of each sample, which may refer to nodes
+ * removed by pruning. As with start(), passing true to the returned function
+ * starts the next profile before the current one is stopped.
+ */
+export function startV8Profile(
+  intervalMicros: Microseconds = DEFAULT_INTERVAL_MICROS,
+  name?: string,
+  lineNumbers?: boolean,
+  recordSamples?: boolean,
+  collection: TimeProfileCollection = {}
 ) {
+  const run = startV8Profiling(
+    intervalMicros,
+    name,
+    lineNumbers,
+    recordSamples,
+    collection.cpuTime,
+    collection.contexts,
+    collection.sampleCost
+  );
+  return function stop(restart = false): TimeProfile {
+    const profile = stopV8Profiling(run, restart, runName =>
+      stopProfiling(
+        runName,
+        lineNumbers,
+        collection.maxDepth,
+        collection.minHitCount
+      )
+    );
+    return {...profile, threadId};
+  };
+}
+
+/**
+ * Collects a profile and returns it with its tree translated into columns,
+ * without serializing it.
+ */
+export async function v8ProfileColumns(
+  options: TimeProfilerOptions
+): Promise<TimeProfileColumns> {
+  const stop = startV8ProfileColumns(
+    options.intervalMicros || DEFAULT_INTERVAL_MICROS,
+    options.name,
+    options.lineNumbers,
+    options.recordSamples,
+    options
+  );
+  await delay(options.durationMillis);
+  return stop();
+}
+
+/**
+ * Starts profiling, as startV8Profile() does. The returned function stops
+ * profiling and returns the profile with its tree translated into columns,
+ * which takes a few typed arrays rather than one object per node.
+ */
+export function startV8ProfileColumns(
+  intervalMicros: Microseconds = DEFAULT_INTERVAL_MICROS,
+  name?: string,
+  lineNumbers?: boolean,
+  recordSamples?: boolean,
+  collection: TimeProfileCollection = {}
+) {
+  const run = startV8Profiling(
+    intervalMicros,
+    name,
+    lineNumbers,
+    recordSamples,
+    collection.cpuTime,
+    collection.contexts,
+    collection.sampleCost
+  );
+  return function stop(restart = false): TimeProfileColumns {
+    const profile = stopV8Profiling(run, restart, runName =>
+      stopProfilingToColumns(
+        runName,
+        lineNumbers,
+        collection.maxDepth,
+        collection.minHitCount
+      )
+    );
+    return {...profile, threadId};
+  };
+}
+
+/**
+ * Collects a profile and returns it gzipped in pprof format, ready to be
+ * written to a file or uploaded.
+ *
+ * Unless a source mapper is specified, the profile is serialized by the
+ * native module without first being translated into JavaScript objects, on
+ * a worker thread, so that only copying it out of V8 blocks the event loop.
+ * Otherwise, it is translated into columns, and samples are encoded and
+ * gzipped in chunks as they are serialized.
+ */
+export async function profileToPprof(
+  options: TimeProfilerOptions
+): Promise<Buffer> {
+  const adaptiveInterval = options.adaptiveInterval;
+  const intervalMicros = adaptiveInterval
+    ? adaptiveInterval.intervalMicros
+    : options.intervalMicros || DEFAULT_INTERVAL_MICROS;
+  if (adaptiveInterval) {
+    options = {...options, sampleCost: true};
+  }
+  if (options.sourceMapper) {
+    const stop = startV8ProfileColumns(
+      intervalMicros,
+      options.name,
+      options.lineNumbers,
+      false,
+      options
+    );
+    await delay(options.durationMillis);
+    const prof = stop();
+    const stats = newProfileStats(getTranslationStats());
+    const writer = new ProfileStreamWriter();
+    const profile = measureSerialization(stats, options.sourceMapper, () =>
+      serializeTimeProfileColumns(
+        prof,
+        intervalMicros,
+        options.sourceMapper,
+        sharedStringTable,
+        samples => writer.writeSamples(samples)
+      )
+    );
+    setProfileStats(profile, stats);
+    const buffer = await writer.finish(profile);
+    if (adaptiveInterval) {
+      adaptiveInterval.update(
+        prof.endTime - prof.startTime,
+        intervalMicros,
+        stats
+      );
+    }
+    return buffer;
+  }
+  const stop = startToPprofAsync(
+    intervalMicros,
+    options.name,
+    options.lineNumbers,
+    options
+  );
+  await delay(options.durationMillis);
+  const buffer = await stop();
+  if (adaptiveInterval) {
+    adaptiveInterval.update(
+      options.durationMillis * 1000,
+      intervalMicros,
+      profileStats(buffer)!
+    );
+  }
+  return buffer;
+}
+
+/**
+ * Collects a profile from this thread and from every other thread (main or
+ * worker) which has loaded this module, and returns the profiles merged into
+ * one, gzipped in pprof format. Each sample has a "thread" label with the ID
+ * of its thread. The source mapper, cpuTime and contexts options are not
+ * supported. Threads which are already profiling, or which fail to start
+ * profiling, are left out, as are threads which do not stop profiling
+ * within a second, e.g. because they are blocked in a synchronous call;
+ * comments of the profile count them. Only this thread reports when it is
+ * idle, so the idle time of other threads is attributed to (program).
+ */
+export async function profileAllThreads(
+  options: TimeProfilerOptions
+): Promise<Buffer> {
+  if (profiling) {
+    throw new Error('already profiling');
+  }
+  const intervalMicros = options.intervalMicros || DEFAULT_INTERVAL_MICROS;
+  const runName = options.name || newRunName();
+  startProfilingAllThreads(runName, options.lineNumbers, intervalMicros);
+  profiling = true;
+  // eslint-disable-next-line @typescript-eslint/no-explicit-any
+  (process as any)._startProfilerIdleNotifier();
+  try {
+    await delay(options.durationMillis);
+    return await stopProfilingAllThreadsToPprof(
+      runName,
+      options.lineNumbers,
+      intervalMicros,
+      Date.now() * 1000 * 1000,
+      options.maxDepth,
+      options.minHitCount
+    );
+  } finally {
+    profiling = false;
+    // eslint-disable-next-line @typescript-eslint/no-explicit-any
+    (process as any)._stopProfilerIdleNotifier();
+  }
+}
+
+/**
+ * Starts profiling. The returned function stops profiling and returns the
+ * profile serialized in pprof format by the native module. The returned
+ * buffer is not compressed. As with start(), passing true to the returned
+ * function starts the next profile before the current one is stopped.
+ */
+export function startToPprof(
+  intervalMicros: Microseconds = DEFAULT_INTERVAL_MICROS,
+  name?: string,
+  lineNumbers?: boolean,
+  collection: TimeProfileCollection = {}
+) {
+  const run = startV8Profiling(
+    intervalMicros,
+    name,
+    lineNumbers,
+    false,
+    collection.cpuTime,
+    collection.contexts,
+    collection.sampleCost
+  );
+  return function stop(restart = false): Buffer {
+    return stopV8Profiling(run, restart, (runName, runIntervalMicros) =>
+      stopProfilingToPprof(
+        runName,
+        lineNumbers,
+        runIntervalMicros,
+        Date.now() * 1000 * 1000,
+        collection.maxDepth,
+        collection.minHitCount
+      )
+    );
+  };
+}
+
+/**
+ * Starts profiling. The returned function stops profiling, and resolves to
+ * the profile gzipped in pprof format. Only copying the profile out of V8
+ * blocks the event loop: the profile is serialized and gzipped on a libuv
+ * worker thread. As with start(), passing true to the returned function
+ * starts the next profile before the current one is stopped.
+ */
+export function startToPprofAsync(
+  intervalMicros: Microseconds = DEFAULT_INTERVAL_MICROS,
+  name?: string,
+  lineNumbers?: boolean,
+  collection: TimeProfileCollection = {}
+) {
+  const run = startV8Profiling(
+    intervalMicros,
+    name,
+    lineNumbers,
+    false,
+    collection.cpuTime,
+    collection.contexts,
+    collection.sampleCost
+  );
+  return function stop(restart = false): Promise<Buffer> {
+    const gzipped = stopV8Profiling(
+      run,
+      restart,
+      (runName, runIntervalMicros) =>
+        stopProfilingToPprofAsync(
+          runName,
+          lineNumbers,
+          runIntervalMicros,
+          Date.now() * 1000 * 1000,
+          collection.maxDepth,
+          collection.minHitCount
+        )
+    );
+    // The profile has already been copied, so the translation stats are
+    // those of the copy.
+    return gzippedWithStats(gzipped, newProfileStats(getTranslationStats()));
+  };
+}
+
+/**
+ * Starts profiling. The returned function stops profiling and merges the
+ * profile into aggregator, natively, without translating or serializing it.
+ * The merged profile is collected with aggregator.flush(). As with start(),
+ * passing true to the returned function starts the next profile before the
+ * current one is stopped, so that successive profiles can be merged without
+ * gaps. Profiles collected with and without cpuTime cannot be merged into
+ * the same aggregator.
+ */
+export function startToAggregate(
+  aggregator: ProfileAggregator,
+  intervalMicros: Microseconds = DEFAULT_INTERVAL_MICROS,
+  name?: string,
+  lineNumbers?: boolean,
+  collection: TimeProfileCollection = {}
+) {
+  const run = startV8Profiling(
+    intervalMicros,
+    name,
+    lineNumbers,
+    false,
+    collection.cpuTime,
+    collection.contexts,
+    collection.sampleCost
+  );
+  return function stop(restart = false) {
+    stopV8Profiling(run, restart, (runName, runIntervalMicros) =>
+      stopProfilingToAggregate(
+        runName,
+        lineNumbers,
+        runIntervalMicros,
+        Date.now() * 1000 * 1000,
+        collection.maxDepth,
+        collection.minHitCount,
+        aggregator.native
+      )
+    );
+  };
+}
+
+function startV8Profiling(
+  intervalMicros: Microseconds,
+  name?: string,
+  lineNumbers?: boolean,
+  recordSamples?: boolean,
+  cpuTime?: boolean,
+  contexts?: boolean,
+  sampleCost?: boolean
+): ProfilingRun {
   if (profiling) {
     throw new Error('already profiling');
   }
 
   profiling = true;
-  const runName = name || `pprof-${Date.now()}-${Math.random()}`;
+  const runName = name || newRunName();
   setSamplingInterval(intervalMicros);
   // Node.js contains an undocumented API for reporting idle status to V8.
   // This lets the profiler distinguish idle time from time spent in native
@@ -79,13 +618,75 @@ export function start(
   // See https://github.com/nodejs/node/issues/19009#issuecomment-403161559.
   // eslint-disable-next-line @typescript-eslint/no-explicit-any
   (process as any)._startProfilerIdleNotifier();
-  startProfiling(runName, lineNumbers);
-  return function stop() {
-    profiling = false;
-    const result = stopProfiling(runName, lineNumbers);
-    // eslint-disable-next-line @typescript-eslint/no-explicit-any
-    (process as any)._stopProfilerIdleNotifier();
-    const profile = serializeTimeProfile(result, intervalMicros, sourceMapper);
-    return profile;
+  startProfiling(
+    runName,
+    lineNumbers,
+    false,
+    recordSamples,
+    cpuTime,
+    contexts,
+    sampleCost
+  );
+  return {
+    runName,
+    intervalMicros,
+    lineNumbers,
+    recordSamples,
+    cpuTime,
+    contexts,
+    sampleCost,
+    profileCount: 0,
   };
 }
+
+/**
+ * Stops the profile of run with stopFn, which is passed its name and its
+ * sampling interval. When restarting, the next profile is sampled every
+ * nextIntervalMicros, if set and supported.
+ */
+function stopV8Profiling<T>(
+  run: ProfilingRun,
+  restart: boolean,
+  stopFn: (runName: string, intervalMicros: Microseconds) => T,
+  nextIntervalMicros?: Microseconds
+): T {
+  const runName = run.runName;
+  const intervalMicros = run.intervalMicros;
+  if (restart) {
+    run.profileCount++;
+    let newProfiler = run.profileCount >= PROFILES_PER_CPU_PROFILER;
+    if (
+      NEW_PROFILER_SUPPORTED &&
+      nextIntervalMicros &&
+      nextIntervalMicros !== intervalMicros
+    ) {
+      // The sampling interval of a CPU profiler is set when it is created.
+      setSamplingInterval(nextIntervalMicros);
+      run.intervalMicros = nextIntervalMicros;
+      newProfiler = true;
+    }
+    if (newProfiler) {
+      run.profileCount = 0;
+    }
+    run.runName = newRunName();
+    startProfiling(
+      run.runName,
+      run.lineNumbers,
+      newProfiler,
+      run.recordSamples,
+      run.cpuTime,
+      run.contexts,
+      run.sampleCost
+    );
+    return stopFn(runName, intervalMicros);
+  }
+  profiling = false;
+  const result = stopFn(runName, intervalMicros);
+  // eslint-disable-next-line @typescript-eslint/no-explicit-any
+  (process as any)._stopProfilerIdleNotifier();
+  return result;
+}
+
+function newRunName() {
+  return `pprof-${Date.now()}-${Math.random()}`;
+}
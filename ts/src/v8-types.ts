@@ -22,6 +22,20 @@ export interface TimeProfile {
   topDownRoot: TimeProfileNode;
   /** Time in nanoseconds at which profile was started. */
   startTime: number;
+  /** Samples, if they were recorded and there is at least one sample. */
+  samples?: TimeProfileSamples;
+  /** ID of the profiled thread: 0 for the main thread. */
+  threadId?: number;
+}
+
+/**
+ * Samples of a time profile, as columns: sample i was taken in the node with
+ * ID nodeIds[i], timeDeltas[i] microseconds after the previous sample (or the
+ * start of the profile, for the first sample).
+ */
+export interface TimeProfileSamples {
+  timeDeltas: Int32Array;
+  nodeIds: Uint32Array;
 }
 
 export interface ProfileNode {
@@ -31,11 +45,41 @@ export interface ProfileNode {
   scriptId?: number;
   lineNumber?: number;
   columnNumber?: number;
+  /**
+   * Keys, from 0, of the location and function of the node among those of
+   * its profile; only set by the native time profiler.
+   */
+  locationKey?: number;
+  functionKey?: number;
   children: ProfileNode[];
 }
 
 export interface TimeProfileNode extends ProfileNode {
   hitCount: number;
+  /**
+   * ID which samples refer to; only set when samples were recorded. With line
+   * numbers, the nodes for the self time of a function have the ID.
+   */
+  id?: number;
+  /**
+   * CPU time in nanoseconds used by the thread in the samples of this node;
+   * only set when the profile was started with cpuTime.
+   */
+  cpuTime?: number;
+  /**
+   * The hits of this node split by the context they were sampled in; only
+   * set on nodes with hits when the profile was started with contexts.
+   */
+  contexts?: TimeProfileNodeContext[];
+}
+
+/** The hits of a node which were sampled in one context. */
+export interface TimeProfileNodeContext {
+  /** Context set by setContext(), or 0 for none. */
+  context: number;
+  hitCount: number;
+  /** CPU time in nanoseconds, when the profile was started with cpuTime. */
+  cpuTime?: number;
 }
 
 export interface AllocationProfileNode extends ProfileNode {
@@ -46,3 +90,165 @@ export interface Allocation {
   sizeBytes: number;
   count: number;
 }
+
+/**
+ * Changes in the allocation profile since the heap profiler was started, or
+ * since the previous delta was collected.
+ */
+export interface AllocationProfileDelta {
+  /** Nodes not included in a previous delta, parents first. */
+  nodes: AllocationProfileDeltaNode[];
+  /** New samples, as columns; sample i has ID sampleIds[i]. */
+  samples: AllocationProfileDeltaSamples;
+  /** IDs of previously reported samples which have since been freed. */
+  freedSampleIds: Float64Array;
+  /**
+   * True if an adaptive interval restarted the sampling heap profiler since
+   * the previous delta. The nodes and samples reported before are then gone
+   * without being listed as freed, and their IDs may be reused; this delta
+   * has every node and sample of the new profile.
+   */
+  reset: boolean;
+}
+
+export interface AllocationProfileDeltaNode {
+  id: number;
+  /** ID of the parent node, or 0 for the root node. */
+  parentId: number;
+  name: string;
+  scriptName: string;
+  scriptId: number;
+  lineNumber: number;
+  columnNumber: number;
+}
+
+export interface AllocationProfileDeltaSamples {
+  sampleIds: Float64Array;
+  nodeIds: Uint32Array;
+  sizes: Float64Array;
+  counts: Uint32Array;
+}
+
+/**
+ * The nodes of a profile tree as columns, which take a few typed arrays
+ * rather than one object per node. Node i is a call to the function named
+ * strings[names[i]] in the script named strings[scriptNames[i]], and its
+ * parent is node parents[i]. Parents come before their children; node 0 is
+ * the root, whose parent is -1.
+ */
+/**
+ * Cost of the last collection of a profile by the native module.
+ */
+export interface TranslationStats {
+  /**
+   * Time in nanoseconds taken to copy the profile out of V8 and translate
+   * or serialize it, measured with a monotonic clock. For a profile
+   * serialized on a worker thread, this is only the time taken on the
+   * profiled thread.
+   */
+  nanos: number;
+  /** Nodes of the profile, the root included. */
+  nodeCount: number;
+  /** Hits of a time profile, or sampled objects of a heap profile. */
+  sampleCount: number;
+  /**
+   * CPU time in nanoseconds which the profiled thread spent taking the
+   * samples of a time profile, or -1 if it was not measured.
+   */
+  sampleNanos: number;
+}
+
+/**
+ * A profile copied out of V8 by the native module, then serialized in pprof
+ * format and gzipped on a libuv worker thread.
+ */
+export interface GzippedProfile {
+  buffer: Buffer;
+  /** Time in nanoseconds taken on the worker thread. */
+  encodeNanos: number;
+}
+
+export interface ProfileNodeColumns {
+  parents: Int32Array;
+  names: Int32Array;
+  scriptNames: Int32Array;
+  scriptIds: Int32Array;
+  lineNumbers: Int32Array;
+  columnNumbers: Int32Array;
+  /**
+   * Keys, from 0, of the locations and functions of the nodes among those of
+   * the profile; only set by the native module.
+   */
+  locationKeys?: Int32Array;
+  functionKeys?: Int32Array;
+}
+
+export interface TimeProfileNodeColumns extends ProfileNodeColumns {
+  hitCounts: Int32Array;
+  /**
+   * IDs which samples refer to, or 0 for nodes which no sample refers to;
+   * only set when samples were recorded.
+   */
+  ids?: Uint32Array;
+  /**
+   * CPU time in nanoseconds used in the samples of each node; only set when
+   * the profile was started with cpuTime.
+   */
+  cpuTimes?: Float64Array;
+}
+
+/**
+ * A time profile with its tree translated into columns rather than objects.
+ */
+export interface TimeProfileColumns {
+  /** Time in nanoseconds at which profile was stopped. */
+  endTime: number;
+  /** Time in nanoseconds at which profile was started. */
+  startTime: number;
+  /** Distinct strings which the nodes refer to. */
+  strings: string[];
+  nodes: TimeProfileNodeColumns;
+  /** Hits of the nodes by context, if the profile was started with them. */
+  contexts?: TimeProfileContextColumns;
+  /** Samples, if they were recorded and there is at least one sample. */
+  samples?: TimeProfileSamples;
+  /** ID of the profiled thread: 0 for the main thread. */
+  threadId?: number;
+}
+
+/**
+ * Hits of nodes by context, as columns: hitCounts[i] hits of node nodes[i]
+ * were sampled in context contexts[i], where they used cpuTimes[i]
+ * nanoseconds of CPU time if CPU time was recorded. The contexts of a node
+ * are consecutive, in the order of the nodes, and in increasing order.
+ */
+export interface TimeProfileContextColumns {
+  nodes: Int32Array;
+  contexts: Uint32Array;
+  hitCounts: Int32Array;
+  cpuTimes?: Float64Array;
+}
+
+/**
+ * An allocation profile translated into columns rather than objects.
+ */
+export interface AllocationProfileColumns {
+  /** Distinct strings which the nodes refer to. */
+  strings: string[];
+  nodes: ProfileNodeColumns;
+  allocations: AllocationColumns;
+}
+
+/**
+ * Allocations as columns, merged by size bucket: allocation i is of counts[i]
+ * objects of bytes[i] bytes in total, in node nodes[i], each of which is at
+ * most buckets[i] bytes, a power of two, and more than half of it. The
+ * allocations of a node are consecutive, in the order of the nodes, and in
+ * increasing order of their buckets.
+ */
+export interface AllocationColumns {
+  nodes: Int32Array;
+  buckets: Float64Array;
+  counts: Uint32Array;
+  bytes: Float64Array;
+}
@@ -189,6 +189,12 @@ export const decodedTimeProfile = Object.freeze(
   perftools.profiles.Profile.decode(encodedTimeProfile)
 );
 
+// Label of a heap sample with the size bucket of its objects, where "bytes"
+// is string 4.
+function bytesLabel(bucket: number): perftools.profiles.Label[] {
+  return [new perftools.profiles.Label({key: 4, num: bucket, numUnit: 4})];
+}
+
 const heapLeaf1 = {
   name: 'function2',
   scriptName: 'script1',
@@ -294,28 +300,23 @@ export const heapProfile: perftools.profiles.IProfile = Object.freeze({
   sample: [
     new perftools.profiles.Sample({
       locationId: [1],
-      value: [1, 5],
-      label: [],
-    }),
-    new perftools.profiles.Sample({
-      locationId: [1],
-      value: [3, 21],
-      label: [],
+      value: [4, 26],
+      label: bytesLabel(8),
     }),
     new perftools.profiles.Sample({
       locationId: [3, 2, 1],
       value: [8, 80],
-      label: [],
+      label: bytesLabel(16),
     }),
     new perftools.profiles.Sample({
       locationId: [3, 2, 1],
       value: [15, 15 * 72],
-      label: [],
+      label: bytesLabel(128),
     }),
     new perftools.profiles.Sample({
       locationId: [4, 2, 1],
       value: [5, 5 * 1024],
-      label: [],
+      label: bytesLabel(1024),
     }),
   ],
   location: heapLocations,
@@ -404,32 +405,27 @@ export const heapProfileWithExternal: perftools.profiles.IProfile =
       new perftools.profiles.Sample({
         locationId: [1],
         value: [1, 1024],
-        label: [],
-      }),
-      new perftools.profiles.Sample({
-        locationId: [2],
-        value: [1, 5],
-        label: [],
+        label: bytesLabel(1024),
       }),
       new perftools.profiles.Sample({
         locationId: [2],
-        value: [3, 21],
-        label: [],
+        value: [4, 26],
+        label: bytesLabel(8),
       }),
       new perftools.profiles.Sample({
         locationId: [4, 3, 2],
         value: [8, 80],
-        label: [],
+        label: bytesLabel(16),
       }),
       new perftools.profiles.Sample({
         locationId: [4, 3, 2],
         value: [15, 15 * 72],
-        label: [],
+        label: bytesLabel(128),
       }),
       new perftools.profiles.Sample({
         locationId: [5, 3, 2],
         value: [5, 5 * 1024],
-        label: [],
+        label: bytesLabel(1024),
       }),
     ],
     location: heapLocationsWithExternal,
@@ -507,7 +503,7 @@ export const anonymousFunctionHeapProfile: perftools.profiles.IProfile =
       new perftools.profiles.Sample({
         locationId: [1],
         value: [1, 5],
-        label: [],
+        label: bytesLabel(8),
       }),
     ],
     location: anonymousFunctionHeapLocations,
@@ -725,17 +721,17 @@ export const heapProfileIncludePath: perftools.profiles.IProfile =
       new perftools.profiles.Sample({
         locationId: [2, 1],
         value: [2, 4],
-        label: [],
+        label: bytesLabel(2),
       }),
       new perftools.profiles.Sample({
         locationId: [3, 1],
         value: [1, 2],
-        label: [],
+        label: bytesLabel(2),
       }),
       new perftools.profiles.Sample({
         locationId: [5, 4],
         value: [3, 6],
-        label: [],
+        label: bytesLabel(2),
       }),
     ],
     location: heapIncludePathLocations,
@@ -805,7 +801,7 @@ export const heapProfileExcludePath: perftools.profiles.IProfile =
       new perftools.profiles.Sample({
         locationId: [2, 1],
         value: [1, 2],
-        label: [],
+        label: bytesLabel(2),
       }),
     ],
     location: heapExcludePathLocations,
@@ -967,12 +963,12 @@ export const heapSourceProfile: perftools.profiles.IProfile = Object.freeze({
     new perftools.profiles.Sample({
       locationId: [2, 1],
       value: [3, 6],
-      label: [],
+      label: bytesLabel(2),
     }),
     new perftools.profiles.Sample({
       locationId: [4, 3, 1],
       value: [5, 25],
-      label: [],
+      label: bytesLabel(8),
     }),
   ],
   location: heapSourceLocations,
@@ -0,0 +1,131 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+import {AdaptiveHeapInterval, AdaptiveInterval} from '../src/adaptive-interval';
+import {ProfileStats} from '../src/profiler-stats';
+
+const assert = require('assert');
+
+function stats(
+  sampleCount: number,
+  translateNanos = 0,
+  sampleNanos = -1
+): ProfileStats {
+  return {
+    translateNanos,
+    serializeNanos: 0,
+    sourceMapNanos: 0,
+    encodeNanos: 0,
+    encodedBytes: 0,
+    nodeCount: 1,
+    sampleCount,
+    sampleNanos,
+  };
+}
+
+describe('AdaptiveInterval', () => {
+  const options = {
+    targetOverhead: 0.01,
+    minIntervalMicros: 1000,
+    maxIntervalMicros: 64000,
+    sampleCostNanos: 10000,
+  };
+
+  it('should start at the shortest interval', () => {
+    assert.strictEqual(new AdaptiveInterval(options).intervalMicros, 1000);
+  });
+
+  it('should measure the cost of a window', () => {
+    const adaptive = new AdaptiveInterval(options);
+    // 1000 samples of 10us and 10ms to collect, over 1s.
+    assert.strictEqual(adaptive.overhead(1e6, stats(1000, 1e7)), 0.02);
+  });
+
+  it('should lengthen the interval when over the target overhead', () => {
+    const adaptive = new AdaptiveInterval(options);
+    // 1000 samples of 10us over 1s cost 1%, twice the target of 0.5%.
+    const halfPercent = new AdaptiveInterval({
+      ...options,
+      targetOverhead: 0.005,
+    });
+    assert.strictEqual(halfPercent.update(1e6, 1000, stats(1000)), 2000);
+    // At the target, the interval does not change.
+    assert.strictEqual(adaptive.update(1e6, 1000, stats(1000)), 1000);
+  });
+
+  it('should use the measured cost of the samples over the estimate', () => {
+    // 1000 samples which cost 2.5ms to take over 1s, rather than the 10ms
+    // estimated, cost 0.25%.
+    assert.strictEqual(
+      new AdaptiveInterval(options).overhead(1e6, stats(1000, 0, 2.5e6)),
+      0.0025
+    );
+    // With the same number of samples, only the measured cost moves the
+    // interval: the estimate alone would keep it at 4000.
+    const adaptive = new AdaptiveInterval(options);
+    assert.strictEqual(adaptive.update(1e6, 4000, stats(1000)), 4000);
+    assert.strictEqual(adaptive.update(1e6, 4000, stats(1000, 0, 2e7)), 8000);
+    assert.strictEqual(adaptive.update(1e6, 4000, stats(1000, 0, 5e6)), 2000);
+    // A measured cost of 0 is used rather than the estimate.
+    assert.strictEqual(adaptive.update(1e6, 4000, stats(1000, 0, 0)), 2000);
+  });
+
+  it('should change the interval by at most a factor of two', () => {
+    const adaptive = new AdaptiveInterval(options);
+    assert.strictEqual(adaptive.update(1e6, 4000, stats(10000)), 8000);
+    assert.strictEqual(adaptive.update(1e6, 8000, stats(0)), 4000);
+  });
+
+  it('should keep the interval within bounds', () => {
+    const adaptive = new AdaptiveInterval(options);
+    assert.strictEqual(adaptive.update(1e6, 1000, stats(0)), 1000);
+    assert.strictEqual(adaptive.update(1e6, 48000, stats(1e6)), 64000);
+    assert.strictEqual(adaptive.intervalMicros, 64000);
+  });
+
+  it('should not change the interval after an empty window', () => {
+    const adaptive = new AdaptiveInterval(options);
+    assert.strictEqual(adaptive.update(0, 1000, stats(100)), 1000);
+  });
+});
+
+describe('AdaptiveHeapInterval', () => {
+  const adaptive = new AdaptiveHeapInterval({
+    minSamples: 100,
+    maxSamples: 300,
+    minIntervalBytes: 1024,
+    maxIntervalBytes: 1024 * 1024,
+  });
+
+  it('should start with the middle of the range of samples', () => {
+    assert.strictEqual(adaptive.initialIntervalBytes(200 * 4096), 4096);
+    assert.strictEqual(adaptive.initialIntervalBytes(0), 1024);
+  });
+
+  it('should keep the interval while the samples are in range', () => {
+    assert.strictEqual(adaptive.update(4096, 100 * 4096), undefined);
+    assert.strictEqual(adaptive.update(4096, 300 * 4096), undefined);
+  });
+
+  it('should aim at the middle of the range of samples', () => {
+    assert.strictEqual(adaptive.update(4096, 400 * 4096), 8192);
+    assert.strictEqual(adaptive.update(4096, 50 * 4096), 1024);
+    assert.strictEqual(
+      adaptive.update(1024 * 1024, 1000 * 1024 * 1024),
+      undefined
+    );
+  });
+});
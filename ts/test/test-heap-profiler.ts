@@ -15,10 +15,17 @@
  */
 
 import * as sinon from 'sinon';
+import * as v8 from 'v8';
+import {runInNewContext} from 'vm';
+import {gunzipSync, gzipSync} from 'zlib';
 
+import {AdaptiveHeapInterval} from '../src/adaptive-interval';
 import * as heapProfiler from '../src/heap-profiler';
 import * as v8HeapProfiler from '../src/heap-profiler-bindings';
-import {AllocationProfileNode} from '../src/v8-types';
+import {ProfileAggregator} from '../src/profile-aggregator';
+import {encode} from '../src/profile-encoder';
+import {profileStats} from '../src/profiler-stats';
+import {AllocationProfileDelta, AllocationProfileNode} from '../src/v8-types';
 
 import {
   heapProfileExcludePath,
@@ -70,6 +77,101 @@ describe('HeapProfiler', () => {
       assert.deepEqual(heapProfileWithExternal, profile);
     });
 
+    it('should record the cost of collecting and encoding the profile', async () => {
+      profileStub = sinon
+        .stub(v8HeapProfiler, 'getAllocationProfile')
+        .returns(copy(v8HeapProfile));
+      memoryUsageStub = sinon.stub(process, 'memoryUsage').returns({
+        external: 0,
+        rss: 2048,
+        heapTotal: 4096,
+        heapUsed: 2048,
+        arrayBuffers: 512,
+      });
+      const statsStub = sinon
+        .stub(v8HeapProfiler, 'getTranslationStats')
+        .returns({
+          nanos: 100,
+          nodeCount: 3,
+          sampleCount: 7,
+          sampleNanos: -1,
+        });
+      try {
+        heapProfiler.start(1024 * 512, 32);
+        const profile = heapProfiler.profile();
+        const stats = profileStats(profile)!;
+        assert.strictEqual(stats.translateNanos, 100);
+        assert.strictEqual(stats.nodeCount, 3);
+        assert.strictEqual(stats.sampleCount, 7);
+        assert.ok(stats.serializeNanos > 0);
+        assert.strictEqual(stats.sourceMapNanos, 0);
+        assert.strictEqual(stats.encodedBytes, 0);
+
+        const encoded = await encode(profile);
+        assert.strictEqual(profileStats(encoded), stats);
+        assert.ok(stats.encodeNanos > 0);
+        assert.strictEqual(stats.encodedBytes, encoded.length);
+      } finally {
+        statsStub.restore();
+      }
+    });
+
+    it('should restart sampling when the heap leaves the range of samples', () => {
+      profileStub = sinon
+        .stub(v8HeapProfiler, 'getAllocationProfile')
+        .returns(copy(v8HeapProfile));
+      memoryUsageStub = sinon.stub(process, 'memoryUsage').returns({
+        external: 0,
+        rss: 2048,
+        heapTotal: 4096,
+        heapUsed: 2048,
+        arrayBuffers: 512,
+      });
+      const heapStatisticsStub = sinon
+        .stub(v8, 'getHeapStatistics')
+        .returns({used_heap_size: 200 * 4096} as v8.HeapInfo);
+      const statsStub = sinon
+        .stub(v8HeapProfiler, 'getTranslationStats')
+        .returns({
+          nanos: 100,
+          nodeCount: 3,
+          sampleCount: 7,
+          sampleNanos: -1,
+        });
+      try {
+        const adaptiveInterval = new AdaptiveHeapInterval({
+          minSamples: 100,
+          maxSamples: 300,
+          minIntervalBytes: 1024,
+          maxIntervalBytes: 1024 * 1024,
+        });
+        heapProfiler.start(1024 * 512, 32, adaptiveInterval);
+        assert.ok(startStub.calledOnceWith(4096, 32));
+
+        // Few live samples do not restart sampling while the heap is in
+        // range: they are only those allocated since sampling started.
+        assert.strictEqual(heapProfiler.profile().period, 4096);
+        assert.ok(startStub.calledOnce);
+
+        heapStatisticsStub.returns({
+          used_heap_size: 800 * 4096,
+        } as v8.HeapInfo);
+        assert.strictEqual(heapProfiler.profile().period, 4096);
+        assert.ok(stopStub.calledOnce);
+        assert.ok(startStub.calledTwice);
+        assert.ok(startStub.secondCall.calledWith(16384, 32));
+
+        // The profiles which follow the restart have few live samples too,
+        // but the heap still has as many samples as wanted.
+        assert.strictEqual(heapProfiler.profile().period, 16384);
+        assert.strictEqual(heapProfiler.profile().period, 16384);
+        assert.ok(startStub.calledTwice);
+      } finally {
+        heapStatisticsStub.restore();
+        statsStub.restore();
+      }
+    });
+
     it('should return a profile equal to the expected profile when including all samples', async () => {
       profileStub = sinon
         .stub(v8HeapProfiler, 'getAllocationProfile')
@@ -133,6 +235,126 @@ describe('HeapProfiler', () => {
     });
   });
 
+  describe('v8ProfileDelta', () => {
+    it('should return the delta collected by the native module', () => {
+      const delta: AllocationProfileDelta = {
+        nodes: [
+          {
+            id: 1,
+            parentId: 0,
+            name: '(root)',
+            scriptName: '',
+            scriptId: 0,
+            lineNumber: 0,
+            columnNumber: 0,
+          },
+        ],
+        samples: {
+          sampleIds: new Float64Array([2]),
+          nodeIds: new Uint32Array([1]),
+          sizes: new Float64Array([64]),
+          counts: new Uint32Array([3]),
+        },
+        freedSampleIds: new Float64Array([1]),
+        reset: false,
+      };
+      const deltaStub = sinon
+        .stub(v8HeapProfiler, 'getAllocationProfileDelta')
+        .returns(delta);
+      try {
+        heapProfiler.start(1024 * 512, 32);
+        assert.deepStrictEqual(heapProfiler.v8ProfileDelta(), delta);
+        assert.ok(!stopStub.called, 'expected heap profiler to keep running');
+      } finally {
+        deltaStub.restore();
+      }
+    });
+
+    it('should throw error when not started', () => {
+      assert.throws(
+        () => {
+          heapProfiler.v8ProfileDelta();
+        },
+        (err: Error) => {
+          return err.message === 'Heap profiler is not enabled.';
+        }
+      );
+    });
+  });
+
+  describe('profileToPprof', () => {
+    it('should return the gzipped profile serialized by the native module', async () => {
+      const pprofStub = sinon
+        .stub(v8HeapProfiler, 'getAllocationProfileToPprofAsync')
+        .resolves({buffer: gzipSync('profile'), encodeNanos: 42});
+      memoryUsageStub = sinon.stub(process, 'memoryUsage').returns({
+        external: 1024,
+        rss: 2048,
+        heapTotal: 4096,
+        heapUsed: 2048,
+        arrayBuffers: 512,
+      });
+      try {
+        heapProfiler.start(1024 * 512, 32);
+        const encoded = await heapProfiler.profileToPprof('ignored');
+        assert.strictEqual(gunzipSync(encoded).toString(), 'profile');
+        assert.strictEqual(profileStats(encoded)!.encodeNanos, 42);
+        assert.ok(
+          pprofStub.calledWith(1024 * 512, 0, 'ignored', 1024),
+          'expected getAllocationProfileToPprofAsync to be called'
+        );
+      } finally {
+        pprofStub.restore();
+      }
+    });
+
+    it('should throw error when not started', async () => {
+      await assert.rejects(heapProfiler.profileToPprof(), {
+        message: 'Heap profiler is not enabled.',
+      });
+    });
+  });
+
+  describe('addToAggregate', () => {
+    it('should merge the profile into the native aggregator', () => {
+      const aggregateStub = sinon.stub(
+        v8HeapProfiler,
+        'addAllocationProfileToAggregate'
+      );
+      memoryUsageStub = sinon.stub(process, 'memoryUsage').returns({
+        external: 1024,
+        rss: 2048,
+        heapTotal: 4096,
+        heapUsed: 2048,
+        arrayBuffers: 512,
+      });
+      const aggregator = new ProfileAggregator();
+      try {
+        heapProfiler.start(1024 * 512, 32);
+        heapProfiler.addToAggregate(aggregator, 'ignored');
+        assert.ok(
+          aggregateStub.calledWith(
+            1024 * 512,
+            0,
+            'ignored',
+            1024,
+            aggregator.native
+          ),
+          'expected addAllocationProfileToAggregate to be called'
+        );
+      } finally {
+        aggregateStub.restore();
+      }
+    });
+
+    it('should throw error when not started', () => {
+      const aggregator = new ProfileAggregator();
+      assert.throws(() => heapProfiler.addToAggregate(aggregator), {
+        message: 'Heap profiler is not enabled.',
+      });
+    });
+  });
+
   describe('start', () => {
     it('should call startSamplingHeapProfiler', () => {
       const intervalBytes1 = 1024 * 512;
@@ -185,3 +407,118 @@ describe('HeapProfiler', () => {
     });
   });
 });
+
+describe('HeapProfiler (native)', () => {
+  // gc() is only global when Node runs with --expose-gc; setting the flag
+  // exposes it in contexts created afterwards.
+  v8.setFlagsFromString('--expose-gc');
+  const gc: () => void = global.gc || runInNewContext('gc');
+
+  let retained: number[][] = [];
+
+  function allocateRetained() {
+    for (let i = 0; i < 1000; i++) {
+      retained.push(new Array(128).fill(i));
+    }
+  }
+
+  // IDs of the samples of delta which were allocated by allocateRetained().
+  function retainedSampleIds(delta: AllocationProfileDelta): number[] {
+    const nodeIds = new Set(
+      delta.nodes
+        .filter(node => node.name === 'allocateRetained')
+        .map(node => node.id)
+    );
+    const {sampleIds, nodeIds: sampleNodeIds} = delta.samples;
+    return Array.from(sampleIds).filter((id, i) =>
+      nodeIds.has(sampleNodeIds[i])
+    );
+  }
+
+  afterEach(() => {
+    heapProfiler.stop();
+    retained = [];
+  });
+
+  it('should report new nodes and samples, then freed samples', () => {
+    heapProfiler.start(512, 64);
+    allocateRetained();
+
+    const first = heapProfiler.v8ProfileDelta();
+    const ids = retainedSampleIds(first);
+    assert.ok(ids.length > 0, 'expected samples of retained objects');
+    assert.strictEqual(first.freedSampleIds.length, 0);
+
+    const second = heapProfiler.v8ProfileDelta();
+    const firstNodeIds = new Set(first.nodes.map(node => node.id));
+    for (const node of second.nodes) {
+      assert.ok(!firstNodeIds.has(node.id), `node ${node.id} reported again`);
+    }
+    const firstSampleIds = new Set(first.samples.sampleIds);
+    for (const id of second.samples.sampleIds) {
+      assert.ok(!firstSampleIds.has(id), `sample ${id} reported again`);
+    }
+
+    retained = [];
+    gc();
+    const freed = new Set(heapProfiler.v8ProfileDelta().freedSampleIds);
+    for (const id of ids) {
+      assert.ok(freed.has(id), `sample ${id} not reported as freed`);
+    }
+  });
+
+  it('should flag the delta after an adaptive restart as a reset', () => {
+    const heapStatisticsStub = sinon
+      .stub(v8, 'getHeapStatistics')
+      .returns({used_heap_size: 200 * 4096} as v8.HeapInfo);
+    try {
+      heapProfiler.start(
+        512,
+        64,
+        new AdaptiveHeapInterval({
+          minSamples: 100,
+          maxSamples: 300,
+          minIntervalBytes: 1024,
+          maxIntervalBytes: 1024 * 1024,
+        })
+      );
+      allocateRetained();
+      const first = heapProfiler.v8ProfileDelta();
+      assert.strictEqual(first.reset, false);
+      assert.ok(retainedSampleIds(first).length > 0);
+
+      // The heap has outgrown the range, so collecting a profile restarts
+      // the sampling heap profiler at a longer interval.
+      heapStatisticsStub.returns({
+        used_heap_size: 800 * 4096,
+      } as v8.HeapInfo);
+      assert.strictEqual(heapProfiler.profile().period, 4096);
+
+      const restarted = heapProfiler.v8ProfileDelta();
+      assert.strictEqual(restarted.reset, true);
+      assert.strictEqual(restarted.freedSampleIds.length, 0);
+      assert.ok(restarted.nodes.some(node => node.name === '(root)'));
+
+      allocateRetained();
+      assert.strictEqual(heapProfiler.v8ProfileDelta().reset, false);
+    } finally {
+      heapStatisticsStub.restore();
+    }
+  });
+
+  it('should report every node again once restarted', () => {
+    heapProfiler.start(512, 64);
+    allocateRetained();
+    const first = heapProfiler.v8ProfileDelta();
+    assert.ok(first.nodes.some(node => node.name === '(root)'));
+    heapProfiler.stop();
+
+    heapProfiler.start(512, 64);
+    allocateRetained();
+    const restarted = heapProfiler.v8ProfileDelta();
+    assert.strictEqual(restarted.reset, false);
+    assert.ok(restarted.nodes.some(node => node.name === '(root)'));
+    assert.ok(retainedSampleIds(restarted).length > 0);
+    assert.strictEqual(restarted.freedSampleIds.length, 0);
+  });
+});
@@ -0,0 +1,129 @@
+/**
+ * Copyright 2021 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+import * as fs from 'fs';
+import * as path from 'path';
+import {SourceMapGenerator} from 'source-map';
+import * as tmp from 'tmp';
+
+import {
+  decodeMappings,
+  parseSourceMapFile,
+} from '../src/source-map-decoder-bindings';
+import {MappingIndex} from '../src/sourcemapper/mapping-index';
+
+const assert = require('assert');
+
+describe('MappingIndex', () => {
+  const generator = new SourceMapGenerator({file: 'out.js'});
+  for (let line = 1; line <= 100; line++) {
+    for (let column = 0; column < 500; column += 1 + (line % 7) * 20) {
+      generator.addMapping({
+        source: `src${line % 3}.ts`,
+        name: column % 2 ? `f${line}` : undefined,
+        generated: {line, column},
+        original: {line: 1000 - line, column: column % 80},
+      });
+    }
+  }
+  const mappings = generator.toJSON().mappings;
+
+  it('should find the mapping at or before a generated position', () => {
+    const index = MappingIndex.decodeInJs('AAAAA,KCCCC;;EAEAA,EAAE');
+    assert.deepStrictEqual(Array.from(index.lineStarts), [0, 2, 2, 4]);
+    assert.strictEqual(index.find(1, 0), 0);
+    assert.strictEqual(index.find(1, 4), 0);
+    assert.strictEqual(index.find(1, 5), 1);
+    assert.strictEqual(index.find(2, 0), -1);
+    assert.strictEqual(index.find(3, 1), -1);
+    assert.strictEqual(index.find(3, 2), 2);
+    assert.strictEqual(index.find(3, 100), 3);
+    assert.strictEqual(index.find(4, 0), -1);
+    assert.strictEqual(index.sources[1], 1);
+    assert.strictEqual(index.sourceLines[1], 2);
+    assert.strictEqual(index.sourceColumns[1], 1);
+    assert.strictEqual(index.names[1], 1);
+    assert.strictEqual(index.names[3], -1);
+  });
+
+  it('should decode the same mappings natively and in JavaScript', () => {
+    const tables = decodeMappings(mappings);
+    assert.ok(tables, 'expected a native source map decoder');
+    const index = MappingIndex.decodeInJs(mappings);
+    assert.deepStrictEqual(tables!.lineStarts, index.lineStarts);
+    assert.deepStrictEqual(tables!.columns, index.columns);
+    assert.deepStrictEqual(tables!.sources, index.sources);
+    assert.deepStrictEqual(tables!.sourceLines, index.sourceLines);
+    assert.deepStrictEqual(tables!.sourceColumns, index.sourceColumns);
+    assert.deepStrictEqual(tables!.names, index.names);
+  });
+
+  it('should throw on invalid mappings', () => {
+    for (const invalid of ['A!', 'AB', 'gggggggggA', 'AAAAAA']) {
+      assert.throws(() => MappingIndex.decodeInJs(invalid));
+      assert.throws(() => decodeMappings(invalid));
+    }
+  });
+});
+
+describe('parseSourceMapFile', () => {
+  const dir = tmp.dirSync({unsafeCleanup: true});
+  const mapPath = path.join(dir.name, 'out.js.map');
+  const map = {
+    version: 3,
+    file: 'out.js',
+    sourceRoot: 'src',
+    sources: ['a.ts', null, 'b \u00fc\ud83d\ude00 "q".ts'],
+    names: ['f', 'g\n'],
+    sourcesContent: ['const a = "\\";\n', null],
+    mappings: 'AAAAA,KCCCC;;EAEAA',
+    x_extension: {nested: [1, -2.5e3, true, null, {s: ']}'}]},
+  };
+
+  after(() => {
+    dir.removeCallback();
+  });
+
+  it('should parse the fields of a source map file', () => {
+    fs.writeFileSync(mapPath, JSON.stringify(map, null, 2));
+    const parsed = parseSourceMapFile(mapPath)!;
+    assert.strictEqual(parsed.file, 'out.js');
+    assert.strictEqual(parsed.sourceRoot, 'src');
+    assert.deepStrictEqual(parsed.sources, ['a.ts', '', map.sources[2]]);
+    assert.deepStrictEqual(parsed.names, map.names);
+    assert.deepStrictEqual(
+      parsed.mappings.columns,
+      MappingIndex.decodeInJs(map.mappings).columns
+    );
+  });
+
+  it('should decode escaped characters', () => {
+    const escaped = JSON.stringify(map).replace(
+      /[\u007f-\uffff]/g,
+      c => '\\u' + ('000' + c.charCodeAt(0).toString(16)).slice(-4)
+    );
+    fs.writeFileSync(mapPath, escaped);
+    const parsed = parseSourceMapFile(mapPath)!;
+    assert.deepStrictEqual(parsed.sources, ['a.ts', '', map.sources[2]]);
+  });
+
+  it('should throw on invalid source maps', () => {
+    for (const invalid of ['', '{"mappings": "AAAA"', '{"sections": []}']) {
+      fs.writeFileSync(mapPath, invalid);
+      assert.throws(() => parseSourceMapFile(mapPath));
+    }
+  });
+});
@@ -15,12 +15,25 @@
  */
 
 import * as pify from 'pify';
+import {Writer} from 'protobufjs/minimal';
+import {PassThrough} from 'stream';
 import {gunzip as gunzipPromise, gunzipSync} from 'zlib';
 
 import {perftools} from '../../proto/profile';
-import {encode, encodeSync} from '../src/profile-encoder';
+import {
+  encode,
+  encodeSync,
+  flattenProfile,
+  ProfileStreamWriter,
+} from '../src/profile-encoder';
+import {encodeProfile, ProfileTables} from '../src/profile-encoder-bindings';
 
-import {decodedTimeProfile, timeProfile} from './profiles-for-tests';
+import {
+  decodedHeapProfile,
+  decodedTimeProfile,
+  heapProfile,
+  timeProfile,
+} from './profiles-for-tests';
 
 const assert = require('assert');
 const gunzip = pify(gunzipPromise);
@@ -33,7 +46,170 @@ describe('profile-encoded', () => {
       const decoded = perftools.profiles.Profile.decode(unzipped);
       assert.deepEqual(decoded, decodedTimeProfile);
     });
+    it('should encode profile the same way as protobufjs', async () => {
+      for (const profile of [timeProfile, heapProfile, decodedHeapProfile]) {
+        const encoded = await gunzip(await encode(profile));
+        const expected = perftools.profiles.Profile.encode(profile).finish();
+        assert.ok(Buffer.from(expected).equals(encoded));
+      }
+    });
+    it('should encode strings containing NUL characters', async () => {
+      const profile = {
+        ...timeProfile,
+        stringTable: [...timeProfile.stringTable!, 'a\0b'],
+      };
+      const encoded = await gunzip(await encode(profile));
+      const expected = perftools.profiles.Profile.encode(profile).finish();
+      assert.ok(Buffer.from(expected).equals(encoded));
+    });
+    it('should encode int64 values above 2^53 exactly', async () => {
+      const writer = Writer.create();
+      perftools.profiles.Profile.encode(heapProfile, writer);
+      // timeNanos, then a sample whose value is below -2^53.
+      writer.uint32((9 << 3) | 0).int64('1700000000000000123');
+      writer
+        .uint32((2 << 3) | 2)
+        .fork()
+        .uint32((2 << 3) | 0)
+        .int64('-9007199254740993')
+        .ldelim();
+      const profile = perftools.profiles.Profile.decode(writer.finish());
+      assert.strictEqual(String(profile.timeNanos), '1700000000000000123');
+
+      const encoded = await gunzip(await encode(profile));
+      const expected = perftools.profiles.Profile.encode(profile).finish();
+      assert.ok(Buffer.from(expected).equals(encoded));
+      const decoded = perftools.profiles.Profile.decode(encoded);
+      assert.strictEqual(String(decoded.timeNanos), '1700000000000000123');
+      assert.strictEqual(
+        String(decoded.sample[decoded.sample.length - 1].value[0]),
+        '-9007199254740993'
+      );
+    });
+    it('should reject tables whose counts are not whole entries', async () => {
+      const tamperings: Array<(tables: ProfileTables) => void> = [
+        // The sums of the counts still match the sizes of the tables.
+        tables => {
+          tables.samples[0] -= 3;
+          tables.samples[3] += 3;
+        },
+        tables => {
+          tables.locations[7] += 1;
+        },
+        tables => {
+          tables.samples = tables.samples.subarray(0, 4);
+        },
+        tables => {
+          tables.locations = tables.locations.subarray(0, 5);
+        },
+        tables => {
+          tables.periodType = tables.periodType.subarray(0, 3);
+        },
+        tables => {
+          tables.header = new Float64Array(13) as unknown as Uint32Array;
+        },
+      ];
+      for (const tamper of tamperings) {
+        const tables = flattenProfile(timeProfile);
+        tamper(tables);
+        await assert.rejects(encodeProfile(tables), TypeError);
+      }
+    });
+  });
+  describe('ProfileStreamWriter', () => {
+    it('should write a profile which can be decoded', async () => {
+      const writer = new ProfileStreamWriter();
+      writer.writeSamples(timeProfile.sample!);
+      const encoded = await writer.finish(timeProfile);
+      const decoded = perftools.profiles.Profile.decode(gunzipSync(encoded));
+      assert.deepEqual(decoded, decodedTimeProfile);
+    });
+
+    it('should gzip samples in chunks', async () => {
+      const writer = new ProfileStreamWriter();
+      writeManySamples(writer);
+      const encoded = await writer.finish({...heapProfile, sample: []});
+      checkManySamples(encoded);
+    });
+
+    it('should write the gzipped chunks to a stream', async () => {
+      const out = new PassThrough();
+      const chunks: Buffer[] = [];
+      out.on('data', chunk => chunks.push(chunk));
+      const ended = new Promise(resolve => out.on('end', resolve));
+      const writer = new ProfileStreamWriter(out);
+      writeManySamples(writer);
+      const encoded = await writer.finish({...heapProfile, sample: []});
+      assert.strictEqual(encoded.length, 0);
+      await ended;
+      assert.ok(chunks.length > 1, 'expected several gzip members');
+      checkManySamples(Buffer.concat(chunks));
+    });
+
+    it('should wait for the stream to drain', async () => {
+      const out = new PassThrough({highWaterMark: 1});
+      const writer = new ProfileStreamWriter(out);
+      writeManySamples(writer);
+      let finished = false;
+      const finishing = writer
+        .finish({...heapProfile, sample: []})
+        .then(() => (finished = true));
+      await new Promise(resolve => setTimeout(resolve, 100));
+      assert.ok(!finished, 'expected finish() to wait until out is read');
+      const chunks: Buffer[] = [];
+      out.on('data', chunk => chunks.push(chunk));
+      await finishing;
+      checkManySamples(Buffer.concat(chunks));
+    });
+
+    it('should buffer at most one chunk of encoded samples', async () => {
+      const writer = new ProfileStreamWriter();
+      let maxPendingBytes = 0;
+      let flushes = 0;
+      writeManySamples(writer, () => {
+        maxPendingBytes = Math.max(maxPendingBytes, writer.pendingBytes);
+        if (writer.pendingBytes === 0) {
+          flushes++;
+        }
+      });
+      assert.ok(flushes > 2, 'expected several chunks to be gzipped');
+      assert.ok(
+        maxPendingBytes < 256 * 1024,
+        `expected at most one chunk to be buffered, got ${maxPendingBytes}`
+      );
+      checkManySamples(await writer.finish({...heapProfile, sample: []}));
+    });
+
+    const SAMPLE_COUNT = 100000;
+
+    function writeManySamples(
+      writer: ProfileStreamWriter,
+      afterWrite?: () => void
+    ) {
+      for (let i = 0; i < SAMPLE_COUNT; i += 1000) {
+        const samples = [];
+        for (let j = i; j < i + 1000; j++) {
+          samples.push({locationId: [1, 2, 3], value: [j, 2 * j]});
+        }
+        writer.writeSamples(samples);
+        if (afterWrite) {
+          afterWrite();
+        }
+      }
+    }
+
+    function checkManySamples(encoded: Buffer) {
+      const decoded = perftools.profiles.Profile.decode(gunzipSync(encoded));
+      assert.strictEqual(decoded.sample.length, SAMPLE_COUNT);
+      const last = decoded.sample[SAMPLE_COUNT - 1];
+      assert.deepStrictEqual(last.value.map(Number), [
+        SAMPLE_COUNT - 1,
+        2 * (SAMPLE_COUNT - 1),
+      ]);
+      assert.deepEqual(decoded.location, decodedHeapProfile.location);
+    }
   });
+
   describe('encodeSync', () => {
     it('should encode profile such that the encoded profile can be decoded', () => {
       const encoded = encodeSync(timeProfile);
@@ -13,14 +13,32 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+import * as fs from 'fs';
+import * as path from 'path';
 import * as sinon from 'sinon';
+import * as sourceMap from 'source-map';
 import * as tmp from 'tmp';
 
+import {perftools} from '../../proto/profile';
 import {
+  allocationSizeBucket,
+  bucketAllocations,
   serializeHeapProfile,
+  serializeHeapProfileColumns,
   serializeTimeProfile,
+  serializeTimeProfileColumns,
+  StringTable,
 } from '../src/profile-serializer';
 import {SourceMapper} from '../src/sourcemapper/sourcemapper';
+import {
+  AllocationProfileColumns,
+  AllocationProfileNode,
+  ProfileNode,
+  TimeProfile,
+  TimeProfileColumns,
+  TimeProfileNode,
+  TimeProfileNodeContext,
+} from '../src/v8-types';
 
 import {
   anonymousFunctionHeapProfile,
@@ -40,6 +58,172 @@ import {
 
 const assert = require('assert');
 
+// Translates a profile tree into columns, with nodes in the order in which
+// serialize() visits them, as the native translation does.
+function nodeColumns<T extends ProfileNode>(root: T) {
+  const strings: string[] = [];
+  const stringIndices = new Map<string, number>();
+  const stringIndex = (str: string) => {
+    let index = stringIndices.get(str);
+    if (index === undefined) {
+      index = strings.length;
+      strings.push(str);
+      stringIndices.set(str, index);
+    }
+    return index;
+  };
+  const ordered: T[] = [];
+  const parents: number[] = [];
+  const pending = [{node: root, parent: -1}];
+  while (pending.length > 0) {
+    const {node, parent} = pending.pop()!;
+    const index = ordered.length;
+    ordered.push(node);
+    parents.push(parent);
+    for (const child of node.children as T[]) {
+      pending.push({node: child, parent: index});
+    }
+  }
+  const nodes = {
+    parents: Int32Array.from(parents),
+    names: Int32Array.from(ordered, node => stringIndex(node.name || '')),
+    scriptNames: Int32Array.from(ordered, node => stringIndex(node.scriptName)),
+    scriptIds: Int32Array.from(ordered, node => node.scriptId || 0),
+    lineNumbers: Int32Array.from(ordered, node => node.lineNumber || 0),
+    columnNumbers: Int32Array.from(ordered, node => node.columnNumber || 0),
+  };
+  if (root.locationKey !== undefined) {
+    return {
+      strings,
+      ordered,
+      nodes: {
+        ...nodes,
+        locationKeys: Int32Array.from(ordered, node => node.locationKey!),
+        functionKeys: Int32Array.from(ordered, node => node.functionKey!),
+      },
+    };
+  }
+  return {strings, ordered, nodes};
+}
+
+function timeProfileColumns(prof: TimeProfile): TimeProfileColumns {
+  const {strings, ordered, nodes} = nodeColumns(prof.topDownRoot);
+  const columns: TimeProfileColumns = {
+    startTime: prof.startTime,
+    endTime: prof.endTime,
+    strings,
+    nodes: {
+      ...nodes,
+      hitCounts: Int32Array.from(
+        ordered,
+        node => (node as TimeProfileNode).hitCount
+      ),
+    },
+  };
+  if (prof.topDownRoot.cpuTime !== undefined) {
+    columns.nodes.cpuTimes = Float64Array.from(
+      ordered,
+      node => (node as TimeProfileNode).cpuTime || 0
+    );
+  }
+  if (prof.topDownRoot.contexts !== undefined) {
+    const contextNodes: number[] = [];
+    const contexts: TimeProfileNodeContext[] = [];
+    ordered.forEach((node, index) => {
+      for (const hits of (node as TimeProfileNode).contexts || []) {
+        contextNodes.push(index);
+        contexts.push(hits);
+      }
+    });
+    columns.contexts = {
+      nodes: Int32Array.from(contextNodes),
+      contexts: Uint32Array.from(contexts, hits => hits.context),
+      hitCounts: Int32Array.from(contexts, hits => hits.hitCount),
+    };
+  }
+  return columns;
+}
+
+// Copies a time profile, with a CPU time of nanosPerHit for each hit.
+function withCpuTime(prof: TimeProfile, nanosPerHit: number): TimeProfile {
+  const copy = (node: TimeProfileNode): TimeProfileNode => ({
+    ...node,
+    cpuTime: node.hitCount * nanosPerHit,
+    children: (node.children as TimeProfileNode[]).map(copy),
+  });
+  return {...prof, topDownRoot: copy(prof.topDownRoot)};
+}
+
+// Copies a time profile, with the keys of the locations and functions of its
+// nodes which the native module would set.
+function withKeys(prof: TimeProfile): TimeProfile {
+  const locationKeys = new Map<string, number>();
+  const functionKeys = new Map<string, number>();
+  const keyOf = (keys: Map<string, number>, key: string) => {
+    if (!keys.has(key)) {
+      keys.set(key, keys.size);
+    }
+    return keys.get(key);
+  };
+  const copy = (node: TimeProfileNode): TimeProfileNode => ({
+    ...node,
+    locationKey: keyOf(
+      locationKeys,
+      `${node.scriptId}:${node.lineNumber}:${node.columnNumber}:${node.name}`
+    ),
+    functionKey: keyOf(functionKeys, `${node.scriptId}:${node.name}`),
+    children: (node.children as TimeProfileNode[]).map(copy),
+  });
+  return {...prof, topDownRoot: copy(prof.topDownRoot)};
+}
+
+// Copies a time profile, with half of the hits of each node, rounded down,
+// in context 0 and the rest in context 7. The root has an empty list, so
+// that the copy is known to have contexts.
+function withContexts(prof: TimeProfile): TimeProfile {
+  const copy = (node: TimeProfileNode): TimeProfileNode => {
+    const half = Math.floor(node.hitCount / 2);
+    const contexts = [
+      {context: 0, hitCount: half},
+      {context: 7, hitCount: node.hitCount - half},
+    ].filter(hits => hits.hitCount > 0);
+    return {
+      ...node,
+      contexts: contexts.length > 0 ? contexts : undefined,
+      children: (node.children as TimeProfileNode[]).map(copy),
+    };
+  };
+  return {...prof, topDownRoot: {...copy(prof.topDownRoot), contexts: []}};
+}
+
+function heapProfileColumns(
+  root: AllocationProfileNode
+): AllocationProfileColumns {
+  const {strings, ordered, nodes} = nodeColumns(root);
+  const allocationNodes: number[] = [];
+  const buckets: number[] = [];
+  const counts: number[] = [];
+  const bytes: number[] = [];
+  ordered.forEach((node, index) => {
+    for (const bucket of bucketAllocations(node.allocations)) {
+      allocationNodes.push(index);
+      buckets.push(bucket.bucket);
+      counts.push(bucket.count);
+      bytes.push(bucket.bytes);
+    }
+  });
+  return {
+    strings,
+    nodes,
+    allocations: {
+      nodes: Int32Array.from(allocationNodes),
+      buckets: Float64Array.from(buckets),
+      counts: Uint32Array.from(counts),
+      bytes: Float64Array.from(bytes),
+    },
+  };
+}
+
 describe('profile-serializer', () => {
   let dateStub: sinon.SinonStub<[], number>;
 
@@ -62,6 +246,79 @@ describe('profile-serializer', () => {
       );
       assert.deepEqual(timeProfileOut, anonymousFunctionTimeProfile);
     });
+    it('should produce expected profile from keyed locations', () => {
+      assert.deepEqual(
+        serializeTimeProfile(withKeys(v8TimeProfile), 1000),
+        timeProfile
+      );
+      assert.deepEqual(
+        serializeTimeProfile(withKeys(v8AnonymousFunctionTimeProfile), 1000),
+        anonymousFunctionTimeProfile
+      );
+    });
+    it('should pass samples to the sample sink instead of the profile', () => {
+      const samples: perftools.profiles.ISample[] = [];
+      const timeProfileOut = serializeTimeProfile(
+        v8TimeProfile,
+        1000,
+        undefined,
+        new StringTable(),
+        chunk => samples.push(...chunk)
+      );
+      assert.deepEqual(timeProfileOut.sample, []);
+      assert.deepEqual({...timeProfileOut, sample: samples}, timeProfile);
+    });
+    it('should add the CPU time of the nodes as a third value', () => {
+      const stringTable = new StringTable();
+      const timeProfileOut = serializeTimeProfile(
+        withCpuTime(v8TimeProfile, 700),
+        1000,
+        undefined,
+        stringTable
+      );
+      const sampleType = timeProfileOut.sampleType!;
+      assert.strictEqual(sampleType.length, 3);
+      assert.strictEqual(stringTable.strings[sampleType[2].type!], 'cpu');
+      assert.strictEqual(
+        stringTable.strings[sampleType[2].unit!],
+        'nanoseconds'
+      );
+      assert.deepEqual(
+        timeProfileOut.sample!.map(sample => sample.value),
+        timeProfile.sample!.map(sample => {
+          const value = sample.value as number[];
+          return [...value, value[0] * 700];
+        })
+      );
+    });
+    it('should split the samples of nodes by context', () => {
+      const stringTable = new StringTable();
+      const timeProfileOut = serializeTimeProfile(
+        withContexts(v8TimeProfile),
+        1000,
+        undefined,
+        stringTable
+      );
+      const hits = new Map<number, number>();
+      for (const sample of timeProfileOut.sample!) {
+        const label = sample.label || [];
+        let context = 0;
+        if (label.length > 0) {
+          assert.strictEqual(label.length, 1);
+          const key = stringTable.strings[label[0].key as number];
+          assert.strictEqual(key, 'context');
+          context = label[0].num as number;
+        }
+        const value = sample.value as number[];
+        hits.set(context, (hits.get(context) || 0) + value[0]);
+      }
+      let total = 0;
+      for (const sample of timeProfile.sample!) {
+        total += (sample.value as number[])[0];
+      }
+      assert.deepStrictEqual([...hits.keys()].sort(), [0, 7]);
+      assert.strictEqual(hits.get(0)! + hits.get(7)!, total);
+    });
   });
 
   describe('serializeHeapProfile', () => {
@@ -79,6 +336,120 @@ describe('profile-serializer', () => {
     });
   });
 
+  describe('bucketAllocations', () => {
+    it('should bucket sizes by the next power of two', () => {
+      assert.deepStrictEqual(
+        [1, 2, 3, 4, 5, 1024, 1025].map(allocationSizeBucket),
+        [1, 2, 4, 4, 8, 1024, 2048]
+      );
+    });
+    it('should merge allocations of the same bucket in bucket order', () => {
+      assert.deepStrictEqual(
+        bucketAllocations([
+          {sizeBytes: 72, count: 15},
+          {sizeBytes: 5, count: 1},
+          {sizeBytes: 7, count: 3},
+        ]),
+        [
+          {bucket: 8, count: 4, bytes: 26},
+          {bucket: 128, count: 15, bytes: 15 * 72},
+        ]
+      );
+    });
+  });
+
+  describe('serializeTimeProfileColumns', () => {
+    it('should produce the profile serializeTimeProfile produces', () => {
+      for (const prof of [
+        v8TimeProfile,
+        v8AnonymousFunctionTimeProfile,
+        withCpuTime(v8TimeProfile, 700),
+        withContexts(v8TimeProfile),
+        withKeys(v8TimeProfile),
+      ]) {
+        assert.deepEqual(
+          serializeTimeProfileColumns(timeProfileColumns(prof), 1000),
+          serializeTimeProfile(prof, 1000)
+        );
+      }
+    });
+  });
+
+  describe('serializeHeapProfileColumns', () => {
+    it('should produce the profile serializeHeapProfile produces', () => {
+      for (const prof of [v8HeapProfile, v8AnonymousFunctionHeapProfile]) {
+        assert.deepEqual(
+          serializeHeapProfileColumns(heapProfileColumns(prof), 0, 512 * 1024),
+          serializeHeapProfile(prof, 0, 512 * 1024)
+        );
+      }
+    });
+
+    it('should skip the samples of ignored scripts', () => {
+      assert.deepEqual(
+        serializeHeapProfileColumns(
+          heapProfileColumns(v8HeapProfile),
+          0,
+          512 * 1024,
+          'script2'
+        ),
+        serializeHeapProfile(v8HeapProfile, 0, 512 * 1024, 'script2')
+      );
+    });
+  });
+
+  describe('shared string table', () => {
+    it('should produce the same profile when reused', () => {
+      const stringTable = new StringTable();
+      serializeTimeProfile(v8TimeProfile, 1000, undefined, stringTable);
+      const timeProfileOut = serializeTimeProfile(
+        v8TimeProfile,
+        1000,
+        undefined,
+        stringTable
+      );
+      assert.deepEqual(timeProfileOut, timeProfile);
+    });
+    it('should only give each profile the strings it uses', () => {
+      const stringTable = new StringTable();
+      serializeTimeProfile(v8TimeProfile, 1000, undefined, stringTable);
+      const heapProfileOut = serializeHeapProfile(
+        v8HeapProfile,
+        0,
+        512 * 1024,
+        undefined,
+        undefined,
+        stringTable
+      );
+      assert.deepEqual(heapProfileOut, heapProfile);
+      const timeProfileOut = serializeTimeProfile(
+        v8TimeProfile,
+        1000,
+        undefined,
+        stringTable
+      );
+      assert.deepEqual(timeProfileOut, timeProfile);
+    });
+    it('should clear the table once it exceeds its maximum size', () => {
+      const stringTable = new StringTable(1);
+      serializeHeapProfile(
+        v8HeapProfile,
+        0,
+        512 * 1024,
+        undefined,
+        undefined,
+        stringTable
+      );
+      const timeProfileOut = serializeTimeProfile(
+        v8TimeProfile,
+        1000,
+        undefined,
+        stringTable
+      );
+      assert.deepEqual(timeProfileOut, timeProfile);
+    });
+  });
+
   describe('source map specified', () => {
     let sourceMapper: SourceMapper;
     before(async () => {
@@ -108,10 +479,153 @@ describe('profile-serializer', () => {
         );
         assert.deepEqual(timeProfileOut, timeSourceProfile);
       });
+      it('should produce expected profile from keyed locations', () => {
+        const timeProfileOut = serializeTimeProfile(
+          withKeys(v8TimeGeneratedProfile),
+          1000,
+          sourceMapper
+        );
+        assert.deepEqual(timeProfileOut, timeSourceProfile);
+      });
+    });
+
+    it('should look up each location once across profiles', () => {
+      // Use a new source mapper, without the results of previous tests.
+      const memoMapper = new SourceMapper();
+      memoMapper.infoMap = sourceMapper.infoMap;
+      const consumer = memoMapper.infoMap.get(
+        path.join(mapDirPath, 'foo.js')
+      )!.mapConsumer as {} as sourceMap.SourceMapConsumer;
+      const lookupSpy = sinon.spy(consumer, 'originalPositionFor');
+      try {
+        for (let i = 0; i < 2; i++) {
+          const heapProfileOut = serializeHeapProfile(
+            v8HeapGeneratedProfile,
+            0,
+            512 * 1024,
+            undefined,
+            memoMapper
+          );
+          assert.deepEqual(heapProfileOut, heapSourceProfile);
+        }
+        // foo.js has two distinct locations in the profile.
+        assert.strictEqual(lookupSpy.callCount, 2);
+      } finally {
+        lookupSpy.restore();
+      }
+    });
+
+    it('should keep results when many locations are duplicates', () => {
+      const memoMapper = new SourceMapper();
+      memoMapper.infoMap = sourceMapper.infoMap;
+      const file = path.join(mapDirPath, 'foo.js');
+      const consumer = memoMapper.infoMap.get(file)!
+        .mapConsumer as {} as sourceMap.SourceMapConsumer;
+      const lookupSpy = sinon.spy(consumer, 'originalPositionFor');
+      try {
+        // More locations than are kept, but only two distinct ones.
+        const locations = [];
+        for (let i = 0; i < 100000; i++) {
+          locations.push({file, line: 1, column: i % 2});
+        }
+        for (let i = 0; i < 2; i++) {
+          memoMapper.mappingInfos(locations);
+        }
+        assert.strictEqual(lookupSpy.callCount, 2);
+      } finally {
+        lookupSpy.restore();
+      }
     });
 
     after(() => {
       tmp.setGracefulCleanup();
     });
   });
+
+  describe('lazy source map specified', () => {
+    it('should produce expected profiles', async () => {
+      const sourceMapper = await SourceMapper.create([mapDirPath], {
+        lazy: true,
+      });
+      assert.ok(sourceMapper.hasMappingInfo(path.join(mapDirPath, 'foo.js')));
+      assert.ok(!sourceMapper.hasMappingInfo(path.join(mapDirPath, 'bar.js')));
+      const heapProfileOut = serializeHeapProfile(
+        v8HeapGeneratedProfile,
+        0,
+        512 * 1024,
+        undefined,
+        sourceMapper
+      );
+      assert.deepEqual(heapProfileOut, heapSourceProfile);
+      const timeProfileOut = serializeTimeProfile(
+        v8TimeGeneratedProfile,
+        1000,
+        sourceMapper
+      );
+      assert.deepEqual(timeProfileOut, timeSourceProfile);
+    });
+
+    it('should produce expected profiles with compact mappings', async () => {
+      const sourceMapper = await SourceMapper.create([mapDirPath], {
+        compactMappings: true,
+      });
+      assert.ok(sourceMapper.hasMappingInfo(path.join(mapDirPath, 'foo.js')));
+      const timeProfileOut = serializeTimeProfile(
+        v8TimeGeneratedProfile,
+        1000,
+        sourceMapper
+      );
+      assert.deepEqual(timeProfileOut, timeSourceProfile);
+    });
+
+    it('should resolve sources against the source root', async () => {
+      const dir = tmp.dirSync().name;
+      const map = new sourceMap.SourceMapGenerator({
+        file: 'qux.js',
+        sourceRoot: '/build',
+      });
+      map.addMapping({
+        source: '/build/./lib/qux.ts',
+        generated: {line: 1, column: 0},
+        original: {line: 10, column: 0},
+      });
+      map.addMapping({
+        source: 'src/qux.ts',
+        generated: {line: 2, column: 0},
+        original: {line: 20, column: 0},
+      });
+      fs.writeFileSync(path.join(dir, 'qux.js.map'), map.toString());
+      const file = path.join(dir, 'qux.js');
+      const locations = [
+        {file, line: 1, column: 0},
+        {file, line: 2, column: 0},
+      ];
+      const expected = (await SourceMapper.create([dir])).mappingInfos(
+        locations
+      );
+      assert.deepEqual(
+        expected.map(loc => loc.file),
+        ['/build/lib/qux.ts', '/build/src/qux.ts']
+      );
+      for (const options of [{compactMappings: true}, {lazy: true}]) {
+        const sourceMapper = await SourceMapper.create([dir], options);
+        assert.deepEqual(sourceMapper.mappingInfos(locations), expected);
+      }
+    });
+
+    it('should parse source maps again once dropped from the cache', async () => {
+      const sourceMapper = await SourceMapper.create([mapDirPath], {
+        lazy: true,
+        maxCacheBytes: 1,
+      });
+      for (let i = 0; i < 2; i++) {
+        const timeProfileOut = serializeTimeProfile(
+          v8TimeGeneratedProfile,
+          1000,
+          sourceMapper
+        );
+        assert.deepEqual(timeProfileOut, timeSourceProfile);
+      }
+    });
+  });
 });
@@ -16,8 +16,16 @@
 
 import delay from 'delay';
 import * as sinon from 'sinon';
+import {Worker} from 'worker_threads';
+import {gunzipSync} from 'zlib';
+
+import {perftools} from '../../proto/profile';
+import {AdaptiveInterval} from '../src/adaptive-interval';
+import {ProfileAggregator} from '../src/profile-aggregator';
+import {profileStats} from '../src/profiler-stats';
 import * as time from '../src/time-profiler';
 import * as v8TimeProfiler from '../src/time-profiler-bindings';
+import {TimeProfile, TimeProfileNode} from '../src/v8-types';
 import {timeProfile, v8TimeProfile} from './profiles-for-tests';
 
 const assert = require('assert');
@@ -40,6 +48,355 @@ describe('Time Profiler', () => {
         [-1, -1]
       );
     });
+
+    it('should record the cost of collecting the profile', async () => {
+      const profile = await time.profile(PROFILE_OPTIONS);
+      const stats = profileStats(profile)!;
+      assert.ok(stats.translateNanos > 0);
+      assert.ok(stats.serializeNanos > 0);
+      assert.ok(stats.nodeCount > 1);
+      assert.ok(stats.sampleCount > 0);
+      assert.strictEqual(stats.encodedBytes, 0);
+    });
+  });
+
+  describe('v8Profile', () => {
+    it('should record samples which refer to nodes of the profile', async () => {
+      const profile = await time.v8Profile({
+        ...PROFILE_OPTIONS,
+        recordSamples: true,
+      });
+      const ids = new Set<number>();
+      const nodes: TimeProfileNode[] = [profile.topDownRoot];
+      while (nodes.length > 0) {
+        const node = nodes.pop()!;
+        ids.add(node.id!);
+        nodes.push(...(node.children as TimeProfileNode[]));
+      }
+      const samples = profile.samples!;
+      assert.ok(samples.nodeIds.length > 0);
+      assert.strictEqual(samples.timeDeltas.length, samples.nodeIds.length);
+      for (const id of samples.nodeIds) {
+        assert.ok(ids.has(id), `no node with ID ${id}`);
+      }
+    });
+
+    it('should not record samples by default', async () => {
+      const profile = await time.v8Profile(PROFILE_OPTIONS);
+      assert.strictEqual(profile.samples, undefined);
+      assert.strictEqual(profile.topDownRoot.id, undefined);
+      assert.strictEqual(profile.threadId, 0);
+    });
+
+    it('should only have hits in leaves with line numbers', async () => {
+      const profile = await time.v8Profile({
+        ...PROFILE_OPTIONS,
+        lineNumbers: true,
+      });
+      const nodes = profile.topDownRoot.children as TimeProfileNode[];
+      assert.ok(nodes.length > 0);
+      while (nodes.length > 0) {
+        const node = nodes.pop()!;
+        if (node.hitCount > 0) {
+          assert.strictEqual(node.children.length, 0);
+        }
+        nodes.push(...(node.children as TimeProfileNode[]));
+      }
+    });
+
+    it('should profile worker threads and the main thread at once', async () => {
+      const modulePath = JSON.stringify(
+        require.resolve('../src/time-profiler')
+      );
+      const worker = new Worker(
+        `
+        const {parentPort} = require('worker_threads');
+        const time = require(${modulePath});
+        time.v8Profile({durationMillis: 200}).then(profile => {
+          parentPort.postMessage(profile.threadId);
+        });
+        `,
+        {eval: true}
+      );
+      const workerThreadId = new Promise(resolve => {
+        worker.on('message', resolve);
+      });
+      const profile = await time.v8Profile(PROFILE_OPTIONS);
+      assert.strictEqual(profile.threadId, 0);
+      assert.strictEqual(await workerThreadId, worker.threadId);
+    });
+  });
+
+  describe('v8ProfileColumns', () => {
+    it('should put parents before their children', async () => {
+      const profile = await time.v8ProfileColumns({
+        ...PROFILE_OPTIONS,
+        recordSamples: true,
+      });
+      const nodes = profile.nodes;
+      const count = nodes.parents.length;
+      assert.ok(count > 1);
+      assert.strictEqual(nodes.parents[0], -1);
+      assert.strictEqual(profile.strings[nodes.names[0]], '(root)');
+      const ids = new Set<number>();
+      for (let i = 1; i < count; i++) {
+        assert.ok(nodes.parents[i] >= 0 && nodes.parents[i] < i);
+        assert.ok(nodes.names[i] < profile.strings.length);
+        assert.ok(nodes.scriptNames[i] < profile.strings.length);
+        ids.add(nodes.ids![i]);
+      }
+      for (const id of profile.samples!.nodeIds) {
+        assert.ok(ids.has(id), `no node with ID ${id}`);
+      }
+    });
+  });
+
+  describe('startV8Profile', () => {
+    function recurse(depth: number): number {
+      if (depth === 0) {
+        const end = Date.now() + 2;
+        while (Date.now() < end);
+        return 0;
+      }
+      return recurse(depth - 1) + 1;
+    }
+
+    function collect(pruning: time.TimeProfilePruning): TimeProfile {
+      const stop = time.startV8Profile(100, undefined, false, false, pruning);
+      const end = Date.now() + 200;
+      while (Date.now() < end) {
+        recurse(100);
+      }
+      return stop();
+    }
+
+    function totalHits(node: TimeProfileNode): number {
+      let total = 0;
+      const nodes = [node];
+      while (nodes.length > 0) {
+        const next = nodes.pop()!;
+        total += next.hitCount;
+        nodes.push(...(next.children as TimeProfileNode[]));
+      }
+      return total;
+    }
+
+    it('should fold nodes deeper than maxDepth into truncated nodes', () => {
+      const profile = collect({maxDepth: 5});
+      let truncated = 0;
+      const nodes = [{node: profile.topDownRoot, depth: 0}];
+      while (nodes.length > 0) {
+        const {node, depth} = nodes.pop()!;
+        if (node.name === '(truncated)') {
+          assert.strictEqual(depth, 6);
+          assert.strictEqual(node.children.length, 0);
+          truncated += node.hitCount;
+        } else {
+          assert.ok(depth <= 5, `node ${node.name} at depth ${depth}`);
+        }
+        for (const child of node.children as TimeProfileNode[]) {
+          nodes.push({node: child, depth: depth + 1});
+        }
+      }
+      assert.ok(truncated > 0, 'no truncated hits');
+    });
+
+    it('should prune subtrees with fewer than minHitCount hits', () => {
+      const profile = collect({minHitCount: 10});
+      const nodes = profile.topDownRoot.children as TimeProfileNode[];
+      assert.ok(nodes.length > 0);
+      while (nodes.length > 0) {
+        const node = nodes.pop()!;
+        if (node.name !== '(truncated)') {
+          assert.ok(totalHits(node) >= 10, `node ${node.name} not pruned`);
+        }
+        nodes.push(...(node.children as TimeProfileNode[]));
+      }
+    });
+  });
+
+  describe('profileAllThreads', () => {
+    it('should merge profiles of all threads with thread labels', async () => {
+      const modulePath = JSON.stringify(
+        require.resolve('../src/time-profiler')
+      );
+      const worker = new Worker(
+        `
+        const {parentPort} = require('worker_threads');
+        require(${modulePath});
+        parentPort.postMessage('ready');
+        setInterval(() => {
+          const end = Date.now() + 20;
+          while (Date.now() < end);
+        }, 25);
+        `,
+        {eval: true}
+      );
+      await new Promise(resolve => worker.once('message', resolve));
+      try {
+        const buf = await time.profileAllThreads(PROFILE_OPTIONS);
+        const profile = perftools.profiles.Profile.decode(gunzipSync(buf));
+        const threadKey = profile.stringTable.indexOf('thread');
+        const threadIds = new Set<number>();
+        for (const sample of profile.sample) {
+          assert.strictEqual(sample.label.length, 1);
+          assert.strictEqual(Number(sample.label[0].key), threadKey);
+          threadIds.add(Number(sample.label[0].num));
+        }
+        assert.ok(threadIds.has(0), 'no samples from the main thread');
+        assert.ok(
+          threadIds.has(worker.threadId),
+          'no samples from the worker thread'
+        );
+      } finally {
+        await worker.terminate();
+      }
+    });
+
+    it('should leave out threads which are already profiling', async () => {
+      const modulePath = JSON.stringify(
+        require.resolve('../src/time-profiler')
+      );
+      const worker = new Worker(
+        `
+        const {parentPort} = require('worker_threads');
+        const time = require(${modulePath});
+        const stop = time.start(5000);
+        parentPort.on('message', () => parentPort.postMessage(stop().period));
+        parentPort.postMessage('ready');
+        setInterval(() => {
+          const end = Date.now() + 20;
+          while (Date.now() < end);
+        }, 25);
+        `,
+        {eval: true}
+      );
+      await new Promise(resolve => worker.once('message', resolve));
+      try {
+        const buf = await time.profileAllThreads(PROFILE_OPTIONS);
+        const profile = perftools.profiles.Profile.decode(gunzipSync(buf));
+        for (const sample of profile.sample) {
+          assert.notStrictEqual(
+            Number(sample.label[0].num),
+            worker.threadId,
+            'unexpected samples from the worker thread'
+          );
+        }
+        const comments = profile.comment.map(
+          id => profile.stringTable[Number(id)]
+        );
+        assert.ok(
+          comments.indexOf(
+            'Threads which did not start profiling: 1. ' +
+              'Another CPU profile was already running.'
+          ) >= 0,
+          `unexpected comments: ${comments}`
+        );
+
+        const period = new Promise(resolve => worker.once('message', resolve));
+        worker.postMessage('stop');
+        assert.strictEqual(await period, 5000);
+      } finally {
+        await worker.terminate();
+      }
+    });
+  });
+
+  describe('profileToPprof', () => {
+    it('should return a gzipped profile which includes program or idle time', async () => {
+      const encoded = await time.profileToPprof(PROFILE_OPTIONS);
+      const profile = perftools.profiles.Profile.decode(gunzipSync(encoded));
+      const stats = profileStats(encoded)!;
+      assert.ok(stats.translateNanos > 0);
+      assert.ok(stats.encodeNanos > 0);
+      assert.strictEqual(stats.encodedBytes, encoded.length);
+      assert.deepEqual(
+        profile.stringTable.slice(0, 5),
+        ['', 'sample', 'count', 'wall', 'microseconds']
+      );
+      assert.notDeepEqual(
+        [
+          profile.stringTable.indexOf('(program)'),
+          profile.stringTable.indexOf('(idle)'),
+        ],
+        [-1, -1]
+      );
+    });
+
+    it('should measure the cost of the samples with an adaptive interval', async () => {
+      const measured = profileStats(
+        await time.profileToPprof({
+          ...PROFILE_OPTIONS,
+          adaptiveInterval: new AdaptiveInterval(),
+        })
+      )!;
+      if (process.platform === 'win32') {
+        assert.strictEqual(measured.sampleNanos, -1);
+      } else {
+        assert.ok(measured.sampleNanos >= 0);
+      }
+      const unmeasured = profileStats(
+        await time.profileToPprof(PROFILE_OPTIONS)
+      )!;
+      assert.strictEqual(unmeasured.sampleNanos, -1);
+    });
+
+    it('should produce a profile with line numbers', async () => {
+      const encoded = await time.profileToPprof({
+        ...PROFILE_OPTIONS,
+        lineNumbers: true,
+      });
+      const profile = perftools.profiles.Profile.decode(gunzipSync(encoded));
+      assert.ok(profile.sample.length > 0);
+      for (const sample of profile.sample) {
+        assert.ok(sample.locationId.length > 0);
+      }
+    });
+  });
+
+  describe('startToAggregate', () => {
+    it('should merge successive profiles into one gzipped profile', async () => {
+      const aggregator = new ProfileAggregator();
+      const stop = time.startToAggregate(aggregator);
+      let hits = 0;
+      for (let i = 0; i < 3; i++) {
+        await delay(100);
+        stop(i < 2);
+        hits += v8TimeProfiler.getTranslationStats().sampleCount;
+      }
+      assert.strictEqual(aggregator.profileCount, 3);
+      const encoded = await aggregator.flush();
+      assert.strictEqual(aggregator.profileCount, 0);
+      assert.strictEqual(aggregator.stackCount, 0);
+      const profile = perftools.profiles.Profile.decode(gunzipSync(encoded));
+      let mergedHits = 0;
+      for (const sample of profile.sample) {
+        mergedHits += Number(sample.value[0]);
+      }
+      assert.strictEqual(mergedHits, hits);
+      assert.strictEqual(profileStats(encoded)!.encodedBytes, encoded.length);
+    });
+
+    it('should fold the lightest stacks past maxStacks', async () => {
+      const aggregator = new ProfileAggregator({maxStacks: 1});
+      const stop = time.startToAggregate(aggregator);
+      const end = Date.now() + 100;
+      while (Date.now() < end);
+      stop();
+      assert.strictEqual(aggregator.stackCount, 1);
+      const profile = perftools.profiles.Profile.decode(
+        gunzipSync(await aggregator.flush())
+      );
+      for (const sample of profile.sample) {
+        const location = profile.location.find(
+          l => Number(l.id) === Number(sample.locationId[0])
+        )!;
+        const fn = profile.function.find(
+          f => Number(f.id) === Number(location.line![0].functionId)
+        )!;
+        assert.strictEqual(profile.stringTable[Number(fn.name)], '(truncated)');
+      }
+    });
   });
 
   describe('profile (w/ stubs)', () => {
@@ -73,5 +430,55 @@ describe('Time Profiler', () => {
       const profile = await time.profile(PROFILE_OPTIONS);
       assert.deepEqual(timeProfile, profile);
     });
+
+    it('should start the next profile before stopping when restarting', () => {
+      const startStub = sinonStubs[0];
+      const stopStub = sinonStubs[1];
+      startStub.resetHistory();
+      stopStub.resetHistory();
+      const stop = time.start(1000, 'first');
+      for (let i = 0; i < 10; i++) {
+        assert.deepEqual(timeProfile, stop(true));
+      }
+      stop();
+      assert.strictEqual(startStub.callCount, 11);
+      assert.strictEqual(stopStub.callCount, 11);
+      assert.strictEqual(stopStub.getCall(0).args[0], 'first');
+      for (let i = 1; i < 11; i++) {
+        const runName = startStub.getCall(i).args[0];
+        assert.notStrictEqual(runName, stopStub.getCall(i - 1).args[0]);
+        assert.strictEqual(runName, stopStub.getCall(i).args[0]);
+        assert.ok(startStub.getCall(i).calledBefore(stopStub.getCall(i - 1)));
+        // The CPU profiler is renewed every tenth profile.
+        assert.strictEqual(startStub.getCall(i).args[2], i === 10);
+      }
+      // Profiling is stopped, so it can be started again.
+      time.start(1000)();
+    });
+
+    it('should sample the CPU time of each profile when cpuTime is set', () => {
+      const startStub = sinonStubs[0];
+      startStub.resetHistory();
+      const stop = time.start(1000, 'cpu', undefined, false, {cpuTime: true});
+      stop(true);
+      stop();
+      assert.strictEqual(startStub.callCount, 2);
+      for (const call of startStub.getCalls()) {
+        assert.strictEqual(call.args[4], true);
+      }
+    });
+
+    it('should sample the context of each profile when contexts is set', () => {
+      const startStub = sinonStubs[0];
+      startStub.resetHistory();
+      const stop = time.start(1000, 'ctx', undefined, false, {contexts: true});
+      stop(true);
+      stop();
+      assert.strictEqual(startStub.callCount, 2);
+      for (const call of startStub.getCalls()) {
+        assert.strictEqual(call.args[4], undefined);
+        assert.strictEqual(call.args[5], true);
+      }
+    });
   });
 });